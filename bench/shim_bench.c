@@ -0,0 +1,290 @@
+/**
+ * Overhead benchmark of the interception layer (built as a separate redpill_shimbench.ko with "make shimbench")
+ *
+ * Every test runs a tight loop over a kernel path redpill sits in, first natively (nothing installed) and then with
+ * our hook installed, and prints per-call cycles (get_cycles()) for both along with the difference:
+ *  - syscall: getppid() called through sys_call_table natively, via the dispatcher with an override only (like
+ *             execve interception does) and with an override + a pre-hook (see override_syscall())
+ *  - ovsym: a call to an overridden function whose shim calls the original with call_overridden_symbol(), i.e. the
+ *           full trampoline => shim => original round trip (detour or code swapping - whatever the kernel allows)
+ *  - drvreg: platform_driver_register() + unregister of a dummy driver with a DWATCH_STATE_COMING watcher for another
+ *            driver (which is what makes us sit in driver_register())
+ *  - pci: config space dword read of a real device vs. a virtual one (see virtual_pci.c)
+ * sd_probe() shim isn't covered: it needs a real SCSI disk to be probed and cannot be triggered synthetically.
+ *
+ * Results are printed to the kernel log. The benchmark runs once on load; the module does nothing afterwards and can
+ * be removed.
+ *
+ * Usage: insmod redpill_shimbench.ko [iterations=100000] [reg_iterations=200] [vpci_bus=254]
+ * It must NOT be loaded together with redpill.ko (both would fight over the same hooks).
+ *
+ * This module links the interception code directly (it's not exported by redpill.ko) so it tests the same sources.
+ */
+#include "../common.h"
+#include "../internal/override_symbol.h" //override_syscall(), add_syscall_hook(), override_symbol_ng()
+#include "../internal/intercept_driver_register.h" //watch_driver_register()
+#include "../internal/virtual_pci.h" //vpci_add_single_device()
+#include "../internal/ksym_cache.h" //ksym_lookup_name()
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/platform_device.h> //platform_driver_register()
+#include <linux/pci.h>
+#include <linux/timex.h> //get_cycles()
+#include <asm/unistd_64.h> //__NR_getppid
+
+#define BENCH_DRV_NAME "rp_shimbench"
+#define BENCH_WATCHED_DRV_NAME "rp_shimbench_watched" //never registered - it only makes driver_register() shimmed
+
+static int iterations = 100000;
+module_param(iterations, int, 0444);
+MODULE_PARM_DESC(iterations, "Number of calls in each test of a cheap path (syscall, ovsym, pci)");
+
+static int reg_iterations = 200;
+module_param(reg_iterations, int, 0444);
+MODULE_PARM_DESC(reg_iterations, "Number of driver register+unregister calls in the drvreg test");
+
+static int vpci_bus = 0xfe;
+module_param(vpci_bus, int, 0444);
+MODULE_PARM_DESC(vpci_bus, "Number of the virtual PCI bus used in the pci test (must not exist)");
+
+/**
+ * Runs the expression in a loop and evaluates to the average number of cycles per iteration
+ *
+ * Preemption is disabled so that the result isn't skewed by the scheduler (use it only for code which doesn't sleep).
+ */
+#define measure_cycles(n, expr) ({            \
+    preempt_disable();                        \
+    cycles_t __start = get_cycles();          \
+    for (int __i = 0; __i < (n); ++__i)       \
+        (expr);                               \
+    cycles_t __total = get_cycles() - __start; \
+    preempt_enable();                         \
+    div_u64(__total, (n));                    \
+})
+
+static void print_result(const char *test, const char *variant, u64 native, u64 hooked)
+{
+    pr_loc_inf("[%s] native=%llu cycles/call %s=%llu cycles/call => overhead=%lld cycles/call", test, native, variant,
+               hooked, (s64)hooked - (s64)native);
+}
+
+/******************************************************* syscall ******************************************************/
+typedef asmlinkage long (*bench_syscall_fn)(void);
+static bench_syscall_fn org_sys_getppid = NULL;
+
+static asmlinkage long shim_sys_getppid(void)
+{
+    return org_sys_getppid();
+}
+
+static syscall_hook_result bench_syscall_hook(struct syscall_hook_args *args, long *ret)
+{
+    return SYSCALL_HOOK_CONTINUE;
+}
+
+static int bench_syscall(void)
+{
+    //The table is searched without kallsyms by override_symbol.c, but it doesn't expose it - kallsyms is enough here
+    unsigned long *table = (unsigned long *)ksym_lookup_name("sys_call_table");
+    if (!table) {
+        pr_loc_wrn("[syscall] sys_call_table not in kallsyms - skipping");
+        return 0;
+    }
+
+    volatile bench_syscall_fn *entry = (volatile bench_syscall_fn *)&table[__NR_getppid];
+    u64 native = measure_cycles(iterations, (*entry)());
+
+    int out = override_syscall(__NR_getppid, shim_sys_getppid, (void *)&org_sys_getppid);
+    if (out != 0) {
+        pr_loc_err("[syscall] override_syscall() failed - error=%d", out);
+        return out;
+    }
+    u64 override = measure_cycles(iterations, (*entry)());
+
+    if ((out = add_syscall_hook(__NR_getppid, bench_syscall_hook, 0)) != 0) {
+        pr_loc_err("[syscall] add_syscall_hook() failed - error=%d", out);
+        restore_syscall(__NR_getppid);
+        return out;
+    }
+    u64 hooked = measure_cycles(iterations, (*entry)());
+
+    remove_syscall_hook(__NR_getppid, bench_syscall_hook);
+    restore_syscall(__NR_getppid);
+
+    print_result("syscall", "override", native, override);
+    print_result("syscall", "override+hook", native, hooked);
+    return 0;
+}
+
+/******************************************************** ovsym *******************************************************/
+static noinline int shim_bench_target(int value)
+{
+    barrier(); //keeps the function body non-trivial so it cannot be merged/folded
+    return value + 1;
+}
+static int (*volatile bench_target_ptr)(int) = shim_bench_target; //prevents the compiler from inlining the calls
+
+static struct override_symbol_inst *ov_bench_target = NULL;
+static int shim_bench_target_override(int value)
+{
+    int out, ret;
+    ret = call_overridden_symbol(out, ov_bench_target, value);
+
+    return unlikely(ret != 0) ? ret : out;
+}
+
+static int bench_ovsym(void)
+{
+    u64 native = measure_cycles(iterations, bench_target_ptr(1));
+
+    ov_bench_target = override_symbol_ng("shim_bench_target", shim_bench_target_override);
+    if (IS_ERR(ov_bench_target)) {
+        int out = PTR_ERR(ov_bench_target);
+        ov_bench_target = NULL;
+        pr_loc_err("[ovsym] override_symbol_ng() failed - error=%d", out);
+        return out;
+    }
+
+    //The first call may need to prepare the code swapping - it's not what we want to measure
+    bench_target_ptr(1);
+    u64 hooked = measure_cycles(iterations, bench_target_ptr(1));
+
+    restore_symbol_ng(ov_bench_target);
+    ov_bench_target = NULL;
+
+    print_result("ovsym", "overridden", native, hooked);
+    return 0;
+}
+
+/******************************************************* drvreg *******************************************************/
+static int bench_drv_probe(struct platform_device *pdev)
+{
+    return -ENODEV;
+}
+
+static struct platform_driver bench_drv = {
+    .probe = bench_drv_probe,
+    .driver = {
+        .name = BENCH_DRV_NAME,
+        .owner = THIS_MODULE,
+    },
+};
+
+static driver_watch_notify_result bench_drv_watcher(struct device_driver *drv, driver_watch_notify_state event)
+{
+    return DWATCH_NOTIFY_CONTINUE;
+}
+
+/**
+ * Registers & unregisters the dummy driver reg_iterations times; it sleeps so preemption cannot be disabled
+ *
+ * @return cycles/call or 0 on error
+ */
+static u64 drvreg_loop(void)
+{
+    cycles_t start = get_cycles();
+    for (int i = 0; i < reg_iterations; ++i) {
+        if (platform_driver_register(&bench_drv) != 0)
+            return 0;
+        platform_driver_unregister(&bench_drv);
+    }
+
+    return div_u64(get_cycles() - start, reg_iterations);
+}
+
+static int bench_drvreg(void)
+{
+    u64 native = drvreg_loop();
+
+    driver_watcher_instance *watcher = watch_driver_register(BENCH_WATCHED_DRV_NAME, bench_drv_watcher,
+                                                             DWATCH_STATE_COMING);
+    if (IS_ERR(watcher)) {
+        pr_loc_err("[drvreg] watch_driver_register() failed - error=%ld", PTR_ERR(watcher));
+        return PTR_ERR(watcher);
+    }
+    u64 hooked = drvreg_loop();
+    unwatch_driver_register(watcher);
+
+    if (!native || !hooked) {
+        pr_loc_err("[drvreg] platform_driver_register() failed");
+        return -EIO;
+    }
+
+    print_result("drvreg", "watched", native, hooked);
+    return 0;
+}
+
+/********************************************************* pci ********************************************************/
+static const struct pci_dev_descriptor bench_pci_dev =
+    PCI_DSC_NORMAL_DEV(0x8086, 0x1234, U16_CLASS_TO_U8_CLASS(PCI_CLASS_SERIAL_USB),
+                       U16_CLASS_TO_U8_SUBCLASS(PCI_CLASS_SERIAL_USB), 0x20, PCI_DSC_REV_NONE,
+                       PCI_HEADER_TYPE_NORMAL);
+
+static int bench_pci(void)
+{
+    u32 val;
+
+    struct pci_dev *real = pci_get_device(PCI_ANY_ID, PCI_ANY_ID, NULL);
+    if (!real) {
+        pr_loc_wrn("[pci] no real PCI device to compare with - skipping");
+        return 0;
+    }
+    u64 native = measure_cycles(iterations, pci_read_config_dword(real, PCI_VENDOR_ID, &val));
+    pci_dev_put(real);
+
+    const struct virtual_device *vdev = vpci_add_single_device(vpci_bus, 0x00, &bench_pci_dev);
+    if (IS_ERR(vdev)) {
+        pr_loc_err("[pci] failed to add virtual device on bus %02x - error=%ld", vpci_bus, PTR_ERR(vdev));
+        return PTR_ERR(vdev);
+    }
+
+    int out = 0;
+    struct pci_bus *bus = pci_find_bus(0, vpci_bus);
+    if (!bus) {
+        pr_loc_err("[pci] virtual bus %02x not found after adding a device", vpci_bus);
+        out = -ENODEV;
+        goto out_remove;
+    }
+    u64 hooked = measure_cycles(iterations, pci_bus_read_config_dword(bus, PCI_DEVFN(0, 0), PCI_VENDOR_ID, &val));
+
+    print_result("pci", "virtual", native, hooked);
+
+    out_remove:
+    vpci_remove_all_devices_and_buses();
+    return out;
+}
+
+static int __init init_shim_bench(void)
+{
+    rp_dbg_trace_init();
+    if (iterations <= 0 || reg_iterations <= 0 || vpci_bus < 0 || vpci_bus > 0xff) {
+        pr_loc_err("Invalid params: iterations=%d reg_iterations=%d vpci_bus=%d", iterations, reg_iterations,
+                   vpci_bus);
+        return -EINVAL;
+    }
+
+    pr_loc_inf("Running interception benchmark (iterations=%d, reg_iterations=%d)", iterations, reg_iterations);
+
+    //Tests are independent - a failure of one doesn't stop the others
+    int out = 0, ret;
+    if ((ret = bench_syscall()) != 0)
+        out = ret;
+    if ((ret = bench_ovsym()) != 0)
+        out = ret;
+    if ((ret = bench_drvreg()) != 0)
+        out = ret;
+    if ((ret = bench_pci()) != 0)
+        out = ret;
+
+    return out;
+}
+
+static void __exit cleanup_shim_bench(void)
+{
+    //noop - everything is done & cleaned up during init
+}
+
+MODULE_AUTHOR("RedPill");
+MODULE_LICENSE("GPL");
+module_init(init_shim_bench);
+module_exit(cleanup_shim_bench);
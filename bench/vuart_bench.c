@@ -0,0 +1,399 @@
+/**
+ * Throughput & latency benchmark for the vUART (built as a separate redpill_bench.ko with "make bench")
+ *
+ * The module brings up a vUART on a spare line, opens the corresponding /dev/ttyS# from the kernel (so that the whole
+ * tty => 8250 => vUART stack is exercised, like it would be with a real app) and runs two tests:
+ *  - callback: a message is written to the port and timed until it is fully delivered to the TX callback
+ *  - loopback: the port is put in MCR LOOP mode (TIOCM_LOOP) and a message is timed until it is read back
+ *
+ * For each test bytes/s, average & p99 latency, and register accesses per byte (if vUART stats are compiled in) are
+ * printed to the kernel log. The benchmark runs once on load; the module does nothing afterwards and can be removed.
+ *
+ * Optionally a trace recorded with <debugfs>/redpill/vuart/ttyS#/trace can be replayed on the port (see vuart_trace.h)
+ * "iterations" times as fast as possible, to measure the emulation cost of a real-world session (e.g. a boot).
+ *
+ * Usage: insmod redpill_bench.ko [line=3] [iterations=1000] [msg_len=64] [chip=0] [replay=/path/to/trace]
+ * The line used must NOT be used by anything else (incl. redpill.ko itself - by default PMU uses ttyS1).
+ *
+ * This module links the vUART code directly (it's not exported by redpill.ko) so it tests exactly the same sources.
+ */
+#include "../common.h"
+#include "../internal/uart/virtual_uart.h"
+#include "../internal/uart/vuart_trace.h" //vuart_trace_replay()
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/fs.h> //filp_open, vfs_read, vfs_write
+#include <linux/termios.h> //struct termios, TCGETS, TIOCM_LOOP
+#include <linux/tty.h>
+#include <linux/completion.h>
+#include <linux/ktime.h>
+#include <linux/sort.h>
+#include <linux/vmalloc.h>
+#include <linux/uaccess.h> //get_fs, set_fs
+#include <linux/version.h>
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,13,0)
+#define reinit_completion(x) INIT_COMPLETION(*(x))
+#endif
+
+#define BENCH_MAX_MSG_LEN 4096
+#define BENCH_TIMEOUT (HZ * 2) //max time for a single message to arrive
+#define BENCH_MAX_TRACE_LEN (64 << 20)
+
+static int line = 3;
+module_param(line, int, 0444);
+MODULE_PARM_DESC(line, "ttyS# to benchmark on (must be unused)");
+
+static int iterations = 1000;
+module_param(iterations, int, 0444);
+MODULE_PARM_DESC(iterations, "Number of messages to send in each test");
+
+static int msg_len = 64;
+module_param(msg_len, int, 0444);
+MODULE_PARM_DESC(msg_len, "Length of a single message in bytes");
+
+static int chip = VUART_CHIP_16550A;
+module_param(chip, int, 0444);
+MODULE_PARM_DESC(chip, "Chip model to emulate (see vuart_chip_model)");
+
+static char *replay = NULL;
+module_param(replay, charp, 0444);
+MODULE_PARM_DESC(replay, "Path to a vUART trace to replay after other tests (optional)");
+
+struct bench_result {
+    u64 total_ns;
+    u64 avg_ns;
+    u64 p99_ns;
+    u64 bytes;
+    u64 reg_accesses;
+};
+
+static char tx_cb_buffer[VUART_FIFO_MAX_LEN];
+static char *msg_buf = NULL;
+static u64 *samples = NULL;
+static DECLARE_COMPLETION(msg_delivered);
+static unsigned int cb_received = 0;
+static u64 cb_delivered_ns = 0;
+
+static void bench_tx_callback(int cb_line, const char *buffer, unsigned int len, vuart_flush_reason reason)
+{
+    cb_received += len;
+    if (cb_received >= msg_len) {
+        cb_delivered_ns = ktime_to_ns(ktime_get());
+        cb_received = 0;
+        complete(&msg_delivered);
+    }
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    u64 x = *(const u64 *)a, y = *(const u64 *)b;
+    return (x > y) - (x < y);
+}
+
+static u64 get_reg_accesses(void)
+{
+    u64 reads, writes;
+    if (vuart_get_reg_accesses(line, &reads, &writes) != 0)
+        return 0;
+
+    return reads + writes;
+}
+
+/**
+ * Calls tty ioctl on the file using kernel memory for args
+ */
+static long tty_kioctl(struct file *filp, unsigned int cmd, void *arg)
+{
+    mm_segment_t old_fs = get_fs();
+    set_fs(KERNEL_DS);
+    long out = filp->f_op->unlocked_ioctl(filp, cmd, (unsigned long)arg);
+    set_fs(old_fs);
+
+    return out;
+}
+
+/**
+ * Puts the tty in raw mode so that nothing is buffered or translated by the line discipline
+ */
+static int set_raw_mode(struct file *filp)
+{
+    struct termios tios;
+    long out;
+
+    if ((out = tty_kioctl(filp, TCGETS, &tios)) != 0)
+        return out;
+
+    tios.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON);
+    tios.c_oflag &= ~OPOST;
+    tios.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+    tios.c_cflag &= ~(CSIZE | PARENB | CRTSCTS);
+    tios.c_cflag |= CS8 | CLOCAL;
+    tios.c_cc[VMIN] = 1;
+    tios.c_cc[VTIME] = 0;
+
+    return tty_kioctl(filp, TCSETS, &tios);
+}
+
+static ssize_t tty_kwrite(struct file *filp, const char *buf, size_t len)
+{
+    mm_segment_t old_fs = get_fs();
+    loff_t pos = 0;
+    set_fs(KERNEL_DS);
+    ssize_t out = vfs_write(filp, (const char __user *)buf, len, &pos);
+    set_fs(old_fs);
+
+    return out;
+}
+
+static ssize_t tty_kread_full(struct file *filp, char *buf, size_t len)
+{
+    mm_segment_t old_fs = get_fs();
+    loff_t pos = 0;
+    size_t total = 0;
+    ssize_t out = 0;
+
+    set_fs(KERNEL_DS);
+    while (total < len) {
+        out = vfs_read(filp, (char __user *)buf + total, len - total, &pos);
+        if (out <= 0)
+            break;
+        total += out;
+    }
+    set_fs(old_fs);
+
+    return out < 0 ? out : total;
+}
+
+static void summarize(struct bench_result *res, u64 reg_before)
+{
+    u64 sum = 0;
+    for (int i = 0; i < iterations; ++i)
+        sum += samples[i];
+
+    sort(samples, iterations, sizeof(u64), cmp_u64, NULL);
+    res->avg_ns = div_u64(sum, iterations);
+    unsigned int p99_idx = (iterations * 99) / 100;
+    res->p99_ns = samples[p99_idx < iterations ? p99_idx : iterations - 1];
+    res->bytes = (u64)iterations * msg_len;
+    res->reg_accesses = get_reg_accesses() - reg_before;
+}
+
+static void print_result(const char *name, struct bench_result *res)
+{
+    u64 bps = res->total_ns ? div64_u64(res->bytes * NSEC_PER_SEC, res->total_ns) : 0;
+    u64 regs_x100 = res->bytes ? div64_u64(res->reg_accesses * 100, res->bytes) : 0;
+
+    pr_loc_inf("[%s] %llu bytes in %llu us => %llu B/s; latency avg=%llu ns p99=%llu ns; reg accesses/byte=%llu.%02llu",
+               name, res->bytes, div_u64(res->total_ns, NSEC_PER_USEC), bps, res->avg_ns, res->p99_ns,
+               div_u64(regs_x100, 100), regs_x100 % 100);
+}
+
+static int bench_callback(struct file *filp, struct bench_result *res)
+{
+    int out;
+    u64 reg_before = get_reg_accesses();
+    u64 start = ktime_to_ns(ktime_get());
+
+    for (int i = 0; i < iterations; ++i) {
+        reinit_completion(&msg_delivered);
+        u64 t0 = ktime_to_ns(ktime_get());
+        if ((out = tty_kwrite(filp, msg_buf, msg_len)) != msg_len) {
+            pr_loc_err("Write failed at iteration %d - error=%d", i, out);
+            return out < 0 ? out : -EIO;
+        }
+
+        if (!wait_for_completion_timeout(&msg_delivered, BENCH_TIMEOUT)) {
+            pr_loc_err("Message %d was not delivered to the TX callback in time", i);
+            return -ETIMEDOUT;
+        }
+        samples[i] = cb_delivered_ns - t0;
+    }
+
+    res->total_ns = ktime_to_ns(ktime_get()) - start;
+    summarize(res, reg_before);
+    return 0;
+}
+
+static int bench_loopback(struct file *filp, struct bench_result *res)
+{
+    int out;
+    int mctrl = TIOCM_LOOP;
+    char *rx_buf = msg_buf + BENCH_MAX_MSG_LEN;
+
+    if ((out = tty_kioctl(filp, TIOCMBIS, &mctrl)) != 0) {
+        pr_loc_err("Failed to enable loopback mode - error=%d", out);
+        return out;
+    }
+
+    u64 reg_before = get_reg_accesses();
+    u64 start = ktime_to_ns(ktime_get());
+    for (int i = 0; i < iterations; ++i) {
+        u64 t0 = ktime_to_ns(ktime_get());
+        if ((out = tty_kwrite(filp, msg_buf, msg_len)) != msg_len ||
+            (out = tty_kread_full(filp, rx_buf, msg_len)) != msg_len) {
+            pr_loc_err("Loopback failed at iteration %d - error=%d", i, out);
+            out = out < 0 ? out : -EIO;
+            goto out_unloop;
+        }
+        samples[i] = ktime_to_ns(ktime_get()) - t0;
+    }
+
+    res->total_ns = ktime_to_ns(ktime_get()) - start;
+    summarize(res, reg_before);
+    out = 0;
+
+    out_unloop:
+    tty_kioctl(filp, TIOCMBIC, &mctrl);
+    return out;
+}
+
+/**
+ * Loads the whole trace file into a vmalloc()ed buffer
+ */
+static void *load_trace(const char *path, size_t *len)
+{
+    struct file *filp = filp_open(path, O_RDONLY, 0);
+    if (IS_ERR(filp)) {
+        pr_loc_err("Failed to open trace %s - error=%ld", path, PTR_ERR(filp));
+        return filp;
+    }
+
+    void *buf = ERR_PTR(-EFBIG);
+    loff_t size = i_size_read(file_inode(filp));
+    if (size <= 0 || size > BENCH_MAX_TRACE_LEN) {
+        pr_loc_err("Trace %s has invalid size %lld (max %d)", path, size, BENCH_MAX_TRACE_LEN);
+        goto out_close;
+    }
+
+    if (!(buf = vmalloc(size))) {
+        pr_loc_crt("vmalloc failed");
+        buf = ERR_PTR(-ENOMEM);
+        goto out_close;
+    }
+
+    ssize_t read;
+    if ((read = tty_kread_full(filp, buf, size)) != size) {
+        pr_loc_err("Failed to read trace %s - error=%zd", path, read);
+        vfree(buf);
+        buf = ERR_PTR(read < 0 ? read : -EIO);
+        goto out_close;
+    }
+    *len = size;
+
+    out_close:
+    filp_close(filp, NULL);
+    return buf;
+}
+
+static int bench_replay(const char *path)
+{
+    int out;
+    size_t len;
+    struct vuart_replay_result res, total = { 0 };
+
+    void *trace = load_trace(path, &len);
+    if (IS_ERR(trace))
+        return PTR_ERR(trace);
+
+    u64 reg_before = get_reg_accesses();
+    for (int i = 0; i < iterations; ++i) {
+        if ((out = vuart_trace_replay(line, trace, len, &res)) != 0) {
+            pr_loc_err("Replay failed at iteration %d - error=%d", i, out);
+            goto out_free;
+        }
+        total.records += res.records;
+        total.read_mismatches += res.read_mismatches;
+        total.total_ns += res.total_ns;
+    }
+
+    pr_loc_inf("[replay] %llu records in %llu us => %llu ns/record; read mismatches=%llu; reg accesses=%llu",
+               total.records, div_u64(total.total_ns, NSEC_PER_USEC),
+               total.records ? div64_u64(total.total_ns, total.records) : 0, total.read_mismatches,
+               get_reg_accesses() - reg_before);
+    out = 0;
+
+    out_free:
+    vfree(trace);
+    return out;
+}
+
+static int __init init_bench(void)
+{
+    int out;
+    struct file *filp;
+    struct bench_result res;
+    char dev_path[16];
+
+    rp_dbg_trace_init();
+    if (iterations <= 0 || msg_len <= 0 || msg_len > BENCH_MAX_MSG_LEN) {
+        pr_loc_err("Invalid params: iterations=%d msg_len=%d (max %d)", iterations, msg_len, BENCH_MAX_MSG_LEN);
+        return -EINVAL;
+    }
+
+    msg_buf = vmalloc(BENCH_MAX_MSG_LEN * 2); //TX + RX
+    samples = vmalloc(sizeof(u64) * iterations);
+    if (!msg_buf || !samples) {
+        pr_loc_crt("vmalloc failed");
+        out = -ENOMEM;
+        goto out_free;
+    }
+    for (int i = 0; i < msg_len; ++i)
+        msg_buf[i] = 'A' + (i % 26);
+
+    if ((out = vuart_add_device(line, chip)) != 0)
+        goto out_free;
+
+    if ((out = vuart_set_tx_callback(line, bench_tx_callback, tx_cb_buffer, VUART_THRESHOLD_MAX)) != 0)
+        goto out_remove;
+
+    snprintf(dev_path, sizeof(dev_path), "/dev/ttyS%d", line);
+    filp = filp_open(dev_path, O_RDWR | O_NOCTTY, 0);
+    if (IS_ERR(filp)) {
+        out = PTR_ERR(filp);
+        pr_loc_err("Failed to open %s - error=%d", dev_path, out);
+        goto out_remove;
+    }
+
+    if ((out = set_raw_mode(filp)) != 0) {
+        pr_loc_err("Failed to set raw mode on %s - error=%d", dev_path, out);
+        goto out_close;
+    }
+
+    pr_loc_inf("Running vUART benchmark on ttyS%d (chip=%d, iterations=%d, msg_len=%d)", line, chip, iterations,
+               msg_len);
+
+    if ((out = bench_callback(filp, &res)) != 0)
+        goto out_close;
+    print_result("callback", &res);
+
+    if ((out = bench_loopback(filp, &res)) != 0)
+        goto out_close;
+    print_result("loopback", &res);
+
+    //The port stays open during replay so that the driver's state matches the one the trace was (usually) recorded in
+    if (replay && (out = bench_replay(replay)) != 0)
+        goto out_close;
+
+    out_close:
+    filp_close(filp, NULL);
+    out_remove:
+    vuart_remove_device(line); //this also removes the callback
+    out_free:
+    vfree(msg_buf);
+    vfree(samples);
+    msg_buf = NULL;
+    samples = NULL;
+
+    return out;
+}
+
+static void __exit cleanup_bench(void)
+{
+    //noop - everything is done & cleaned up during init
+}
+
+MODULE_AUTHOR("RedPill");
+MODULE_LICENSE("GPL");
+module_init(init_bench);
+module_exit(cleanup_bench);
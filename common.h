@@ -16,6 +16,7 @@
 /**********************************************************************************************************************/
 
 #include "internal/stealth.h"
+#include "debug/debug_trace.h" //rp_dbg_enabled()
 #include <linux/init.h>
 #include <linux/kernel.h>
 #include <linux/errno.h>
@@ -41,7 +42,12 @@
 #define pr_loc_err(fmt, ...) pr_err ( "<%s/%s:%d> " pr_fmt(fmt) "\n", KBUILD_MODNAME, __FILENAME__, __LINE__, ##__VA_ARGS__)
 #define pr_loc_inf(fmt, ...) pr_info( "<%s/%s:%d> " pr_fmt(fmt) "\n", KBUILD_MODNAME, __FILENAME__, __LINE__, ##__VA_ARGS__)
 #define pr_loc_wrn(fmt, ...) pr_warn( "<%s/%s:%d> " pr_fmt(fmt) "\n", KBUILD_MODNAME, __FILENAME__, __LINE__, ##__VA_ARGS__)
-#define pr_loc_dbg(fmt, ...) pr_info( "<%s/%s:%d> " pr_fmt(fmt) "\n", KBUILD_MODNAME, __FILENAME__, __LINE__, ##__VA_ARGS__)
+//Debug messages are used on hot paths - they're gated by a static key and their arguments are evaluated lazily
+#define pr_loc_dbg(fmt, ...) \
+    do { \
+        if (rp_dbg_enabled()) \
+            pr_info( "<%s/%s:%d> " pr_fmt(fmt) "\n", KBUILD_MODNAME, __FILENAME__, __LINE__, ##__VA_ARGS__); \
+    } while(0)
 
 #define pr_loc_bug(fmt, ...) pr_err ( "<%s/%s:%d> !!BUG!! " pr_fmt(fmt) "\n", KBUILD_MODNAME, __FILENAME__, __LINE__, ##__VA_ARGS__)
 #endif //STEALTH_MODE
@@ -1,25 +1,24 @@
 #include "cmdline_delegate.h"
 #include "../common.h" //commonly used headers in this module
 #include "../internal/call_protected.h" //used to call cmdline_proc_show()
+#include "../internal/init_arena.h" //rp_arena_alloc()
 
-#define ensure_cmdline_param(cmdline_param) \
-    if (strncmp(param_pointer, cmdline_param, sizeof_str_chunk(cmdline_param)) != 0) { return false; }
-
-#define ensure_cmdline_token(cmdline_param) \
-    if (strncmp(param_pointer, cmdline_param, sizeof(cmdline_param)) != 0) { return false; }
+/*
+ * All extractors below are called by extract_config_from_cmdline() for tokens matching their entry in cmdline_opts[].
+ * They receive a pointer to the destination field in the runtime config and a pointer to the value (i.e. the part of
+ * the token after the option name). Each returns true if the value was consumed (even if it was invalid - this is
+ * reported by the extractor itself) or false if it wasn't meant for it (it will be then reported as unrecognized).
+ */
 
 /**
  * Extracts device model (syno_hw_version=<string>) from kernel cmd line
  *
- * @param model pointer to save model to
- * @param param_pointer currently processed token
- * @return true on match, false if param didn't match
+ * @param dst syno_hw to save model to
  */
-static bool extract_hw(syno_hw *model, const char *param_pointer)
+static bool __init extract_hw(void *dst, const char *value)
 {
-    ensure_cmdline_param(CMDLINE_KT_HW);
-
-    if (strscpy((char *)model, param_pointer + sizeof_str_chunk(CMDLINE_KT_HW), sizeof(syno_hw)) < 0)
+    syno_hw *model = dst;
+    if (strscpy((char *)model, value, sizeof(syno_hw)) < 0)
         pr_loc_wrn("HW version truncated to %zu", sizeof(syno_hw)-1);
 
     pr_loc_dbg("HW version set to: %s", (char *)model);
@@ -30,15 +29,12 @@ static bool extract_hw(syno_hw *model, const char *param_pointer)
 /**
  * Extracts serial number (sn=<string>) from kernel cmd line
  *
- * @param sn pointer to save s/n to
- * @param param_pointer currently processed token
- * @return true on match, false if param didn't match
+ * @param dst serial_no to save s/n to
  */
-static bool extract_sn(serial_no *sn, const char *param_pointer)
+static bool __init extract_sn(void *dst, const char *value)
 {
-    ensure_cmdline_param(CMDLINE_KT_SN);
-
-    if(strscpy((char *)sn, param_pointer + sizeof_str_chunk(CMDLINE_KT_SN), sizeof(serial_no)) < 0)
+    serial_no *sn = dst;
+    if(strscpy((char *)sn, value, sizeof(serial_no)) < 0)
         pr_loc_wrn("S/N truncated to %zu", sizeof(serial_no)-1);
 
     pr_loc_dbg("S/N set to: %s", (char *)sn);
@@ -46,12 +42,21 @@ static bool extract_sn(serial_no *sn, const char *param_pointer)
     return true;
 }
 
-static bool extract_boot_media_type(struct boot_media *boot_media, const char *param_pointer)
+/**
+ * Extracts boot media type switch (synoboot_satadom=<1|0>) from kernel cmd line
+ *
+ * @param dst struct boot_media
+ */
+static bool __init extract_boot_media_type(void *dst, const char *value_ptr)
 {
-    ensure_cmdline_param(CMDLINE_KT_SATADOM);
-
-    char value = param_pointer[sizeof_str_chunk(CMDLINE_KT_SATADOM)];
+    struct boot_media *boot_media = dst;
+    char value = value_ptr[0];
     if (likely(value == '1')) {
+        if (boot_media->type == BOOT_MEDIA_ANY) { //boot_any=1 already includes SATA
+            pr_loc_dbg("Boot media SATADOM requested (along with USB)");
+            return true;
+        }
+
         boot_media->type = BOOT_MEDIA_SATA;
         pr_loc_dbg("Boot media SATADOM requested");
         return true;
@@ -71,16 +76,13 @@ static bool extract_boot_media_type(struct boot_media *boot_media, const char *p
 /**
  * Extracts VID override (vid=<uint>) from kernel cmd line
  *
- * @param user_vid pointer to save VID
- * @param param_pointer currently processed token
- * @return true on match, false if param didn't match
+ * @param dst device_id to save VID
  */
-static bool extract_vid(device_id *user_vid, const char *param_pointer)
+static bool __init extract_vid(void *dst, const char *value)
 {
-    ensure_cmdline_param(CMDLINE_CT_VID);
-
+    device_id *user_vid = dst;
     long long numeric_param;
-    int tmp_call_res = kstrtoll(param_pointer + sizeof_str_chunk(CMDLINE_CT_VID), 0, &numeric_param);
+    int tmp_call_res = kstrtoll(value, 0, &numeric_param);
     if (unlikely(tmp_call_res != 0)) {
         pr_loc_err("Call to %s() failed => %d", "kstrtoll", tmp_call_res);
         return true;
@@ -105,16 +107,13 @@ static bool extract_vid(device_id *user_vid, const char *param_pointer)
 /**
  * Extracts PID override (pid=<uint>) from kernel cmd line
  *
- * @param user_pid pointer to save PID
- * @param param_pointer currently processed token
- * @return true on match, false if param didn't match
+ * @param dst device_id to save PID
  */
-static bool extract_pid(device_id *user_pid, const char *param_pointer)
+static bool __init extract_pid(void *dst, const char *value)
 {
-    ensure_cmdline_param(CMDLINE_CT_PID);
-
+    device_id *user_pid = dst;
     long long numeric_param;
-    int tmp_call_res = kstrtoll(param_pointer + sizeof_str_chunk(CMDLINE_CT_PID), 0, &numeric_param);
+    int tmp_call_res = kstrtoll(value, 0, &numeric_param);
     if (unlikely(tmp_call_res != 0)) {
         pr_loc_err("Call to %s() failed => %d", "kstrtoll", tmp_call_res);
         return true;
@@ -136,17 +135,102 @@ static bool extract_pid(device_id *user_pid, const char *param_pointer)
     return true;
 }
 
+/**
+ * Parses a single numeric field of the USB rule ("*" means "any")
+ *
+ * @return 0 if the field should be ignored, 1 if it should be matched, -E on parse error
+ */
+static int __init parse_usb_rule_id(const char *field, device_id *out)
+{
+    if (!field || field[0] == '\0' || strcmp(field, "*") == 0)
+        return 0;
+
+    u16 val;
+    int err = kstrtou16(field, 0, &val);
+    if (unlikely(err != 0))
+        return err;
+
+    *out = val;
+    return 1;
+}
+
+/**
+ * Extracts USB boot device rule (usb_rule=<vid|*>:<pid|*>[:<class|*>[:<serial>]]) from kernel cmd line
+ *
+ * The option can be specified multiple times (up to MAX_USB_BOOT_RULES) - a device matching any of the rules is used.
+ *
+ * @param dst struct boot_media to save the rule to
+ */
+static bool __init extract_usb_rule(void *dst, const char *value)
+{
+    struct boot_media *boot = dst;
+    if (unlikely(boot->usb_rules_num >= MAX_USB_BOOT_RULES)) {
+        pr_loc_err("Too many %s options - only %d are supported", CMDLINE_CT_USB_RULE, MAX_USB_BOOT_RULES);
+        return true;
+    }
+
+    char rule_txt[USB_RULE_SERIAL_MAX_LEN + 32];
+    if (strscpy(rule_txt, value, sizeof(rule_txt)) < 0) {
+        pr_loc_err("Cmdline %s is invalid (value too long)", CMDLINE_CT_USB_RULE);
+        return true;
+    }
+
+    struct usb_boot_rule *rule = &boot->usb_rules[boot->usb_rules_num];
+    memset(rule, 0, sizeof(*rule));
+
+    char *cursor = rule_txt;
+    char *vid = strsep(&cursor, ":");
+    char *pid = strsep(&cursor, ":");
+    char *if_class = strsep(&cursor, ":");
+    char *serial = cursor; //the rest (serials may contain ":")
+
+    int res;
+    if ((res = parse_usb_rule_id(vid, &rule->vid)) < 0)
+        goto error_out;
+    rule->match_flags |= res ? USB_RULE_MATCH_VID : 0;
+
+    if ((res = parse_usb_rule_id(pid, &rule->pid)) < 0)
+        goto error_out;
+    rule->match_flags |= res ? USB_RULE_MATCH_PID : 0;
+
+    device_id class_val = 0;
+    if ((res = parse_usb_rule_id(if_class, &class_val)) < 0 || class_val > 0xFF)
+        goto error_out;
+    if (res) {
+        rule->if_class = (u8)class_val;
+        rule->match_flags |= USB_RULE_MATCH_CLASS;
+    }
+
+    if (serial && serial[0] != '\0') {
+        if (strscpy(rule->serial, serial, sizeof(rule->serial)) < 0) {
+            pr_loc_err("Cmdline %s is invalid (serial longer than %d)", CMDLINE_CT_USB_RULE, USB_RULE_SERIAL_MAX_LEN);
+            return true; //the rule isn't counted, so the next one will overwrite it
+        }
+        rule->match_flags |= USB_RULE_MATCH_SERIAL;
+    }
+
+    pr_loc_dbg("USB boot rule #%u: flags=0x%02x vid=0x%04x pid=0x%04x class=0x%02x serial=\"%s\"",
+               boot->usb_rules_num, rule->match_flags, rule->vid, rule->pid, rule->if_class, rule->serial);
+    ++boot->usb_rules_num;
+
+    return true;
+
+    error_out:
+    pr_loc_err("Cmdline %s is invalid (expected <vid|*>:<pid|*>[:<class|*>[:<serial>]])", CMDLINE_CT_USB_RULE);
+    return true;
+}
+
 /**
  * Extracts MFG mode enable switch (mfg<noval>) from kernel cmd line
  *
- * @param is_mfg_boot pointer to flag
- * @param param_pointer currently processed token
- * @return true on match, false if param didn't match
+ * @param dst bool flag
  */
-static bool extract_mfg(bool *is_mfg_boot, const char *param_pointer)
+static bool __init extract_mfg(void *dst, const char *value)
 {
-    ensure_cmdline_token(CMDLINE_CT_MFG);
+    if (value[0] != '\0') //it's a switch - "mfgfoo" isn't "mfg"
+        return false;
 
+    bool *is_mfg_boot = dst;
     *is_mfg_boot = true;
     pr_loc_dbg("MFG boot requested");
 
@@ -154,15 +238,37 @@ static bool extract_mfg(bool *is_mfg_boot, const char *param_pointer)
 }
 
 /**
- * Extracts maximum size of SATA DOM (dom_szmax=<number of MiB>) from kernel cmd line
+ * Extracts switch for looking up the boot device on both USB & SATA (boot_any=<1|0>) from kernel cmd line
+ *
+ * @param dst struct boot_media
  */
-static bool extract_dom_max_size(struct boot_media *boot_media, const char *param_pointer)
+static bool __init extract_boot_any(void *dst, const char *value_ptr)
 {
-    ensure_cmdline_param(CMDLINE_CT_DOM_SZMAX);
+    struct boot_media *boot_media = dst;
+    char value = value_ptr[0];
+    if (likely(value == '1')) {
+        boot_media->type = BOOT_MEDIA_ANY;
+        pr_loc_dbg("Boot media USB or SATADOM (whichever is found first) requested");
+        return true;
+    }
+
+    if (value != '0')
+        pr_loc_err("Option \"%s%c\" is invalid (value should be 0 or 1)", CMDLINE_CT_BOOT_ANY, value);
 
-    long size_mib = simple_strtol(param_pointer + sizeof_str_chunk(CMDLINE_KT_NETIF_NUM), NULL, 10);
+    return true;
+}
+
+/**
+ * Extracts maximum size of SATA DOM (dom_szmax=<number of MiB>) from kernel cmd line
+ *
+ * @param dst struct boot_media
+ */
+static bool __init extract_dom_max_size(void *dst, const char *value)
+{
+    struct boot_media *boot_media = dst;
+    long size_mib = simple_strtol(value, NULL, 10);
     if (size_mib <= 0) {
-        pr_loc_err("Invalid maximum size of SATA DoM (\"%s=%ld\")", CMDLINE_KT_NETIF_NUM, size_mib);
+        pr_loc_err("Invalid maximum size of SATA DoM (\"%s%ld\")", CMDLINE_CT_DOM_SZMAX, size_mib);
         return true;
     }
 
@@ -173,17 +279,70 @@ static bool extract_dom_max_size(struct boot_media *boot_media, const char *para
 }
 
 /**
- * Extracts MFG mode enable switch (syno_port_thaw=<1|0>) from kernel cmd line
+ * Extracts CPU list for threads of the module (rp_cpus=<cpu list>) from kernel cmd line
+ *
+ * The list is only validated when it's applied (see set_thread_placement()), as the CPUs aren't known here yet.
+ *
+ * @param dst struct thread_placement
+ */
+static bool __init extract_thread_cpus(void *dst, const char *value)
+{
+    struct thread_placement *threads = dst;
+    if (strscpy(threads->cpus, value, sizeof(threads->cpus)) < 0) {
+        pr_loc_err("Cmdline %s is invalid (value too long)", CMDLINE_CT_RP_CPUS);
+        threads->cpus[0] = '\0';
+        return true;
+    }
+
+    pr_loc_dbg("Threads CPU list set to: %s", threads->cpus);
+
+    return true;
+}
+
+/**
+ * Extracts scheduling of threads of the module (rp_sched=<normal|fifo|rr>[:<nice|RT priority>]) from kernel cmd line
  *
- * @param port_thaw pointer to flag
- * @param param_pointer currently processed token
- * @return true on match, false if param didn't match
+ * @param dst struct thread_placement
  */
-static bool extract_port_thaw(bool *port_thaw, const char *param_pointer)
+static bool __init extract_thread_sched(void *dst, const char *value)
 {
-    ensure_cmdline_param(CMDLINE_KT_THAW);
+    static const struct { const char *name; thread_sched_policy policy; int def_prio; } policies[] __initconst = {
+        { "normal", THREAD_SCHED_NORMAL, 0 },
+        { "fifo", THREAD_SCHED_FIFO, 1 },
+        { "rr", THREAD_SCHED_RR, 1 },
+    };
+    struct thread_placement *threads = dst;
+
+    for (int i = 0; i < ARRAY_SIZE(policies); i++) {
+        size_t len = strlen(policies[i].name);
+        if (strncmp(value, policies[i].name, len) != 0 || (value[len] != '\0' && value[len] != ':'))
+            continue;
 
-    short value = param_pointer[sizeof_str_chunk(CMDLINE_KT_THAW)];
+        int prio = policies[i].def_prio;
+        if (value[len] == ':' && kstrtoint(value + len + 1, 10, &prio) != 0)
+            break;
+
+        threads->policy = policies[i].policy;
+        threads->prio = prio;
+        pr_loc_dbg("Threads scheduling set to %s (prio=%d)", policies[i].name, prio);
+
+        return true;
+    }
+
+    pr_loc_err("Cmdline %s%s is invalid (expected <normal|fifo|rr>[:<nice|RT priority>])", CMDLINE_CT_RP_SCHED, value);
+
+    return true;
+}
+
+/**
+ * Extracts port thaw switch (syno_port_thaw=<1|0>) from kernel cmd line
+ *
+ * @param dst bool flag
+ */
+static bool __init extract_port_thaw(void *dst, const char *value_ptr)
+{
+    bool *port_thaw = dst;
+    short value = value_ptr[0];
 
     if (value == '0') {
         *port_thaw = false;
@@ -207,15 +366,12 @@ static bool extract_port_thaw(bool *port_thaw, const char *param_pointer)
 /**
  * Extracts number of expected network interfaces (netif_num=<number>) from kernel cmd line
  *
- * @param netif_num pointer to save number
- * @param param_pointer currently processed token
- * @return true on match, false if param didn't match
+ * @param dst unsigned short to save number
  */
-static bool extract_netif_num(unsigned short *netif_num, const char *param_pointer)
+static bool __init extract_netif_num(void *dst, const char *value_ptr)
 {
-    ensure_cmdline_param(CMDLINE_KT_NETIF_NUM);
-
-    short value = *(param_pointer + sizeof_str_chunk(CMDLINE_KT_NETIF_NUM)) - 48; //ASCII: 0=48 and 9=57
+    unsigned short *netif_num = dst;
+    short value = value_ptr[0] - 48; //ASCII: 0=48 and 9=57
 
     if (value == 0) {
         pr_loc_wrn("You specified no network interfaces (\"%s=0\")", CMDLINE_KT_NETIF_NUM);
@@ -234,28 +390,29 @@ static bool extract_netif_num(unsigned short *netif_num, const char *param_point
 }
 
 /**
- * Extracts network interfaces MAC addresses (mac1...mac4=<MAC> **OR** macs=<mac1,mac2,macN>)
- *
- * Note: mixing two notations may lead to undefined behaviors
+ * Extracts network interfaces MAC addresses (macs=<mac1,mac2,macN>)
  *
- * @param macs pointer to save macs
- * @param param_pointer currently processed token
- * @return true on match, false if param didn't match
+ * @param dst array of mac_address pointers
  */
-static bool extract_netif_macs(mac_address *macs[MAX_NET_IFACES], const char *param_pointer)
+static bool __init extract_netif_macs_list(void *dst, const char *value)
 {
-    if (strncmp(param_pointer, CMDLINE_KT_MACS, sizeof_str_chunk(CMDLINE_KT_MACS)) == 0) {
-        //TODO: implement macs=
-        pr_loc_err("\"%s\" is not implemented, use %s...%s instead >>>%s<<<", CMDLINE_KT_MACS, CMDLINE_KT_MAC1,
-                   CMDLINE_KT_MAC4, param_pointer);
+    //TODO: implement macs=
+    pr_loc_err("\"%s\" is not implemented, use %s...%s instead >>>%s<<<", CMDLINE_KT_MACS, CMDLINE_KT_MAC1,
+               CMDLINE_KT_MAC4, value);
 
-        return false;
-    }
+    return false;
+}
 
-    //mac1=...mac4= are valid options. ASCII for 1 is 49, ASCII for 4 is 52
-    if (strncmp(param_pointer, "mac", 3) != 0 || *(param_pointer + 4) != '=' || *(param_pointer + 3) < 49 ||
-        *(param_pointer + 3) > 52)
-        return false;
+/**
+ * Extracts network interfaces MAC addresses (mac1...mac4=<MAC>)
+ *
+ * Note: mixing it with macs= may lead to undefined behaviors
+ *
+ * @param dst array of mac_address pointers
+ */
+static bool __init extract_netif_macs(void *dst, const char *value)
+{
+    mac_address **macs = dst;
 
     //Find free spot
     unsigned short i = 0;
@@ -263,13 +420,13 @@ static bool extract_netif_macs(mac_address *macs[MAX_NET_IFACES], const char *pa
         if (macs[i])
             continue;
 
-        macs[i] = kmalloc(sizeof(mac_address), GFP_KERNEL);
+        macs[i] = rp_arena_alloc(sizeof(mac_address));
         if (!macs[i]) {
             pr_loc_crt("Failed to reserve %zu bytes of memory", sizeof(mac_address));
             goto out_found;
         }
 
-        if(strscpy((char *)macs[i], param_pointer + sizeof_str_chunk(CMDLINE_KT_MAC1), sizeof(mac_address)) < 0)
+        if(strscpy((char *)macs[i], value, sizeof(mac_address)) < 0)
             pr_loc_wrn("MAC #%d truncated to %zu", i+1, sizeof(mac_address)-1);
 
 
@@ -283,15 +440,107 @@ static bool extract_netif_macs(mac_address *macs[MAX_NET_IFACES], const char *pa
         return true;
 }
 
-static bool report_unrecognized_option(const char *param_pointer)
+static void __init report_unrecognized_option(const char *param_pointer)
 {
     pr_loc_dbg("Option \"%s\" not recognized - ignoring", param_pointer);
-
-    return true;
 }
 
 /************************************************* End of extractors **************************************************/
 
+typedef bool (cmdline_opt_extractor)(void *dst, const char *value);
+struct cmdline_opt {
+    const char *name; //option name incl. "=" if it has any value (tokens are matched by prefix)
+    unsigned char name_len;
+    bool hide:1; //whether it should be removed from /proc/cmdline when stealth mode is on
+    bool over_blob:1; //whether it's extracted even if the config came from a blob (which has no equivalent of it)
+    cmdline_opt_extractor *extract; //NULL for options which we're only hiding
+    size_t dst_offset; //offset of the field passed to extract within struct runtime_config
+};
+
+#define CMDLINE_OPT(_name, _extract, _dst, _hide) \
+    { .name = _name, .name_len = sizeof_str_chunk(_name), .hide = _hide, .extract = _extract, \
+      .dst_offset = offsetof(struct runtime_config, _dst) }
+//Same as CMDLINE_OPT() but for options which are not a part of the config blob (see config_blob.h)
+#define CMDLINE_OPT_OVER_BLOB(_name, _extract, _dst, _hide) \
+    { .name = _name, .name_len = sizeof_str_chunk(_name), .hide = _hide, .over_blob = true, .extract = _extract, \
+      .dst_offset = offsetof(struct runtime_config, _dst) }
+#define CMDLINE_OPT_HIDE(_name) { .name = _name, .name_len = sizeof_str_chunk(_name), .hide = true }
+
+/**
+ * All options we know about
+ *
+ * Options MUST be grouped by their first character (lookups are done only within the group of the token's first char,
+ * see index_cmdline_opts()). Within the group the first matching option wins.
+ * The list of hidden options is currently static. However, it's prepared to be dynamic based on the model.
+ */
+static const struct cmdline_opt cmdline_opts[] __initconst = {
+    CMDLINE_OPT(CMDLINE_CT_BOOT_ANY,   extract_boot_any,         boot_media,          true),
+    CMDLINE_OPT(CMDLINE_CT_DOM_SZMAX,  extract_dom_max_size,     boot_media,          false),
+    CMDLINE_OPT_HIDE(CMDLINE_KT_ELEVATOR),
+    CMDLINE_OPT_HIDE(CMDLINE_KT_EARLY_PK),
+    CMDLINE_OPT_HIDE(CMDLINE_KT_LOGLEVEL),
+    CMDLINE_OPT_HIDE(CMDLINE_KT_PK_BUFFER),
+    CMDLINE_OPT(CMDLINE_KT_MACS,       extract_netif_macs_list,  macs,                false),
+    CMDLINE_OPT(CMDLINE_KT_MAC1,       extract_netif_macs,       macs,                false),
+    CMDLINE_OPT(CMDLINE_KT_MAC2,       extract_netif_macs,       macs,                false),
+    CMDLINE_OPT(CMDLINE_KT_MAC3,       extract_netif_macs,       macs,                false),
+    CMDLINE_OPT(CMDLINE_KT_MAC4,       extract_netif_macs,       macs,                false),
+    CMDLINE_OPT(CMDLINE_CT_MFG,        extract_mfg,              boot_media.mfg_mode, true),
+    CMDLINE_OPT(CMDLINE_KT_NETIF_NUM,  extract_netif_num,        netif_num,           false),
+    CMDLINE_OPT(CMDLINE_CT_PID,        extract_pid,              boot_media.pid,      true),
+    CMDLINE_OPT_OVER_BLOB(CMDLINE_CT_RP_CPUS,  extract_thread_cpus,  threads,   true),
+    CMDLINE_OPT_OVER_BLOB(CMDLINE_CT_RP_SCHED, extract_thread_sched, threads,   true),
+    CMDLINE_OPT(CMDLINE_KT_HW,         extract_hw,               hw,                  false),
+    CMDLINE_OPT(CMDLINE_KT_SN,         extract_sn,               sn,                  false),
+    CMDLINE_OPT(CMDLINE_KT_SATADOM,    extract_boot_media_type,  boot_media,          false),
+    CMDLINE_OPT(CMDLINE_KT_THAW,       extract_port_thaw,        port_thaw,           true),
+    CMDLINE_OPT(CMDLINE_CT_USB_RULE,   extract_usb_rule,         boot_media,          true),
+    CMDLINE_OPT(CMDLINE_CT_VID,        extract_vid,              boot_media.vid,      true),
+};
+
+//Index of the first option (+1, so that 0 means "none") for every first character of a token
+static unsigned char cmdline_opts_idx[256] __initdata = { 0 };
+static bool cmdline_opts_indexed __initdata = false;
+
+static void __init index_cmdline_opts(void)
+{
+    if (cmdline_opts_indexed)
+        return;
+
+    for (int i = 0; i < ARRAY_SIZE(cmdline_opts); i++) {
+        unsigned char first = cmdline_opts[i].name[0];
+        if (i > 0 && cmdline_opts[i - 1].name[0] == first)
+            continue; //same group
+
+        if (unlikely(cmdline_opts_idx[first])) {
+            pr_loc_bug("Options starting with '%c' are not grouped - \"%s\" will not be found", first,
+                       cmdline_opts[i].name);
+            continue;
+        }
+        cmdline_opts_idx[first] = i + 1;
+    }
+    cmdline_opts_indexed = true;
+}
+
+/**
+ * Finds the option a cmdline token is for
+ *
+ * @return option or NULL if none matched
+ */
+static const struct cmdline_opt * __init find_cmdline_opt(const char *token)
+{
+    unsigned char first = token[0];
+    if (!cmdline_opts_idx[first])
+        return NULL;
+
+    for (int i = cmdline_opts_idx[first] - 1; i < ARRAY_SIZE(cmdline_opts) && cmdline_opts[i].name[0] == first; i++) {
+        if (strncmp(token, cmdline_opts[i].name, cmdline_opts[i].name_len) == 0)
+            return &cmdline_opts[i];
+    }
+
+    return NULL;
+}
+
 static char cmdline_cache[CMDLINE_MAX] = { '\0' };
 /**
  * Extracts the cmdline from kernel and caches it for later use
@@ -341,34 +590,26 @@ long get_kernel_cmdline(char *cmdline_out, size_t maxlen)
     return strscpy(cmdline_out, cmdline_cache, maxlen);
 }
 
-#define ADD_BLACKLIST_ENTRY(idx, token) cmdline_blacklist[idx] = kmalloc(sizeof(token), GFP_KERNEL); \
-                                        if (unlikely(!cmdline_blacklist[idx])) {                     \
-                                            pr_loc_crt("kmalloc failed");                            \
-                                            return -EFAULT;                                          \
-                                        }                                                            \
-                                        strcpy((char *)cmdline_blacklist[idx], token);               \
-                                        pr_loc_dbg("Add cmdline blacklist \"%s\" @ %d",              \
-                                                   (char *)cmdline_blacklist[idx], idx);
-int populate_cmdline_blacklist(cmdline_token *cmdline_blacklist[MAX_BLACKLISTED_CMDLINE_TOKENS], syno_hw *model)
+static char filtered_cmdline_cache[CMDLINE_MAX] = { '\0' }; //cmdline without hidden options
+static bool filtered_cmdline_ready = false;
+
+long get_filtered_kernel_cmdline(char *cmdline_out, unsigned long maxlen)
 {
-    //Currently, this list is static. However, it's prepared to be dynamic based on the model
-    //Make sure you don't go over MAX_BLACKLISTED_CMDLINE_TOKENS (and if so adjust it)
-    ADD_BLACKLIST_ENTRY(0, CMDLINE_CT_VID);
-    ADD_BLACKLIST_ENTRY(1, CMDLINE_CT_PID);
-    ADD_BLACKLIST_ENTRY(2, CMDLINE_CT_MFG);
-    ADD_BLACKLIST_ENTRY(3, CMDLINE_KT_ELEVATOR);
-    ADD_BLACKLIST_ENTRY(4, CMDLINE_KT_LOGLEVEL);
-    ADD_BLACKLIST_ENTRY(5, CMDLINE_KT_PK_BUFFER);
-    ADD_BLACKLIST_ENTRY(6, CMDLINE_KT_EARLY_PK);
-    ADD_BLACKLIST_ENTRY(7, CMDLINE_KT_THAW);
+    if (unlikely(!filtered_cmdline_ready)) {
+        pr_loc_bug("Filtered cmdline requested before cmdline was processed");
+        return -ENODATA;
+    }
 
-    return 0;
+    if (unlikely(maxlen > CMDLINE_MAX))
+        maxlen = CMDLINE_MAX;
+
+    return strscpy(cmdline_out, filtered_cmdline_cache, maxlen);
 }
 
-int extract_config_from_cmdline(struct runtime_config *config)
+int __init extract_config_from_cmdline(struct runtime_config *config, bool blob_loaded)
 {
-    char *cmdline_txt;
-    cmdline_txt = kzalloc(CMDLINE_MAX, GFP_KERNEL); //we want our struct to be empty
+    int out = 0;
+    char *cmdline_txt = kzalloc(CMDLINE_MAX, GFP_KERNEL); //we want our struct to be empty
     if (!cmdline_txt) {
         pr_loc_crt("Failed to reserve %lu bytes of memory", CMDLINE_MAX*sizeof(char));
         return -EFAULT; //no free due to kmalloc failure
@@ -376,42 +617,62 @@ int extract_config_from_cmdline(struct runtime_config *config)
 
     if(get_kernel_cmdline(cmdline_txt, CMDLINE_MAX) <= 0) {
         pr_loc_crt("Failed to extract cmdline");
-        return -EIO;
+        out = -EIO;
+        goto out_free;
     }
 
     pr_loc_dbg("Cmdline: %s", cmdline_txt);
+    index_cmdline_opts();
 
     /**
      * Temporary variables
      */
     unsigned int param_counter = 0;
+    char *cursor = cmdline_txt;
     char *single_param_chunk; //Pointer to the beginning of the cmdline token
+    char *filtered_ptr = filtered_cmdline_cache; //cannot overflow as it's a subset of cmdline_txt
+    const struct cmdline_opt *opt;
 
-    while ((single_param_chunk = strsep(&cmdline_txt, CMDLINE_SEP)) != NULL ) {
+    //Every token is looked up once: the option found decides both where it goes in the config and whether it's
+    // copied to the filtered cmdline
+    while ((single_param_chunk = strsep(&cursor, CMDLINE_SEP)) != NULL ) {
         if (unlikely(single_param_chunk[0] == '\0')) //Skip empty params (e.g. last one)
             continue;
         pr_loc_dbg("Param #%d: |%s|", param_counter++, single_param_chunk);
 
-        //Stop after the first one matches
-        extract_hw(&config->hw, single_param_chunk)                      ||
-        extract_sn(&config->sn, single_param_chunk)                      ||
-        extract_boot_media_type(&config->boot_media, single_param_chunk) ||
-        extract_vid(&config->boot_media.vid, single_param_chunk)         ||
-        extract_pid(&config->boot_media.pid, single_param_chunk)         ||
-        extract_dom_max_size(&config->boot_media, single_param_chunk)    ||
-        extract_mfg(&config->boot_media.mfg_mode, single_param_chunk)    ||
-        extract_port_thaw(&config->port_thaw, single_param_chunk)        ||
-        extract_netif_num(&config->netif_num, single_param_chunk)        ||
-        extract_netif_macs(config->macs, single_param_chunk)             ||
-        report_unrecognized_option(single_param_chunk)                   ;
-    }
+        opt = find_cmdline_opt(single_param_chunk);
+        if (opt && opt->hide) {
+            pr_loc_dbg("Cmdline param \"%s\" blacklisted - it will be hidden", single_param_chunk);
+        } else {
+            //strsep() already found where the token ends (& moved the cursor past the separator) - no need to rescan it
+            size_t len = cursor ? (size_t)(cursor - single_param_chunk - 1) : strlen(single_param_chunk);
+            if (filtered_ptr != filtered_cmdline_cache)
+                *(filtered_ptr++) = ' ';
+            memcpy(filtered_ptr, single_param_chunk, len);
+            filtered_ptr += len;
+        }
+
+        if (!config) //only filtering
+            continue;
+
+        if (blob_loaded && opt && opt->extract && !opt->over_blob) {
+            //Native options (e.g. sn=) are always there; only the ones which the loader added are worth a warning
+            if (opt->hide)
+                pr_loc_wrn("Cmdline param \"%s\" ignored - config blob takes precedence", single_param_chunk);
+            continue;
+        }
 
-    if (populate_cmdline_blacklist(config->cmdline_blacklist, &config->hw) != 0)
-        return -EIO;
+        if (!opt || !opt->extract ||
+            !opt->extract((char *)config + opt->dst_offset, single_param_chunk + opt->name_len))
+            report_unrecognized_option(single_param_chunk);
+    }
+    *filtered_ptr = '\0';
+    filtered_cmdline_ready = true;
 
     pr_loc_inf("CmdLine processed successfully, tokens=%d", param_counter);
 
+    out_free:
     kfree(cmdline_txt);
 
-    return 0;
+    return out;
 }
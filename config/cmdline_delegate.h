@@ -17,7 +17,11 @@
 #define CMDLINE_CT_PID "pid=" //Boot media Product ID override
 #define CMDLINE_CT_MFG "mfg" //VID & PID override will use force-reinstall VID/PID combo
 #define CMDLINE_CT_MFG "mfg" //VID & PID override will use force-reinstall VID/PID combo
+#define CMDLINE_CT_USB_RULE "usb_rule=" //USB boot device match rule <vid|*>:<pid|*>[:<class|*>[:<serial>]], repeatable
+#define CMDLINE_CT_BOOT_ANY "boot_any=" //0|1 - look for the boot device on USB & SATA at once (first matching one wins)
 #define CMDLINE_CT_DOM_SZMAX "dom_szmax=" //Max size of SATA device (MiB) to be considered a DOM (usually you should NOT use this)
+#define CMDLINE_CT_RP_CPUS "rp_cpus=" //CPU list our threads run on (e.g. 2-3); default: all CPUs but the first one
+#define CMDLINE_CT_RP_SCHED "rp_sched=" //Scheduling of our threads <normal|fifo|rr>[:<nice|RT priority>]
 
 //Standard Linux cmdline tokens
 #define CMDLINE_KT_ELEVATOR  "elevator=" //Sets I/O scheduler (we use it to load RP LKM earlier than normally possible)
@@ -53,13 +57,29 @@
  */
 long get_kernel_cmdline(char *cmdline_out, unsigned long maxlen);
 
+/**
+ * Provides kernel cmdline without options which should be hidden from userspace (e.g. vid=, pid=, mfg...)
+ *
+ * The filtered version is produced by extract_config_from_cmdline() while it goes through the cmdline (so that it's
+ * tokenized only once). Tokens in the filtered version are always separated by a single space.
+ *
+ * @param cmdline_out A pointer to your buffer to save the cmdline
+ * @param maxlen Your buffer space (in general you should use CMDLINE_MAX)
+ * @return cmdline length on success or -E on error (-ENODATA if cmdline wasn't processed yet)
+ */
+long get_filtered_kernel_cmdline(char *cmdline_out, unsigned long maxlen);
+
 /**
  * Extracts & processes parameters from kernel cmdline
  *
  * Note: it's not guaranteed that the config will be valid. Check runtime_config.h.
+ * Every token is matched against a single table of known options; the same table decides which tokens are hidden by
+ * get_filtered_kernel_cmdline().
  *
- * @param config pointer to save configuration
+ * @param config pointer to save configuration; NULL to only process the cmdline for get_filtered_kernel_cmdline()
+ * @param blob_loaded whether the config was already loaded from a blob; only options which the blob has no equivalent
+ *                    of (e.g. rp_cpus=) are then extracted, while the rest is just filtered
  */
-int extract_config_from_cmdline(struct runtime_config *config);
+int extract_config_from_cmdline(struct runtime_config *config, bool blob_loaded);
 
 #endif //REDPILLLKM_CMDLINE_DELEGATE_H
@@ -0,0 +1,207 @@
+/*
+ * Loads the runtime config from a fixed-layout binary blob
+ *
+ * The kernel cmdline is limited (we read at most CMDLINE_MAX of it) and every option has to be parsed out of text.
+ * The blob (see struct rp_config_blob) has no such limits: it's read once, checked (magic, version, length, crc32 and
+ * bounds of every field) while still in the read buffer and then copied field-by-field into the runtime config.
+ *
+ * The file is read directly instead of using request_firmware(), as the latter needs a device and (on kernels with the
+ * user helper) may stall the boot for a minute waiting for userspace when the file doesn't exist.
+ */
+#include "config_blob.h"
+#include "cmdline_delegate.h" //extract_config_from_cmdline()
+#include "../common.h"
+#include "../internal/init_arena.h" //rp_arena_alloc()
+#include <linux/fs.h> //filp_open, vfs_read
+#include <linux/uaccess.h> //get_fs, set_fs
+#include <linux/crc32.h> //crc32_le()
+
+#define blob_str_valid(field) (strnlen(field, sizeof(field)) < sizeof(field))
+
+/**
+ * Reads the whole blob file
+ *
+ * @return number of bytes read, -ENOENT if there's no file, -EFBIG if it's larger than len, or other -E on error
+ */
+static long __init read_blob_file(const char *path, void *buf, size_t len)
+{
+    struct file *filp = filp_open(path, O_RDONLY, 0);
+    if (IS_ERR(filp))
+        return PTR_ERR(filp);
+
+    mm_segment_t old_fs = get_fs();
+    loff_t pos = 0;
+    size_t total = 0;
+    ssize_t out = 0;
+    char overflow;
+
+    set_fs(KERNEL_DS);
+    while (total < len) {
+        out = vfs_read(filp, (char __user *)buf + total, len - total, &pos);
+        if (out <= 0)
+            break;
+        total += out;
+    }
+    if (out >= 0 && total == len && vfs_read(filp, (char __user *)&overflow, 1, &pos) > 0)
+        out = -EFBIG;
+    set_fs(old_fs);
+    filp_close(filp, NULL);
+
+    return out < 0 ? out : total;
+}
+
+static bool __init validate_config_blob(const struct rp_config_blob *blob, size_t len)
+{
+    if (len < RP_CONFIG_BLOB_HDR_LEN || blob->magic != RP_CONFIG_BLOB_MAGIC) {
+        pr_loc_err("Config blob is not a valid RedPill config (len=%zu)", len);
+        return false;
+    }
+
+    if (blob->version != RP_CONFIG_BLOB_VERSION || blob->flags != 0) {
+        pr_loc_err("Config blob version %u (flags=0x%x) is not supported - expected %u", blob->version, blob->flags,
+                   RP_CONFIG_BLOB_VERSION);
+        return false;
+    }
+
+    if (blob->length != sizeof(struct rp_config_blob) || len != blob->length) {
+        pr_loc_err("Config blob length mismatch (file=%zu declared=%u expected=%zu)", len, blob->length,
+                   sizeof(struct rp_config_blob));
+        return false;
+    }
+
+    u32 crc = crc32_le(~0, (const u8 *)blob + RP_CONFIG_BLOB_HDR_LEN, len - RP_CONFIG_BLOB_HDR_LEN) ^ ~0;
+    if (crc != blob->crc32) {
+        pr_loc_err("Config blob crc32 mismatch (got 0x%08x expected 0x%08x)", crc, blob->crc32);
+        return false;
+    }
+
+    if (!blob_str_valid(blob->hw) || !blob_str_valid(blob->sn) || blob->boot_media_type > BOOT_MEDIA_ANY ||
+        blob->usb_rules_num > RP_CONFIG_BLOB_MAX_USB_RULES || blob->macs_num > RP_CONFIG_BLOB_MAX_MACS) {
+        pr_loc_err("Config blob contains out of range values");
+        return false;
+    }
+
+    for (int i = 0; i < blob->usb_rules_num; i++) {
+        if (!blob_str_valid(blob->usb_rules[i].serial)) {
+            pr_loc_err("Config blob USB rule #%d serial is not terminated", i);
+            return false;
+        }
+    }
+
+    for (int i = 0; i < blob->macs_num; i++) {
+        if (!blob_str_valid(blob->macs[i])) {
+            pr_loc_err("Config blob MAC #%d is not terminated", i);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Copies validated blob into the runtime config
+ */
+static int __init apply_config_blob(struct runtime_config *config, const struct rp_config_blob *blob)
+{
+    if (strscpy((char *)config->hw, blob->hw, sizeof(syno_hw)) < 0)
+        pr_loc_wrn("HW version truncated to %zu", sizeof(syno_hw)-1);
+    if (strscpy((char *)config->sn, blob->sn, sizeof(serial_no)) < 0)
+        pr_loc_wrn("S/N truncated to %zu", sizeof(serial_no)-1);
+
+    config->boot_media.type = blob->boot_media_type;
+    config->boot_media.mfg_mode = blob->mfg_mode;
+    config->boot_media.vid = blob->vid;
+    config->boot_media.pid = blob->pid;
+    if (blob->dom_size_mib)
+        config->boot_media.dom_size_mib = blob->dom_size_mib;
+    config->port_thaw = blob->port_thaw;
+    config->netif_num = blob->netif_num;
+
+    config->boot_media.usb_rules_num = 0;
+    for (int i = 0; i < blob->usb_rules_num; i++) {
+        if (unlikely(i >= MAX_USB_BOOT_RULES)) {
+            pr_loc_wrn("Config blob contains %u USB rules - only %d are supported", blob->usb_rules_num,
+                       MAX_USB_BOOT_RULES);
+            break;
+        }
+
+        struct usb_boot_rule *rule = &config->boot_media.usb_rules[i];
+        rule->match_flags = blob->usb_rules[i].match_flags;
+        rule->if_class = blob->usb_rules[i].if_class;
+        rule->vid = blob->usb_rules[i].vid;
+        rule->pid = blob->usb_rules[i].pid;
+        //Both are USB_RULE_SERIAL_MAX_LEN+1 long & the blob one was checked to be terminated in validate_config_blob()
+        BUILD_BUG_ON(sizeof(rule->serial) != sizeof(blob->usb_rules[i].serial));
+        memcpy(rule->serial, blob->usb_rules[i].serial, sizeof(rule->serial));
+        ++config->boot_media.usb_rules_num;
+    }
+
+    for (int i = 0; i < blob->macs_num; i++) {
+        if (unlikely(i >= MAX_NET_IFACES)) {
+            pr_loc_wrn("Config blob contains %u MACs - only %d are supported", blob->macs_num, MAX_NET_IFACES);
+            break;
+        }
+
+        config->macs[i] = rp_arena_alloc(sizeof(mac_address));
+        if (unlikely(!config->macs[i])) {
+            pr_loc_crt("rp_arena_alloc failed");
+            return -ENOMEM; //already allocated ones are freed with the arena
+        }
+
+        if (strscpy((char *)config->macs[i], blob->macs[i], sizeof(mac_address)) < 0)
+            pr_loc_wrn("MAC #%d truncated to %zu", i+1, sizeof(mac_address)-1);
+    }
+
+    pr_loc_dbg("Config blob applied: hw=%s boot=%u usb_rules=%u macs=%u", (char *)config->hw, blob->boot_media_type,
+               config->boot_media.usb_rules_num, blob->macs_num);
+    return 0;
+}
+
+/**
+ * @return 0 if the blob was loaded, -ENOENT if there's no (valid) blob, other -E on error
+ */
+static int __init load_config_blob(struct runtime_config *config)
+{
+    struct rp_config_blob *blob = kmalloc(sizeof(struct rp_config_blob), GFP_KERNEL);
+    if (unlikely(!blob)) {
+        pr_loc_crt("kmalloc failed");
+        return -ENOMEM;
+    }
+
+    int out;
+    long len = read_blob_file(RP_CONFIG_BLOB_PATH, blob, sizeof(struct rp_config_blob));
+    if (len < 0) {
+        if (len == -ENOENT)
+            pr_loc_dbg("No config blob at %s", RP_CONFIG_BLOB_PATH);
+        else
+            pr_loc_err("Failed to read config blob from %s - error=%ld", RP_CONFIG_BLOB_PATH, len);
+        out = -ENOENT;
+        goto out_free;
+    }
+
+    if (!validate_config_blob(blob, len)) {
+        out = -ENOENT;
+        goto out_free;
+    }
+
+    out = apply_config_blob(config, blob);
+
+    out_free:
+    kfree(blob);
+    return out;
+}
+
+int __init extract_runtime_config(struct runtime_config *config)
+{
+    int out = load_config_blob(config);
+    if (out == -ENOENT) {
+        pr_loc_dbg("Using kernel cmdline for runtime config");
+        return extract_config_from_cmdline(config, false);
+    }
+
+    if (out != 0)
+        return out;
+
+    pr_loc_inf("Runtime config loaded from %s", RP_CONFIG_BLOB_PATH);
+    return extract_config_from_cmdline(config, true); //to know what to hide & for options not in the blob
+}
@@ -0,0 +1,84 @@
+#ifndef REDPILLLKM_CONFIG_BLOB_H
+#define REDPILLLKM_CONFIG_BLOB_H
+
+/*
+ * Everything in this section is shared with userspace (i.e. tools generating the blob) - it must only use fixed-size
+ * types and no kernel headers. All numbers are little-endian.
+ */
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stdint.h>
+typedef uint8_t __u8;
+typedef uint16_t __u16;
+typedef uint32_t __u32;
+#endif
+
+#define RP_CONFIG_BLOB_PATH "/lib/firmware/redpill/config.bin" //usually placed in the initramfs
+#define RP_CONFIG_BLOB_MAGIC 0x46435052 //"RPCF"
+#define RP_CONFIG_BLOB_VERSION 1
+#define RP_CONFIG_BLOB_HDR_LEN 16 //magic, version, flags, length & crc32 are not covered by the crc32
+#define RP_CONFIG_BLOB_MAX_USB_RULES 8
+#define RP_CONFIG_BLOB_MAX_MACS 16
+
+struct rp_config_blob_usb_rule {
+    __u8 match_flags; //USB_RULE_MATCH_* from runtime_config.h
+    __u8 if_class;
+    __u16 vid;
+    __u16 pid;
+    char serial[33]; //NUL-terminated
+    __u8 _reserved;
+} __attribute__((packed));
+
+/**
+ * Layout of the runtime config blob (version 1)
+ *
+ * Fields have the same meaning as the corresponding cmdline options (see config/cmdline_delegate.h). Strings are
+ * NUL-terminated within their fields. Arrays are sized for the future; entries above what a given module version
+ * supports are ignored with a warning.
+ */
+struct rp_config_blob {
+    //Header
+    __u32 magic; //RP_CONFIG_BLOB_MAGIC
+    __u16 version; //RP_CONFIG_BLOB_VERSION
+    __u16 flags; //reserved, must be 0
+    __u32 length; //sizeof(struct rp_config_blob) for the version
+    __u32 crc32; //crc32_le(~0, <blob after header>, length - RP_CONFIG_BLOB_HDR_LEN) ^ ~0
+
+    //Data
+    char hw[16]; //syno_hw_version=
+    char sn[16]; //sn=
+    __u8 boot_media_type; //enum boot_media_type (synoboot_satadom= / boot_any=)
+    __u8 mfg_mode; //mfg
+    __u8 port_thaw; //syno_port_thaw=
+    __u8 netif_num; //netif_num=
+    __u16 vid; //vid=
+    __u16 pid; //pid=
+    __u32 dom_size_mib; //dom_szmax= (0 = default)
+    __u8 usb_rules_num;
+    __u8 macs_num;
+    __u8 _reserved[2];
+    struct rp_config_blob_usb_rule usb_rules[RP_CONFIG_BLOB_MAX_USB_RULES]; //usb_rule=
+    char macs[RP_CONFIG_BLOB_MAX_MACS][16]; //mac1= ... macN=
+} __attribute__((packed));
+
+#ifdef __KERNEL__
+#include "runtime_config.h"
+
+/**
+ * Extracts the runtime config from the config blob or kernel cmdline (if there's no blob)
+ *
+ * The blob is read from RP_CONFIG_BLOB_PATH and validated in place (no string parsing is involved). When it's missing
+ * or invalid the config is extracted from the cmdline, as it always was. The cmdline is processed either way, so that
+ * options which need to be hidden are known (see get_filtered_kernel_cmdline()). Options which have no equivalent in
+ * the blob (rp_cpus= & rp_sched=) are applied on top of it; other loader options next to a blob are ignored with a
+ * warning.
+ *
+ * Note: it's not guaranteed that the config will be valid. Check runtime_config.h.
+ *
+ * @return 0 on success, -E on error
+ */
+int extract_runtime_config(struct runtime_config *config);
+#endif //__KERNEL__
+
+#endif //REDPILLLKM_CONFIG_BLOB_H
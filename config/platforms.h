@@ -1,74 +1,110 @@
 /*
- * DO NOT include this file anywhere besides runtime_config.c - its format is meant to be internal to the configuration
- * parsing.
+ * DO NOT include this file anywhere besides runtime_config.c & runtime_config.h - its format is meant to be internal to
+ * the configuration parsing.
+ *
+ * Every platform is defined as an initializer of struct hw_config. The table made from them (see runtime_config.c) is
+ * discarded after the module is initialized - only the selected platform is copied (see populate_hw_config()).
  */
 #ifndef REDPILLLKM_PLATFORMS_H
 #define REDPILLLKM_PLATFORMS_H
 
 #include "../shim/pci_shim.h"
-const struct hw_config supported_platforms[] = {
-    {
-        .name = "DS3615xs",
-        .pci_stubs = {
-                { .type = VPD_MARVELL_88SE9235, .bus = 0x07, .dev = 0x00, .fn = 0x00, .multifunction = false },
-                { .type = VPD_MARVELL_88SE9235, .bus = 0x08, .dev = 0x00, .fn = 0x00, .multifunction = false },
-                { .type = VPD_MARVELL_88SE9235, .bus = 0x09, .dev = 0x00, .fn = 0x00, .multifunction = false },
-                { .type = VPD_MARVELL_88SE9235, .bus = 0x0a, .dev = 0x00, .fn = 0x00, .multifunction = false },
-                { .type = __VPD_TERMINATOR__ }
-        },
-        .emulate_rtc = false,
-        .swap_serial = true,
-        .reinit_ttyS0 = false,
-        .fix_disk_led_ctrl = false,
-    },
-    {
-            .name = "DS918+",
-            .pci_stubs = {
-                    { .type = VPD_MARVELL_88SE9215,    .bus = 0x01, .dev = 0x00, .fn = 0x00, .multifunction = false },
-                    { .type = VPD_INTEL_I211,          .bus = 0x02, .dev = 0x00, .fn = 0x00, .multifunction = false },
-                    { .type = VPD_INTEL_I211,          .bus = 0x03, .dev = 0x00, .fn = 0x00, .multifunction = false },
-                    { .type = VPD_INTEL_CPU_AHCI_CTRL, .bus = 0x00, .dev = 0x12, .fn = 0x00, .multifunction = false },
-                    { .type = VPD_INTEL_CPU_PCIE_PA,   .bus = 0x00, .dev = 0x13, .fn = 0x00, .multifunction = false },
-                    { .type = VPD_INTEL_CPU_PCIE_PB,   .bus = 0x00, .dev = 0x14, .fn = 0x00, .multifunction = false },
-                    { .type = VPD_INTEL_CPU_USB_XHCI,  .bus = 0x00, .dev = 0x15, .fn = 0x00, .multifunction = false },
-                    { .type = VPD_INTEL_CPU_I2C,       .bus = 0x00, .dev = 0x16, .fn = 0x00, .multifunction = false },
-                    { .type = VPD_INTEL_CPU_HSUART,    .bus = 0x00, .dev = 0x18, .fn = 0x00, .multifunction = false },
-                    { .type = VPD_INTEL_CPU_SPI,       .bus = 0x00, .dev = 0x19, .fn = 0x02, .multifunction = true },
-                    { .type = VPD_INTEL_CPU_SPI,       .bus = 0x00, .dev = 0x19, .fn = 0x00, .multifunction = true },
-                    { .type = VPD_INTEL_CPU_SMBUS,     .bus = 0x00, .dev = 0x1f, .fn = 0x01, .multifunction = true },
-                    { .type = VPD_INTEL_CPU_SMBUS,     .bus = 0x00, .dev = 0x1f, .fn = 0x00, .multifunction = true },
+#include "../shim/bios/mfgbios_types.h" //VTK_*
 
-                    { .type = __VPD_TERMINATOR__ }
-            },
-            .emulate_rtc = true,
-            .swap_serial = false,
-            .reinit_ttyS0 = true,
-            .fix_disk_led_ctrl = true,
-    },
-     {
-            .name = "DS920+",
-            .pci_stubs = {
-                    { .type = VPD_MARVELL_88SE9215,    .bus = 0x01, .dev = 0x00, .fn = 0x00, .multifunction = false },
-                    { .type = VPD_INTEL_I211,          .bus = 0x02, .dev = 0x00, .fn = 0x00, .multifunction = false },
-                    { .type = VPD_INTEL_I211,          .bus = 0x03, .dev = 0x00, .fn = 0x00, .multifunction = false },
-                    { .type = VPD_INTEL_CPU_AHCI_CTRL, .bus = 0x00, .dev = 0x12, .fn = 0x00, .multifunction = false },
-                    { .type = VPD_INTEL_CPU_PCIE_PA,   .bus = 0x00, .dev = 0x13, .fn = 0x00, .multifunction = false },
-                    { .type = VPD_INTEL_CPU_PCIE_PB,   .bus = 0x00, .dev = 0x14, .fn = 0x00, .multifunction = false },
-                    { .type = VPD_INTEL_CPU_USB_XHCI,  .bus = 0x00, .dev = 0x15, .fn = 0x00, .multifunction = false },
-                    { .type = VPD_INTEL_CPU_I2C,       .bus = 0x00, .dev = 0x16, .fn = 0x00, .multifunction = false },
-                    { .type = VPD_INTEL_CPU_HSUART,    .bus = 0x00, .dev = 0x18, .fn = 0x00, .multifunction = false },
-                    { .type = VPD_INTEL_CPU_SPI,       .bus = 0x00, .dev = 0x19, .fn = 0x02, .multifunction = true },
-                    { .type = VPD_INTEL_CPU_SPI,       .bus = 0x00, .dev = 0x19, .fn = 0x00, .multifunction = true },
-                    { .type = VPD_INTEL_CPU_SMBUS,     .bus = 0x00, .dev = 0x1f, .fn = 0x01, .multifunction = true },
-                    { .type = VPD_INTEL_CPU_SMBUS,     .bus = 0x00, .dev = 0x1f, .fn = 0x00, .multifunction = true },
+//mfgBIOS vtable entries shimmed on every platform (mostly fans, LEDs & buzzer which we don't have)
+#define BIOS_SHIMS_GENERIC \
+        { VTK_GET_FAN_STATE,      BIOS_SHIM_ZERO }, \
+        { VTK_SET_FAN_STATE,      BIOS_SHIM_ZERO }, \
+        { VTK_SET_DISK_LED,       BIOS_SHIM_ZERO }, \
+        { VTK_SET_PWR_LED,        BIOS_SHIM_ZERO }, \
+        { VTK_SET_GPIO_PIN,       BIOS_SHIM_ZERO }, \
+        { VTK_GET_GPIO_PIN,       BIOS_SHIM_GPIO_USABLE }, \
+        { VTK_SET_GPIO_PIN_BLINK, BIOS_SHIM_ZERO_TRACE }, \
+        { VTK_SET_ALR_LED,        BIOS_SHIM_ZERO }, \
+        { VTK_GET_BUZ_CLR,        BIOS_SHIM_ZERO }, \
+        { VTK_SET_BUZ_CLR,        BIOS_SHIM_ZERO }, \
+        { VTK_SET_CPU_FAN_STATUS, BIOS_SHIM_ZERO }, \
+        { VTK_SET_PHY_LED,        BIOS_SHIM_ZERO }, \
+        { VTK_SET_HDD_ACT_LED,    BIOS_SHIM_ZERO }, \
+        { VTK_GET_MICROP_ID,      BIOS_SHIM_ZERO }, \
+        { VTK_SET_MICROP_ID,      BIOS_SHIM_ZERO }
 
-                    { .type = __VPD_TERMINATOR__ }
-            },
-            .emulate_rtc = true,
-            .swap_serial = false,
-            .reinit_ttyS0 = true,
-            .fix_disk_led_ctrl = true,
-    },
-};
+//Platforms without a real RTC (accessible by mfgBIOS) get it emulated (see shim/bios/rtc_proxy.h)
+#define BIOS_SHIMS_RTC_PROXY \
+        { VTK_RTC_GET_TIME,  BIOS_SHIM_RTC_GET_TIME }, \
+        { VTK_RTC_SET_TIME,  BIOS_SHIM_RTC_SET_TIME }, \
+        { VTK_RTC_INT_APWR,  BIOS_SHIM_RTC_INT_APWR }, \
+        { VTK_RTC_GET_APWR,  BIOS_SHIM_RTC_GET_APWR }, \
+        { VTK_RTC_SET_APWR,  BIOS_SHIM_RTC_SET_APWR }, \
+        { VTK_RTC_UINT_APWR, BIOS_SHIM_RTC_UINT_APWR }
+
+#define PLATFORM_DS3615xs {                                                                              \
+    .name = "DS3615xs",                                                                                  \
+    .pci_stubs = {                                                                                       \
+        { .type = VPD_MARVELL_88SE9235, .bus = 0x07, .dev = 0x00, .fn = 0x00, .multifunction = false },  \
+        { .type = VPD_MARVELL_88SE9235, .bus = 0x08, .dev = 0x00, .fn = 0x00, .multifunction = false },  \
+        { .type = VPD_MARVELL_88SE9235, .bus = 0x09, .dev = 0x00, .fn = 0x00, .multifunction = false },  \
+        { .type = VPD_MARVELL_88SE9235, .bus = 0x0a, .dev = 0x00, .fn = 0x00, .multifunction = false },  \
+        { .type = __VPD_TERMINATOR__ }                                                                   \
+    },                                                                                                   \
+    .bios_shims = { BIOS_SHIMS_GENERIC },                                                                \
+    .swap_serial = true,                                                                                 \
+    .reinit_ttyS0 = false,                                                                               \
+    .fix_disk_led_ctrl = false,                                                                          \
+    .pmu = { .resp = { [PMU_RESP_UNIQ] = "-synology_bromolow_3615xs" } },                                \
+}
+
+#define PLATFORM_DS918P {                                                                                   \
+    .name = "DS918+",                                                                                       \
+    .pci_stubs = {                                                                                          \
+        { .type = VPD_MARVELL_88SE9215,    .bus = 0x01, .dev = 0x00, .fn = 0x00, .multifunction = false },  \
+        { .type = VPD_INTEL_I211,          .bus = 0x02, .dev = 0x00, .fn = 0x00, .multifunction = false },  \
+        { .type = VPD_INTEL_I211,          .bus = 0x03, .dev = 0x00, .fn = 0x00, .multifunction = false },  \
+        { .type = VPD_INTEL_CPU_AHCI_CTRL, .bus = 0x00, .dev = 0x12, .fn = 0x00, .multifunction = false },  \
+        { .type = VPD_INTEL_CPU_PCIE_PA,   .bus = 0x00, .dev = 0x13, .fn = 0x00, .multifunction = false },  \
+        { .type = VPD_INTEL_CPU_PCIE_PB,   .bus = 0x00, .dev = 0x14, .fn = 0x00, .multifunction = false },  \
+        { .type = VPD_INTEL_CPU_USB_XHCI,  .bus = 0x00, .dev = 0x15, .fn = 0x00, .multifunction = false },  \
+        { .type = VPD_INTEL_CPU_I2C,       .bus = 0x00, .dev = 0x16, .fn = 0x00, .multifunction = false },  \
+        { .type = VPD_INTEL_CPU_HSUART,    .bus = 0x00, .dev = 0x18, .fn = 0x00, .multifunction = false },  \
+        { .type = VPD_INTEL_CPU_SPI,       .bus = 0x00, .dev = 0x19, .fn = 0x02, .multifunction = true },   \
+        { .type = VPD_INTEL_CPU_SPI,       .bus = 0x00, .dev = 0x19, .fn = 0x00, .multifunction = true },   \
+        { .type = VPD_INTEL_CPU_SMBUS,     .bus = 0x00, .dev = 0x1f, .fn = 0x01, .multifunction = true },   \
+        { .type = VPD_INTEL_CPU_SMBUS,     .bus = 0x00, .dev = 0x1f, .fn = 0x00, .multifunction = true },   \
+        { .type = __VPD_TERMINATOR__ }                                                                      \
+    },                                                                                                      \
+    .bios_shims = { BIOS_SHIMS_GENERIC, BIOS_SHIMS_RTC_PROXY },                                             \
+    .swap_serial = false,                                                                                   \
+    .reinit_ttyS0 = true,                                                                                   \
+    .fix_disk_led_ctrl = true,                                                                              \
+    .pmu = { .resp = { [PMU_RESP_UNIQ] = "-synology_apollolake_918+" } },                                   \
+}
+
+#define PLATFORM_DS920P {                                                                                   \
+    .name = "DS920+",                                                                                       \
+    .pci_stubs = {                                                                                          \
+        { .type = VPD_MARVELL_88SE9215,    .bus = 0x01, .dev = 0x00, .fn = 0x00, .multifunction = false },  \
+        { .type = VPD_INTEL_I211,          .bus = 0x02, .dev = 0x00, .fn = 0x00, .multifunction = false },  \
+        { .type = VPD_INTEL_I211,          .bus = 0x03, .dev = 0x00, .fn = 0x00, .multifunction = false },  \
+        { .type = VPD_INTEL_CPU_AHCI_CTRL, .bus = 0x00, .dev = 0x12, .fn = 0x00, .multifunction = false },  \
+        { .type = VPD_INTEL_CPU_PCIE_PA,   .bus = 0x00, .dev = 0x13, .fn = 0x00, .multifunction = false },  \
+        { .type = VPD_INTEL_CPU_PCIE_PB,   .bus = 0x00, .dev = 0x14, .fn = 0x00, .multifunction = false },  \
+        { .type = VPD_INTEL_CPU_USB_XHCI,  .bus = 0x00, .dev = 0x15, .fn = 0x00, .multifunction = false },  \
+        { .type = VPD_INTEL_CPU_I2C,       .bus = 0x00, .dev = 0x16, .fn = 0x00, .multifunction = false },  \
+        { .type = VPD_INTEL_CPU_HSUART,    .bus = 0x00, .dev = 0x18, .fn = 0x00, .multifunction = false },  \
+        { .type = VPD_INTEL_CPU_SPI,       .bus = 0x00, .dev = 0x19, .fn = 0x02, .multifunction = true },   \
+        { .type = VPD_INTEL_CPU_SPI,       .bus = 0x00, .dev = 0x19, .fn = 0x00, .multifunction = true },   \
+        { .type = VPD_INTEL_CPU_SMBUS,     .bus = 0x00, .dev = 0x1f, .fn = 0x01, .multifunction = true },   \
+        { .type = VPD_INTEL_CPU_SMBUS,     .bus = 0x00, .dev = 0x1f, .fn = 0x00, .multifunction = true },   \
+        { .type = __VPD_TERMINATOR__ }                                                                      \
+    },                                                                                                      \
+    .bios_shims = { BIOS_SHIMS_GENERIC, BIOS_SHIMS_RTC_PROXY },                                             \
+    .swap_serial = false,                                                                                   \
+    .reinit_ttyS0 = true,                                                                                   \
+    .fix_disk_led_ctrl = true,                                                                              \
+    .pmu = { .resp = { [PMU_RESP_UNIQ] = "-synology_geminilake_920+" } },                                   \
+}
+
+//All platforms supported by a generic build (make PLATFORM=<name> builds the module for just one, see Makefile)
+#define SUPPORTED_PLATFORMS PLATFORM_DS3615xs, PLATFORM_DS918P, PLATFORM_DS920P
 
 #endif //REDPILLLKM_PLATFORMS_H
@@ -12,16 +12,25 @@ struct runtime_config current_config = {
         .mfg_mode = false,
         .vid = VID_PID_EMPTY,
         .pid = VID_PID_EMPTY,
+        .usb_rules_num = 0,
         .dom_size_mib = 1024, //usually the image will be used with ESXi and thus it will be ~100MB anyway
     },
     .port_thaw = true,
     .netif_num = 0,
     .macs = { '\0' },
-    .cmdline_blacklist = { '\0' },
     .hw_config = NULL,
 };
 
-static inline bool validate_sn(const serial_no *sn) {
+#ifdef RP_PLATFORM
+static const struct hw_config supported_platforms[] __initconst = { RP_PLATFORM };
+#else
+static const struct hw_config supported_platforms[] __initconst = { SUPPORTED_PLATFORMS };
+#endif
+
+//The only platform definition which stays resident (see populate_hw_config())
+static struct hw_config active_hw_config;
+
+static inline bool __init validate_sn(const serial_no *sn) {
     if (*sn[0] == '\0') {
         pr_loc_err("Serial number is empty");
         return false;
@@ -32,9 +41,14 @@ static inline bool validate_sn(const serial_no *sn) {
     return true;
 }
 
-static inline bool validate_boot_dev(const struct boot_media *boot)
+static inline bool __init validate_boot_dev(const struct boot_media *boot)
 {
     if (likely(boot->type == BOOT_MEDIA_USB)) {
+        if (boot->usb_rules_num > 0) {
+            pr_loc_dbg("Configured boot device type to USB with %u match rule(s)", boot->usb_rules_num);
+            return true;
+        }
+
         if (boot->vid == VID_PID_EMPTY && boot->pid == VID_PID_EMPTY) {
             pr_loc_wrn("Empty/no \"%s\" and \"%s\" specified - first USB storage device will be used", CMDLINE_CT_VID,
                        CMDLINE_CT_PID);
@@ -57,9 +71,9 @@ static inline bool validate_boot_dev(const struct boot_media *boot)
         return false;
 #endif
 
-        if (boot->vid != VID_PID_EMPTY || boot->pid != VID_PID_EMPTY)
-            pr_loc_wrn("Using SATA-DoM boot - %s and %s parameter values will be ignored",
-                       CMDLINE_CT_VID, CMDLINE_CT_PID);
+        if (boot->vid != VID_PID_EMPTY || boot->pid != VID_PID_EMPTY || boot->usb_rules_num > 0)
+            pr_loc_wrn("Using SATA-DoM boot - %s, %s and %s parameter values will be ignored",
+                       CMDLINE_CT_VID, CMDLINE_CT_PID, CMDLINE_CT_USB_RULE);
 
         //this config is impossible as there's no equivalent for force-reinstall boot on SATA, so it's better to detect
         //that rather than causing WTFs for someone who falsely assuming that it's possible
@@ -73,11 +87,36 @@ static inline bool validate_boot_dev(const struct boot_media *boot)
         return true;
     }
 
+    if (boot->type == BOOT_MEDIA_ANY) {
+#ifndef NATIVE_SATA_DOM_SUPPORTED
+        pr_loc_err("Kernel you are running was built without SATA DoM support, you cannot use %s", CMDLINE_CT_BOOT_ANY);
+        return false;
+#endif
+
+        //Without rules the boot device would be whatever device is detected first on any of the buses
+        if (boot->usb_rules_num == 0) {
+            pr_loc_err("You must specify %s (or %s and %s) to use %s1", CMDLINE_CT_USB_RULE, CMDLINE_CT_VID,
+                       CMDLINE_CT_PID, CMDLINE_CT_BOOT_ANY);
+            return false;
+        }
+
+        //The boot device may end up being a SATA one, which cannot be used to force-reinstall (see above)
+        if (boot->mfg_mode) {
+            pr_loc_err("You cannot combine %s1 with %s - the OS supports force-reinstall on USB only",
+                       CMDLINE_CT_BOOT_ANY, CMDLINE_CT_MFG);
+            return false;
+        }
+
+        pr_loc_dbg("Configured boot device type to USB with %u match rule(s) or SATA, whichever is found first",
+                   boot->usb_rules_num);
+        return true;
+    }
+
     pr_loc_bug("Got unknown boot type - did you forget to update %s?", __FUNCTION__);
     return false;
 }
 
-static inline bool validate_nets(const unsigned short if_num, mac_address *macs[MAX_NET_IFACES])
+static inline bool __init validate_nets(const unsigned short if_num, mac_address *macs[MAX_NET_IFACES])
 {
     size_t mac_len;
     unsigned short macs_num = 0;
@@ -120,7 +159,7 @@ static inline bool validate_nets(const unsigned short if_num, mac_address *macs[
  * (but partially too) but the match between platform config chosen vs. kernel currently attempting to run that
  * platform.
  */
-static inline bool validate_platform_config(const struct hw_config *hw)
+static inline bool __init validate_platform_config(const struct hw_config *hw)
 {
 #ifdef UART_BUG_SWAPPED
     const bool kernel_serial_swapped = true;
@@ -129,15 +168,15 @@ static inline bool validate_platform_config(const struct hw_config *hw)
 #endif
 
     //This will not prevent the code from working, so it's not an error state by itself
-    if (unlikely(hw->swap_serial && !kernel_serial_swapped))
+    if (unlikely(hw_cfg(hw, swap_serial) && !kernel_serial_swapped))
         pr_loc_bug("Your kernel indicates COM1 & COM2 ARE NOT swapped but your platform specifies swapping");
-    else if(unlikely(!hw->swap_serial && kernel_serial_swapped))
+    else if(unlikely(!hw_cfg(hw, swap_serial) && kernel_serial_swapped))
         pr_loc_bug("Your kernel indicates COM1 & COM2 ARE swapped but your platform specifies NO swapping");
 
     return true;
 }
 
-static int populate_hw_config(struct runtime_config *config)
+static int __init populate_hw_config(struct runtime_config *config)
 {
     //We cannot run with empty model or model which didn't match
     if (config->hw[0] == '\0') {
@@ -150,15 +189,42 @@ static int populate_hw_config(struct runtime_config *config)
             continue;
 
         pr_loc_dbg("Found platform definition for \"%s\"", config->hw);
-        config->hw_config = &supported_platforms[i];
+        active_hw_config = supported_platforms[i]; //the table is discarded after init
+        config->hw_config = &active_hw_config;
         return 0;
     }
 
+#ifdef RP_PLATFORM
+    pr_loc_crt("The model set using \"%s%s\" is not valid - this module was built for %s only", CMDLINE_KT_HW,
+               config->hw, supported_platforms[0].name);
+#else
     pr_loc_crt("The model set using \"%s%s\" is not valid", CMDLINE_KT_HW, config->hw);
+#endif
     return -EINVAL;
 }
 
-static bool validate_runtime_config(const struct runtime_config *config)
+/**
+ * Compiles legacy vid=/pid= options into a USB boot rule (if no explicit rules were given)
+ *
+ * Rules given with usb_rule= take precedence over vid/pid. Only a complete vid+pid pair is compiled - otherwise there
+ * are no rules and the first USB device will be used (see validate_boot_dev()).
+ */
+static void __init compile_usb_boot_rules(struct boot_media *boot)
+{
+    if (boot->type == BOOT_MEDIA_SATA || boot->usb_rules_num > 0)
+        return;
+
+    if (boot->vid == VID_PID_EMPTY || boot->pid == VID_PID_EMPTY)
+        return;
+
+    boot->usb_rules[0].match_flags = USB_RULE_MATCH_VID | USB_RULE_MATCH_PID;
+    boot->usb_rules[0].vid = boot->vid;
+    boot->usb_rules[0].pid = boot->pid;
+    boot->usb_rules_num = 1;
+    pr_loc_dbg("Compiled USB boot rule from %s0x%04x %s0x%04x", CMDLINE_CT_VID, boot->vid, CMDLINE_CT_PID, boot->pid);
+}
+
+static bool __init validate_runtime_config(const struct runtime_config *config)
 {
     pr_loc_dbg("Validating runtime config...");
     bool valid = true;
@@ -177,15 +243,17 @@ static bool validate_runtime_config(const struct runtime_config *config)
     }
 }
 
-int populate_runtime_config(struct runtime_config *config)
+int __init populate_runtime_config(struct runtime_config *config)
 {
     int out = 0;
 
+    compile_usb_boot_rules(&config->boot_media);
     if ((out = populate_hw_config(config)) != 0 || (out = validate_runtime_config(config)) != 0) {
         pr_loc_err("Failed to populate runtime config!");
         return out;
     }
 
+    set_thread_placement(&config->threads);
     pr_loc_inf("Runtime config populated");
 
     return out;
@@ -193,19 +261,9 @@ int populate_runtime_config(struct runtime_config *config)
 
 void free_runtime_config(struct runtime_config *config)
 {
-    for (int i = 0; i < MAX_NET_IFACES; i++) {
-        if (config->macs[i]) {
-            pr_loc_dbg("Free MAC%d @ %p", i, config->macs[i]);
-            kfree(config->macs[i]);
-        }
-    }
-
-    for (int i = 0; i < MAX_BLACKLISTED_CMDLINE_TOKENS; i++) {
-        if (config->cmdline_blacklist[i]) {
-            pr_loc_dbg("Free cmdline blacklist entry %d @ %p", i, config->cmdline_blacklist[i]);
-            kfree(config->cmdline_blacklist[i]);
-        }
-    }
+    //MACs live in the init arena which is freed as a whole (see rp_arena_free_all()) - just make sure they're not used
+    for (int i = 0; i < MAX_NET_IFACES; i++)
+        config->macs[i] = NULL;
 
     pr_loc_inf("Runtime config freed");
 }
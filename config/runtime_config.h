@@ -3,12 +3,14 @@
 
 #include "uart_defs.h" //UART config values
 #include "../shim/pci_shim.h" //pci_shim_device_type
+#include "../shim/pmu_shim.h" //struct pmu_hw_responses
+#include "../shim/bios/bios_shims_collection.h" //struct bios_vtable_shim, MAX_BIOS_SHIMS
+#include "../internal/thread_placement.h" //struct thread_placement
 #include <linux/types.h> //bool
 
 //These below are currently known runtime limitations
 #define MAX_NET_IFACES 8
 #define MAC_ADDR_LEN 12
-#define MAX_BLACKLISTED_CMDLINE_TOKENS 10
 
 #ifdef CONFIG_SYNO_BOOT_SATA_DOM
 #define NATIVE_SATA_DOM_SUPPORTED //whether SCSI sd.c driver supports native SATA DOM
@@ -24,27 +26,45 @@
 
 #define VID_PID_EMPTY 0x0000
 #define VID_PID_MAX   0xFFFF
+#define MAX_USB_BOOT_RULES 4
+#define USB_RULE_SERIAL_MAX_LEN 32
 
 typedef unsigned short device_id;
 typedef char syno_hw[MODEL_MAX_LENGTH + 1];
 typedef char mac_address[MAC_ADDR_LEN + 1];
 typedef char serial_no[SN_MAX_LENGTH + 1];
-typedef char cmdline_token[];
 
 enum boot_media_type {
     BOOT_MEDIA_USB,
-    BOOT_MEDIA_SATA
+    BOOT_MEDIA_SATA,
+    BOOT_MEDIA_ANY //USB or SATA - whichever is found first (see shim/boot_device_shim.c)
+};
+
+//What a USB boot rule matches on (fields which aren't flagged are ignored)
+#define USB_RULE_MATCH_VID    (1 << 0)
+#define USB_RULE_MATCH_PID    (1 << 1)
+#define USB_RULE_MATCH_CLASS  (1 << 2) //device class or class of any interface (e.g. USB_CLASS_MASS_STORAGE)
+#define USB_RULE_MATCH_SERIAL (1 << 3)
+
+struct usb_boot_rule {
+    u8 match_flags;
+    u8 if_class;
+    device_id vid;
+    device_id pid;
+    char serial[USB_RULE_SERIAL_MAX_LEN + 1];
 };
 
 struct boot_media {
     enum boot_media_type type; //                                     Default: BOOT_MEDIA_USB <valid>
 
-    //USB only options
+    //USB only options (also used for BOOT_MEDIA_ANY)
     bool mfg_mode; //emulate mfg mode (valid for USB boot only).      Default: false <valid>
     device_id vid; //Vendor ID of device containing the loader.       Default: empty <valid, use first>
     device_id pid; //Product ID of device containing the loader.      Default: empty <valid, use first>
+    struct usb_boot_rule usb_rules[MAX_USB_BOOT_RULES]; //any match=boot Default: none <valid, compiled from vid/pid>
+    unsigned int usb_rules_num;
 
-    //SATA only options
+    //SATA only options (also used for BOOT_MEDIA_ANY)
     unsigned long dom_size_mib; //Max size of SATA DOM                Default: 1024 <valid, READ sata_boot_shim.c!!!>
 };
 
@@ -61,13 +81,30 @@ struct hw_config {
 
     struct vpci_device_stub pci_stubs[MAX_VPCI_DEVS];
 
+    struct bios_vtable_shim bios_shims[MAX_BIOS_SHIMS]; //mfgBIOS vtable entries to replace (incl. RTC proxy if needed)
+
     //All custom flags
-    bool emulate_rtc:1;
     bool swap_serial:1; //Whether ttyS0 and ttyS1 are swapped (reverses CONFIG_SYNO_X86_SERIAL_PORT_SWAP)
     bool reinit_ttyS0:1; //Should the ttyS0 be forcefully re-initialized after module loads
     bool fix_disk_led_ctrl:1; //Disabled libata-scsi bespoke disk led control (which often crashes some v4 platforms)
+
+    struct pmu_hw_responses pmu; //what vPMU answers with on this platform
 };
 
+#ifdef RP_PLATFORM
+#include "platforms.h" //RP_PLATFORM initializer
+/**
+ * The only platform a specialized build (make PLATFORM=<name>) supports
+ *
+ * Every unit reading the platform config gets its own copy of the constant, so that reads through hw_cfg() are folded
+ * by the compiler and code for features the platform doesn't use is dropped.
+ */
+static const struct hw_config rp_platform_hw_config __maybe_unused = RP_PLATFORM;
+#define hw_cfg(hw, field) ((void)(hw), rp_platform_hw_config.field)
+#else
+#define hw_cfg(hw, field) ((hw)->field)
+#endif
+
 struct runtime_config {
     syno_hw hw; //used to determine quirks.                                Default: empty <invalid>
     serial_no sn; //Used to validate it and warn the user.                 Default: empty <invalid>
@@ -75,7 +112,7 @@ struct runtime_config {
     bool port_thaw; //Currently unknown.                                   Default: true  <valid>
     unsigned short netif_num; //Number of eth interfaces.                  Default: 0     <invalid>
     mac_address *macs[MAX_NET_IFACES]; //MAC addresses of eth interfaces.  Default: []    <invalid>
-    cmdline_token *cmdline_blacklist[MAX_BLACKLISTED_CMDLINE_TOKENS];//    Default: []
+    struct thread_placement threads; //CPUs & scheduling of our threads.   Default: -     <valid>
     const struct hw_config *hw_config;
 };
 extern struct runtime_config current_config;
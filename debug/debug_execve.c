@@ -1,9 +1,52 @@
+/**
+ * Tracing of execve() calls (only available when built with DBG_EXECVE)
+ *
+ * Printing every execve() synchronously slows the boot to a crawl. Instead, every call is saved into a per-CPU ring and
+ * drained by reading <debugfs>/redpill/execve_trace (each line is: "timestamp_ns cpu pid comm filename argc {args}").
+ * Reading consumes records; records which don't fit because nobody reads them are dropped & counted.
+ *
+ * HOW IT WORKS?
+ * Each CPU has its own single-producer/single-consumer ring. The record is fully prepared on the stack first (as
+ * copying from userspace may sleep), then the producer just copies it into the next free slot with preemption disabled
+ * and advances the head. The only consumer is the debugfs reader (serialized by a mutex) which advances the tail.
+ */
 #include "debug_execve.h"
 #include "../common.h"
-#include <linux/sched.h> //task_struct
-#include <asm/uaccess.h> //get_user
+#include "../internal/debugfs_root.h" //get_debugfs_root()
+#include <linux/sched.h> //task_struct, local_clock()
+#include <asm/uaccess.h> //get_user, copy_to_user
 #include <linux/compat.h> //compat_uptr_t
 #include <linux/binfmts.h> //MAX_ARG_STRINGS
+#include <linux/percpu.h> //alloc_percpu()
+#include <linux/mutex.h>
+#include <linux/atomic.h> //atomic_long_*
+
+#define TRACE_RING_LEN 32 //must be a power of 2
+#define TRACE_FILENAME_LEN 96
+#define TRACE_ARGS_LEN 160 //arguments are concatenated with spaces & truncated
+
+struct execve_record {
+    u64 ts_ns;
+    pid_t pid;
+    int argc;
+    unsigned int cpu;
+    char comm[TASK_COMM_LEN];
+    char filename[TRACE_FILENAME_LEN];
+    char args[TRACE_ARGS_LEN];
+};
+
+struct execve_trace_ring {
+    unsigned int head; //written by producer only
+    unsigned int tail; //written by consumer only
+    atomic_long_t dropped; //incremented by producer, drained by consumer
+    struct execve_record recs[TRACE_RING_LEN];
+};
+
+static struct execve_trace_ring __percpu *rings = NULL;
+static DEFINE_MUTEX(reader_lock);
+#ifdef RP_DEBUGFS_ENABLED
+static struct dentry *trace_file = NULL;
+#endif
 
 /*
  * Struct copied 1:1 from:
@@ -52,62 +95,180 @@ static const char __user *get_user_arg_ptr(struct user_arg_ptr argv, int nr)
     return native;
 }
 
-/*
- * Modified for simplicity from count() in:
- *
- *  linux/fs/exec.c
- *
- *  Copyright (C) 1991, 1992  Linus Torvalds
+/**
+ * Copies (truncated) arguments from userspace into a single string
  */
-static int count_args(struct user_arg_ptr argv)
+static int copy_args(const char __user *const __user *argv, char *out, size_t out_len)
 {
-    if (argv.ptr.native == NULL)
-        return 0;
-
-    int i = 0;
+    struct user_arg_ptr argv_up = {.ptr.native = argv};
+    size_t pos = 0;
+    int argc = 0;
 
-    for (;;) {
-        const char __user *p = get_user_arg_ptr(argv, i);
+    out[0] = '\0';
+    if (!argv)
+        return 0;
 
-        if (!p)
+    for (;; ++argc) {
+        const char __user *arg = get_user_arg_ptr(argv_up, argc);
+        if (!arg)
             break;
 
-        if (IS_ERR(p) || i >= MAX_ARG_STRINGS)
+        if (IS_ERR(arg) || argc >= MAX_ARG_STRINGS)
             return -EFAULT;
 
-        ++i;
+        if (pos + 1 >= out_len)
+            continue; //just count the rest
 
-        if (fatal_signal_pending(current))
-            return -ERESTARTNOHAND;
-        cond_resched();
+        if (pos)
+            out[pos++] = ' ';
+
+        long len = strncpy_from_user(&out[pos], arg, out_len - pos - 1);
+        if (len < 0)
+            return len;
+
+        pos += len;
+        out[pos] = '\0';
     }
 
-    return i;
+    return argc;
 }
 
-void RPDBG_print_execve_call(const char *filename, const char __user *const __user *argv)
+void RPDBG_record_execve_call(const char *filename, const char __user *const __user *argv)
 {
-    struct task_struct *caller = get_cpu_var(current_task);
+    struct execve_record rec;
 
-    struct user_arg_ptr argv_up = {.ptr.native = argv};
-    int argc = count_args(argv_up);
+    if (unlikely(!rings))
+        return;
+
+    rec.pid = current->pid;
+    memcpy(rec.comm, current->comm, TASK_COMM_LEN);
+    rec.comm[TASK_COMM_LEN - 1] = '\0';
+    strlcpy(rec.filename, filename, TRACE_FILENAME_LEN);
+    rec.argc = copy_args(argv, rec.args, TRACE_ARGS_LEN);
+
+    struct execve_trace_ring *ring = get_cpu_ptr(rings);
+    rec.cpu = smp_processor_id();
+    rec.ts_ns = local_clock();
+
+    unsigned int head = ring->head;
+    if (unlikely(head - ACCESS_ONCE(ring->tail) >= TRACE_RING_LEN)) {
+        atomic_long_inc(&ring->dropped);
+    } else {
+        memcpy(&ring->recs[head & (TRACE_RING_LEN - 1)], &rec, sizeof(rec));
+        smp_wmb(); //record must be visible before the head moves
+        ACCESS_ONCE(ring->head) = head + 1;
+    }
+    put_cpu_ptr(rings);
+}
+
+#ifdef RP_DEBUGFS_ENABLED
+#include <linux/debugfs.h>
 
-    char *arg_str = kzalloc(MAX_ARG_STRLEN, GFP_KERNEL);
-    if (!arg_str) {
-        pr_loc_crt("kzalloc failed");
+static ssize_t trace_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
+{
+    char line[TASK_COMM_LEN + TRACE_FILENAME_LEN + TRACE_ARGS_LEN + 64];
+    size_t copied = 0;
+    int cpu;
+
+    mutex_lock(&reader_lock);
+    for_each_possible_cpu(cpu) {
+        struct execve_trace_ring *ring = per_cpu_ptr(rings, cpu);
+        unsigned int tail = ring->tail;
+
+        if (unlikely(atomic_long_read(&ring->dropped))) {
+            long dropped = atomic_long_xchg(&ring->dropped, 0);
+            int len = snprintf(line, sizeof(line), "# cpu%d dropped %ld records\n", cpu, dropped);
+            if (copied + len > count) {
+                atomic_long_add(dropped, &ring->dropped); //try again next time
+                goto out_unlock;
+            }
+            if (copy_to_user(buf + copied, line, len)) {
+                atomic_long_add(dropped, &ring->dropped);
+                goto out_fault;
+            }
+            copied += len;
+        }
+
+        while (tail != ACCESS_ONCE(ring->head)) {
+            smp_rmb(); //head must be read before the record
+            struct execve_record *rec = &ring->recs[tail & (TRACE_RING_LEN - 1)];
+            int len = snprintf(line, sizeof(line), "%llu %u %d %s %s %d {%s}\n", rec->ts_ns, rec->cpu, rec->pid,
+                               rec->comm, rec->filename, rec->argc, rec->args);
+            if (len >= sizeof(line))
+                len = sizeof(line) - 1;
+
+            if (copied + len > count)
+                break;
+
+            if (copy_to_user(buf + copied, line, len))
+                goto out_fault;
+
+            copied += len;
+            smp_mb(); //record must be fully read before the slot is released
+            ACCESS_ONCE(ring->tail) = ++tail;
+        }
+
+        if (tail != ACCESS_ONCE(ring->head)) //no more space in the user buffer
+            break;
+    }
+
+    out_unlock:
+    mutex_unlock(&reader_lock);
+    return copied;
+
+    out_fault: //a partial read is still a success; nothing copied means the buffer is bad
+    mutex_unlock(&reader_lock);
+    if (!copied)
+        return -EFAULT;
+    return copied;
+}
+
+static const struct file_operations trace_fops = {
+    .owner = THIS_MODULE,
+    .read = trace_read,
+    .llseek = no_llseek,
+};
+#endif
+
+void RPDBG_execve_trace_init(void)
+{
+    rings = alloc_percpu(struct execve_trace_ring);
+    if (unlikely(!rings)) {
+        pr_loc_err("alloc_percpu failed - execve() calls will not be traced");
         return;
     }
 
-    char *arg_ptr = &arg_str[0];
-    for (int i = 0; i < argc; i++) {
-        strncpy(arg_ptr, argv[i], (&arg_str[MAX_ARG_STRLEN - 2] - arg_ptr));
-        arg_ptr += strlen(arg_ptr);
-        *arg_ptr = (i + 1 == argc) ? '\0' : ' ';
-        ++arg_ptr;
+#ifdef RP_DEBUGFS_ENABLED
+    struct dentry *root = get_debugfs_root();
+    if (IS_ERR(root)) {
+        pr_loc_wrn("debugfs not available - execve() trace cannot be read");
+        return;
+    }
+
+    trace_file = debugfs_create_file("execve_trace", 0400, root, NULL, &trace_fops);
+    if (IS_ERR_OR_NULL(trace_file)) {
+        pr_loc_err("Failed to create debugfs file for execve() trace");
+        trace_file = NULL;
+        put_debugfs_root();
+        return;
     }
+#else
+    pr_loc_wrn("debugfs is disabled by stealth mode - execve() trace cannot be read");
+#endif
 
-    pr_loc_dbg("execve@cpu%d: %s[%d]=>%s<%i> {%s}", caller->on_cpu, caller->comm, caller->pid, filename, argc,
-               arg_str);
+    pr_loc_dbg("execve() trace initialized");
+}
 
-    kfree(arg_str);
-}
\ No newline at end of file
+void RPDBG_execve_trace_exit(void)
+{
+#ifdef RP_DEBUGFS_ENABLED
+    if (trace_file) {
+        debugfs_remove(trace_file);
+        trace_file = NULL;
+        put_debugfs_root();
+    }
+#endif
+
+    free_percpu(rings);
+    rings = NULL;
+}
@@ -1,6 +1,28 @@
 #ifndef REDPILL_DEBUG_EXECVE_H
 #define REDPILL_DEBUG_EXECVE_H
 
-void RPDBG_print_execve_call(const char *filename, const char *const *argv);
+#include <linux/compiler.h> //__user
+
+/**
+ * Sets up the execve() trace buffer & <debugfs>/redpill/execve_trace file
+ *
+ * Failure is not fatal - calls will simply not be recorded.
+ */
+void RPDBG_execve_trace_init(void);
+
+/**
+ * Removes everything created by RPDBG_execve_trace_init(); no RPDBG_record_execve_call() may be running
+ */
+void RPDBG_execve_trace_exit(void);
+
+/**
+ * Records an execve() call in the trace buffer
+ *
+ * This is safe to call on the execve() path: it never prints anything and never takes any locks.
+ *
+ * @param filename kernel copy of the filename
+ * @param argv userspace argv as passed to execve()
+ */
+void RPDBG_record_execve_call(const char *filename, const char __user *const __user *argv);
 
 #endif //REDPILL_DEBUG_EXECVE_H
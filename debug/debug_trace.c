@@ -0,0 +1,62 @@
+#include "debug_trace.h"
+#include "../internal/stealth.h" //STEALTH_MODE
+#include <linux/module.h> //module_param_cb
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/string.h> //strtobool
+
+#if STEALTH_MODE == STEALTH_MODE_OFF
+#define RP_DBG_DEFAULT true
+#else
+#define RP_DBG_DEFAULT false
+#endif
+
+struct static_key rp_dbg_key = STATIC_KEY_INIT_FALSE;
+
+static bool dbg_enabled = RP_DBG_DEFAULT; //desired state
+static bool dbg_applied = false; //whether the key reflects dbg_enabled (see rp_dbg_trace_init())
+static DEFINE_MUTEX(dbg_lock);
+
+static int set_debug(const char *val, const struct kernel_param *kp)
+{
+    bool new_state;
+    int out;
+
+    if ((out = strtobool(val, &new_state)) != 0)
+        return out;
+
+    mutex_lock(&dbg_lock);
+    if (dbg_applied && new_state != dbg_enabled) {
+        if (new_state)
+            static_key_slow_inc(&rp_dbg_key);
+        else
+            static_key_slow_dec(&rp_dbg_key);
+    }
+    dbg_enabled = new_state;
+    mutex_unlock(&dbg_lock);
+
+    return 0;
+}
+
+static int get_debug(char *buffer, const struct kernel_param *kp)
+{
+    return sprintf(buffer, "%c", dbg_enabled ? 'Y' : 'N');
+}
+
+static const struct kernel_param_ops debug_ops = {
+    .set = set_debug,
+    .get = get_debug,
+};
+module_param_cb(debug, &debug_ops, NULL, 0644);
+MODULE_PARM_DESC(debug, "Print debug messages (can be changed in runtime)");
+
+void rp_dbg_trace_init(void)
+{
+    mutex_lock(&dbg_lock);
+    if (!dbg_applied) {
+        if (dbg_enabled)
+            static_key_slow_inc(&rp_dbg_key);
+        dbg_applied = true;
+    }
+    mutex_unlock(&dbg_lock);
+}
@@ -0,0 +1,27 @@
+#ifndef REDPILL_DEBUG_TRACE_H
+#define REDPILL_DEBUG_TRACE_H
+
+/**
+ * Runtime switch for debug messages (pr_loc_dbg() and everything built on top of it)
+ *
+ * Debug messages are guarded by a static key: when disabled every pr_loc_dbg() is a single patched NOP and its
+ * arguments are NOT evaluated (so e.g. get_hex_print() calls passed to it cost nothing). They can be switched on
+ * without rebuilding using "debug=1" module param or in runtime via /sys/module/<module>/parameters/debug.
+ *
+ * By default debug messages are enabled only with STEALTH_MODE_OFF.
+ */
+#include <linux/jump_label.h> //struct static_key, static_key_false()
+
+extern struct static_key rp_dbg_key;
+
+#define rp_dbg_enabled() static_key_false(&rp_dbg_key)
+
+/**
+ * Applies the initial state of debug messages - it must be called as the first thing in the module init
+ *
+ * Module params are parsed before jump entries of the module are registered, so the key cannot be flipped while this
+ * happens (the param value is only remembered until this function is called).
+ */
+void rp_dbg_trace_init(void);
+
+#endif //REDPILL_DEBUG_TRACE_H
@@ -0,0 +1,57 @@
+#ifndef REDPILL_HOST_EMU_H
+#define REDPILL_HOST_EMU_H
+
+/**
+ * API of the userspace emulators build used by the benchmark & fuzzer (see host/CMakeLists.txt)
+ *
+ * The emulators themselves are exactly the module sources; functions here only drive them the way the kernel would
+ * (or reach into their internals where the kernel has no equivalent entry point, e.g. to reset state between inputs).
+ */
+#include <stdbool.h>
+#include <stddef.h>
+
+struct runtime_config;
+
+/**
+ * Enables/disables printing of non-error kernel log messages (incl. pr_loc_dbg())
+ */
+void rp_host_set_verbose(bool verbose);
+
+/**
+ * Sets what /proc/cmdline shows (i.e. what the cmdline parser gets); the string doesn't need to be NULL-terminated
+ */
+void rp_host_set_cmdline(const char *cmdline, size_t len);
+
+/**
+ * Parses the cmdline set with rp_host_set_cmdline() into config, as if the module just loaded
+ *
+ * Unlike a single module load this can be called repeatedly. Every call must be paired with rp_emu_cmdline_free().
+ *
+ * @return 0 on success, -E on error
+ */
+int rp_emu_cmdline_parse(struct runtime_config *config);
+
+/**
+ * Frees everything rp_emu_cmdline_parse() allocated in config
+ */
+void rp_emu_cmdline_free(struct runtime_config *config);
+
+/**
+ * Registers the vPMU (and its vUART on ttyS1) with a set of responses of a generic platform
+ */
+int rp_emu_pmu_start(void);
+int rp_emu_pmu_stop(void);
+
+/**
+ * Feeds bytes directly to the PMU stream parser, skipping the vUART (vPMU must be started)
+ *
+ * @param end_of_packet whether the transmitter went idle after these bytes (see parse_pmu_stream())
+ */
+void rp_emu_pmu_feed(const char *buffer, unsigned int len, bool end_of_packet);
+
+/**
+ * Number of PMU commands executed since rp_emu_pmu_start()
+ */
+unsigned long rp_emu_pmu_executed(void);
+
+#endif //REDPILL_HOST_EMU_H
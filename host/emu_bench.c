@@ -0,0 +1,371 @@
+/**
+ * Microbenchmarks of the emulators' hot paths, ran in userspace (see host/CMakeLists.txt)
+ *
+ * Every benchmark is a loop of st->iterations operations; the runner scales the number of iterations up until a single
+ * run takes at least BENCH_MIN_TIME_NS and reports the time per operation (and throughput for byte-oriented ones).
+ * Setup is done outside of the timed loop. This mirrors how Google Benchmark works, without pulling C++ into the tree.
+ *
+ * Usage: rp_emu_bench [-v] [name_filter]
+ *
+ * Note that all accesses go through the same entry points the kernel uses (e.g. port->serial_in() for the 8250 driver
+ * or bus->ops->read() for the PCI core) but without the real kernel around them - that's the point: the numbers show
+ * the cost of the emulation itself. For end-to-end numbers on a real kernel see bench/vuart_bench.c.
+ */
+#include "rp_host.h"
+#include "emu.h"
+#include "../config/runtime_config.h" //struct runtime_config
+#include "../config/cmdline_delegate.h" //get_filtered_kernel_cmdline()
+#include "../internal/uart/virtual_uart.h"
+#include "../internal/virtual_pci.h"
+#include <linux/serial_reg.h> //UART_*
+#include <linux/pci_regs.h> //PCI_*
+
+#define BENCH_MIN_TIME_NS (200 * NSEC_PER_MSEC)
+#define BENCH_MAX_ITERATIONS (1UL << 32)
+#define BENCH_LINE 2 //ttyS# used for raw vUART benchmarks (PMU uses ttyS1)
+
+struct bench_state {
+    unsigned long iterations;
+    unsigned long bytes_per_iteration; //0 if throughput doesn't make sense
+    volatile unsigned long sink; //results go here so that the compiler cannot remove the work
+};
+
+typedef int (bench_setup_fn)(void);
+typedef void (bench_fn)(struct bench_state *st);
+typedef void (bench_teardown_fn)(void);
+
+struct bench_def {
+    const char *name;
+    bench_setup_fn *setup; //may be NULL; returns 0 or -E
+    bench_fn *run;
+    bench_teardown_fn *teardown; //may be NULL
+};
+
+/******************************************************** vUART *******************************************************/
+static struct uart_port *bench_port = NULL;
+static char bench_tx_buffer[VUART_FIFO_MAX_LEN];
+
+static void bench_tx_cb(int line, const char *buffer, unsigned int len, vuart_flush_reason reason)
+{
+    //discard
+}
+
+static int vuart_setup(void)
+{
+    int out = vuart_add_device(BENCH_LINE, VUART_CHIP_16550A);
+    if (out != 0)
+        return out;
+
+    bench_port = rp_host_uart_port(BENCH_LINE);
+    if (!bench_port)
+        return -ENODEV;
+
+    //What 8250 does on startup: enable FIFOs, set 8N1 & start listening (RX is held in the ring until RDI is enabled)
+    bench_port->serial_out(bench_port, UART_FCR, UART_FCR_ENABLE_FIFO | UART_FCR_CLEAR_RCVR | UART_FCR_CLEAR_XMIT);
+    bench_port->serial_out(bench_port, UART_LCR, UART_LCR_WLEN8);
+    bench_port->serial_out(bench_port, UART_IER, UART_IER_RDI);
+
+    return vuart_set_tx_callback(BENCH_LINE, bench_tx_cb, bench_tx_buffer, VUART_FIFO_LEN);
+}
+
+static void vuart_teardown(void)
+{
+    vuart_remove_device(BENCH_LINE);
+    bench_port = NULL;
+}
+
+//Console & THR writes poll LSR all the time; this should go through the lockless read path
+static void bm_vuart_lsr_poll(struct bench_state *st)
+{
+    unsigned long acc = 0;
+    for (unsigned long i = 0; i < st->iterations; ++i)
+        acc += bench_port->serial_in(bench_port, UART_LSR);
+
+    st->sink = acc;
+}
+
+//A write without side effects (only locking + register update)
+static void bm_vuart_scr_write(struct bench_state *st)
+{
+    for (unsigned long i = 0; i < st->iterations; ++i)
+        bench_port->serial_out(bench_port, UART_SCR, (int)i);
+}
+
+//THR writes the way serial8250_tx_chars() does them: a FIFO worth of bytes without polling LSR in between (the FIFO
+// flushes to the callback every 16 bytes)
+static void bm_vuart_tx_char(struct bench_state *st)
+{
+    st->bytes_per_iteration = 1;
+    for (unsigned long i = 0; i < st->iterations; ++i)
+        bench_port->serial_out(bench_port, UART_TX, 'A' + (i & 0x0f));
+}
+
+//Injecting a FIFO worth of data & reading it back the way the driver does (LSR DR => RHR)
+static void bm_vuart_rx_fifo(struct bench_state *st)
+{
+    static const char data[VUART_FIFO_LEN] = "0123456789abcdef";
+    unsigned long acc = 0;
+
+    st->bytes_per_iteration = sizeof(data);
+    for (unsigned long i = 0; i < st->iterations; ++i) {
+        vuart_inject_rx(BENCH_LINE, data, sizeof(data));
+        while (bench_port->serial_in(bench_port, UART_LSR) & UART_LSR_DR)
+            acc += bench_port->serial_in(bench_port, UART_RX);
+    }
+
+    st->sink = acc;
+}
+
+/********************************************************* vPMU *******************************************************/
+static struct uart_port *pmu_port = NULL;
+
+static int pmu_setup(void)
+{
+    int out = rp_emu_pmu_start();
+    if (out != 0)
+        return out;
+
+    pmu_port = rp_host_uart_port(1);
+    if (!pmu_port)
+        return -ENODEV;
+
+    pmu_port->serial_out(pmu_port, UART_FCR, UART_FCR_ENABLE_FIFO);
+    pmu_port->serial_out(pmu_port, UART_LCR, UART_LCR_WLEN8);
+    pmu_port->serial_out(pmu_port, UART_IER, UART_IER_RDI);
+
+    return 0;
+}
+
+static void pmu_teardown(void)
+{
+    rp_emu_pmu_stop();
+    pmu_port = NULL;
+}
+
+//A typical burst sent by the mfgBIOS/scemd: LED & buzzer commands glued together, followed by IDLE
+static const char pmu_burst[] = "-4-8-@-7-6-2-SW1-B-J-K-t-u";
+
+static void bm_pmu_parse(struct bench_state *st)
+{
+    st->bytes_per_iteration = sizeof(pmu_burst) - 1;
+    for (unsigned long i = 0; i < st->iterations; ++i)
+        rp_emu_pmu_feed(pmu_burst, sizeof(pmu_burst) - 1, true);
+
+    st->sink = rp_emu_pmu_executed();
+}
+
+//The same burst but going through the vUART like the driver sends it: THRE interrupt on, bytes, THRE off (=IDLE)
+static void bm_pmu_via_vuart(struct bench_state *st)
+{
+    st->bytes_per_iteration = sizeof(pmu_burst) - 1;
+    for (unsigned long i = 0; i < st->iterations; ++i) {
+        pmu_port->serial_out(pmu_port, UART_IER, UART_IER_RDI | UART_IER_THRI);
+        for (const char *curr = pmu_burst; *curr; ++curr)
+            pmu_port->serial_out(pmu_port, UART_TX, *curr);
+        pmu_port->serial_out(pmu_port, UART_IER, UART_IER_RDI);
+    }
+
+    st->sink = rp_emu_pmu_executed();
+}
+
+//Request for the unique ID & reading the reply back (what scemd does on every start)
+static void bm_pmu_get_uniq(struct bench_state *st)
+{
+    unsigned long acc = 0;
+    for (unsigned long i = 0; i < st->iterations; ++i) {
+        rp_emu_pmu_feed("-R", 2, true);
+        while (pmu_port->serial_in(pmu_port, UART_LSR) & UART_LSR_DR)
+            acc += pmu_port->serial_in(pmu_port, UART_RX);
+    }
+
+    st->sink = acc;
+}
+
+/********************************************************* vPCI *******************************************************/
+#define BENCH_VPCI_BUS 0x10
+#define BENCH_VPCI_DEVS 8
+
+static const struct pci_dev_descriptor bench_pci_dev =
+    PCI_DSC_NORMAL_DEV(0x8086, 0x1234, U16_CLASS_TO_U8_CLASS(PCI_CLASS_SERIAL_USB),
+                       U16_CLASS_TO_U8_SUBCLASS(PCI_CLASS_SERIAL_USB), 0x20, PCI_DSC_REV_NONE,
+                       PCI_HEADER_TYPE_NORMAL);
+static const u8 bench_pm_cap[] = { PCI_CAP_ID_PM, 0x00, 0x03, 0x00, 0x08, 0x00, 0x00, 0x00 };
+static const u8 bench_ext_cap[] = { 0x01, 0x00, 0x01, 0x00, 0xde, 0xad, 0xbe, 0xef };
+static const struct pci_cfg_chunk bench_chunks[] = {
+    { .offset = 0x40, .len = sizeof(bench_pm_cap), .data = bench_pm_cap },
+    { .offset = 0x100, .len = sizeof(bench_ext_cap), .data = bench_ext_cap },
+};
+static const struct pci_cfg_ext bench_ext = {
+    .cap_ptr = 0x40, .chunks_num = ARRAY_SIZE(bench_chunks), .chunks = bench_chunks
+};
+static struct pci_bus *bench_bus = NULL;
+
+static int vpci_setup(void)
+{
+    vpci_begin_batch();
+    for (int dev = 0; dev < BENCH_VPCI_DEVS; ++dev) {
+        const struct virtual_device *vdev = vpci_add_device_ext(BENCH_VPCI_BUS, dev, 0, &bench_pci_dev, &bench_ext);
+        if (IS_ERR(vdev))
+            return PTR_ERR(vdev);
+    }
+
+    int out = vpci_commit_batch();
+    if (out != 0)
+        return out;
+
+    bench_bus = rp_host_pci_bus(BENCH_VPCI_BUS);
+    return bench_bus ? 0 : -ENODEV;
+}
+
+static void vpci_teardown(void)
+{
+    vpci_remove_all_devices_and_buses(); //it always returns -EIO (see its docs)
+    bench_bus = NULL;
+}
+
+//Dword reads of the standard header - what lspci & drivers do the most
+static void bm_vpci_read_header(struct bench_state *st)
+{
+    unsigned long acc = 0;
+    u32 val;
+
+    for (unsigned long i = 0; i < st->iterations; ++i) {
+        bench_bus->ops->read(bench_bus, PCI_DEVFN(i % BENCH_VPCI_DEVS, 0), (i * 4) & (PCI_DSC_HEADER_LEN - 1), 4, &val);
+        acc += val;
+    }
+
+    st->sink = acc;
+}
+
+//Walking capabilities & extended config space (sparse chunks lookup)
+static void bm_vpci_read_ext(struct bench_state *st)
+{
+    unsigned long acc = 0;
+    u32 val;
+
+    for (unsigned long i = 0; i < st->iterations; ++i) {
+        bench_bus->ops->read(bench_bus, PCI_DEVFN(i % BENCH_VPCI_DEVS, 0), 0x40 + ((i * 4) & 0xff), 4, &val);
+        acc += val;
+    }
+
+    st->sink = acc;
+}
+
+//Probing of empty slots happens for every devfn on every scan
+static void bm_vpci_probe_empty(struct bench_state *st)
+{
+    unsigned long acc = 0;
+    u32 val;
+
+    for (unsigned long i = 0; i < st->iterations; ++i) {
+        bench_bus->ops->read(bench_bus, PCI_DEVFN(BENCH_VPCI_DEVS + (i % 8), 0), PCI_VENDOR_ID, 4, &val);
+        acc += val;
+    }
+
+    st->sink = acc;
+}
+
+/******************************************************* Cmdline ******************************************************/
+static const char bench_cmdline[] =
+    "BOOT_IMAGE=/zImage syno_hw_version=DS918+ console=ttyS0,115200n8 netif_num=2 earlyprintk loglevel=15 "
+    "log_buf_len=32M syno_port_thaw=1 mac1=0011322CA785 mac2=0011322CA786 sn=1780PDN123456 vid=0x46f4 pid=0x0001 "
+    "elevator=elevator root=/dev/md0 synoboot_satadom=0 usb_rule=0x46f4:*:8 quiet";
+
+static int cmdline_setup(void)
+{
+    rp_host_set_cmdline(bench_cmdline, sizeof(bench_cmdline) - 1);
+    return 0;
+}
+
+//Full parse into runtime config + building the filtered cmdline
+static void bm_cmdline_parse(struct bench_state *st)
+{
+    struct runtime_config config;
+
+    st->bytes_per_iteration = sizeof(bench_cmdline) - 1;
+    for (unsigned long i = 0; i < st->iterations; ++i) {
+        rp_emu_cmdline_parse(&config);
+        rp_emu_cmdline_free(&config);
+    }
+
+    st->sink = config.netif_num;
+}
+
+/******************************************************** Runner ******************************************************/
+static const struct bench_def benchmarks[] = {
+    { "vuart_lsr_poll", vuart_setup, bm_vuart_lsr_poll, vuart_teardown },
+    { "vuart_scr_write", vuart_setup, bm_vuart_scr_write, vuart_teardown },
+    { "vuart_tx_char", vuart_setup, bm_vuart_tx_char, vuart_teardown },
+    { "vuart_rx_fifo", vuart_setup, bm_vuart_rx_fifo, vuart_teardown },
+    { "pmu_parse", pmu_setup, bm_pmu_parse, pmu_teardown },
+    { "pmu_via_vuart", pmu_setup, bm_pmu_via_vuart, pmu_teardown },
+    { "pmu_get_uniq", pmu_setup, bm_pmu_get_uniq, pmu_teardown },
+    { "vpci_read_header", vpci_setup, bm_vpci_read_header, vpci_teardown },
+    { "vpci_read_ext", vpci_setup, bm_vpci_read_ext, vpci_teardown },
+    { "vpci_probe_empty", vpci_setup, bm_vpci_probe_empty, vpci_teardown },
+    { "cmdline_parse", cmdline_setup, bm_cmdline_parse, NULL },
+};
+
+static s64 run_once(const struct bench_def *def, struct bench_state *st)
+{
+    s64 start = ktime_get_ns();
+    def->run(st);
+
+    return ktime_get_ns() - start;
+}
+
+static int run_benchmark(const struct bench_def *def)
+{
+    struct bench_state st = { .iterations = 1 };
+    s64 elapsed;
+
+    int out = def->setup ? def->setup() : 0;
+    if (out != 0) {
+        fprintf(stderr, "%s: setup failed (error=%d)\n", def->name, out);
+        if (def->teardown)
+            def->teardown();
+        return out;
+    }
+
+    //Scale iterations so that the measured run is long enough to not be affected by the clock resolution
+    while ((elapsed = run_once(def, &st)) < BENCH_MIN_TIME_NS && st.iterations < BENCH_MAX_ITERATIONS) {
+        u64 next = elapsed > 0 ? div64_u64((u64)st.iterations * BENCH_MIN_TIME_NS * 14 / 10, elapsed) : 0;
+        st.iterations = max_t(u64, next, (u64)st.iterations * 2);
+        st.iterations = min_t(u64, st.iterations, BENCH_MAX_ITERATIONS);
+    }
+
+    double ns_op = (double)elapsed / st.iterations;
+    printf("%-20s %12lu %12.2f", def->name, st.iterations, ns_op);
+    if (st.bytes_per_iteration)
+        printf(" %10.2f", (double)st.bytes_per_iteration * st.iterations * 1000.0 / elapsed); //bytes/ns => MB/s
+    printf("\n");
+
+    if (def->teardown)
+        def->teardown();
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *filter = NULL;
+    int failed = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-v") == 0)
+            rp_host_set_verbose(true);
+        else
+            filter = argv[i];
+    }
+
+    printf("%-20s %12s %12s %10s\n", "benchmark", "iterations", "ns/op", "MB/s");
+    for (int i = 0; i < ARRAY_SIZE(benchmarks); ++i) {
+        if (filter && !strstr(benchmarks[i].name, filter))
+            continue;
+
+        if (run_benchmark(&benchmarks[i]) != 0)
+            ++failed;
+    }
+
+    return failed ? 1 : 0;
+}
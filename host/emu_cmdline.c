@@ -0,0 +1,25 @@
+/**
+ * Cmdline parser built for userspace
+ *
+ * The parser caches the cmdline & its filtered version as it runs once per module load; here it runs once per input.
+ */
+#include "../config/cmdline_delegate.c"
+#include "../internal/init_arena.h" //rp_arena_free_all()
+#include "emu.h"
+
+int rp_emu_cmdline_parse(struct runtime_config *config)
+{
+    cmdline_cache[0] = '\0';
+    filtered_cmdline_ready = false;
+    memset(config, 0, sizeof(*config));
+
+    return extract_config_from_cmdline(config, false);
+}
+
+void rp_emu_cmdline_free(struct runtime_config *config)
+{
+    //MACs are in the init arena - the emulator doesn't allocate anything else from it so it can be dropped as a whole
+    for (int i = 0; i < MAX_NET_IFACES; i++)
+        config->macs[i] = NULL;
+    rp_arena_free_all();
+}
@@ -0,0 +1,201 @@
+/**
+ * Fuzzing harness for the emulators' input parsers, ran in userspace (see host/CMakeLists.txt)
+ *
+ * Everything the emulators parse comes from outside of the module: the cmdline from the bootloader, PMU commands &
+ * register accesses from (often closed-source) userspace via the 8250 driver and config space reads from the PCI core.
+ * The first byte of the input selects the target, the rest is fed to it:
+ *  - 'c' cmdline: the rest is the cmdline (parsed into a runtime config + filtered cmdline)
+ *  - 'p' vPMU stream: the rest is split into packets on 0x00 bytes; each one ends with IDLE
+ *  - 'u' vUART registers: the rest is a sequence of 2-byte ops: [RW:1|reg:3|chip:2|unused:2] [value]
+ *  - 'v' vPCI config: the rest is a sequence of 4-byte reads: [devfn] [where_lo] [where_hi] [size]
+ *
+ * With clang this is a libFuzzer target (e.g. rp_emu_fuzz -max_len=4096 corpus/). Otherwise it's a replay binary taking
+ * input files as arguments, which is useful to reproduce crashes under a debugger or valgrind.
+ */
+#include "rp_host.h"
+#include "emu.h"
+#include "../config/runtime_config.h" //struct runtime_config
+#include "../config/cmdline_delegate.h" //get_filtered_kernel_cmdline(), CMDLINE_MAX
+#include "../internal/uart/virtual_uart.h"
+#include "../internal/virtual_pci.h"
+#include <linux/serial_reg.h> //UART_*
+#include <linux/pci_regs.h> //PCI_*
+
+#define FUZZ_UART_LINE 2
+#define FUZZ_VPCI_BUS 0x20
+
+static void fuzz_cmdline(const u8 *data, size_t size)
+{
+    struct runtime_config config;
+    char filtered[CMDLINE_MAX];
+
+    rp_host_set_cmdline((const char *)data, size);
+    if (rp_emu_cmdline_parse(&config) == 0) {
+        //The filtered cmdline is a subset of the original one, so it must always fit
+        long out = get_filtered_kernel_cmdline(filtered, sizeof(filtered));
+        if ((out < 0 && out != -E2BIG) || (out >= 0 && out != strlen(filtered)))
+            __builtin_trap(); //tokens are copied by length - a wrong one would leave a NUL or garbage inside
+    }
+    rp_emu_cmdline_free(&config);
+}
+
+static void fuzz_pmu(const u8 *data, size_t size)
+{
+    if (rp_emu_pmu_start() != 0)
+        return;
+
+    const u8 *packet = data;
+    for (const u8 *curr = data, *end = data + size; curr <= end; ++curr) {
+        if (curr == end || *curr == 0x00) {
+            rp_emu_pmu_feed((const char *)packet, curr - packet, true);
+            packet = curr + 1;
+        }
+    }
+
+    //Whatever was replied has to be readable by the driver once it starts listening
+    struct uart_port *port = rp_host_uart_port(1);
+    if (port)
+        port->serial_out(port, UART_IER, UART_IER_RDI);
+    for (int i = 0; port && i < VUART_RX_RING_LEN && (port->serial_in(port, UART_LSR) & UART_LSR_DR); ++i)
+        port->serial_in(port, UART_RX);
+
+    rp_emu_pmu_stop();
+}
+
+static char fuzz_tx_buffer[VUART_FIFO_MAX_LEN];
+static void fuzz_tx_cb(int line, const char *buffer, unsigned int len, vuart_flush_reason reason)
+{
+    if (len > VUART_FIFO_MAX_LEN)
+        __builtin_trap();
+}
+
+static void fuzz_vuart(const u8 *data, size_t size)
+{
+    static const vuart_chip_model chips[] = { VUART_CHIP_16550A, VUART_CHIP_16750, VUART_CHIP_16C950 };
+    vuart_chip_model chip = size ? chips[((data[0] >> 2) & 0x03) % ARRAY_SIZE(chips)] : VUART_CHIP_16550A;
+
+    if (vuart_add_device(FUZZ_UART_LINE, chip) != 0)
+        return;
+
+    struct uart_port *port = rp_host_uart_port(FUZZ_UART_LINE);
+    if (!port)
+        goto out_remove;
+
+    vuart_set_tx_callback(FUZZ_UART_LINE, fuzz_tx_cb, fuzz_tx_buffer, size ? (data[0] & 0x1f) + 1 : VUART_FIFO_LEN);
+    for (size_t i = 0; i + 1 < size; i += 2) {
+        int reg = (data[i] >> 4) & 0x07;
+        if (data[i] & 0x80) {
+            port->serial_out(port, reg, data[i + 1]);
+        } else {
+            port->serial_in(port, reg);
+        }
+
+        if ((data[i] & 0x03) == 0x03) //occasionally inject RX data & let the timers run, like in real life
+            vuart_inject_rx(FUZZ_UART_LINE, (const char *)&data[i + 1], 1);
+        if ((data[i] & 0x03) == 0x02)
+            rp_host_fire_timers();
+    }
+
+    out_remove:
+    vuart_remove_device(FUZZ_UART_LINE);
+}
+
+static const struct pci_dev_descriptor fuzz_pci_dev =
+    PCI_DSC_NORMAL_DEV(0x8086, 0x4321, U16_CLASS_TO_U8_CLASS(PCI_CLASS_SERIAL_USB),
+                       U16_CLASS_TO_U8_SUBCLASS(PCI_CLASS_SERIAL_USB), 0x20, PCI_DSC_REV_NONE,
+                       PCI_HEADER_TO_MULTI(PCI_HEADER_TYPE_NORMAL));
+static const u8 fuzz_pm_cap[] = { PCI_CAP_ID_PM, 0x50, 0x03, 0x00, 0x08, 0x00, 0x00, 0x00 };
+static const u8 fuzz_msi_cap[] = { PCI_CAP_ID_MSI, 0x00, 0x80, 0x00 };
+static const u8 fuzz_ext_cap[] = { 0x01, 0x00, 0x01, 0x00, 0xde, 0xad, 0xbe, 0xef };
+static const struct pci_cfg_chunk fuzz_chunks[] = {
+    { .offset = 0x40, .len = sizeof(fuzz_pm_cap), .data = fuzz_pm_cap },
+    { .offset = 0x50, .len = sizeof(fuzz_msi_cap), .data = fuzz_msi_cap },
+    { .offset = 0x100, .len = sizeof(fuzz_ext_cap), .data = fuzz_ext_cap },
+};
+static const struct pci_cfg_ext fuzz_ext = {
+    .cap_ptr = 0x40, .chunks_num = ARRAY_SIZE(fuzz_chunks), .chunks = fuzz_chunks
+};
+
+static void fuzz_vpci(const u8 *data, size_t size)
+{
+    vpci_begin_batch();
+    vpci_add_device_ext(FUZZ_VPCI_BUS, 0, 1, &fuzz_pci_dev, NULL);
+    vpci_add_device_ext(FUZZ_VPCI_BUS, 0, 0, &fuzz_pci_dev, &fuzz_ext);
+    vpci_add_device_ext(FUZZ_VPCI_BUS, 1, 0, &fuzz_pci_dev, NULL);
+    if (vpci_commit_batch() != 0)
+        goto out_remove;
+
+    struct pci_bus *bus = rp_host_pci_bus(FUZZ_VPCI_BUS);
+    if (!bus)
+        goto out_remove;
+
+    for (size_t i = 0; i + 3 < size; i += 4) {
+        u32 val = 0;
+        int where = data[i + 1] | (data[i + 2] << 8);
+        int ret = bus->ops->read(bus, data[i], where, data[i + 3] & 0x07, &val);
+        if (ret == PCIBIOS_SUCCESSFUL && (data[i + 3] & 0x07) < 4 && (val >> ((data[i + 3] & 0x07) * 8)) != 0)
+            __builtin_trap(); //bytes above the requested size must always be zeroed
+    }
+
+    out_remove:
+    vpci_remove_all_devices_and_buses();
+}
+
+int LLVMFuzzerTestOneInput(const u8 *data, size_t size)
+{
+    if (size < 1)
+        return 0;
+
+    switch (data[0]) {
+        case 'c':
+            fuzz_cmdline(data + 1, size - 1);
+            break;
+        case 'p':
+            fuzz_pmu(data + 1, size - 1);
+            break;
+        case 'u':
+            fuzz_vuart(data + 1, size - 1);
+            break;
+        case 'v':
+            fuzz_vpci(data + 1, size - 1);
+            break;
+        default:
+            return -1; //not a valid input - don't add it to the corpus
+    }
+
+    return 0;
+}
+
+#ifndef RP_HOST_LIBFUZZER
+#define FUZZ_MAX_INPUT (1 << 20)
+
+int main(int argc, char **argv)
+{
+    static u8 input[FUZZ_MAX_INPUT];
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s [-v] <input_file>...\n(build with clang to get a libFuzzer target)\n", argv[0]);
+        return 2;
+    }
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-v") == 0) {
+            rp_host_set_verbose(true);
+            continue;
+        }
+
+        FILE *file = fopen(argv[i], "rb");
+        if (!file) {
+            perror(argv[i]);
+            return 1;
+        }
+
+        size_t size = fread(input, 1, sizeof(input), file);
+        fclose(file);
+        LLVMFuzzerTestOneInput(input, size);
+        printf("%s: %zu bytes OK\n", argv[i], size);
+    }
+
+    return 0;
+}
+#endif
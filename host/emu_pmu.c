@@ -0,0 +1,58 @@
+/**
+ * vPMU built for userspace
+ *
+ * Command handlers are dispatched through the workqueue stub, i.e. they run right after the vUART access which
+ * triggered the TX callback (or synchronously inside rp_emu_pmu_feed()). The vPMU port is lazy so it's opened right away, as the 8250 startup would do.
+ */
+#include "../shim/pmu_shim.c"
+#include "emu.h"
+#include <linux/serial_reg.h> //UART_MCR_*
+
+static const struct hw_config host_hw = {
+    .name = "host",
+    .pmu = { .resp = { [PMU_RESP_UNIQ] = "-synology_apollolake_918+" } },
+};
+static work_func_t dispatch_fn = NULL;
+static unsigned long executed_cmds = 0;
+
+static void count_dispatch_commands(struct work_struct *work)
+{
+    executed_cmds += kfifo_len(&dispatch_queue);
+    dispatch_fn(work);
+}
+
+int rp_emu_pmu_start(void)
+{
+    int out = register_pmu_shim(&host_hw);
+    if (out != 0)
+        return out;
+
+    struct uart_port *port = rp_host_uart_port(PMU_TTYS_LINE);
+    if (!port) {
+        unregister_pmu_shim();
+        return -ENODEV;
+    }
+    port->serial_out(port, UART_MCR, UART_MCR_OUT2 | UART_MCR_RTS | UART_MCR_DTR); //the vPMU is started synchronously
+
+    executed_cmds = 0;
+    if (!dispatch_fn)
+        dispatch_fn = dispatch_work.func;
+    dispatch_work.func = count_dispatch_commands;
+
+    return 0;
+}
+
+int rp_emu_pmu_stop(void)
+{
+    return unregister_pmu_shim();
+}
+
+void rp_emu_pmu_feed(const char *buffer, unsigned int len, bool end_of_packet)
+{
+    parse_pmu_stream(buffer, len, end_of_packet);
+}
+
+unsigned long rp_emu_pmu_executed(void)
+{
+    return executed_cmds;
+}
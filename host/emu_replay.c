@@ -0,0 +1,144 @@
+/**
+ * Replays vUART traces in userspace (see host/CMakeLists.txt and internal/uart/vuart_trace.h)
+ *
+ * A trace captured on a real box (e.g. a whole DS918+ boot from <debugfs>/redpill/vuart/ttyS1/trace) is fed back into
+ * the emulator as fast as possible, which gives a deterministic, hardware-free reproduction of real-world traffic for
+ * profiling & debugging. Traces recorded on the PMU line (ttyS1) are replayed into the vPMU, so the PMU parser and
+ * command handlers run exactly like they did on the box; any other line gets a bare vUART with a discarding callback.
+ *
+ * Usage: rp_emu_replay [-v] [-n iterations] <trace_file>
+ */
+#include "rp_host.h"
+#include "emu.h"
+#include "../internal/uart/virtual_uart.h"
+#include "../internal/uart/vuart_trace.h"
+#include <linux/serial_reg.h> //UART_LSR
+#include <unistd.h> //getopt()
+
+#define REPLAY_PMU_LINE 1
+#define REPLAY_MAX_TRACE (64 << 20)
+
+static char replay_tx_buffer[VUART_FIFO_MAX_LEN];
+
+static void replay_tx_cb(int line, const char *buffer, unsigned int len, vuart_flush_reason reason)
+{
+    //discard
+}
+
+static void *read_trace(const char *path, size_t *len)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        perror(path);
+        return NULL;
+    }
+
+    char *buf = malloc(REPLAY_MAX_TRACE);
+    if (buf)
+        *len = fread(buf, 1, REPLAY_MAX_TRACE, file);
+    fclose(file);
+
+    return buf;
+}
+
+static int start_port(const struct vuart_trace_hdr *hdr)
+{
+    int out;
+
+    if (hdr->line == REPLAY_PMU_LINE) {
+        if ((out = rp_emu_pmu_start()) != 0)
+            return out;
+    } else {
+        if ((out = vuart_add_device(hdr->line, hdr->chip)) != 0 ||
+            (out = vuart_set_tx_callback(hdr->line, replay_tx_cb, replay_tx_buffer, VUART_FIFO_LEN)) != 0)
+            return out;
+    }
+
+    //The vUART learns the port from the driver's first access (see capture_uart_port())
+    struct uart_port *port = rp_host_uart_port(hdr->line);
+    if (!port)
+        return -ENODEV;
+    port->serial_in(port, UART_LSR);
+
+    return 0;
+}
+
+static void stop_port(const struct vuart_trace_hdr *hdr)
+{
+    if (hdr->line == REPLAY_PMU_LINE)
+        rp_emu_pmu_stop();
+    else
+        vuart_remove_device(hdr->line);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long iterations = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "vn:")) != -1) {
+        if (opt == 'v')
+            rp_host_set_verbose(true);
+        else if (opt == 'n')
+            iterations = strtoul(optarg, NULL, 10);
+        else
+            iterations = 0; //invalid option => usage
+    }
+
+    const char *path = (optind == argc - 1) ? argv[optind] : NULL;
+    if (!path || !iterations) {
+        fprintf(stderr, "Usage: %s [-v] [-n iterations] <trace_file>\n", argv[0]);
+        return 2;
+    }
+
+    size_t len = 0;
+    void *trace = read_trace(path, &len);
+    if (!trace)
+        return 1;
+
+    const struct vuart_trace_hdr *hdr = trace;
+    if (len < sizeof(*hdr) || hdr->magic != VUART_TRACE_MAGIC) {
+        fprintf(stderr, "%s: not a vUART trace\n", path);
+        free(trace);
+        return 1;
+    }
+    printf("%s: ttyS%u, chip=%u, %zu records, %u dropped while recording\n", path, hdr->line, hdr->chip,
+           (len - sizeof(*hdr)) / sizeof(struct vuart_trace_rec), hdr->dropped);
+
+    int out = start_port(hdr);
+    if (out != 0) {
+        fprintf(stderr, "Failed to start ttyS%u: error=%d\n", hdr->line, out);
+        stop_port(hdr);
+        free(trace);
+        return 1;
+    }
+
+    struct vuart_replay_result res, total = { 0 };
+    for (unsigned long i = 0; i < iterations; ++i) {
+        if ((out = vuart_trace_replay(hdr->line, trace, len, &res)) != 0) {
+            fprintf(stderr, "Replay #%lu failed: error=%d\n", i, out);
+            break;
+        }
+        rp_host_fire_timers(); //let the idle/poll timers run between sessions, like they would on a quiet line
+
+        total.records += res.records;
+        total.reads += res.reads;
+        total.writes += res.writes;
+        total.rx_bytes += res.rx_bytes;
+        total.read_mismatches += res.read_mismatches;
+        total.total_ns += res.total_ns;
+    }
+
+    if (out == 0 && total.records) {
+        printf("%llu records (%llu reads, %llu writes, %llu RX bytes) in %llu us => %.1f ns/record; "
+               "%llu read mismatches\n", total.records, total.reads, total.writes, total.rx_bytes,
+               total.total_ns / NSEC_PER_USEC, (double)total.total_ns / total.records, total.read_mismatches);
+        if (hdr->line == REPLAY_PMU_LINE)
+            printf("PMU commands executed: %lu\n", rp_emu_pmu_executed());
+    }
+
+    stop_port(hdr);
+    free(trace);
+
+    return out == 0 ? 0 : 1;
+}
@@ -0,0 +1,253 @@
+/**
+ * Checks the vIRQ delivery in userspace (see host/CMakeLists.txt and internal/uart/vuart_virtual_irq.c)
+ *
+ * Unlike the rest of the emulators this one is built with real vIRQ threads (coroutines, see rp_host.h) & stats. A
+ * minimal 8250 "driver" (interrupt-driven RX & TX, plus console-like polled writes) runs a random mix of traffic on
+ * ttyS0 with and without interrupt coalescing (and with TX idle detection). Afterwards the stats are read from debugfs, just like a user would, and
+ * the following must hold:
+ *  - every wake-up of the vIRQ thread resulted in a call to the interrupt handler (virq_wakeups <= virq_handler_calls)
+ *  - everything injected was received by the driver and everything written was delivered to the TX callback
+ *
+ * Usage: rp_emu_virq [-v] [-n iterations] [-s seed]
+ */
+#include "rp_host.h"
+#include "emu.h"
+#include "../internal/uart/virtual_uart.h"
+#include <linux/serial_reg.h> //UART_*
+#include <unistd.h> //getopt()
+
+#define VIRQ_LINE 0
+#define VIRQ_OPS 2000 //operations per iteration
+#define VIRQ_CHUNK_MAX 64 //max bytes injected/written in a single operation
+#define VIRQ_STATS_BUF 4096
+#define VIRQ_TX_IDLE_CHARS 4
+
+static char tx_cb_buffer[VUART_FIFO_MAX_LEN];
+static struct uart_port *port;
+
+//State of the "driver" & the other end of the line
+static struct {
+    unsigned int ier;
+    unsigned int tx_pending; //bytes written by the app but not yet put into THR
+    u64 tx_written; //bytes put into THR
+    u64 tx_delivered; //bytes which reached the TX callback
+    u64 rx_injected; //bytes accepted by vuart_inject_rx()
+    u64 rx_received; //bytes read by the driver from RHR
+} drv;
+
+static u64 rand_state;
+
+static unsigned int next_rand(unsigned int max)
+{
+    rand_state = rand_state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (unsigned int)(rand_state >> 33) % max;
+}
+
+static void tx_cb(int line, const char *buffer, unsigned int len, vuart_flush_reason reason)
+{
+    drv.tx_delivered += len;
+}
+
+static void set_ier(unsigned int ier)
+{
+    drv.ier = ier;
+    port->serial_out(port, UART_IER, ier);
+}
+
+static void receive_chars(void)
+{
+    for (int i = 0; i < 256 && (port->serial_in(port, UART_LSR) & UART_LSR_DR); ++i) {
+        port->serial_in(port, UART_RX);
+        ++drv.rx_received;
+    }
+}
+
+static void transmit_chars(void)
+{
+    if (!drv.tx_pending) { //like serial8250_stop_tx()
+        set_ier(drv.ier & ~UART_IER_THRI);
+        return;
+    }
+
+    for (int i = 0; i < VUART_FIFO_LEN && drv.tx_pending; ++i) {
+        port->serial_out(port, UART_TX, 'A' + (drv.tx_written & 0x0f));
+        ++drv.tx_written;
+        --drv.tx_pending;
+    }
+}
+
+//This is what the vIRQ calls, just like the real IRQ would call the 8250 driver
+int serial8250_handle_irq(struct uart_port *irq_port, unsigned int iir)
+{
+    if (iir & UART_IIR_NO_INT)
+        return 0;
+
+    unsigned int lsr = irq_port->serial_in(irq_port, UART_LSR);
+    if (lsr & UART_LSR_DR)
+        receive_chars();
+    irq_port->serial_in(irq_port, UART_MSR);
+    if ((lsr & UART_LSR_THRE) && (drv.ier & UART_IER_THRI))
+        transmit_chars();
+
+    return 1;
+}
+
+//Like serial8250_console_write(): IER is masked and every char waits for THRE by polling LSR
+static void console_write(unsigned int len)
+{
+    unsigned int ier = drv.ier;
+    port->serial_out(port, UART_IER, 0);
+    for (unsigned int i = 0; i < len; ++i) {
+        for (int tries = 0; tries < 1000 && !(port->serial_in(port, UART_LSR) & UART_LSR_THRE); ++tries)
+            rp_host_fire_timers(); //on a real box time would pass while polling
+        port->serial_out(port, UART_TX, '.');
+        ++drv.tx_written;
+    }
+    set_ier(ier);
+}
+
+static void run_op(void)
+{
+    char buf[VIRQ_CHUNK_MAX];
+    unsigned int len = 1 + next_rand(VIRQ_CHUNK_MAX);
+    int out;
+
+    switch (next_rand(6)) {
+        case 0: //the other end sends something
+            memset(buf, 'r', len);
+            if ((out = vuart_inject_rx(VIRQ_LINE, buf, len)) > 0)
+                drv.rx_injected += out;
+            break;
+        case 1: //an app writes to the tty => driver starts TX
+            drv.tx_pending += len;
+            if (!(drv.ier & UART_IER_THRI))
+                set_ier(drv.ier | UART_IER_THRI);
+            break;
+        case 2:
+            console_write(len % 8);
+            break;
+        case 3: //someone polls the chip without servicing it
+            port->serial_in(port, UART_IIR);
+            port->serial_in(port, UART_LSR);
+            break;
+        case 4: //time passes
+            rp_host_fire_timers();
+            break;
+        case 5: //coalescing is toggled from time to time
+            if (next_rand(8) == 0) {
+                unsigned int bytes = next_rand(2) ? 1 + next_rand(VUART_FIFO_LEN) : 0;
+                vuart_set_irq_coalescing(VIRQ_LINE, bytes, bytes ? 50 + next_rand(500) : 0);
+            }
+            break;
+    }
+}
+
+//Lets everything in flight settle: the driver keeps its ports open & time passes until nothing is pending anymore
+static void drain(void)
+{
+    for (int i = 0; i < 1000 && (drv.tx_pending || drv.rx_received < drv.rx_injected ||
+                                 drv.tx_delivered < drv.tx_written); ++i)
+        rp_host_fire_timers();
+}
+
+static long long get_stat(const char *stats, const char *name)
+{
+    size_t name_len = strlen(name);
+    for (const char *line = stats; line && *line; line = strchr(line, '\n') ? strchr(line, '\n') + 1 : NULL) {
+        if (strncmp(line, name, name_len) == 0 && line[name_len] == ' ')
+            return strtoll(line + name_len + 1, NULL, 10);
+    }
+
+    return -1;
+}
+
+static int run_iteration(unsigned long iteration)
+{
+    int out;
+    memset(&drv, 0, sizeof(drv));
+
+    //Without the idle timeout console writes which are shorter than the threshold would wait for the driver's next TX
+    if ((out = vuart_add_device(VIRQ_LINE, VUART_CHIP_16550A)) != 0 ||
+        (out = vuart_set_tx_callback(VIRQ_LINE, tx_cb, tx_cb_buffer, VUART_FIFO_LEN)) != 0 ||
+        (out = vuart_set_tx_idle_timeout(VIRQ_LINE, VIRQ_TX_IDLE_CHARS)) != 0) {
+        fprintf(stderr, "Failed to add ttyS%d: error=%d\n", VIRQ_LINE, out);
+        vuart_remove_device(VIRQ_LINE);
+        return 1;
+    }
+
+    //Like serial8250_startup() + set_termios()
+    port = rp_host_uart_port(VIRQ_LINE);
+    port->serial_out(port, UART_FCR, UART_FCR_ENABLE_FIFO | UART_FCR_CLEAR_RCVR | UART_FCR_CLEAR_XMIT);
+    port->serial_out(port, UART_LCR, UART_LCR_WLEN8);
+    port->serial_out(port, UART_MCR, UART_MCR_OUT2 | UART_MCR_RTS | UART_MCR_DTR);
+    set_ier(UART_IER_RDI | UART_IER_RLSI);
+
+    for (int i = 0; i < VIRQ_OPS; ++i)
+        run_op();
+    drain();
+
+    char stats[VIRQ_STATS_BUF];
+    char dir[8];
+    snprintf(dir, sizeof(dir), "ttyS%d", VIRQ_LINE);
+    ssize_t len = rp_host_debugfs_read(dir, "stats", stats, sizeof(stats));
+    long long wakeups = len > 0 ? get_stat(stats, "virq_wakeups") : -1;
+    long long calls = len > 0 ? get_stat(stats, "virq_handler_calls") : -1;
+    vuart_remove_device(VIRQ_LINE);
+
+    int failed = 0;
+    if (wakeups < 0 || calls < 0) {
+        fprintf(stderr, "#%lu: failed to read vIRQ stats (error=%zd)\n", iteration, len);
+        return 1;
+    }
+
+    if (wakeups > calls) {
+        fprintf(stderr, "#%lu: vIRQ woken up %lld times but the handler was called only %lld times\n", iteration,
+                wakeups, calls);
+        failed = 1;
+    }
+
+    if (drv.rx_received != drv.rx_injected || drv.tx_delivered != drv.tx_written) {
+        fprintf(stderr, "#%lu: RX %llu/%llu bytes received, TX %llu/%llu bytes delivered\n", iteration,
+                (unsigned long long)drv.rx_received, (unsigned long long)drv.rx_injected,
+                (unsigned long long)drv.tx_delivered, (unsigned long long)drv.tx_written);
+        failed = 1;
+    }
+
+    if (rp_host_verbose)
+        printf("#%lu: wakeups=%lld handler_calls=%lld rx=%llu tx=%llu\n", iteration, wakeups, calls,
+               (unsigned long long)drv.rx_received, (unsigned long long)drv.tx_written);
+
+    return failed;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long iterations = 20;
+    unsigned long seed = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "vn:s:")) != -1) {
+        if (opt == 'v')
+            rp_host_set_verbose(true);
+        else if (opt == 'n')
+            iterations = strtoul(optarg, NULL, 10);
+        else if (opt == 's')
+            seed = strtoul(optarg, NULL, 10);
+        else
+            iterations = 0; //invalid option => usage
+    }
+
+    if (!iterations || optind != argc) {
+        fprintf(stderr, "Usage: %s [-v] [-n iterations] [-s seed]\n", argv[0]);
+        return 2;
+    }
+
+    unsigned long failures = 0;
+    for (unsigned long i = 0; i < iterations; ++i) {
+        rand_state = seed + i;
+        failures += run_iteration(i);
+    }
+
+    printf("%lu iterations (seed=%lu), %lu failed\n", iterations, seed, failures);
+    return failures ? 1 : 0;
+}
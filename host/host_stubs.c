@@ -0,0 +1,788 @@
+/**
+ * Link-time side of the userspace stubs (see include/rp_host.h)
+ *
+ * Besides kernel primitives this file plays the role of the kernel subsystems the emulators talk to: the 8250 driver
+ * (ports registration), the PCI core (bus scanning) and /proc/cmdline. Their state can be inspected and driven using
+ * the rp_host_*() functions.
+ */
+#include "rp_host.h"
+#include "emu.h"
+#include "../config/cmdline_delegate.h" //CMDLINE_MAX
+#include "../debug/debug_trace.h" //rp_dbg_key
+#include "../internal/call_protected.h" //_cmdline_proc_show()
+#include "../internal/intercept_driver_register.h" //is_driver_registered() & friends
+#include "../internal/thread_placement.h" //alloc_placed_workqueue()
+#include "../internal/debugfs_root.h" //get_debugfs_root()
+#include <stdarg.h>
+#include <linux/pci_regs.h> //PCI_VENDOR_ID, PCI_HEADER_TYPE
+
+/******************************************************* Logging ******************************************************/
+bool rp_host_verbose = false;
+struct static_key rp_dbg_key = STATIC_KEY_INIT_FALSE;
+
+void rp_host_printk(int level, const char *fmt, ...)
+{
+    if (!rp_host_verbose)
+        return;
+
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+}
+
+void rp_host_set_verbose(bool verbose)
+{
+    rp_host_verbose = verbose;
+    rp_dbg_key.enabled = verbose;
+}
+
+/******************************************************** kfifo *******************************************************/
+int __kfifo_alloc(struct __kfifo *fifo, unsigned int size, unsigned int esize)
+{
+    fifo->in = fifo->out = 0;
+    fifo->esize = esize;
+
+    size = roundup_pow_of_two(size);
+    if (size < 2) {
+        fifo->data = NULL;
+        fifo->mask = 0;
+        return -EINVAL;
+    }
+
+    fifo->data = kmalloc(size * esize, GFP_KERNEL);
+    if (!fifo->data) {
+        fifo->mask = 0;
+        return -ENOMEM;
+    }
+    fifo->mask = size - 1;
+
+    return 0;
+}
+
+int __kfifo_init(struct __kfifo *fifo, void *buffer, unsigned int size, unsigned int esize)
+{
+    size /= esize;
+    if (size & (size - 1))
+        size = roundup_pow_of_two(size) >> 1; //like the kernel: rounds down, never beyond the buffer
+
+    fifo->in = fifo->out = 0;
+    fifo->esize = esize;
+    fifo->data = buffer;
+    if (size < 2) {
+        fifo->mask = 0;
+        return -EINVAL;
+    }
+    fifo->mask = size - 1;
+
+    return 0;
+}
+
+void __kfifo_free(struct __kfifo *fifo)
+{
+    kfree(fifo->data);
+    fifo->in = fifo->out = fifo->esize = fifo->mask = 0;
+    fifo->data = NULL;
+}
+
+/**
+ * Copies len elements between the ring and a flat buffer, wrapping around the end of the ring if needed
+ */
+static void kfifo_copy(struct __kfifo *fifo, void *flat, unsigned int len, unsigned int off, bool to_ring)
+{
+    unsigned int size = fifo->mask + 1;
+    unsigned int esize = fifo->esize;
+
+    off &= fifo->mask;
+    unsigned int first = min(len, size - off);
+    char *ring = fifo->data;
+
+    if (to_ring) {
+        memcpy(ring + off * esize, flat, first * esize);
+        memcpy(ring, (char *)flat + first * esize, (len - first) * esize);
+    } else {
+        memcpy(flat, ring + off * esize, first * esize);
+        memcpy((char *)flat + first * esize, ring, (len - first) * esize);
+    }
+}
+
+unsigned int __kfifo_in(struct __kfifo *fifo, const void *buf, unsigned int len)
+{
+    unsigned int avail = (fifo->mask + 1) - (fifo->in - fifo->out);
+    if (len > avail)
+        len = avail;
+
+    kfifo_copy(fifo, (void *)buf, len, fifo->in, true);
+    fifo->in += len;
+
+    return len;
+}
+
+unsigned int __kfifo_out(struct __kfifo *fifo, void *buf, unsigned int len)
+{
+    unsigned int used = fifo->in - fifo->out;
+    if (len > used)
+        len = used;
+
+    kfifo_copy(fifo, buf, len, fifo->out, false);
+    fifo->out += len;
+
+    return len;
+}
+
+/******************************************************* hrtimer ******************************************************/
+static struct hrtimer *active_timers = NULL;
+s64 rp_host_clock_skew_ns = 0;
+
+static void unlink_timer(struct hrtimer *timer)
+{
+    for (struct hrtimer **curr = &active_timers; *curr; curr = &(*curr)->next_active) {
+        if (*curr == timer) {
+            *curr = timer->next_active;
+            break;
+        }
+    }
+
+    timer->active = false;
+    timer->next_active = NULL;
+}
+
+void hrtimer_init(struct hrtimer *timer, int clock_id, enum hrtimer_mode mode)
+{
+    memset(timer, 0, sizeof(*timer));
+}
+
+void hrtimer_start(struct hrtimer *timer, ktime_t tim, const enum hrtimer_mode mode)
+{
+    timer->expires = mode == HRTIMER_MODE_REL ? ktime_get() + tim : tim;
+    if (timer->active)
+        return; //restarting only changes the expiry
+
+    timer->active = true;
+    timer->next_active = active_timers;
+    active_timers = timer;
+}
+
+int hrtimer_cancel(struct hrtimer *timer)
+{
+    if (!timer->active)
+        return 0;
+
+    unlink_timer(timer);
+    return 1;
+}
+
+unsigned int rp_host_fire_timers(void)
+{
+    unsigned int fired = 0;
+    while (active_timers) {
+        struct hrtimer *timer = active_timers;
+        unlink_timer(timer);
+        ktime_t now = ktime_get();
+        if (now < timer->expires)
+            rp_host_clock_skew_ns += timer->expires - now;
+        if (timer->function(timer) == HRTIMER_RESTART)
+            hrtimer_start(timer, timer->expires, HRTIMER_MODE_ABS);
+        ++fired;
+    }
+
+    return fired;
+}
+
+/****************************************************** Workqueue *****************************************************/
+struct workqueue_struct {
+    const char *name;
+};
+
+struct workqueue_struct *alloc_ordered_workqueue(const char *name, unsigned int flags)
+{
+    struct workqueue_struct *wq = kmalloc(sizeof(struct workqueue_struct), GFP_KERNEL);
+    if (wq)
+        wq->name = name;
+
+    return wq;
+}
+
+struct workqueue_struct *alloc_placed_workqueue(const char *name)
+{
+    return alloc_ordered_workqueue(name, 0); //works are run synchronously - there's nothing to place
+}
+
+void place_thread(struct task_struct *task)
+{
+    //there's a single CPU
+}
+
+void destroy_workqueue(struct workqueue_struct *wq)
+{
+    kfree(wq);
+}
+
+unsigned int rp_host_locks_held = 0;
+static struct work_struct *pending_works = NULL;
+static struct work_struct **pending_works_tail = &pending_works;
+
+bool queue_work(struct workqueue_struct *wq, struct work_struct *work)
+{
+    if (work->pending)
+        return false;
+
+    if (!rp_host_locks_held) {
+        work->func(work);
+        return true;
+    }
+
+    work->pending = true;
+    work->next_pending = NULL;
+    *pending_works_tail = work;
+    pending_works_tail = &work->next_pending;
+    return true;
+}
+
+static struct work_struct *pop_pending_work(struct work_struct *work)
+{
+    for (struct work_struct **curr = &pending_works; *curr; curr = &(*curr)->next_pending) {
+        if (!work || *curr == work) {
+            struct work_struct *found = *curr;
+            *curr = found->next_pending;
+            if (!*curr)
+                pending_works_tail = curr;
+            found->pending = false;
+            found->next_pending = NULL;
+            return found;
+        }
+    }
+
+    return NULL;
+}
+
+static bool run_tasks(void);
+
+void rp_host_run_deferred_work(void)
+{
+    struct work_struct *work;
+    do {
+        while (!rp_host_locks_held && (work = pop_pending_work(NULL)))
+            work->func(work); //new works queued by it are added at the end
+    } while (run_tasks()); //threads may queue more works
+}
+
+bool cancel_work_sync(struct work_struct *work)
+{
+    return pop_pending_work(work) != NULL;
+}
+
+/******************************************************* Threads ******************************************************/
+#define TASK_STACK_SIZE (256 * 1024)
+#define MAX_TASKS 16
+
+struct task_struct rp_host_main_task = { .pid = 1 };
+struct task_struct *rp_host_current = NULL;
+static ucontext_t main_ctx;
+static struct task_struct *tasks[MAX_TASKS] = { NULL };
+static bool tasks_runnable = false; //whether any task may be runnable (avoids scanning on every unlock)
+static int last_pid = 1;
+
+static void task_entry(void)
+{
+    struct task_struct *task = rp_host_current;
+    task->exit_code = task->fn(task->data);
+    task->exited = true;
+    task->runnable = false;
+} //returning switches back to main_ctx (uc_link)
+
+static void switch_to_task(struct task_struct *task)
+{
+    rp_host_current = task;
+    swapcontext(&main_ctx, &task->ctx);
+    rp_host_current = NULL;
+}
+
+/**
+ * Runs all runnable tasks until they wait or exit; only the main thread schedules, and only when no lock is held
+ *
+ * @return whether anything was run
+ */
+static bool run_tasks(void)
+{
+    bool ran = false;
+    while (tasks_runnable && !rp_host_current && !rp_host_locks_held) {
+        tasks_runnable = false;
+        for (int i = 0; i < MAX_TASKS; ++i) {
+            if (tasks[i] && tasks[i]->runnable && !rp_host_locks_held) {
+                switch_to_task(tasks[i]);
+                ran = true;
+            }
+        }
+    }
+
+    return ran;
+}
+
+static void make_runnable(struct task_struct *task)
+{
+    task->runnable = true;
+    tasks_runnable = true;
+}
+
+struct task_struct *kthread_create(int (*fn)(void *data), void *data, const char *namefmt, ...)
+{
+    int slot = 0;
+    while (slot < MAX_TASKS && tasks[slot])
+        ++slot;
+    if (slot == MAX_TASKS)
+        return ERR_PTR(-EAGAIN);
+
+    struct task_struct *task = kzalloc(sizeof(struct task_struct), GFP_KERNEL);
+    if (!task || !(task->stack = kmalloc(TASK_STACK_SIZE, GFP_KERNEL))) {
+        kfree(task);
+        return ERR_PTR(-ENOMEM);
+    }
+
+    task->pid = ++last_pid;
+    task->fn = fn;
+    task->data = data;
+    getcontext(&task->ctx);
+    task->ctx.uc_stack.ss_sp = task->stack;
+    task->ctx.uc_stack.ss_size = TASK_STACK_SIZE;
+    task->ctx.uc_link = &main_ctx;
+    makecontext(&task->ctx, task_entry, 0);
+    tasks[slot] = task;
+
+    return task; //like in the kernel it doesn't run until woken up
+}
+
+int wake_up_process(struct task_struct *task)
+{
+    if (task->runnable || task->exited)
+        return 0;
+
+    make_runnable(task);
+    run_tasks();
+    return 1;
+}
+
+bool kthread_should_stop(void)
+{
+    return rp_host_current && rp_host_current->should_stop;
+}
+
+static void unlink_waiting(struct task_struct *task)
+{
+    if (!task->waiting_on)
+        return;
+
+    for (struct task_struct **curr = &task->waiting_on->waiters; *curr; curr = &(*curr)->next_waiting) {
+        if (*curr == task) {
+            *curr = task->next_waiting;
+            break;
+        }
+    }
+    task->waiting_on = NULL;
+    task->next_waiting = NULL;
+}
+
+int kthread_stop(struct task_struct *task)
+{
+    if (rp_host_current) {
+        fprintf(stderr, "%s() can only be called from the main thread\n", __FUNCTION__);
+        abort();
+    }
+
+    task->should_stop = true;
+    while (!task->exited) { //it cannot wait for a lock held by us - there are no sleeping locks
+        unlink_waiting(task);
+        switch_to_task(task);
+    }
+
+    for (int i = 0; i < MAX_TASKS; ++i) {
+        if (tasks[i] == task)
+            tasks[i] = NULL;
+    }
+
+    int out = task->exit_code;
+    kfree(task->stack);
+    kfree(task);
+    return out;
+}
+
+void wake_up_interruptible(wait_queue_head_t *wq)
+{
+    while (wq->waiters) {
+        struct task_struct *task = wq->waiters;
+        unlink_waiting(task);
+        make_runnable(task);
+    }
+
+    run_tasks();
+}
+
+void rp_host_wait(wait_queue_head_t *wq)
+{
+    struct task_struct *task = rp_host_current;
+    if (!task || rp_host_locks_held) {
+        fprintf(stderr, "%s() called from the main thread or with a lock held\n", __FUNCTION__);
+        abort();
+    }
+
+    task->runnable = false;
+    task->waiting_on = wq;
+    task->next_waiting = wq->waiters;
+    wq->waiters = task;
+    swapcontext(&task->ctx, &main_ctx); //returns when woken up (or stopped)
+}
+
+/****************************************************** seq_file ******************************************************/
+#define SEQ_BUF_LEN (4 * PAGE_SIZE)
+
+void seq_printf(struct seq_file *m, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(m->buf + m->count, m->size - m->count, fmt, args);
+    va_end(args);
+
+    //Just like the kernel: on overflow the buffer is marked as full
+    m->count = (len < 0 || len >= m->size - m->count) ? m->size : m->count + len;
+}
+
+int single_open(struct file *file, int (*show)(struct seq_file *m, void *v), void *data)
+{
+    struct seq_file *m = kzalloc(sizeof(struct seq_file), GFP_KERNEL);
+    if (!m)
+        return -ENOMEM;
+
+    m->show = show;
+    m->private = data;
+    file->private_data = m;
+    return 0;
+}
+
+int single_release(struct inode *inode, struct file *file)
+{
+    struct seq_file *m = file->private_data;
+    kfree(m->buf);
+    kfree(m);
+    return 0;
+}
+
+ssize_t seq_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
+{
+    struct seq_file *m = file->private_data;
+    if (!m->buf) {
+        if (!(m->buf = kmalloc(SEQ_BUF_LEN, GFP_KERNEL)))
+            return -ENOMEM;
+        m->size = SEQ_BUF_LEN;
+
+        int out = m->show(m, NULL);
+        if (out < 0)
+            return out;
+    }
+
+    size_t len = (*ppos < m->count) ? min(count, m->count - (size_t)*ppos) : 0;
+    memcpy(buf, m->buf + *ppos, len);
+    *ppos += len;
+    return len;
+}
+
+loff_t seq_lseek(struct file *file, loff_t offset, int whence)
+{
+    return -ESPIPE;
+}
+
+/******************************************************* debugfs ******************************************************/
+struct dentry {
+    char name[32];
+    struct dentry *parent;
+    void *data;
+    const struct file_operations *fops; //NULL for directories
+    struct dentry *next; //list of all entries
+    bool removed;
+};
+
+static struct dentry *dentries = NULL;
+static struct dentry *debugfs_root = NULL;
+static unsigned int debugfs_root_users = 0;
+
+static struct dentry *create_dentry(const char *name, struct dentry *parent, void *data,
+                                    const struct file_operations *fops)
+{
+    struct dentry *dentry = kzalloc(sizeof(struct dentry), GFP_KERNEL);
+    if (!dentry)
+        return ERR_PTR(-ENOMEM);
+
+    strscpy(dentry->name, name, sizeof(dentry->name));
+    dentry->parent = parent;
+    dentry->data = data;
+    dentry->fops = fops;
+    dentry->next = dentries;
+    dentries = dentry;
+    return dentry;
+}
+
+struct dentry *debugfs_create_dir(const char *name, struct dentry *parent)
+{
+    return create_dentry(name, parent, NULL, NULL);
+}
+
+struct dentry *debugfs_create_file(const char *name, unsigned short mode, struct dentry *parent, void *data,
+                                   const struct file_operations *fops)
+{
+    return create_dentry(name, parent, data, fops);
+}
+
+void debugfs_remove_recursive(struct dentry *dentry)
+{
+    if (IS_ERR_OR_NULL(dentry))
+        return;
+
+    //Marking first as parents must stay valid while checking the ancestry
+    for (struct dentry *curr = dentries; curr; curr = curr->next) {
+        for (struct dentry *anc = curr; anc; anc = anc->parent) {
+            if (anc == dentry) {
+                curr->removed = true;
+                break;
+            }
+        }
+    }
+
+    for (struct dentry **curr = &dentries; *curr;) {
+        struct dentry *found = *curr;
+        if (!found->removed) {
+            curr = &found->next;
+            continue;
+        }
+
+        *curr = found->next;
+        kfree(found);
+    }
+}
+
+struct dentry *get_debugfs_root(void)
+{
+    if (!debugfs_root) {
+        debugfs_root = debugfs_create_dir(KBUILD_MODNAME, NULL);
+        if (IS_ERR(debugfs_root)) {
+            struct dentry *err = debugfs_root;
+            debugfs_root = NULL;
+            return err;
+        }
+    }
+
+    ++debugfs_root_users;
+    return debugfs_root;
+}
+
+void put_debugfs_root(void)
+{
+    if (!debugfs_root_users || --debugfs_root_users)
+        return;
+
+    debugfs_remove_recursive(debugfs_root);
+    debugfs_root = NULL;
+}
+
+ssize_t rp_host_debugfs_read(const char *dir, const char *name, char *buf, size_t size)
+{
+    struct dentry *dentry = dentries;
+    while (dentry && (!dentry->fops || !dentry->parent || strcmp(dentry->name, name) != 0 ||
+                      strcmp(dentry->parent->name, dir) != 0))
+        dentry = dentry->next;
+
+    if (!dentry || !size)
+        return -ENOENT;
+
+    struct inode inode = { .i_private = dentry->data };
+    struct file file = { .private_data = NULL };
+    int out = dentry->fops->open ? dentry->fops->open(&inode, &file) : 0;
+    if (out != 0)
+        return out;
+
+    ssize_t total = 0;
+    loff_t pos = 0;
+    while (total < size - 1) {
+        ssize_t len = dentry->fops->read(&file, buf + total, size - 1 - total, &pos);
+        if (len <= 0) {
+            if (len < 0)
+                total = len;
+            break;
+        }
+        total += len;
+    }
+
+    if (total >= 0)
+        buf[total] = '\0';
+    if (dentry->fops->release)
+        dentry->fops->release(&inode, &file);
+
+    return total;
+}
+
+/****************************************************** 8250 UART *****************************************************/
+static struct uart_port uart_ports[CONFIG_SERIAL_8250_NR_UARTS];
+static bool uart_ports_used[CONFIG_SERIAL_8250_NR_UARTS];
+
+int serial8250_register_8250_port(struct uart_8250_port *up)
+{
+    if (up->port.line >= CONFIG_SERIAL_8250_NR_UARTS)
+        return -EINVAL;
+
+    //Like the real driver we copy what we need; the caller frees its structure right after
+    uart_ports[up->port.line] = up->port;
+    spin_lock_init(&uart_ports[up->port.line].lock);
+    uart_ports_used[up->port.line] = true;
+
+    return up->port.line;
+}
+
+struct uart_port *rp_host_uart_port(int line)
+{
+    if (line < 0 || line >= CONFIG_SERIAL_8250_NR_UARTS || !uart_ports_used[line])
+        return NULL;
+
+    return &uart_ports[line];
+}
+
+int is_driver_registered(const char *name, struct bus_type *bus)
+{
+    return 1; //the "8250 driver" is always there
+}
+
+driver_watcher_instance *watch_driver_register(const char *name, watch_dr_callback *cb, int event_mask)
+{
+    return ERR_PTR(-ENOSYS);
+}
+
+int unwatch_driver_register(driver_watcher_instance *instance)
+{
+    return -ENOSYS;
+}
+
+/******************************************************* Cmdline ******************************************************/
+static char host_cmdline[CMDLINE_MAX * 2] = { '\0' }; //allows testing truncation
+
+void rp_host_set_cmdline(const char *cmdline, size_t len)
+{
+    if (len >= sizeof(host_cmdline))
+        len = sizeof(host_cmdline) - 1;
+
+    memcpy(host_cmdline, cmdline, len);
+    host_cmdline[len] = '\0';
+}
+
+int _cmdline_proc_show(struct seq_file *m, void *v)
+{
+    //seq_printf(m, "%s\n", saved_command_line) - on overflow the kernel marks the buffer as full
+    int len = snprintf(m->buf + m->count, m->size - m->count, "%s\n", host_cmdline);
+    m->count = (len < 0 || len >= m->size - m->count) ? m->size : m->count + len;
+
+    return 0;
+}
+
+/********************************************************* PCI ********************************************************/
+static struct pci_bus *pci_buses[256] = { NULL };
+
+static bool pci_bus_has_devfn(struct pci_bus *bus, unsigned int devfn)
+{
+    struct pci_dev *dev;
+    list_for_each_entry(dev, &bus->devices, bus_list) {
+        if (dev->devfn == devfn)
+            return true;
+    }
+
+    return false;
+}
+
+/**
+ * Probes every devfn on the bus (VID+DID dword, like pci_bus_read_dev_vendor_id() does) and adds new devices
+ *
+ * Just like the real core it looks at further functions of a device only if its function 0 exists & is multifunction.
+ */
+static unsigned int pci_scan_devices(struct pci_bus *bus)
+{
+    unsigned int found = 0;
+
+    for (unsigned int slot = 0; slot < 32; ++slot) {
+        for (unsigned int fn = 0; fn < 8; ++fn) {
+            unsigned int devfn = PCI_DEVFN(slot, fn);
+            u32 l = 0;
+            if (bus->ops->read(bus, devfn, PCI_VENDOR_ID, 4, &l) != PCIBIOS_SUCCESSFUL || l == 0xffffffff ||
+                l == 0x00000000 || l == 0x0000ffff || l == 0xffff0000) {
+                if (fn == 0)
+                    break;
+                continue;
+            }
+
+            if (!pci_bus_has_devfn(bus, devfn)) {
+                struct pci_dev *dev = kzalloc(sizeof(struct pci_dev), GFP_KERNEL);
+                if (!dev)
+                    return found;
+
+                dev->devfn = devfn;
+                dev->bus = bus;
+                list_add_tail(&dev->bus_list, &bus->devices);
+                ++found;
+            }
+
+            u32 hdr = 0;
+            if (fn == 0 && (bus->ops->read(bus, devfn, PCI_HEADER_TYPE, 1, &hdr) != PCIBIOS_SUCCESSFUL ||
+                            !(hdr & 0x80)))
+                break;
+        }
+    }
+
+    return found;
+}
+
+struct pci_bus *pci_scan_bus(int bus_no, struct pci_ops *ops, void *sysdata)
+{
+    if (bus_no < 0 || bus_no > 0xff || pci_buses[bus_no])
+        return NULL;
+
+    struct pci_bus *bus = kzalloc(sizeof(struct pci_bus), GFP_KERNEL);
+    if (!bus)
+        return NULL;
+
+    bus->number = bus_no;
+    bus->ops = ops;
+    bus->sysdata = sysdata;
+    INIT_LIST_HEAD(&bus->devices);
+    pci_scan_devices(bus);
+    pci_buses[bus_no] = bus;
+
+    return bus;
+}
+
+unsigned int pci_rescan_bus(struct pci_bus *bus)
+{
+    pci_scan_devices(bus);
+    return 0;
+}
+
+void pci_bus_add_devices(const struct pci_bus *bus)
+{
+    struct pci_dev *dev;
+    list_for_each_entry(dev, &bus->devices, bus_list)
+        dev->is_added = true;
+}
+
+void pci_stop_and_remove_bus_device(struct pci_dev *dev)
+{
+    list_del(&dev->bus_list);
+    kfree(dev);
+}
+
+void pci_remove_bus(struct pci_bus *bus)
+{
+    struct pci_dev *dev, *dev_n;
+    list_for_each_entry_safe(dev, dev_n, &bus->devices, bus_list)
+        pci_stop_and_remove_bus_device(dev);
+
+    pci_buses[bus->number] = NULL;
+    kfree(bus);
+}
+
+struct pci_bus *rp_host_pci_bus(unsigned char number)
+{
+    return pci_buses[number];
+}
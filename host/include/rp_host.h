@@ -0,0 +1,785 @@
+#ifndef REDPILL_RP_HOST_H
+#define REDPILL_RP_HOST_H
+
+/**
+ * Userspace stand-ins for the kernel primitives used by the emulators (vUART, vPMU, vPCI & cmdline parser)
+ *
+ * This header is NOT a kernel compatibility layer - it implements just enough for the selected sources of the module to
+ * compile & behave the same way in a userspace process (see host/CMakeLists.txt). Every linux/ and asm/ header the
+ * emulators include is generated by CMake as a one-liner including this file. UAPI headers which exist in
+ * userspace (e.g. <linux/serial_reg.h> or <linux/pci_regs.h>) are intentionally NOT shadowed.
+ *
+ * Semantics worth knowing when reading benchmark/fuzzing results:
+ *  - everything runs in a single thread; spinlocks are real (uncontended) atomics, IRQ flags are not saved
+ *  - work items are executed synchronously when queued, unless a lock is held - then they're run as soon as the last
+ *    one is released (i.e. PMU command handlers run right after the vUART register access which flushed the command)
+ *  - hrtimers never fire on their own (rp_host_fire_timers() expires all pending ones, moving the clock forward)
+ *  - kthreads are coroutines: a woken up thread runs (until it waits again) as soon as no lock is held, so e.g. a vIRQ
+ *    runs right after the register access which raised the interrupt and never in the middle of one
+ *  - there's a single CPU, so per-CPU data is just one copy of it
+ *  - kmalloc() & friends are malloc() & friends
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <ucontext.h> //kthreads
+#include <sys/types.h> //ssize_t
+
+#ifndef LINUX_VERSION_CODE
+#define LINUX_VERSION_CODE 263227 //4.4.x, i.e. the newest kernel the module supports
+#endif
+#define KERNEL_VERSION(a,b,c) (((a) << 16) + ((b) << 8) + (c))
+
+/******************************************************* Types ********************************************************/
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef unsigned long long u64; //like in the kernel (matters for printf formats)
+typedef int8_t s8;
+typedef int16_t s16;
+typedef int32_t s32;
+typedef long long s64;
+typedef uint8_t __u8;
+typedef uint16_t __u16;
+typedef uint32_t __u32;
+typedef uint64_t __u64;
+typedef unsigned int gfp_t;
+typedef s64 ktime_t;
+typedef unsigned int upf_t;
+
+#define GFP_KERNEL 0
+#define GFP_ATOMIC 0
+
+/*************************************************** Compiler stuff ***************************************************/
+#define __init
+#define __exit
+#define __initdata
+#define __initconst
+#define __refdata
+#define __user
+#define __percpu
+#define __iomem
+#define __must_check __attribute__((warn_unused_result))
+#define __maybe_unused __attribute__((unused))
+#define __packed __attribute__((packed))
+#define __aligned(x) __attribute__((aligned(x)))
+#define SMP_CACHE_BYTES 64
+#define ____cacheline_aligned_in_smp __attribute__((aligned(SMP_CACHE_BYTES)))
+#ifndef __always_inline //glibc has its own
+#define __always_inline inline __attribute__((always_inline))
+#endif
+#define noinline __attribute__((noinline))
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#define barrier() __asm__ __volatile__("" ::: "memory")
+#define smp_mb() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define smp_rmb() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define smp_wmb() __atomic_thread_fence(__ATOMIC_RELEASE)
+#define ACCESS_ONCE(x) (*(volatile typeof(x) *)&(x))
+
+#define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
+#define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+#define BITS_PER_LONG (sizeof(long) * 8)
+#define BIT(nr) (1UL << (nr))
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+#define ALIGN(x, a) (((x) + (a) - 1) & ~((typeof(x))(a) - 1))
+#define PAGE_SIZE 4096UL
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define min_t(t, a, b) min((t)(a), (t)(b))
+#define max_t(t, a, b) max((t)(a), (t)(b))
+
+#define NSEC_PER_USEC 1000L
+#define NSEC_PER_MSEC 1000000L
+#define NSEC_PER_SEC 1000000000L
+#define USEC_PER_SEC 1000000L
+
+/*************************************************** Module plumbing **************************************************/
+struct module;
+#define THIS_MODULE ((struct module *)NULL)
+#define KBUILD_MODNAME "redpill"
+#define MODULE_AUTHOR(x)
+#define MODULE_LICENSE(x)
+#define MODULE_PARM_DESC(n, d)
+#define module_param(n, t, p)
+#define module_param_named(n, v, t, p)
+#define module_init(f)
+#define module_exit(f)
+#define EXPORT_SYMBOL(s)
+
+/******************************************************* Logging ******************************************************/
+#define RP_HOST_LOG_ERR 3
+#define RP_HOST_LOG_INF 6
+
+/**
+ * Kernel log replacement; messages are printed to stderr only when rp_host_verbose is set (benchmarks & fuzzing are
+ * expected to trigger error messages a lot)
+ */
+extern bool rp_host_verbose;
+void rp_host_printk(int level, const char *fmt, ...);
+
+#define pr_fmt(fmt) fmt
+#define printk(fmt, ...) rp_host_printk(RP_HOST_LOG_INF, fmt, ##__VA_ARGS__)
+#define pr_crit(fmt, ...) rp_host_printk(RP_HOST_LOG_ERR, fmt, ##__VA_ARGS__)
+#define pr_err(fmt, ...) rp_host_printk(RP_HOST_LOG_ERR, fmt, ##__VA_ARGS__)
+#define pr_warn(fmt, ...) rp_host_printk(RP_HOST_LOG_INF, fmt, ##__VA_ARGS__)
+#define pr_info(fmt, ...) rp_host_printk(RP_HOST_LOG_INF, fmt, ##__VA_ARGS__)
+
+//See debug/debug_trace.h - on the host it's a plain flag
+struct static_key {
+    int enabled;
+};
+#define STATIC_KEY_INIT_FALSE { .enabled = 0 }
+#define static_key_false(key) unlikely((key)->enabled)
+#define static_key_true(key) likely((key)->enabled)
+
+/****************************************************** Errors ********************************************************/
+#define MAX_ERRNO 4095
+#define IS_ERR_VALUE(x) unlikely((unsigned long)(void *)(x) >= (unsigned long)-MAX_ERRNO)
+static inline void *ERR_PTR(long error) { return (void *)error; }
+static inline long PTR_ERR(const void *ptr) { return (long)ptr; }
+static inline bool IS_ERR(const void *ptr) { return IS_ERR_VALUE((unsigned long)ptr); }
+static inline bool IS_ERR_OR_NULL(const void *ptr) { return unlikely(!ptr) || IS_ERR_VALUE((unsigned long)ptr); }
+
+/****************************************************** Memory ********************************************************/
+#define kmalloc(size, flags) malloc(size)
+#define kzalloc(size, flags) calloc(1, size)
+#define kcalloc(n, size, flags) calloc(n, size)
+#define kfree(ptr) free((void *)(ptr))
+#define vmalloc(size) malloc(size)
+#define vfree(ptr) free(ptr)
+
+#define alloc_percpu(type) ((type *)calloc(1, sizeof(type)))
+#define free_percpu(ptr) free(ptr)
+#define per_cpu_ptr(ptr, cpu) ((void)(cpu), (ptr))
+#define for_each_possible_cpu(cpu) for ((cpu) = 0; (cpu) < 1; ++(cpu))
+#define this_cpu_inc(var) (++(var))
+#define this_cpu_add(var, val) ((var) += (val))
+
+/****************************************************** Strings *******************************************************/
+static inline ssize_t strscpy(char *dest, const char *src, size_t count)
+{
+    if (unlikely(count == 0))
+        return -E2BIG;
+
+    size_t len = strnlen(src, count);
+    if (len == count) {
+        memcpy(dest, src, count - 1);
+        dest[count - 1] = '\0';
+        return -E2BIG;
+    }
+
+    memcpy(dest, src, len + 1);
+    return len;
+}
+
+//kstrto*() accept a single trailing newline and nothing else after the number
+static inline int rp_host_kstrto_end(const char *s, const char *end)
+{
+    if (end == s)
+        return -EINVAL;
+
+    if (*end == '\n')
+        ++end;
+
+    return *end == '\0' ? 0 : -EINVAL;
+}
+
+static inline int kstrtoll(const char *s, unsigned int base, long long *res)
+{
+    char *end;
+    errno = 0;
+    long long val = strtoll(s, &end, base);
+    if (errno == ERANGE)
+        return -ERANGE;
+
+    int out = rp_host_kstrto_end(s, end);
+    if (out == 0)
+        *res = val;
+
+    return out;
+}
+
+static inline int kstrtoull(const char *s, unsigned int base, unsigned long long *res)
+{
+    if (*s == '-')
+        return -EINVAL;
+
+    char *end;
+    errno = 0;
+    unsigned long long val = strtoull(s, &end, base);
+    if (errno == ERANGE)
+        return -ERANGE;
+
+    int out = rp_host_kstrto_end(s, end);
+    if (out == 0)
+        *res = val;
+
+    return out;
+}
+
+static inline int kstrtou16(const char *s, unsigned int base, u16 *res)
+{
+    unsigned long long val;
+    int out = kstrtoull(s, base, &val);
+    if (out != 0)
+        return out;
+
+    if (val > USHRT_MAX)
+        return -ERANGE;
+
+    *res = val;
+    return 0;
+}
+
+static inline int kstrtouint(const char *s, unsigned int base, unsigned int *res)
+{
+    unsigned long long val;
+    int out = kstrtoull(s, base, &val);
+    if (out != 0)
+        return out;
+
+    if (val > UINT_MAX)
+        return -ERANGE;
+
+    *res = val;
+    return 0;
+}
+
+static inline int kstrtoint(const char *s, unsigned int base, int *res)
+{
+    long long val;
+    int out = kstrtoll(s, base, &val);
+    if (out != 0)
+        return out;
+
+    if (val < INT_MIN || val > INT_MAX)
+        return -ERANGE;
+
+    *res = val;
+    return 0;
+}
+
+#define simple_strtol(s, end, base) strtol(s, end, base)
+#define simple_strtoul(s, end, base) strtoul(s, end, base)
+
+/******************************************************* Math *********************************************************/
+static inline u64 div_u64(u64 dividend, u32 divisor) { return dividend / divisor; }
+static inline u64 div64_u64(u64 dividend, u64 divisor) { return dividend / divisor; }
+static inline s64 div_s64(s64 dividend, s32 divisor) { return dividend / divisor; }
+
+static inline bool is_power_of_2(unsigned long n) { return n != 0 && (n & (n - 1)) == 0; }
+static inline unsigned long roundup_pow_of_two(unsigned long n)
+{
+    return n <= 1 ? 1 : 1UL << (BITS_PER_LONG - __builtin_clzl(n - 1));
+}
+static inline int fls64(u64 x) { return x ? 64 - __builtin_clzll(x) : 0; }
+
+/******************************************************* Atomics ******************************************************/
+typedef struct {
+    int counter;
+} atomic_t;
+#define ATOMIC_INIT(i) { (i) }
+#define atomic_read(v) __atomic_load_n(&(v)->counter, __ATOMIC_RELAXED)
+#define atomic_set(v, i) __atomic_store_n(&(v)->counter, (i), __ATOMIC_RELAXED)
+#define atomic_inc(v) ((void)__atomic_add_fetch(&(v)->counter, 1, __ATOMIC_RELAXED))
+#define atomic_dec(v) ((void)__atomic_sub_fetch(&(v)->counter, 1, __ATOMIC_RELAXED))
+#define atomic_add(i, v) ((void)__atomic_add_fetch(&(v)->counter, (i), __ATOMIC_RELAXED))
+#define atomic_inc_return(v) __atomic_add_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST)
+#define atomic_dec_and_test(v) (__atomic_sub_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST) == 0)
+#define xchg(ptr, val) __atomic_exchange_n(ptr, val, __ATOMIC_SEQ_CST)
+
+/****************************************************** Locking *******************************************************/
+//Real (test-and-set) spinlocks so that the cost of locking is included in measurements; IRQ state isn't touched
+typedef struct {
+    volatile int locked;
+} spinlock_t;
+#define __SPIN_LOCK_UNLOCKED(name) { .locked = 0 }
+#define DEFINE_SPINLOCK(name) spinlock_t name = __SPIN_LOCK_UNLOCKED(name)
+#define spin_lock_init(lock) ((lock)->locked = 0)
+
+extern unsigned int rp_host_locks_held; //work queued while >0 is deferred, like a worker waiting for the atomic section
+void rp_host_run_deferred_work(void);
+
+static inline void spin_lock(spinlock_t *lock)
+{
+    while (__atomic_test_and_set((void *)&lock->locked, __ATOMIC_ACQUIRE))
+        ;
+    ++rp_host_locks_held;
+}
+
+static inline void spin_unlock(spinlock_t *lock)
+{
+    __atomic_clear((void *)&lock->locked, __ATOMIC_RELEASE);
+    if (--rp_host_locks_held == 0)
+        rp_host_run_deferred_work();
+}
+
+#define spin_lock_irqsave(lock, flags) do { (flags) = 0; spin_lock(lock); } while(0)
+#define spin_unlock_irqrestore(lock, flags) do { (void)(flags); spin_unlock(lock); } while(0)
+#define spin_lock_irq(lock) spin_lock(lock)
+#define spin_unlock_irq(lock) spin_unlock(lock)
+#define spin_lock_bh(lock) spin_lock(lock)
+#define spin_unlock_bh(lock) spin_unlock(lock)
+
+struct mutex {
+    spinlock_t lock;
+};
+#define DEFINE_MUTEX(name) struct mutex name = { .lock = __SPIN_LOCK_UNLOCKED(name.lock) }
+#define mutex_init(m) spin_lock_init(&(m)->lock)
+#define mutex_lock(m) spin_lock(&(m)->lock)
+#define mutex_unlock(m) spin_unlock(&(m)->lock)
+
+typedef struct {
+    unsigned sequence;
+} seqcount_t;
+#define seqcount_init(s) ((s)->sequence = 0)
+
+static inline unsigned read_seqcount_begin(const seqcount_t *s)
+{
+    unsigned ret;
+    while ((ret = __atomic_load_n(&s->sequence, __ATOMIC_ACQUIRE)) & 1)
+        ;
+
+    return ret;
+}
+
+static inline int read_seqcount_retry(const seqcount_t *s, unsigned start)
+{
+    smp_rmb();
+    return unlikely(__atomic_load_n(&s->sequence, __ATOMIC_RELAXED) != start);
+}
+
+static inline void write_seqcount_begin(seqcount_t *s)
+{
+    __atomic_store_n(&s->sequence, s->sequence + 1, __ATOMIC_RELAXED);
+    smp_wmb();
+}
+
+static inline void write_seqcount_end(seqcount_t *s)
+{
+    smp_wmb();
+    __atomic_store_n(&s->sequence, s->sequence + 1, __ATOMIC_RELAXED);
+}
+
+/******************************************************** Time ********************************************************/
+extern s64 rp_host_clock_skew_ns; //how far rp_host_fire_timers() moved the clock to reach timer expiries
+
+static inline ktime_t ktime_get(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (s64)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec + rp_host_clock_skew_ns;
+}
+#define ktime_to_ns(kt) ((s64)(kt))
+#define ns_to_ktime(ns) ((ktime_t)(ns))
+#define ktime_get_ns() ktime_to_ns(ktime_get())
+
+enum hrtimer_mode {
+    HRTIMER_MODE_ABS = 0,
+    HRTIMER_MODE_REL = 1,
+};
+
+enum hrtimer_restart {
+    HRTIMER_NORESTART,
+    HRTIMER_RESTART,
+};
+
+#ifndef CLOCK_MONOTONIC
+#define CLOCK_MONOTONIC 1
+#endif
+
+struct hrtimer {
+    enum hrtimer_restart (*function)(struct hrtimer *);
+    bool active;
+    ktime_t expires;
+    struct hrtimer *next_active; //list of timers waiting for rp_host_fire_timers()
+};
+
+void hrtimer_init(struct hrtimer *timer, int clock_id, enum hrtimer_mode mode);
+void hrtimer_start(struct hrtimer *timer, ktime_t tim, const enum hrtimer_mode mode);
+int hrtimer_cancel(struct hrtimer *timer);
+#define hrtimer_try_to_cancel(timer) hrtimer_cancel(timer) //a callback never runs concurrently
+#define hrtimer_active(timer) ((timer)->active)
+#define hrtimer_set_expires(timer, time) ((timer)->expires = (time))
+
+/**
+ * Expires all started hrtimers right now (as if their time passed)
+ *
+ * @return number of timers fired
+ */
+unsigned int rp_host_fire_timers(void);
+
+/******************************************************* Lists ********************************************************/
+struct list_head {
+    struct list_head *next, *prev;
+};
+#define LIST_HEAD_INIT(name) { &(name), &(name) }
+#define LIST_HEAD(name) struct list_head name = LIST_HEAD_INIT(name)
+
+static inline void INIT_LIST_HEAD(struct list_head *list)
+{
+    list->next = list;
+    list->prev = list;
+}
+
+static inline void list_add_tail(struct list_head *entry, struct list_head *head)
+{
+    entry->prev = head->prev;
+    entry->next = head;
+    head->prev->next = entry;
+    head->prev = entry;
+}
+
+static inline void list_del(struct list_head *entry)
+{
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    entry->next = entry->prev = NULL;
+}
+
+#define list_empty(head) ((head)->next == (head))
+#define list_entry(ptr, type, member) container_of(ptr, type, member)
+#define list_for_each_entry(pos, head, member) \
+    for (pos = list_entry((head)->next, typeof(*pos), member); &pos->member != (head); \
+         pos = list_entry(pos->member.next, typeof(*pos), member))
+#define list_for_each_entry_safe(pos, n, head, member) \
+    for (pos = list_entry((head)->next, typeof(*pos), member), \
+         n = list_entry(pos->member.next, typeof(*pos), member); &pos->member != (head); \
+         pos = n, n = list_entry(n->member.next, typeof(*n), member))
+
+/****************************************************** Bitmaps *******************************************************/
+#define BITS_TO_LONGS(nr) DIV_ROUND_UP(nr, BITS_PER_LONG)
+#define DECLARE_BITMAP(name, bits) unsigned long name[BITS_TO_LONGS(bits)]
+#define set_bit(nr, addr) ((addr)[(nr) / BITS_PER_LONG] |= 1UL << ((nr) % BITS_PER_LONG))
+#define clear_bit(nr, addr) ((addr)[(nr) / BITS_PER_LONG] &= ~(1UL << ((nr) % BITS_PER_LONG)))
+#define test_bit(nr, addr) (((addr)[(nr) / BITS_PER_LONG] >> ((nr) % BITS_PER_LONG)) & 1UL)
+#define bitmap_zero(dst, nbits) memset(dst, 0, BITS_TO_LONGS(nbits) * sizeof(unsigned long))
+
+static inline unsigned long find_next_bit(const unsigned long *addr, unsigned long size, unsigned long offset)
+{
+    for (; offset < size; ++offset) {
+        if (test_bit(offset, addr))
+            return offset;
+    }
+
+    return size;
+}
+#define for_each_set_bit(bit, addr, size) \
+    for ((bit) = find_next_bit((addr), (size), 0); (bit) < (size); (bit) = find_next_bit((addr), (size), (bit) + 1))
+
+/******************************************************* kfifo ********************************************************/
+/*
+ * Same layout idea as the kernel one: a power-of-2 ring of fixed-size elements with free-running indexes. Both the
+ * dynamic byte FIFO (struct kfifo + kfifo_alloc()) and typed static FIFOs (DECLARE_KFIFO) are supported.
+ */
+struct __kfifo {
+    unsigned int in;
+    unsigned int out;
+    unsigned int mask;
+    unsigned int esize;
+    void *data;
+};
+
+struct kfifo {
+    struct __kfifo kfifo;
+    unsigned char *type; //only used for its type (element size)
+};
+
+#define DECLARE_KFIFO(fifo, elem_type, size) \
+    struct { struct __kfifo kfifo; elem_type *type; elem_type buf[((size) < 2) || ((size) & ((size) - 1)) ? -1 : (size)]; } fifo
+#define INIT_KFIFO(fifo) \
+    do { \
+        (fifo).kfifo.in = (fifo).kfifo.out = 0; \
+        (fifo).kfifo.mask = ARRAY_SIZE((fifo).buf) - 1; \
+        (fifo).kfifo.esize = sizeof(*(fifo).buf); \
+        (fifo).kfifo.data = (fifo).buf; \
+    } while(0)
+
+int __kfifo_alloc(struct __kfifo *fifo, unsigned int size, unsigned int esize);
+void __kfifo_free(struct __kfifo *fifo);
+unsigned int __kfifo_in(struct __kfifo *fifo, const void *buf, unsigned int len);
+unsigned int __kfifo_out(struct __kfifo *fifo, void *buf, unsigned int len);
+
+int __kfifo_init(struct __kfifo *fifo, void *buffer, unsigned int size, unsigned int esize);
+
+#define kfifo_init(fifo, buffer, size) __kfifo_init(&(fifo)->kfifo, buffer, size, sizeof(*(fifo)->type))
+#define kfifo_alloc(fifo, size, gfp) __kfifo_alloc(&(fifo)->kfifo, size, sizeof(*(fifo)->type))
+#define kfifo_free(fifo) __kfifo_free(&(fifo)->kfifo)
+#define kfifo_reset(fifo) ((fifo)->kfifo.in = (fifo)->kfifo.out = 0)
+#define kfifo_size(fifo) ((fifo)->kfifo.mask + 1)
+#define kfifo_len(fifo) ((fifo)->kfifo.in - (fifo)->kfifo.out)
+#define kfifo_avail(fifo) (kfifo_size(fifo) - kfifo_len(fifo))
+#define kfifo_is_empty(fifo) ((fifo)->kfifo.in == (fifo)->kfifo.out)
+#define kfifo_is_full(fifo) (kfifo_len(fifo) > (fifo)->kfifo.mask)
+#define kfifo_in(fifo, buf, n) __kfifo_in(&(fifo)->kfifo, buf, n)
+#define kfifo_out(fifo, buf, n) __kfifo_out(&(fifo)->kfifo, buf, n)
+#define kfifo_get(fifo, val) __kfifo_out(&(fifo)->kfifo, val, 1)
+#define kfifo_put(fifo, val) \
+    ({ typeof(*(fifo)->type) __val = (val); __kfifo_in(&(fifo)->kfifo, &__val, 1); })
+
+/***************************************************** Workqueues *****************************************************/
+struct work_struct;
+typedef void (*work_func_t)(struct work_struct *work);
+struct work_struct {
+    work_func_t func;
+    bool pending;
+    struct work_struct *next_pending; //list of works waiting for all locks to be released
+};
+struct workqueue_struct;
+
+#define DECLARE_WORK(name, fn) struct work_struct name = { .func = (fn) }
+#define INIT_WORK(work, fn) ((work)->func = (fn))
+
+struct workqueue_struct *alloc_ordered_workqueue(const char *name, unsigned int flags);
+void destroy_workqueue(struct workqueue_struct *wq);
+bool queue_work(struct workqueue_struct *wq, struct work_struct *work); //runs the work now if no lock is held
+#define schedule_work(work) queue_work(NULL, work)
+bool cancel_work_sync(struct work_struct *work); //drops the work if it's deferred; nothing else can be running
+
+/****************************************************** Threads *******************************************************/
+#ifndef SIGKILL
+#define SIGKILL 9
+#endif
+
+struct wait_queue_head;
+struct task_struct {
+    int pid;
+    int (*fn)(void *data);
+    void *data;
+    int exit_code;
+    bool should_stop;
+    bool runnable;
+    bool exited;
+    struct wait_queue_head *waiting_on;
+    struct task_struct *next_waiting; //list of tasks on the waiting_on queue
+    ucontext_t ctx;
+    void *stack;
+};
+
+typedef struct wait_queue_head {
+    struct task_struct *waiters;
+} wait_queue_head_t;
+
+extern struct task_struct *rp_host_current; //NULL when the main thread (i.e. the harness) runs
+extern struct task_struct rp_host_main_task;
+#define current (rp_host_current ? rp_host_current : &rp_host_main_task)
+#define allow_signal(sig) ((void)(sig))
+#define signal_pending(task) ((void)(task), 0) //signals are never delivered
+
+struct task_struct *kthread_create(int (*fn)(void *data), void *data, const char *namefmt, ...);
+int wake_up_process(struct task_struct *task);
+bool kthread_should_stop(void);
+int kthread_stop(struct task_struct *task); //runs the thread until it exits, even if a lock is held
+
+#define init_waitqueue_head(wq) ((wq)->waiters = NULL)
+#define waitqueue_active(wq) (!!(wq)->waiters)
+void wake_up_interruptible(wait_queue_head_t *wq);
+void rp_host_wait(wait_queue_head_t *wq); //puts the current thread to sleep until the queue is woken up
+#define wait_event_interruptible(wq, condition) ({ while (!(condition)) { rp_host_wait(&(wq)); } 0; })
+
+/****************************************************** seq_file ******************************************************/
+struct seq_file {
+    char *buf;
+    size_t size;
+    size_t from;
+    size_t count;
+    void *private;
+    int (*show)(struct seq_file *m, void *v); //set by single_open()
+};
+
+void seq_printf(struct seq_file *m, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/****************************************************** debugfs *******************************************************/
+struct inode {
+    void *i_private;
+};
+
+struct file {
+    void *private_data;
+};
+
+struct file_operations {
+    struct module *owner;
+    int (*open)(struct inode *inode, struct file *file);
+    ssize_t (*read)(struct file *file, char __user *buf, size_t count, loff_t *ppos);
+    ssize_t (*write)(struct file *file, const char __user *buf, size_t count, loff_t *ppos);
+    loff_t (*llseek)(struct file *file, loff_t offset, int whence);
+    int (*release)(struct inode *inode, struct file *file);
+};
+
+int single_open(struct file *file, int (*show)(struct seq_file *m, void *v), void *data);
+int single_release(struct inode *inode, struct file *file);
+ssize_t seq_read(struct file *file, char __user *buf, size_t count, loff_t *ppos);
+loff_t seq_lseek(struct file *file, loff_t offset, int whence);
+
+struct dentry;
+struct dentry *debugfs_create_dir(const char *name, struct dentry *parent);
+struct dentry *debugfs_create_file(const char *name, unsigned short mode, struct dentry *parent, void *data,
+                                   const struct file_operations *fops);
+void debugfs_remove_recursive(struct dentry *dentry);
+
+/**
+ * Reads a whole debugfs file created under directory "dir" (as cat would do)
+ *
+ * @return length of the data (NULL-terminated in buf) or -E on error
+ */
+ssize_t rp_host_debugfs_read(const char *dir, const char *name, char *buf, size_t size);
+
+/********************************************************* UART *******************************************************/
+#define BASE_BAUD (1843200 / 16)
+#define UPF_BOOT_AUTOCONF (1U << 28)
+#define UPF_SKIP_TEST (1U << 6)
+#define UPF_FIXED_TYPE (1U << 27)
+#define STD_COMX_FLAGS (UPF_BOOT_AUTOCONF | UPF_SKIP_TEST)
+#define CONFIG_SERIAL_8250_NR_UARTS 4
+
+#define PORT_16550A 4
+#define PORT_16750 8
+#define PORT_16C950 10
+
+//Driver's TX buffer (see vuart_bulk_tx())
+struct circ_buf {
+    char *buf;
+    int head;
+    int tail;
+};
+#define UART_XMIT_SIZE PAGE_SIZE
+#define CIRC_CNT(head, tail, size) (((head) - (tail)) & ((size) - 1))
+#define CIRC_CNT_TO_END(head, tail, size) \
+    ({ int __end = (size) - (tail); int __n = ((head) + __end) & ((size) - 1); __n < __end ? __n : __end; })
+#define uart_circ_empty(circ) ((circ)->head == (circ)->tail)
+#define uart_circ_chars_pending(circ) CIRC_CNT((circ)->head, (circ)->tail, UART_XMIT_SIZE)
+
+struct uart_state {
+    struct circ_buf xmit;
+};
+
+struct uart_icount {
+    u32 tx;
+};
+
+struct uart_port {
+    spinlock_t lock;
+    unsigned long iobase;
+    unsigned char *membase;
+    unsigned int (*serial_in)(struct uart_port *, int);
+    void (*serial_out)(struct uart_port *, int, int);
+    unsigned int irq;
+    unsigned long irqflags;
+    unsigned int uartclk;
+    unsigned int fifosize;
+    unsigned char x_char;
+    unsigned char regshift;
+    unsigned char iotype;
+    unsigned char hub6;
+    unsigned int line;
+    upf_t flags;
+    unsigned int type;
+    struct uart_state *state;
+    struct uart_icount icount;
+    bool tx_stopped;
+};
+#define uart_tx_stopped(port) ((port)->tx_stopped)
+#define uart_write_wakeup(port) ((void)(port))
+
+struct uart_8250_port {
+    struct uart_port port;
+    unsigned char cur_iotype;
+};
+
+/**
+ * Registers the port (by line) so that it can be retrieved with rp_host_uart_port()
+ *
+ * @return line or -E
+ */
+int serial8250_register_8250_port(struct uart_8250_port *up);
+
+/**
+ * Gets port registered last with serial8250_register_8250_port() for a given line (or NULL if none)
+ *
+ * Register accesses should be done through port->serial_in() & port->serial_out() just like the 8250 driver would.
+ */
+struct uart_port *rp_host_uart_port(int line);
+
+/**
+ * Interrupt handler of the 8250 driver; it's called by the vIRQ (see rp_emu_virq) so it has to be provided by whoever
+ * links vuart_virtual_irq.c
+ */
+int serial8250_handle_irq(struct uart_port *port, unsigned int iir);
+
+/******************************************************** PCI *********************************************************/
+#define PCIBIOS_SUCCESSFUL 0x00
+#define PCIBIOS_DEVICE_NOT_FOUND 0x86
+#define PCIBIOS_BAD_REGISTER_NUMBER 0x87
+#define PCIBIOS_SET_FAILED 0x88
+
+#define PCI_DEVFN(slot, func) ((((slot) & 0x1f) << 3) | ((func) & 0x07))
+#define PCI_SLOT(devfn) (((devfn) >> 3) & 0x1f)
+#define PCI_FUNC(devfn) ((devfn) & 0x07)
+
+#define PCI_CLASS_NOT_DEFINED 0x0000
+#define PCI_BASE_CLASS_STORAGE 0x01
+#define PCI_CLASS_STORAGE_SATA 0x0106
+#define PCI_BASE_CLASS_NETWORK 0x02
+#define PCI_CLASS_NETWORK_ETHERNET 0x0200
+#define PCI_BASE_CLASS_BRIDGE 0x06
+#define PCI_CLASS_BRIDGE_PCI 0x0604
+#define PCI_BASE_CLASS_SERIAL 0x0c
+#define PCI_CLASS_SERIAL_USB 0x0c03
+#define PCI_CLASS_SERIAL_USB_EHCI 0x0c0320
+
+struct pci_bus;
+struct pci_ops {
+    int (*read)(struct pci_bus *bus, unsigned int devfn, int where, int size, u32 *val);
+    int (*write)(struct pci_bus *bus, unsigned int devfn, int where, int size, u32 val);
+};
+
+struct pci_sysdata {
+    int domain;
+    void *iommu;
+};
+
+struct pci_bus {
+    unsigned char number;
+    struct pci_ops *ops;
+    void *sysdata;
+    struct list_head devices;
+};
+
+struct pci_dev {
+    struct list_head bus_list;
+    struct pci_bus *bus;
+    unsigned int devfn;
+    bool is_added;
+};
+
+/**
+ * Creates the bus & probes vendor ID of every devfn on it (like the PCI core scan does), creating pci_dev for each
+ * device which responded
+ */
+struct pci_bus *pci_scan_bus(int bus, struct pci_ops *ops, void *sysdata);
+unsigned int pci_rescan_bus(struct pci_bus *bus);
+void pci_bus_add_devices(const struct pci_bus *bus);
+void pci_stop_and_remove_bus_device(struct pci_dev *dev);
+void pci_remove_bus(struct pci_bus *bus);
+
+/**
+ * Gets bus created by pci_scan_bus() (or NULL if none)
+ */
+struct pci_bus *rp_host_pci_bus(unsigned char number);
+
+/****************************************************** Devices *******************************************************/
+struct notifier_block;
+struct device_driver {
+    const char *name;
+};
+struct bus_type;
+
+#endif //REDPILL_RP_HOST_H
@@ -1,7 +1,7 @@
 #include "call_protected.h"
 #include "../common.h"
 #include <linux/errno.h> //common exit codes
-#include <linux/kallsyms.h> //kallsyms_lookup_name()
+#include "ksym_cache.h" //ksym_lookup_name()
 #include <linux/module.h> //symbol_get()/put
 
 //This will eventually stop working (since Linux >=5.7.0 has the kallsyms_lookup_name() removed)
@@ -19,7 +19,7 @@
   return_type _##org_function_name(call_args)                                                     \
   {                                                                                               \
       if (unlikely(org_function_name##__addr == 0)) {                                             \
-          org_function_name##__addr = kallsyms_lookup_name(#org_function_name);                   \
+          org_function_name##__addr = ksym_lookup_name(#org_function_name);                       \
           if (org_function_name##__addr == 0) {                                                   \
               pr_loc_bug("Failed to fetch %s() syscall address", #org_function_name);             \
               return fail_return;                                                                 \
@@ -90,5 +90,30 @@ DEFINE_UNEXPORTED_SHIM(int, scsi_scan_host_selected, CP_LIST(struct Scsi_Host *s
 DEFINE_UNEXPORTED_SHIM(int, early_serial_setup, CP_LIST(struct uart_port *port), port, -EIO);
 DEFINE_UNEXPORTED_SHIM(int, serial8250_find_port, CP_LIST(struct uart_port *p), CP_LIST(p), -EIO);
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,19,0)
+DEFINE_UNEXPORTED_SHIM(void, insn_init, CP_LIST(struct insn *insn, const void *kaddr, int x86_64),
+                       CP_LIST(insn, kaddr, x86_64), __VOID_RETURN__);
+#else
+DEFINE_UNEXPORTED_SHIM(void, insn_init, CP_LIST(struct insn *insn, const void *kaddr, int buf_len, int x86_64),
+                       CP_LIST(insn, kaddr, buf_len, x86_64), __VOID_RETURN__);
+#endif
+DEFINE_UNEXPORTED_SHIM(void, insn_get_length, CP_LIST(struct insn *insn), CP_LIST(insn), __VOID_RETURN__);
+DEFINE_UNEXPORTED_SHIM(void *, module_alloc, CP_LIST(unsigned long size), CP_LIST(size), NULL);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,0,0)
+DEFINE_UNEXPORTED_SHIM(void, module_free, CP_LIST(struct module *mod, void *module_region),
+                       CP_LIST(mod, module_region), __VOID_RETURN__);
+#else
+DEFINE_UNEXPORTED_SHIM(void, module_memfree, CP_LIST(void *module_region), CP_LIST(module_region), __VOID_RETURN__);
+#endif
+
+#include <linux/workqueue.h>
+DEFINE_UNEXPORTED_SHIM(struct workqueue_attrs *, alloc_workqueue_attrs, CP_LIST(gfp_t gfp_mask), CP_LIST(gfp_mask),
+                       NULL);
+DEFINE_UNEXPORTED_SHIM(void, free_workqueue_attrs, CP_LIST(struct workqueue_attrs *attrs), CP_LIST(attrs),
+                       __VOID_RETURN__);
+DEFINE_UNEXPORTED_SHIM(int, apply_workqueue_attrs,
+                       CP_LIST(struct workqueue_struct *wq, const struct workqueue_attrs *attrs), CP_LIST(wq, attrs),
+                       -EFAULT);
+
 DEFINE_DYNAMIC_SHIM(void, usb_register_notify, CP_LIST(struct notifier_block *nb), CP_LIST(nb), __VOID_RETURN__);
 DEFINE_DYNAMIC_SHIM(void, usb_unregister_notify, CP_LIST(struct notifier_block *nb), CP_LIST(nb), __VOID_RETURN__);
@@ -57,6 +57,31 @@ struct Scsi_Host;
 CP_DECLARE_SHIM(int, scsi_scan_host_selected, CP_LIST(struct Scsi_Host *shost, unsigned int channel, unsigned int id, u64 lun, int rescan));
 #endif
 
+//Used by override_symbol to build detours (see override_symbol.c); the insn decoder is built into the kernel but not
+// exported to modules
+struct insn;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,19,0)
+CP_DECLARE_SHIM(void, insn_init, CP_LIST(struct insn *insn, const void *kaddr, int x86_64));
+#else
+CP_DECLARE_SHIM(void, insn_init, CP_LIST(struct insn *insn, const void *kaddr, int buf_len, int x86_64));
+#endif
+CP_DECLARE_SHIM(void, insn_get_length, CP_LIST(struct insn *insn));
+CP_DECLARE_SHIM(void *, module_alloc, CP_LIST(unsigned long size));
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,0,0)
+struct module;
+CP_DECLARE_SHIM(void, module_free, CP_LIST(struct module *mod, void *module_region));
+#define _module_memfree(module_region) _module_free(NULL, module_region)
+#else
+CP_DECLARE_SHIM(void, module_memfree, CP_LIST(void *module_region));
+#endif
+
+//Used by thread_placement to place workqueue workers on chosen CPUs; these aren't exported on all kernels we support
+struct workqueue_struct;
+struct workqueue_attrs;
+CP_DECLARE_SHIM(struct workqueue_attrs *, alloc_workqueue_attrs, CP_LIST(gfp_t gfp_mask));
+CP_DECLARE_SHIM(void, free_workqueue_attrs, CP_LIST(struct workqueue_attrs *attrs));
+CP_DECLARE_SHIM(int, apply_workqueue_attrs, CP_LIST(struct workqueue_struct *wq, const struct workqueue_attrs *attrs));
+
 #include <linux/notifier.h>
 void _usb_register_notify(struct notifier_block *nb);
 void _usb_unregister_notify(struct notifier_block *nb);
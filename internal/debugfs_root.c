@@ -0,0 +1,73 @@
+/**
+ * Shared debugfs directory for all submodules exposing runtime information (stats, buffers etc.)
+ *
+ * Submodules should never create anything at the debugfs top level directly but get their own subdirectory under the
+ * root provided here. Thanks to that the whole module leaves a single entry which is easy to hide/remove.
+ */
+#include "debugfs_root.h"
+#include "../common.h"
+#include <linux/err.h> //ERR_PTR
+
+#ifdef RP_DEBUGFS_ENABLED
+#include <linux/debugfs.h>
+#include <linux/mutex.h>
+
+#define DEBUGFS_ROOT_NAME KBUILD_MODNAME
+
+static struct dentry *root_dir = NULL;
+static unsigned int root_users = 0;
+static DEFINE_MUTEX(root_lock);
+
+struct dentry *get_debugfs_root(void)
+{
+    struct dentry *out;
+
+    mutex_lock(&root_lock);
+    if (!root_dir) {
+        //Older kernels return NULL on error, newer return ERR_PTR(-ENODEV) when debugfs is not compiled in
+        root_dir = debugfs_create_dir(DEBUGFS_ROOT_NAME, NULL);
+        if (IS_ERR_OR_NULL(root_dir)) {
+            out = root_dir ? root_dir : ERR_PTR(-ENODEV);
+            root_dir = NULL;
+            pr_loc_err("Failed to create debugfs root \"%s\"", DEBUGFS_ROOT_NAME);
+            goto out_unlock;
+        }
+        pr_loc_dbg("Created debugfs root \"%s\"", DEBUGFS_ROOT_NAME);
+    }
+
+    ++root_users;
+    out = root_dir;
+
+    out_unlock:
+    mutex_unlock(&root_lock);
+    return out;
+}
+
+void put_debugfs_root(void)
+{
+    mutex_lock(&root_lock);
+    if (unlikely(!root_users)) {
+        pr_loc_bug("Attempted to %s without a matching get", __FUNCTION__);
+        goto out_unlock;
+    }
+
+    if (--root_users == 0) {
+        debugfs_remove_recursive(root_dir);
+        root_dir = NULL;
+        pr_loc_dbg("Removed debugfs root \"%s\"", DEBUGFS_ROOT_NAME);
+    }
+
+    out_unlock:
+    mutex_unlock(&root_lock);
+}
+#else //RP_DEBUGFS_ENABLED
+struct dentry *get_debugfs_root(void)
+{
+    return ERR_PTR(-ENODEV);
+}
+
+void put_debugfs_root(void)
+{
+    //noop
+}
+#endif //RP_DEBUGFS_ENABLED
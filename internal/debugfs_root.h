@@ -0,0 +1,28 @@
+#ifndef REDPILL_DEBUGFS_ROOT_H
+#define REDPILL_DEBUGFS_ROOT_H
+
+#include "stealth.h" //STEALTH_MODE
+
+//debugfs entries are a dead giveaway - they're only available when stealth mode doesn't hide everything
+#if STEALTH_MODE < STEALTH_MODE_NORMAL
+#define RP_DEBUGFS_ENABLED
+#endif
+
+struct dentry;
+
+/**
+ * Gets (and creates on first call) the module's root directory in debugfs
+ *
+ * Every successful call must be paired with put_debugfs_root(). The directory is removed (recursively!) when the last
+ * user puts it.
+ *
+ * @return dentry ptr, ERR_PTR(-E) on error (incl. -ENODEV when debugfs is disabled by stealth mode or kernel config)
+ */
+struct dentry *get_debugfs_root(void);
+
+/**
+ * Releases reference obtained with get_debugfs_root()
+ */
+void put_debugfs_root(void);
+
+#endif //REDPILL_DEBUGFS_ROOT_H
@@ -0,0 +1,87 @@
+/**
+ * Bump allocator for objects which live as long as the module
+ *
+ * Most of the small allocations we do are made once during init and freed only when the module unloads. Giving each of
+ * them a separate kmalloc() wastes memory on rounding to the cache size (e.g. a 13 byte MAC lands in kmalloc-16, a
+ * short filename entry in kmalloc-64). Their lifetime is also the same, so there's no point in tracking each of them.
+ *
+ * HOW IT WORKS?
+ * Memory is reserved in page-sized chunks linked together. Allocations are carved from the newest chunk; when it's full
+ * a new one is added (the rest of the old one is simply wasted). Objects which don't fit in a chunk get a dedicated
+ * one, placed behind the current chunk so that its free space isn't abandoned. On unload all chunks are freed at once with rp_arena_free_all().
+ */
+#include "init_arena.h"
+#include "../common.h"
+#include <linux/mutex.h>
+
+#define ARENA_ALIGN sizeof(void *)
+#define ARENA_CHUNK_SIZE PAGE_SIZE
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size; //usable size of data
+    size_t used;
+    char data[] __aligned(ARENA_ALIGN);
+};
+
+static struct arena_chunk *chunks = NULL; //newest first
+static DEFINE_MUTEX(arena_lock);
+
+static struct arena_chunk *add_chunk(size_t min_size)
+{
+    size_t size = max_t(size_t, ARENA_CHUNK_SIZE, sizeof(struct arena_chunk) + min_size);
+    struct arena_chunk *chunk = kzalloc(size, GFP_KERNEL);
+    if (unlikely(!chunk)) {
+        pr_loc_crt("kzalloc failed");
+        return NULL;
+    }
+
+    chunk->size = size - sizeof(struct arena_chunk);
+    chunk->used = 0;
+    //Dedicated chunks are always full - keep the current one as the newest so that its free space isn't lost
+    if (size > ARENA_CHUNK_SIZE && chunks) {
+        chunk->next = chunks->next;
+        chunks->next = chunk;
+    } else {
+        chunk->next = chunks;
+        chunks = chunk;
+    }
+    pr_loc_dbg("Added arena chunk of %zu bytes @ %p", chunk->size, chunk);
+
+    return chunk;
+}
+
+void *rp_arena_alloc(size_t size)
+{
+    if (unlikely(size == 0))
+        return NULL;
+
+    size = ALIGN(size, ARENA_ALIGN);
+
+    mutex_lock(&arena_lock);
+    struct arena_chunk *chunk = chunks;
+    if (!chunk || chunk->size - chunk->used < size)
+        chunk = add_chunk(size);
+
+    void *ptr = NULL;
+    if (likely(chunk)) {
+        ptr = chunk->data + chunk->used;
+        chunk->used += size;
+    }
+    mutex_unlock(&arena_lock);
+
+    return ptr;
+}
+
+void rp_arena_free_all(void)
+{
+    mutex_lock(&arena_lock);
+    while (chunks) {
+        struct arena_chunk *next = chunks->next;
+        kfree(chunks);
+        chunks = next;
+    }
+    mutex_unlock(&arena_lock);
+
+    pr_loc_dbg("Arena freed");
+}
@@ -0,0 +1,24 @@
+#ifndef REDPILL_INIT_ARENA_H
+#define REDPILL_INIT_ARENA_H
+
+#include <linux/types.h> //size_t
+
+/**
+ * Allocates zeroed memory which lives until the module is unloaded
+ *
+ * This is meant for small objects created during init and never freed individually (e.g. config values, blocked
+ * filenames). They're packed together into a few pages instead of being scattered over kmalloc caches. There's NO free
+ * for a single allocation - everything is released by rp_arena_free_all().
+ *
+ * This function may sleep.
+ *
+ * @return pointer to the memory or NULL if it cannot be reserved
+ */
+void *rp_arena_alloc(size_t size);
+
+/**
+ * Frees all memory reserved with rp_arena_alloc(); nothing allocated from the arena can be used after this call
+ */
+void rp_arena_free_all(void);
+
+#endif //REDPILL_INIT_ARENA_H
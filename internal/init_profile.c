@@ -0,0 +1,187 @@
+/**
+ * Per-stage init/exit profiler
+ *
+ * The module does a lot of expensive things while loading: kallsyms scans, stop_machine() text patching, TLB flushes
+ * on every CPU etc. When the load gets slow on some platform it's not obvious which stage is to blame. This file
+ * collects the wall time & deltas of global counters (see enum rp_prof_counter) around every stage's init and exit.
+ *
+ * The results are printed once as a single line after the module loads (and another one after it's unloaded). When
+ * debugfs is allowed by stealth mode the full table can also be read from <debugfs>/redpill/init_profile.
+ *
+ * The cost is two ktime_get() calls per stage and an atomic increment per counted operation - the operations counted
+ * are orders of magnitude more expensive, so it's always on.
+ */
+#include "init_profile.h"
+#include "init_stages.h" //MAX_INIT_STAGES
+#include "debugfs_root.h" //get_debugfs_root(), RP_DEBUGFS_ENABLED
+#include "../common.h"
+#include <linux/ktime.h>
+
+#define PROFILE_SUMMARY_LEN 512 //printk limits a single line to ~1K anyway
+
+struct init_profile_entry {
+    const char *name; //NULL if stage was never recorded
+    bool parallel:1;
+    bool exited:1;
+    u64 init_ns;
+    u64 exit_ns;
+    u32 init_counters[__RP_PROF_COUNTERS_NUM];
+    u32 exit_counters[__RP_PROF_COUNTERS_NUM];
+};
+
+atomic_t rp_prof_counters[__RP_PROF_COUNTERS_NUM];
+
+static const char *counter_names[__RP_PROF_COUNTERS_NUM] = { "ksym", "ksym_scan", "patch", "tlb" };
+static struct init_profile_entry entries[MAX_INIT_STAGES];
+static u64 init_total_ns = 0;
+static u32 init_totals[__RP_PROF_COUNTERS_NUM]; //counters when the init finished (lazy lookups come later)
+static u32 exit_base[__RP_PROF_COUNTERS_NUM]; //counters when the teardown started
+
+void init_profile_begin(struct init_profile_sample *sample)
+{
+    for (int i = 0; i < __RP_PROF_COUNTERS_NUM; ++i)
+        sample->counters[i] = atomic_read(&rp_prof_counters[i]);
+
+    sample->ns = ktime_to_ns(ktime_get());
+}
+
+void init_profile_record(unsigned int idx, const char *name, bool parallel, bool exit,
+                         const struct init_profile_sample *start)
+{
+    u64 now = ktime_to_ns(ktime_get());
+
+    if (unlikely(idx >= MAX_INIT_STAGES)) {
+        pr_loc_bug("Stage index %u out of range", idx);
+        return;
+    }
+
+    struct init_profile_entry *entry = &entries[idx];
+    u32 *counters = exit ? entry->exit_counters : entry->init_counters;
+    for (int i = 0; i < __RP_PROF_COUNTERS_NUM; ++i)
+        counters[i] = atomic_read(&rp_prof_counters[i]) - start->counters[i];
+
+    //Parallel stages of the same wave record concurrently, but each of them only touches its own entry
+    entry->name = name;
+    if (exit) {
+        entry->exit_ns = now - start->ns;
+        entry->exited = true;
+    } else {
+        entry->init_ns = now - start->ns;
+        entry->parallel = parallel;
+    }
+}
+
+/**
+ * Formats "name[*]=Nus" for every recorded stage followed by totals of counters
+ */
+static void print_summary(const char *what, bool exit, u64 total_ns, const u32 *base)
+{
+    char line[PROFILE_SUMMARY_LEN];
+    int len = 0;
+
+    for (int i = 0; i < MAX_INIT_STAGES && len < sizeof(line); ++i) {
+        struct init_profile_entry *entry = &entries[i];
+        if (!entry->name || (exit && !entry->exited))
+            continue;
+
+        //Stages always exit one by one
+        len += snprintf(line + len, sizeof(line) - len, " %s%s=%lluus", entry->name,
+                        (!exit && entry->parallel) ? "*" : "",
+                        div_u64(exit ? entry->exit_ns : entry->init_ns, NSEC_PER_USEC));
+    }
+
+    //Totals are taken from the global counters as deltas of parallel stages overlap
+    for (int j = 0; j < __RP_PROF_COUNTERS_NUM && len < sizeof(line); ++j)
+        len += snprintf(line + len, sizeof(line) - len, " %s:%u", counter_names[j],
+                        (u32)atomic_read(&rp_prof_counters[j]) - (base ? base[j] : 0));
+
+    pr_loc_inf("%s took %lluus:%s", what, div_u64(total_ns, NSEC_PER_USEC), line);
+}
+
+#ifdef RP_DEBUGFS_ENABLED
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+static struct dentry *profile_file = NULL;
+
+static int profile_show(struct seq_file *m, void *v)
+{
+    seq_printf(m, "%-24s %10s", "stage", "init_us");
+    for (int j = 0; j < __RP_PROF_COUNTERS_NUM; ++j)
+        seq_printf(m, " %9s", counter_names[j]);
+    seq_puts(m, "\n");
+
+    for (int i = 0; i < MAX_INIT_STAGES; ++i) {
+        struct init_profile_entry *entry = &entries[i];
+        if (!entry->name)
+            continue;
+
+        seq_printf(m, "%-23s%s %10llu", entry->name, entry->parallel ? "*" : " ",
+                   div_u64(entry->init_ns, NSEC_PER_USEC));
+        for (int j = 0; j < __RP_PROF_COUNTERS_NUM; ++j)
+            seq_printf(m, " %9u", entry->init_counters[j]);
+        seq_puts(m, "\n");
+    }
+
+    seq_printf(m, "%-24s %10llu", "total", div_u64(init_total_ns, NSEC_PER_USEC));
+    for (int j = 0; j < __RP_PROF_COUNTERS_NUM; ++j)
+        seq_printf(m, " %9u", init_totals[j]);
+    seq_puts(m, "\n# stages marked with * ran in parallel - their counters include work of concurrent stages\n");
+
+    return 0;
+}
+
+static int profile_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, profile_show, NULL);
+}
+
+static const struct file_operations profile_fops = {
+    .owner = THIS_MODULE,
+    .open = profile_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+#endif
+
+void init_profile_publish(u64 total_ns)
+{
+    init_total_ns = total_ns;
+    for (int i = 0; i < __RP_PROF_COUNTERS_NUM; ++i)
+        init_totals[i] = atomic_read(&rp_prof_counters[i]);
+
+    print_summary("Init", false, total_ns, NULL);
+
+#ifdef RP_DEBUGFS_ENABLED
+    struct dentry *root = get_debugfs_root();
+    if (IS_ERR(root))
+        return; //the summary line was already printed
+
+    profile_file = debugfs_create_file("init_profile", 0400, root, NULL, &profile_fops);
+    if (IS_ERR_OR_NULL(profile_file)) {
+        pr_loc_err("Failed to create debugfs file for init profile");
+        profile_file = NULL;
+        put_debugfs_root();
+    }
+#endif
+}
+
+void init_profile_unpublish(void)
+{
+    for (int i = 0; i < __RP_PROF_COUNTERS_NUM; ++i)
+        exit_base[i] = atomic_read(&rp_prof_counters[i]);
+
+#ifdef RP_DEBUGFS_ENABLED
+    if (profile_file) {
+        debugfs_remove(profile_file);
+        profile_file = NULL;
+        put_debugfs_root();
+    }
+#endif
+}
+
+void init_profile_print_exit(u64 total_ns)
+{
+    print_summary("Exit", true, total_ns, exit_base);
+}
@@ -0,0 +1,75 @@
+#ifndef REDPILL_INIT_PROFILE_H
+#define REDPILL_INIT_PROFILE_H
+
+#include <linux/types.h> //u64, u32, bool
+#include <linux/atomic.h> //atomic_t
+
+/**
+ * Expensive kernel operations counted globally to pin down which init stage is slow and why
+ */
+enum rp_prof_counter {
+    RP_PROF_KSYM_LOOKUP, //symbol lookups (cached or not)
+    RP_PROF_KSYM_SCAN, //lookups which missed the cache and scanned the whole kallsyms
+    RP_PROF_TEXT_PATCH, //kernel text patches written under stop_machine()
+    RP_PROF_TLB_FLUSH, //global TLB flushes (IPIs to all CPUs)
+    __RP_PROF_COUNTERS_NUM
+};
+
+extern atomic_t rp_prof_counters[__RP_PROF_COUNTERS_NUM];
+
+static inline void rp_prof_count(enum rp_prof_counter counter)
+{
+    atomic_inc(&rp_prof_counters[counter]);
+}
+
+static inline void rp_prof_count_n(enum rp_prof_counter counter, unsigned int n)
+{
+    atomic_add(n, &rp_prof_counters[counter]);
+}
+
+/**
+ * Point-in-time snapshot taken before a stage runs
+ */
+struct init_profile_sample {
+    u64 ns;
+    u32 counters[__RP_PROF_COUNTERS_NUM];
+};
+
+/**
+ * Takes a snapshot of the clock & counters
+ */
+void init_profile_begin(struct init_profile_sample *sample);
+
+/**
+ * Saves time & counters deltas since init_profile_begin() for a given stage
+ *
+ * Counters are global. If other stages ran concurrently (i.e. parallel ones) the delta includes their work too - such
+ * entries are marked with "*" when printed.
+ *
+ * @param idx index of the stage in the stages table (see init_stages.h)
+ * @param parallel whether the stage init ran concurrently with others (ignored for exit)
+ * @param exit whether this is the stage teardown (false for init)
+ */
+void init_profile_record(unsigned int idx, const char *name, bool parallel, bool exit,
+                         const struct init_profile_sample *start);
+
+/**
+ * Prints a one-line summary of the init and exposes the full table in debugfs (if stealth mode allows it)
+ *
+ * @param total_ns wall time of the whole init (which is less than a sum of stages when they ran in parallel)
+ */
+void init_profile_publish(u64 total_ns);
+
+/**
+ * Removes the debugfs table published with init_profile_publish()
+ *
+ * This should be called before any stage exits; it's safe to call even if nothing was published.
+ */
+void init_profile_unpublish(void);
+
+/**
+ * Prints a one-line summary of the teardown
+ */
+void init_profile_print_exit(u64 total_ns);
+
+#endif //REDPILL_INIT_PROFILE_H
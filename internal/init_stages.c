@@ -0,0 +1,160 @@
+/*
+ * A tiny dependency-aware scheduler for module initialization
+ *
+ * Most of the subsystems of this module are independent from each other once the config is loaded. Some of them take
+ * a while to register (e.g. PCI shim scanning buses, or anything doing stop_machine() to patch the kernel) and there's
+ * no reason for them to wait for each other on a multi-core machine. See run_init_stages() for details.
+ *
+ * Every stage init & exit is timed by the profiler (see init_profile.c).
+ */
+#include "init_stages.h"
+#include "init_profile.h"
+#include "../common.h"
+#include <linux/async.h> //async_schedule_domain()
+#include <linux/ktime.h>
+
+struct stage_job {
+    const struct init_stage *stage;
+    int result;
+};
+
+static ASYNC_DOMAIN_EXCLUSIVE(init_stages_domain);
+static struct stage_job jobs[MAX_INIT_STAGES] __initdata;
+
+static void __init run_job(struct stage_job *job)
+{
+    struct init_profile_sample start;
+
+    pr_loc_dbg("Initializing stage %s", job->stage->name);
+    init_profile_begin(&start);
+    job->result = job->stage->init();
+    init_profile_record(job - jobs, job->stage->name, job->stage->parallel, false, &start);
+    if (unlikely(job->result != 0))
+        pr_loc_err("Stage %s failed to initialize - error=%d", job->stage->name, job->result);
+}
+
+static void __init run_job_async(void *data, async_cookie_t cookie)
+{
+    run_job(data);
+}
+
+int __init run_init_stages(const struct init_stage *stages, unsigned int num, unsigned long *done)
+{
+    int out = 0;
+    unsigned long pending = 0;
+    u64 start_ns = ktime_to_ns(ktime_get());
+    *done = 0;
+
+    if (unlikely(num > MAX_INIT_STAGES)) {
+        pr_loc_bug("Too many init stages (%u > %d)", num, MAX_INIT_STAGES);
+        return -E2BIG;
+    }
+
+    for (int i = 0; i < num; i++) {
+        if (stages[i].init)
+            pending |= INIT_STAGE_DEP(i);
+        else
+            *done |= INIT_STAGE_DEP(i); //disabled stages are satisfied dependencies
+    }
+
+    while (pending) {
+        unsigned long wave = 0;
+        for (int i = 0; i < num; i++) {
+            if ((pending & INIT_STAGE_DEP(i)) && (stages[i].deps & ~*done) == 0)
+                wave |= INIT_STAGE_DEP(i);
+        }
+
+        if (unlikely(!wave)) {
+            pr_loc_bug("Init stages have unsatisfiable dependencies (pending=0x%lx)", pending);
+            out = -EDEADLK;
+            goto error_out;
+        }
+
+        //Start parallel ones first so that they run while the serial ones are being done in this thread
+        for (int i = 0; i < num; i++) {
+            if (!(wave & INIT_STAGE_DEP(i)))
+                continue;
+
+            jobs[i].stage = &stages[i];
+            jobs[i].result = 0;
+            if (stages[i].parallel)
+                async_schedule_domain(run_job_async, &jobs[i], &init_stages_domain);
+        }
+
+        for (int i = 0; i < num; i++) {
+            if ((wave & INIT_STAGE_DEP(i)) && !stages[i].parallel)
+                run_job(&jobs[i]);
+        }
+        async_synchronize_full_domain(&init_stages_domain);
+
+        pending &= ~wave;
+        for (int i = 0; i < num; i++) {
+            if (!(wave & INIT_STAGE_DEP(i)))
+                continue;
+
+            if (likely(jobs[i].result == 0))
+                *done |= INIT_STAGE_DEP(i);
+            else if (!out)
+                out = jobs[i].result;
+        }
+
+        if (unlikely(out != 0))
+            goto error_out;
+    }
+
+    init_profile_publish(ktime_to_ns(ktime_get()) - start_ns);
+    return 0;
+
+    error_out:
+    exit_stages(stages, num, *done);
+    *done = 0;
+    return out;
+}
+
+void exit_stages(const struct init_stage *stages, unsigned int num, unsigned long done)
+{
+    struct init_profile_sample start;
+    u64 start_ns = ktime_to_ns(ktime_get());
+    init_profile_unpublish();
+
+    //Disabled stages were only marked as done - they have nothing to exit
+    for (int i = 0; i < num; i++) {
+        if (!stages[i].init)
+            done &= ~INIT_STAGE_DEP(i);
+    }
+
+    while (done) {
+        int picked = -1;
+        for (int i = num - 1; i >= 0; i--) { //prefer reverse table order among independent ones
+            if (!(done & INIT_STAGE_DEP(i)))
+                continue;
+
+            bool needed = false;
+            for (int j = 0; j < num && !needed; j++)
+                needed = (done & INIT_STAGE_DEP(j)) && (stages[j].deps & INIT_STAGE_DEP(i));
+
+            if (!needed) {
+                picked = i;
+                break;
+            }
+        }
+
+        if (unlikely(picked < 0)) { //can only happen with circular deps which run_init_stages() wouldn't init
+            pr_loc_bug("Init stages have circular dependencies (done=0x%lx)", done);
+            break;
+        }
+
+        done &= ~INIT_STAGE_DEP(picked);
+        if (!stages[picked].exit)
+            continue;
+
+        pr_loc_dbg("Exiting stage %s", stages[picked].name);
+        init_profile_begin(&start);
+        int out = stages[picked].exit();
+        init_profile_record(picked, stages[picked].name, stages[picked].parallel, true, &start);
+        if (out != 0)
+            pr_loc_wrn("Stage %s failed to exit - error=%d", stages[picked].name, out);
+    }
+
+    init_profile_print_exit(ktime_to_ns(ktime_get()) - start_ns);
+}
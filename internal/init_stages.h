@@ -0,0 +1,46 @@
+#ifndef REDPILL_INIT_STAGES_H
+#define REDPILL_INIT_STAGES_H
+
+#include <linux/types.h> //bool
+
+#define MAX_INIT_STAGES BITS_PER_LONG
+#define INIT_STAGE_DEP(idx) (1UL << (idx))
+
+/**
+ * Single step of module initialization
+ *
+ * Stages are identified by their index in the table passed to run_init_stages(). A stage starts only after all stages
+ * listed in deps finished successfully.
+ */
+struct init_stage {
+    const char *name;
+    int (*init)(void); //NULL if the stage is disabled (it's treated as done)
+    int (*exit)(void); //NULL if there's nothing to undo
+    unsigned long deps; //INIT_STAGE_DEP() of stages which must be initialized first
+    bool parallel:1; //whether init can run concurrently with other stages (in a worker, not in the module init thread)
+};
+
+/**
+ * Initializes all stages respecting their dependencies
+ *
+ * Stages are started in "waves": every wave contains all stages which have their dependencies met. Parallel stages of
+ * a wave are scheduled asynchronously while the remaining ones run one by one (in the table order) in the calling
+ * thread. If any stage fails all stages which were initialized are reversed using exit_stages().
+ *
+ * @param done will be populated with a bitmask of initialized stages (to be passed to exit_stages() later)
+ *
+ * @return 0 on success, -E on error (the first error encountered)
+ */
+int run_init_stages(const struct init_stage *stages, unsigned int num, unsigned long *done);
+
+/**
+ * Reverses initialization of stages in reverse dependency order
+ *
+ * A stage is exited only after all initialized stages depending on it were exited. Failures are logged but don't stop
+ * other stages from exiting.
+ *
+ * @param done bitmask of stages to exit (see run_init_stages())
+ */
+void exit_stages(const struct init_stage *stages, unsigned int num, unsigned long done);
+
+#endif //REDPILL_INIT_STAGES_H
@@ -1,65 +1,101 @@
+/**
+ * Allows watching for registration of specific drivers (by overriding driver_register())
+ *
+ * HOW IT WORKS?
+ * Watchers are kept in a small hash table keyed by the driver name. Multiple watchers can observe the same driver -
+ * they're called in the order in which they were registered. Since driver_register() is called for every driver in the
+ * system the lookup must be cheap: it's lock-free (RCU) and only touches a single bucket.
+ * Callbacks can sleep and can unregister watchers (incl. themselves) so they're never called under RCU. Instead,
+ * matching watchers are collected (with a reference taken) and called afterwards. Watchers are freed when the last
+ * reference is gone.
+ *
+ * LIVE-ONLY WATCHERS
+ * Overriding driver_register() isn't free: if detours aren't available every registration in the system has to swap
+ * the code of driver_register() back and forth. When all watchers for a driver only care about DWATCH_STATE_LIVE we
+ * don't need to intercept anything - such watchers use a module notifier instead. On every module which finished
+ * loading a work is scheduled which checks (using driver_find()) whether watched drivers appeared. The override of
+ * driver_register() is only installed when there's at least one watcher needing DWATCH_STATE_COMING.
+ * Since the kernel doesn't notify about drivers being registered, LIVE-only watchers are triggered after the module
+ * registering the driver finished its init (so they're not suitable for built-in drivers - see is_driver_registered()).
+ */
 #include "intercept_driver_register.h"
 #include "../common.h"
 #include "override_symbol.h"
 #include <linux/platform_device.h> //platform_bus_type
-
-#define MAX_WATCHERS 5 //can be increased as-needed
+#include <linux/hashtable.h> //DEFINE_HASHTABLE, hash_*_rcu
+#include <linux/jhash.h> //jhash()
+#include <linux/mutex.h>
+#include <linux/rcupdate.h> //rcu_read_lock(), kfree_rcu()
+#include <linux/module.h> //register_module_notifier()
+#include <linux/workqueue.h> //checking for LIVE-only watchers
+
+#define WATCHERS_HASH_BITS 4
+#define MAX_WATCHERS_PER_DRIVER 8 //max number of watchers called for a single driver, can be increased as-needed
 #define WATCH_FUNCTION "driver_register"
 
 struct driver_watcher_instance {
+    struct hlist_node node;
+    struct rcu_head rcu;
+    atomic_t refs; //the registry holds one reference as long as the watcher is registered
+    u32 hash;
     watch_dr_callback *cb;
     bool notify_coming:1;
     bool notify_live:1;
+    bool registered:1; //protected by watchers_lock
+    bool via_notifier:1; //LIVE-only watcher which doesn't need driver_register() override
+    bool seen_live:1; //driver was already found by LIVE-only check (accessed only from live_check_work)
     char name[];
 };
 
 static override_symbol_inst *ov_driver_register = NULL;
-static driver_watcher_instance *watchers[MAX_WATCHERS] = { NULL };
+static DEFINE_HASHTABLE(watchers, WATCHERS_HASH_BITS);
+static unsigned int override_watchers_num = 0; //protected by watchers_lock
+static unsigned int notifier_watchers_num = 0; //protected by watchers_lock
+static DEFINE_MUTEX(watchers_lock); //only for writers
 
-/**
- * Finds a registered watcher based on the driver name
- *
- * @return pointer to the spot on the list containing driver_watcher_instance or NULL if not found
- */
-static driver_watcher_instance **match_watcher(const char *name)
-{
-    for (int i=0; i < MAX_WATCHERS; ++i) {
-        if (!watchers[i])
-            continue; //there could be "holes" due to unwatch calls
+static void check_live_drivers(struct work_struct *work);
+static DECLARE_WORK(live_check_work, check_live_drivers);
+static struct task_struct *live_check_task = NULL; //task currently executing check_live_drivers()
 
-        if(strcmp(name, watchers[i]->name) == 0)
-            return &watchers[i];
-    }
-
-    return NULL;
+static __always_inline u32 hash_driver_name(const char *name)
+{
+    return jhash(name, strlen(name), 0);
 }
 
-/**
- * Finds an empty spot in the watchers list
- *
- * @return pointer to the spot on the list which is empty or NULL if not found
- */
-static driver_watcher_instance **watcher_list_spot(void)
+static void put_watcher(driver_watcher_instance *watcher)
 {
-    for (int i=0; i < MAX_WATCHERS; ++i) {
-        if (!watchers[i])
-            return &watchers[i];
-    }
-
-    return NULL;
+    if (atomic_dec_and_test(&watcher->refs))
+        kfree_rcu(watcher, rcu);
 }
 
 /**
- * Checks if there any watchers registered (to determine if it makes sense to still shim the driver_register())
+ * Collects (and takes references to) all watchers registered for a given driver name
+ *
+ * @return number of watchers saved to out
  */
-static bool has_any_watchers(void)
+static unsigned int get_matching_watchers(const char *name, driver_watcher_instance **out)
 {
-    for (int i=0; i < MAX_WATCHERS; ++i) {
-        if (watchers[i])
-            return true;
+    u32 hash = hash_driver_name(name);
+    driver_watcher_instance *watcher;
+    unsigned int num = 0;
+
+    rcu_read_lock();
+    hash_for_each_possible_rcu(watchers, watcher, node, hash) {
+        if (watcher->hash != hash || watcher->via_notifier || strcmp(name, watcher->name) != 0 ||
+            !atomic_inc_not_zero(&watcher->refs))
+            continue;
+
+        if (unlikely(num >= MAX_WATCHERS_PER_DRIVER)) {
+            pr_loc_bug("Too many watchers for %s - some will be skipped", name);
+            put_watcher(watcher);
+            break;
+        }
+
+        out[num++] = watcher;
     }
+    rcu_read_unlock();
 
-    return false;
+    return num;
 }
 
 /**
@@ -85,33 +121,32 @@ static int call_original_driver_register(struct device_driver *drv)
  */
 static int driver_register_shim(struct device_driver *drv)
 {
-    driver_watcher_instance **watcher_lptr = match_watcher(drv->name);
-    int driver_load_result;
+    driver_watcher_instance *matched[MAX_WATCHERS_PER_DRIVER];
+    bool done[MAX_WATCHERS_PER_DRIVER] = { false }; //watchers which want to be removed
+    unsigned int num = get_matching_watchers(drv->name, matched);
+    int driver_load_result = 0;
     bool driver_register_fulfilled = false;
 
-    if (unlikely(!watcher_lptr)) {
+    if (likely(!num)) {
         pr_loc_dbg("%s interception active - no handler observing \"%s\" found", WATCH_FUNCTION, drv->name);
         return call_original_driver_register(drv);
     }
 
-    pr_loc_dbg("%s interception active - calling handler %pF<%p> for \"%s\"", WATCH_FUNCTION, (*watcher_lptr)->cb,
-               (*watcher_lptr)->cb, drv->name);
+    pr_loc_dbg("%s interception active - calling %u handler(s) for \"%s\"", WATCH_FUNCTION, num, drv->name);
 
-    if ((*watcher_lptr)->notify_coming) {
-        pr_loc_dbg("Calling for DWATCH_STATE_COMING");
-        switch ((*watcher_lptr)->cb(drv, DWATCH_STATE_COMING)) {
-            //CONTINUE and DONE cannot use fall-through as we cannot unregister watcher before calling it (as if this is the
-            // last watcher the whole override will be stopped
+    //the first watcher which aborts decides about the result (and watchers after it are not notified about COMING)
+    for (unsigned int i = 0; i < num && !driver_register_fulfilled; ++i) {
+        if (!matched[i]->notify_coming)
+            continue;
+
+        pr_loc_dbg("Calling %pF<%p> for DWATCH_STATE_COMING", matched[i]->cb, matched[i]->cb);
+        switch (matched[i]->cb(drv, DWATCH_STATE_COMING)) {
             case DWATCH_NOTIFY_CONTINUE:
-                pr_loc_dbg("Calling original %s() & leaving watcher active", WATCH_FUNCTION);
-                driver_load_result = call_original_driver_register(drv);
-                driver_register_fulfilled = true;
                 break;
             case DWATCH_NOTIFY_DONE:
-                pr_loc_dbg("Calling original %s() & removing watcher", WATCH_FUNCTION);
-                driver_load_result = call_original_driver_register(drv);
-                unwatch_driver_register(*watcher_lptr); //regardless of the call result we unregister
-                return driver_load_result; //we return here as the watcher doesn't want to be bothered anymore
+                //we cannot unregister watcher now (as if this is the last watcher the whole override will be stopped)
+                done[i] = true;
+                break;
             case DWATCH_NOTIFY_ABORT_OK:
                 pr_loc_dbg("Faking OK return of %s() per callback request", WATCH_FUNCTION);
                 driver_load_result = 0;
@@ -124,7 +159,7 @@ static int driver_register_shim(struct device_driver *drv)
                 break;
             default: //This should never happen if the callback is correct
                 pr_loc_bug("%s callback %pF<%p> returned invalid status value during DWATCH_STATE_COMING",
-                           WATCH_FUNCTION, (*watcher_lptr)->cb, (*watcher_lptr)->cb);
+                           WATCH_FUNCTION, matched[i]->cb, matched[i]->cb);
         }
     }
 
@@ -133,18 +168,103 @@ static int driver_register_shim(struct device_driver *drv)
 
     if (driver_load_result != 0) {
         pr_loc_err("%s driver failed to load - not triggering STATE_LIVE callbacks", drv->name);
-        return driver_load_result;
+    } else {
+        for (unsigned int i = 0; i < num; ++i) {
+            if (!matched[i]->notify_live || done[i]) //watchers which are done don't want to be bothered anymore
+                continue;
+
+            pr_loc_dbg("Calling %pF<%p> for DWATCH_STATE_LIVE", matched[i]->cb, matched[i]->cb);
+            if (matched[i]->cb(drv, DWATCH_STATE_LIVE) == DWATCH_NOTIFY_DONE)
+                done[i] = true;
+        }
     }
 
-    if ((*watcher_lptr)->notify_live) {
-        pr_loc_dbg("Calling for DWATCH_STATE_LIVE");
-        if ((*watcher_lptr)->cb(drv, DWATCH_STATE_LIVE) == DWATCH_NOTIFY_DONE)
-            unwatch_driver_register(*watcher_lptr);
+    for (unsigned int i = 0; i < num; ++i) {
+        if (done[i])
+            unwatch_driver_register(matched[i]); //regardless of the call result we unregister
+        put_watcher(matched[i]);
     }
 
     return driver_load_result;
 }
 
+/**
+ * Collects (and takes references to) all LIVE-only watchers
+ *
+ * @return number of watchers saved to out
+ */
+static unsigned int get_notifier_watchers(driver_watcher_instance **out)
+{
+    driver_watcher_instance *watcher;
+    unsigned int num = 0;
+    int bkt;
+
+    rcu_read_lock();
+    hash_for_each_rcu(watchers, bkt, watcher, node) {
+        if (!watcher->via_notifier || !atomic_inc_not_zero(&watcher->refs))
+            continue;
+
+        if (unlikely(num >= MAX_WATCHERS_PER_DRIVER)) {
+            pr_loc_bug("Too many LIVE-only watchers - some will be skipped");
+            put_watcher(watcher);
+            break;
+        }
+
+        out[num++] = watcher;
+    }
+    rcu_read_unlock();
+
+    return num;
+}
+
+/**
+ * Triggers LIVE-only watchers for drivers which appeared since the last check
+ */
+static void check_live_drivers(struct work_struct *work)
+{
+    driver_watcher_instance *matched[MAX_WATCHERS_PER_DRIVER];
+    unsigned int num = get_notifier_watchers(matched);
+
+    live_check_task = current;
+    for (unsigned int i = 0; i < num; ++i) {
+        struct device_driver *drv = driver_find(matched[i]->name, &platform_bus_type);
+        if (IS_ERR_OR_NULL(drv)) {
+            matched[i]->seen_live = false; //if it was there it's gone now - we should notify when it comes back
+            continue;
+        }
+
+        if (matched[i]->seen_live)
+            continue;
+
+        matched[i]->seen_live = true;
+        pr_loc_dbg("Calling %pF<%p> for DWATCH_STATE_LIVE of \"%s\" (via notifier)", matched[i]->cb, matched[i]->cb,
+                   matched[i]->name);
+        if (matched[i]->cb(drv, DWATCH_STATE_LIVE) == DWATCH_NOTIFY_DONE)
+            unwatch_driver_register(matched[i]);
+    }
+    live_check_task = NULL;
+
+    for (unsigned int i = 0; i < num; ++i)
+        put_watcher(matched[i]);
+}
+
+/**
+ * Schedules check of LIVE-only watchers every time a module finished loading
+ *
+ * Watchers cannot be called directly here: the notifier chain lock is held and callbacks may unregister watchers.
+ */
+static int module_live_notify(struct notifier_block *nb, unsigned long action, void *data)
+{
+    if (action == MODULE_STATE_LIVE)
+        schedule_work(&live_check_work);
+
+    return NOTIFY_OK;
+}
+
+static struct notifier_block module_live_nb = {
+    .notifier_call = module_live_notify,
+};
+
 /**
  * Enables override of driver_register() to watch for new drivers registration
  *
@@ -184,9 +304,10 @@ static int stop_watching(void)
     pr_loc_dbg("Stopping intercept of %s()", WATCH_FUNCTION);
     int out = restore_symbol_ng(ov_driver_register);
     if (unlikely(out != 0)) {
-        pr_loc_err("Failed to restore %s() - error=%ld", WATCH_FUNCTION, PTR_ERR(ov_driver_register));
+        pr_loc_err("Failed to restore %s() - error=%d", WATCH_FUNCTION, out);
         return out;
     }
+    ov_driver_register = NULL;
     pr_loc_dbg("Intercept of %s() stopped", WATCH_FUNCTION);
 
     return 0;
@@ -194,69 +315,95 @@ static int stop_watching(void)
 
 driver_watcher_instance *watch_driver_register(const char *name, watch_dr_callback *cb, int event_mask)
 {
-    driver_watcher_instance **watcher_lptr = match_watcher(name);
-    if (unlikely(watcher_lptr)) {
-        pr_loc_err("Watcher for %s already exists (callback=%pF<%p>)", name, (*watcher_lptr)->cb, (*watcher_lptr)->cb);
-        return ERR_PTR(-EEXIST);
+    driver_watcher_instance *watcher = kmalloc(sizeof(driver_watcher_instance) + (sizeof(char) * strlen(name) + 1),
+                                               GFP_KERNEL);
+    if (unlikely(!watcher)) {
+        pr_loc_crt("kmalloc failed");
+        return ERR_PTR(-ENOMEM);
     }
 
-    watcher_lptr = watcher_list_spot();
-    if (unlikely(!watcher_lptr)) {
-        pr_loc_bug("There are no free spots for a new watcher");
-        return ERR_PTR(-ENOSPC);
+    strcpy(watcher->name, name);
+    watcher->hash = hash_driver_name(name);
+    watcher->cb = cb;
+    atomic_set(&watcher->refs, 1);
+    watcher->notify_coming = ((event_mask & DWATCH_STATE_COMING) == DWATCH_STATE_COMING);
+    watcher->notify_live = ((event_mask & DWATCH_STATE_LIVE) == DWATCH_STATE_LIVE);
+    watcher->via_notifier = !watcher->notify_coming;
+    watcher->seen_live = watcher->via_notifier && is_driver_registered(name, NULL) == 1; //only new registrations count
+    watcher->registered = true;
+
+    int out = 0;
+    mutex_lock(&watchers_lock);
+    if (watcher->via_notifier) {
+        if (!notifier_watchers_num) {
+            pr_loc_dbg("Registering the first LIVE-only watcher - registering module notifier");
+            out = register_module_notifier(&module_live_nb);
+        }
+    } else if (!ov_driver_register) {
+        pr_loc_dbg("Registering the first driver_register watcher - starting watching");
+        out = start_watching();
     }
 
-    *watcher_lptr = kmalloc(sizeof(driver_watcher_instance) + (sizeof(char) * strlen(name) + 1), GFP_KERNEL);
-    if (unlikely(!*watcher_lptr)) {
-        pr_loc_err("kmalloc failed");
-        *watcher_lptr = NULL;
-        return ERR_PTR(-ENOMEM);
+    if (unlikely(out != 0)) {
+        mutex_unlock(&watchers_lock);
+        pr_loc_err("Failed to start watching for %s - error=%d", name, out);
+        kfree(watcher);
+        return ERR_PTR(out);
     }
 
-    strcpy((*watcher_lptr)->name, name);
-    (*watcher_lptr)->cb = cb;
-    (*watcher_lptr)->notify_coming = ((event_mask & DWATCH_STATE_COMING) == DWATCH_STATE_COMING);
-    (*watcher_lptr)->notify_live = ((event_mask & DWATCH_STATE_LIVE) == DWATCH_STATE_LIVE);
-    pr_loc_dbg("Registered driver_register watcher for %s (coming=%d, live=%d)", name,
-               (*watcher_lptr)->notify_coming ? 1 : 0, (*watcher_lptr)->notify_live ? 1 : 0);
-
-    if (!ov_driver_register) {
-        pr_loc_dbg("Registered the first driver_register watcher - starting watching");
-        int out = start_watching();
-        if (unlikely(out != 0))
-            return ERR_PTR(out);
-    }
+    hash_add_rcu(watchers, &watcher->node, watcher->hash);
+    if (watcher->via_notifier)
+        ++notifier_watchers_num;
+    else
+        ++override_watchers_num;
+    mutex_unlock(&watchers_lock);
+
+    pr_loc_dbg("Registered driver_register watcher %pF<%p> for %s (coming=%d, live=%d, notifier=%d)", cb, cb, name,
+               watcher->notify_coming ? 1 : 0, watcher->notify_live ? 1 : 0, watcher->via_notifier ? 1 : 0);
 
-    return *watcher_lptr;
+    return watcher;
 }
 
 int unwatch_driver_register(driver_watcher_instance *instance)
 {
-    driver_watcher_instance **matched_lptr = match_watcher(instance->name);
-    if (unlikely(!matched_lptr)) {
-        pr_loc_bug("Watcher %p for %s couldn't be found in the watchers list", instance, instance->name);
-        return -ENOENT;
+    int out = 0;
+    bool removed = false;
+    bool notifier_stopped = false;
+
+    mutex_lock(&watchers_lock);
+    if (unlikely(!instance->registered)) {
+        pr_loc_bug("Watcher %p for %s is not registered", instance, instance->name);
+        out = -ENOENT;
+        goto out_unlock;
     }
 
-    if (unlikely(*matched_lptr != instance)) {
-        pr_loc_bug("Watcher %p for %s was found but the instance on the list %p (@%p) isn't the same (?!)", instance,
-                   instance->name, *matched_lptr, matched_lptr);
-        return -EINVAL;
-    }
+    hash_del_rcu(&instance->node);
+    instance->registered = false;
+    removed = true;
+    pr_loc_dbg("Removed %pF<%p> watcher for %s driver", instance->cb, instance->cb, instance->name);
 
-    pr_loc_dbg("Removed %pF<%p> watcher for %s driver", (*matched_lptr)->cb, (*matched_lptr)->cb,
-               (*matched_lptr)->name);
-    kfree(*matched_lptr);
-    *matched_lptr = NULL;
-
-    if (!has_any_watchers()) {
+    if (instance->via_notifier) {
+        if (--notifier_watchers_num == 0) {
+            pr_loc_dbg("Removed last LIVE-only watcher - unregistering module notifier");
+            out = unregister_module_notifier(&module_live_nb);
+            notifier_stopped = true;
+        }
+    } else if (--override_watchers_num == 0) {
         pr_loc_dbg("Removed last driver_register watcher - stopping watching");
-        int out;
-        if ((out = stop_watching()) != 0)
-            return out;
+        out = stop_watching();
     }
 
-    return 0;
+    out_unlock:
+    mutex_unlock(&watchers_lock);
+
+    //The work takes watchers_lock (via unwatch) so it must be cancelled after unlocking - but not from within itself
+    if (notifier_stopped && current != live_check_task)
+        cancel_work_sync(&live_check_work);
+
+    if (likely(removed))
+        put_watcher(instance); //drop the registry reference (the instance may be freed now)
+
+    return out;
 }
 
 int is_driver_registered(const char *name, struct bus_type *bus)
@@ -29,12 +29,16 @@ typedef driver_watch_notify_result (watch_dr_callback)(struct device_driver *drv
  *
  * Note: if the driver is already loaded this will do nothing, unless the driver is removed and re-registers. You should
  * probably call is_driver_registered() first.
+ * Multiple watchers can be registered for the same driver - they are called in the order of registration. When any of
+ * them aborts registration during DWATCH_STATE_COMING the ones after it will not receive DWATCH_STATE_COMING.
+ * Watchers interested ONLY in DWATCH_STATE_LIVE don't intercept driver_register() at all: they are notified after the
+ * module registering the driver finishes loading, and only platform drivers are supported in this mode.
  *
  * @param name Name of the driver you want to observe
  * @param cb Callback called on an event
  * @param event_mask ORed driver_watch_notify_state flags to when the callback is called
  *
- * @return 0 on success, -E on error
+ * @return instance ptr on success, ERR_PTR(-E) on error
  */
 driver_watcher_instance *watch_driver_register(const char *name, watch_dr_callback *cb, int event_mask);
 
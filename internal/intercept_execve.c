@@ -13,6 +13,17 @@
  * struct directly. This requires re-exported versions of these functions, so it may be marginally slower.
  * Because of that this trick is only utilized on Linux >v3.18 and older ones call the stub as normal.
  *
+ * BLOCKING BY IDENTITY
+ * Comparing paths passed to execve() misses symlinks, relative paths (./foo) and any other aliases. Because of that the
+ * decision is made later, when the kernel already opened the binary: search_binary_handler() is overridden and the
+ * (s_dev, i_ino) identity of bprm->file is looked up in a small sorted array. Blocked files are resolved to identities
+ * when they're added, or - since they often don't exist yet when we're loaded (e.g. before the root fs is mounted) -
+ * lazily: they're retried at most once a second during exec until found, and the literal path is still matched in the
+ * meantime (which records the identity as well). When the binary is blocked search_binary_handler() fails with a
+ * private error code (the kernel cleans up everything properly) and the execve() shim turns it into a fake success.
+ * If search_binary_handler() cannot be detoured (see override_symbol_ng()) it's not overridden at all and the execve()
+ * shim falls back to matching literal paths only.
+ *
  * References:
  *  - https://github.com/torvalds/linux/commit/b645af2d5905c4e32399005b867987919cbfc3ae
  *  - https://my.oschina.net/macwe/blog/603583
@@ -23,47 +34,315 @@
 #include <asm/unistd_64.h> //syscalls numbers
 #include <linux/limits.h>
 #include <linux/fs.h> //struct filename
-#include "override_symbol.h" //override_syscall()
+#include <linux/hashtable.h> //DEFINE_HASHTABLE, hash_*_rcu
+#include <linux/jump_label.h> //struct static_key, static_key_false()
+#include <linux/mutex.h>
+#include <linux/rcupdate.h> //rcu_read_lock(), synchronize_rcu()
+#include <linux/binfmts.h> //struct linux_binprm
+#include <linux/namei.h> //kern_path()
+#include <linux/jiffies.h>
+#include "override_symbol.h" //override_syscall(), override_symbol_ng()
 #include "call_protected.h" //do_execve(), getname(), putname()
+#include "init_arena.h" //rp_arena_alloc()
 
 #ifdef RPDBG_EXECVE
 #include "../debug/debug_execve.h"
 #endif
 
-#define MAX_INTERCEPTED_FILES 10
+/*
+ * Blocked filenames are kept in a hash set. Since execve() is called A LOT the lookup is optimized:
+ *  - when nothing is blocked a static key skips the lookup entirely
+ *  - the hash is derived only from the length & first bytes of the path (so that we don't hash long paths twice)
+ *  - before a full comparison the length and first bytes are compared as numbers
+ * Entries are only added while the interceptor is active (and all are removed after it's gone) so readers use RCU.
+ */
+#define BLOCKED_HASH_BITS 5
+#define PREFIX_LEN sizeof(unsigned long)
 
-static char * intercepted_filenames[MAX_INTERCEPTED_FILES] = { NULL };
+struct blocked_filename {
+    struct hlist_node node;
+    unsigned long prefix; //first PREFIX_LEN bytes of the name (zero-padded)
+    size_t len;
+    bool resolved; //whether the identity of the file was found already
+    char name[];
+};
 
-int add_blocked_execve_filename(const char *filename)
+struct exec_identity {
+    dev_t dev;
+    unsigned long ino;
+};
+
+struct exec_identities {
+    struct rcu_head rcu;
+    unsigned int num;
+    struct exec_identity ids[]; //sorted by dev, ino
+};
+
+//Error returned from search_binary_handler() shim when the binary is blocked; nothing in the exec path uses this one
+#define EXECVE_BLOCKED_ERR ENOTUNIQ
+#define RESOLVE_RETRY_INTERVAL HZ
+
+static DEFINE_HASHTABLE(blocked_filenames, BLOCKED_HASH_BITS);
+static struct exec_identities __rcu *blocked_identities = NULL;
+static unsigned int unresolved_filenames = 0; //protected by blocked_filenames_lock
+static unsigned long next_resolve_attempt = 0; //jiffies
+static DEFINE_MUTEX(blocked_filenames_lock); //only for writers
+static struct static_key blocklist_active = STATIC_KEY_INIT_FALSE;
+
+static __always_inline unsigned long get_name_prefix(const char *name, size_t len)
 {
-    if (unlikely(strlen(filename) > PATH_MAX))
-        return -ENAMETOOLONG;
+    unsigned long prefix = 0;
+    memcpy(&prefix, name, len < PREFIX_LEN ? len : PREFIX_LEN);
+
+    return prefix;
+}
+
+static __always_inline unsigned long get_name_key(unsigned long prefix, size_t len)
+{
+    return prefix ^ len;
+}
+
+static bool is_blocked_filename(const char *name)
+{
+    size_t len = strlen(name);
+    unsigned long prefix = get_name_prefix(name, len);
+    struct blocked_filename *entry;
+    bool found = false;
 
-    unsigned int idx = 0;
-    while (likely(intercepted_filenames[idx])) { //Find free spot
-        if (unlikely(strcmp(filename, intercepted_filenames[idx]) == 0)) { //Does it exist already?
-            pr_loc_bug("File %s was already added at %d", filename, idx);
-            return -EEXIST;
+    rcu_read_lock();
+    hash_for_each_possible_rcu(blocked_filenames, entry, node, get_name_key(prefix, len)) {
+        if (entry->len == len && entry->prefix == prefix &&
+            (len <= PREFIX_LEN || memcmp(entry->name + PREFIX_LEN, name + PREFIX_LEN, len - PREFIX_LEN) == 0)) {
+            found = true;
+            break;
         }
+    }
+    rcu_read_unlock();
+
+    return found;
+}
+
+static __always_inline int cmp_identity(const struct exec_identity *a, const struct exec_identity *b)
+{
+    if (a->dev != b->dev)
+        return a->dev < b->dev ? -1 : 1;
+
+    return a->ino == b->ino ? 0 : (a->ino < b->ino ? -1 : 1);
+}
 
-        if(unlikely(++idx >= MAX_INTERCEPTED_FILES)) { //Are we out of indexes?
-            pr_loc_bug("Tried to add %d intercepted filename (max=%d)", idx, MAX_INTERCEPTED_FILES);
-            return -ENOMEM;
+static bool is_blocked_identity(const struct exec_identity *id)
+{
+    bool found = false;
+
+    rcu_read_lock();
+    struct exec_identities *ids = rcu_dereference(blocked_identities);
+    if (ids) {
+        int low = 0, high = (int)ids->num - 1;
+        while (low <= high) {
+            int mid = (low + high) / 2;
+            int cmp = cmp_identity(id, &ids->ids[mid]);
+            if (cmp == 0) {
+                found = true;
+                break;
+            }
+
+            if (cmp < 0)
+                high = mid - 1;
+            else
+                low = mid + 1;
         }
     }
+    rcu_read_unlock();
+
+    return found;
+}
+
+/**
+ * Adds identity to the sorted list of blocked ones (copy-on-write); blocked_filenames_lock must be held
+ */
+static int add_blocked_identity(const struct exec_identity *id)
+{
+    struct exec_identities *old = rcu_dereference_protected(blocked_identities,
+                                                            lockdep_is_held(&blocked_filenames_lock));
+    unsigned int old_num = old ? old->num : 0;
+    unsigned int pos = 0;
 
-    intercepted_filenames[idx] = kmalloc(strlen(filename)+1, GFP_KERNEL);
-    strcpy(intercepted_filenames[idx], filename); //Size checked above
-    if (!intercepted_filenames[idx]) {
+    while (pos < old_num && cmp_identity(&old->ids[pos], id) < 0)
+        ++pos;
+
+    if (pos < old_num && cmp_identity(&old->ids[pos], id) == 0)
+        return 0; //e.g. two blocked paths pointing to the same file
+
+    struct exec_identities *new = kmalloc(sizeof(struct exec_identities) +
+                                          sizeof(struct exec_identity) * (old_num + 1), GFP_KERNEL);
+    if (unlikely(!new)) {
         pr_loc_crt("kmalloc failure!");
         return -ENOMEM;
     }
 
+    new->num = old_num + 1;
+    if (old) {
+        memcpy(new->ids, old->ids, sizeof(struct exec_identity) * pos);
+        memcpy(&new->ids[pos + 1], &old->ids[pos], sizeof(struct exec_identity) * (old_num - pos));
+    }
+    new->ids[pos] = *id;
+
+    rcu_assign_pointer(blocked_identities, new);
+    if (old)
+        kfree_rcu(old, rcu);
+
+    pr_loc_dbg("Blocked file identity dev=%u ino=%lu (total=%u)", (unsigned int)id->dev, id->ino, new->num);
+    return 0;
+}
+
+static __always_inline void get_inode_identity(const struct inode *inode, struct exec_identity *id)
+{
+    id->dev = inode->i_sb->s_dev;
+    id->ino = inode->i_ino;
+}
+
+/**
+ * Tries to find identity of the file; blocked_filenames_lock must be held
+ */
+static void resolve_blocked_filename(struct blocked_filename *entry)
+{
+    struct path path;
+    struct exec_identity id;
+
+    if (kern_path(entry->name, LOOKUP_FOLLOW, &path) != 0)
+        return; //doesn't exist (yet?)
+
+    get_inode_identity(path.dentry->d_inode, &id);
+    path_put(&path);
+
+    if (add_blocked_identity(&id) == 0) {
+        entry->resolved = true;
+        --unresolved_filenames;
+        pr_loc_dbg("Resolved blocked file %s", entry->name);
+    }
+}
+
+/**
+ * Retries resolution of all blocked files which didn't exist before (rate-limited, never waits for the lock)
+ */
+static void resolve_pending_filenames(void)
+{
+    struct blocked_filename *entry;
+    int bkt;
+
+    if (!time_after_eq(jiffies, next_resolve_attempt) || !mutex_trylock(&blocked_filenames_lock))
+        return;
+
+    next_resolve_attempt = jiffies + RESOLVE_RETRY_INTERVAL;
+    hash_for_each(blocked_filenames, bkt, entry, node) {
+        if (!entry->resolved)
+            resolve_blocked_filename(entry);
+    }
+    mutex_unlock(&blocked_filenames_lock);
+}
+
+/**
+ * Records identity of a file blocked by its literal path (e.g. when it was created after we tried to resolve it)
+ */
+static void remember_blocked_identity(const struct exec_identity *id)
+{
+    if (!mutex_trylock(&blocked_filenames_lock))
+        return; //it will be resolved next time
+
+    add_blocked_identity(id);
+    mutex_unlock(&blocked_filenames_lock);
+}
+
+static bool is_blocked_binprm(struct linux_binprm *bprm)
+{
+    struct exec_identity id;
+    get_inode_identity(file_inode(bprm->file), &id);
+
+    if (likely(!is_blocked_identity(&id))) {
+        if (likely(!is_blocked_filename(bprm->filename))) {
+            if (unlikely(ACCESS_ONCE(unresolved_filenames))) {
+                resolve_pending_filenames();
+                return is_blocked_identity(&id);
+            }
+
+            return false;
+        }
+
+        remember_blocked_identity(&id);
+    }
+
+    return true;
+}
+
+int add_blocked_execve_filename(const char *filename)
+{
+    size_t len = strlen(filename);
+    if (unlikely(len > PATH_MAX))
+        return -ENAMETOOLONG;
+
+    mutex_lock(&blocked_filenames_lock);
+    if (unlikely(is_blocked_filename(filename))) { //Does it exist already?
+        mutex_unlock(&blocked_filenames_lock);
+        pr_loc_bug("File %s was already added", filename);
+        return -EEXIST;
+    }
+
+    //Filenames are added during init and stay until unload - they're never freed one by one
+    struct blocked_filename *entry = rp_arena_alloc(sizeof(struct blocked_filename) + len + 1);
+    if (unlikely(!entry)) {
+        mutex_unlock(&blocked_filenames_lock);
+        pr_loc_crt("rp_arena_alloc failure!");
+        return -ENOMEM;
+    }
+
+    memcpy(entry->name, filename, len + 1); //Size checked above
+    entry->len = len;
+    entry->prefix = get_name_prefix(filename, len);
+    entry->resolved = false;
+
+    bool was_empty = hash_empty(blocked_filenames);
+    hash_add_rcu(blocked_filenames, &entry->node, get_name_key(entry->prefix, len));
+    ++unresolved_filenames;
+    resolve_blocked_filename(entry);
+    if (was_empty)
+        static_key_slow_inc(&blocklist_active);
+    mutex_unlock(&blocked_filenames_lock);
+
     pr_loc_inf("Filename %s will be blocked from execution", filename);
 
     return 0;
 }
 
+/**
+ * Removes all blocked filenames; it must only be called after the interceptor is unregistered
+ */
+static void free_blocked_filenames(void)
+{
+    struct blocked_filename *entry;
+    struct hlist_node *tmp;
+    int bkt;
+
+    mutex_lock(&blocked_filenames_lock);
+    if (hash_empty(blocked_filenames))
+        goto out_unlock;
+
+    static_key_slow_dec(&blocklist_active);
+    synchronize_rcu(); //the syscall is already restored, but someone may still be inside of the shim
+
+    hash_for_each_safe(blocked_filenames, bkt, tmp, entry, node) {
+        hash_del_rcu(&entry->node); //entries are released with the init arena
+    }
+    unresolved_filenames = 0;
+
+    kfree(rcu_dereference_protected(blocked_identities, lockdep_is_held(&blocked_filenames_lock)));
+    RCU_INIT_POINTER(blocked_identities, NULL);
+
+    out_unlock:
+    mutex_unlock(&blocked_filenames_lock);
+}
+
+static struct override_symbol_inst *ov_search_binary_handler = NULL; //NULL if only paths are matched (no detour)
+
 //These definitions must match SYSCALL_DEFINE3(execve) as in fs/exec.c
 asmlinkage long (*org_sys_execve)(const char __user *filename,
                                   const char __user *const __user *argv,
@@ -81,18 +360,14 @@ static asmlinkage long shim_sys_execve(const char __user *filename,
 
     const char *pathname = path->name;
 #ifdef RPDBG_EXECVE
-    RPDBG_print_execve_call(pathname, argv);
+    RPDBG_record_execve_call(pathname, argv);
 #endif
 
-    for (int i = 0; i < MAX_INTERCEPTED_FILES; i++) {
-        if (!intercepted_filenames[i])
-            break;
-
-        if (unlikely(strcmp(pathname, intercepted_filenames[i]) == 0)) {
-            pr_loc_inf("Blocked %s from running", pathname);
-            //We cannot just return 0 here - execve() *does NOT* return on success, but replaces the current process ctx
-            do_exit(0);
-        }
+    //Without search_binary_handler() shim we can only match the literal path (see register_execve_interceptor())
+    if (unlikely(!ov_search_binary_handler) && static_key_false(&blocklist_active) &&
+        unlikely(is_blocked_filename(pathname))) {
+        pr_loc_inf("Blocked %s from running", pathname);
+        do_exit(0); //see below
     }
 
 //Depending on the version of the kernel do_execve() accepts bare filename (old) or the full struct filename (newer)
@@ -101,20 +376,67 @@ static asmlinkage long shim_sys_execve(const char __user *filename,
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,14,0)
     int out = _do_execve(pathname, argv, envp);
     _putname(path);
-    return out;
 #else
-    return _do_execve(path, argv, envp);
+    int out = _do_execve(path, argv, envp);
 #endif
+
+    //We cannot just return 0 here - execve() *does NOT* return on success, but replaces the current process ctx
+    if (unlikely(out == -EXECVE_BLOCKED_ERR))
+        do_exit(0);
+
+    return out;
+}
+
+static int shim_search_binary_handler(struct linux_binprm *bprm)
+{
+    if (static_key_false(&blocklist_active) && unlikely(is_blocked_binprm(bprm))) {
+        pr_loc_inf("Blocked %s from running", bprm->filename);
+        return -EXECVE_BLOCKED_ERR;
+    }
+
+    int out, ret;
+    ret = call_overridden_symbol(out, ov_search_binary_handler, bprm);
+
+    return unlikely(ret != 0) ? ret : out;
 }
 
 int register_execve_interceptor()
 {
-    int out = override_syscall(__NR_execve, shim_sys_execve, (void *)&org_sys_execve);
-    if (out != 0)
-        return out;
+#ifdef RPDBG_EXECVE
+    RPDBG_execve_trace_init();
+#endif
+
+    ov_search_binary_handler = override_symbol_ng("search_binary_handler", shim_search_binary_handler);
+    int out;
+    if (IS_ERR(ov_search_binary_handler)) {
+        out = PTR_ERR(ov_search_binary_handler);
+        ov_search_binary_handler = NULL;
+        goto error_out;
+    }
+
+    //Calling the original without a detour means copying the code back & forth on every exec without stop_machine(),
+    // which isn't safe on SMP (and binfmt_script recurses into search_binary_handler() on older kernels)
+    if (unlikely(!__get_detour_ptr(ov_search_binary_handler))) {
+        pr_loc_wrn("search_binary_handler() cannot be detoured - blocked executables will be matched by path only");
+        restore_symbol_ng(ov_search_binary_handler);
+        ov_search_binary_handler = NULL;
+    }
+
+    if ((out = override_syscall(__NR_execve, shim_sys_execve, (void *)&org_sys_execve)) != 0) {
+        if (ov_search_binary_handler)
+            restore_symbol_ng(ov_search_binary_handler);
+        ov_search_binary_handler = NULL;
+        goto error_out;
+    }
 
     pr_loc_inf("execve() interceptor registered");
     return 0;
+
+    error_out:
+#ifdef RPDBG_EXECVE
+    RPDBG_execve_trace_exit();
+#endif
+    return out;
 }
 
 int unregister_execve_interceptor()
@@ -123,13 +445,17 @@ int unregister_execve_interceptor()
     if (out != 0)
         return out;
 
-    //Free all strings duplicated in add_blocked_execve_filename()
-    unsigned int idx = 0;
-    while (idx < MAX_INTERCEPTED_FILES-1 && intercepted_filenames[idx]) {
-        kfree(intercepted_filenames[idx]);
-        intercepted_filenames[idx] = NULL;
-        idx++;
-    }
+    if (ov_search_binary_handler && (out = restore_symbol_ng(ov_search_binary_handler)) != 0)
+        return out;
+    ov_search_binary_handler = NULL;
+
+#ifdef RPDBG_EXECVE
+    synchronize_sched(); //the shim may still be executing on some CPU
+    RPDBG_execve_trace_exit();
+#endif
+
+    //Free all entries created in add_blocked_execve_filename()
+    free_blocked_filenames();
 
     pr_loc_inf("execve() interceptor unregistered");
     return 0;
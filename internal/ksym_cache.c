@@ -0,0 +1,133 @@
+/**
+ * Cache of kernel symbols addresses shared by all subsystems
+ *
+ * Every kallsyms_lookup_name() is a linear scan of the whole kallsyms table (tens of thousands of entries, with the
+ * names being decompressed on the fly). We do quite a few of these during init (overrides, syscall table discovery,
+ * protected calls...) and redpill is loaded on the boot critical path.
+ *
+ * HOW IT WORKS?
+ * All symbols which are (or may be) needed are listed below. During init a single kallsyms_on_each_symbol() pass
+ * resolves all of them at once and saves them in a small hash table. Later ksym_lookup_name() calls are just a hash
+ * lookup. Only the kernel image is considered: symbols from modules can disappear when they're unloaded, and symbols
+ * which weren't found are not cached (as they may be provided by a module loaded later).
+ *
+ * If you use a new symbol via kallsyms add it to the list below - otherwise it will still work, just slower.
+ */
+#include "ksym_cache.h"
+#include "../common.h"
+#include "init_profile.h" //rp_prof_count()
+#include <linux/kallsyms.h> //kallsyms_on_each_symbol(), kallsyms_lookup_name()
+#include <linux/hashtable.h> //DEFINE_HASHTABLE, hash_*
+#include <linux/jhash.h> //jhash()
+
+#define KSYM_HASH_BITS 6
+
+struct ksym_entry {
+    const char *name;
+    unsigned long addr;
+    struct hlist_node node;
+};
+
+#define KSYM_ENTRY(sym_name) { .name = sym_name, .addr = 0 },
+static struct ksym_entry entries[] = {
+    //internal/override_symbol.c
+    KSYM_ENTRY("sys_call_table")
+    KSYM_ENTRY("sys_close")
+    KSYM_ENTRY("sys_open")
+    KSYM_ENTRY("sys_read")
+    KSYM_ENTRY("sys_write")
+    KSYM_ENTRY("__start_rodata")
+    KSYM_ENTRY("__end_rodata")
+    KSYM_ENTRY("insn_init")
+    KSYM_ENTRY("insn_get_length")
+    KSYM_ENTRY("module_alloc")
+    //internal/call_protected.c
+    KSYM_ENTRY("cmdline_proc_show")
+    KSYM_ENTRY("flush_tlb_all")
+    KSYM_ENTRY("do_execve")
+    KSYM_ENTRY("getname")
+    KSYM_ENTRY("putname")
+    KSYM_ENTRY("final_putname")
+    KSYM_ENTRY("early_serial_setup")
+    KSYM_ENTRY("serial8250_find_port")
+    KSYM_ENTRY("scsi_scan_host_selected")
+    KSYM_ENTRY("module_free")
+    KSYM_ENTRY("module_memfree")
+    //overridden symbols (see override_symbol() & override_symbol_ng() users)
+    KSYM_ENTRY("driver_register")
+    KSYM_ENTRY("search_binary_handler")
+    KSYM_ENTRY("scsi_register_driver")
+    KSYM_ENTRY("funcSYNOSATADiskLedCtrl")
+    KSYM_ENTRY("syno_ahci_disk_led_enable")
+    KSYM_ENTRY("syno_ahci_disk_led_enable_by_port")
+    KSYM_ENTRY("apply_relocate_add")
+    KSYM_ENTRY("uart_match_port")
+    //internal/uart/uart_swapper.c
+    KSYM_ENTRY("serial8250_interrupt")
+};
+#undef KSYM_ENTRY
+
+static DEFINE_HASHTABLE(ksym_table, KSYM_HASH_BITS);
+static unsigned int entries_missing = ARRAY_SIZE(entries);
+static bool cache_ready = false;
+
+static __always_inline u32 hash_ksym_name(const char *name)
+{
+    return jhash(name, strlen(name), 0);
+}
+
+static struct ksym_entry *find_entry(const char *name, u32 hash)
+{
+    struct ksym_entry *entry;
+    hash_for_each_possible(ksym_table, entry, node, hash) {
+        if (strcmp(entry->name, name) == 0)
+            return entry;
+    }
+
+    return NULL;
+}
+
+static int fill_entry(void *data, const char *name, struct module *mod, unsigned long addr)
+{
+    if (mod) //only the kernel image (see file header)
+        return 0;
+
+    struct ksym_entry *entry = find_entry(name, hash_ksym_name(name));
+    if (!entry || entry->addr) //not needed or a duplicate (=static symbols with the same name; first one wins)
+        return 0;
+
+    entry->addr = addr;
+
+    return --entries_missing == 0 ? 1 : 0; //non-zero stops the iteration
+}
+
+void ksym_cache_init(void)
+{
+    if (unlikely(cache_ready)) {
+        pr_loc_bug("%s called twice", __FUNCTION__);
+        return;
+    }
+
+    for (unsigned int i = 0; i < ARRAY_SIZE(entries); ++i)
+        hash_add(ksym_table, &entries[i].node, hash_ksym_name(entries[i].name));
+
+    kallsyms_on_each_symbol(fill_entry, NULL);
+    rp_prof_count(RP_PROF_KSYM_SCAN);
+    cache_ready = true;
+
+    pr_loc_dbg("Cached %zu kernel symbols (%u not found)", ARRAY_SIZE(entries) - entries_missing, entries_missing);
+}
+
+unsigned long ksym_lookup_name(const char *name)
+{
+    rp_prof_count(RP_PROF_KSYM_LOOKUP);
+    if (likely(cache_ready)) {
+        struct ksym_entry *entry = find_entry(name, hash_ksym_name(name));
+        if (likely(entry && entry->addr))
+            return entry->addr;
+    }
+
+    pr_loc_dbg("Symbol %s is not cached - falling back to kallsyms_lookup_name()", name);
+    rp_prof_count(RP_PROF_KSYM_SCAN);
+    return kallsyms_lookup_name(name);
+}
@@ -0,0 +1,22 @@
+#ifndef REDPILL_KSYM_CACHE_H
+#define REDPILL_KSYM_CACHE_H
+
+/**
+ * Resolves all symbols known to be needed by the module in a single pass over kallsyms
+ *
+ * This should be called as early as possible during init (before any subsystem looks up symbols). Calling it is not
+ * required for correctness - without it every lookup simply falls back to kallsyms_lookup_name().
+ */
+void ksym_cache_init(void);
+
+/**
+ * Drop-in replacement for kallsyms_lookup_name()
+ *
+ * Symbols resolved by ksym_cache_init() are returned in O(1); anything else (or any symbol which wasn't found in the
+ * kernel image) goes to kallsyms_lookup_name() - modules may be loaded later so misses are never cached.
+ *
+ * @return address of the symbol or 0 if not found
+ */
+unsigned long ksym_lookup_name(const char *name);
+
+#endif //REDPILL_KSYM_CACHE_H
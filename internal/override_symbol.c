@@ -24,6 +24,11 @@
  * 0. Kernel keeps syscalls table in .data section which is marked as r/o: it needs to be found & unlocked (#2-4 above)
  * 1. replace pointer in the table with custom one
  * 2. relock memory
+ * The pointer placed in the table is not the override itself but a per-syscall trampoline (a dispatcher). It calls an
+ * SRCU-protected list of pre-hooks (add_syscall_hook(), ordered by priority) and then the override or the original
+ * syscall. This way multiple users can hook the same syscall without clobbering each other, adding/removing hooks or
+ * overrides doesn't touch the table again (it's only written on the first & last use of a syscall), and when there are
+ * no hooks the dispatcher costs a single extra indirect call.
  *
  * CALLING THE ORIGINAL CODE PROBLEM
  * When we wrote this code intially it was meant to be a temporary stop-gap until we have time to write a proper
@@ -62,18 +67,29 @@
  * 10. [R] Lock memory page(s) with trampoline
  * 11. [R] Enable CR0
  *
- * The call_overridden_symbol() obviously has to disable CR0 and unlock memory but it LEAVES the memory unlocked for any
- * subsequent calls. While it's less safe (as something can accidentally override it will not be reported) it shortens
- * the call path for 2nd and beyond calls to the original:
- * 1. Check if memory needs to be unlocked
- * 2. [O] Copy original preamble over trampoline
- * 3. Call original
- * 4. [R] Copy original trampoline over original preamble
+ * Without a detour (see below) call_overridden_symbol() is exactly that: restore + call + override, with both writes
+ * going through the same SMP-safe path as any other patch. It's slow, but it always does the right thing. That's why,
+ * for readability reasons and DRY of checking code it's preferred to use call_overridden_symbol() even if you call the
+ * original method even once.
+ *
+ * SMP SAFETY
+ * Installing & restoring overrides (override_symbol[_ng](), restore_symbol[s][_ng](), batches) never writes to the
+ * code while other CPUs may execute it: all pending writes are collected and applied within one stop_machine() call,
+ * followed by serializing all CPUs. Multiple symbols thus cost a single machine-wide rendezvous. This includes the
+ * legacy way of calling the original (when a detour isn't available, see below): it swaps the code on every call, so
+ * each call costs two rendezvous and it can only be used from a context which can sleep.
+ *
+ * DETOURS
+ * When the kernel contains the instruction decoder (it's not exported, but it's usually built-in for kprobes/perf) we
+ * try to avoid the whole dance above. While preparing the trampoline the preamble is decoded instruction by instruction
+ * until at least OVERRIDE_JUMP_SIZE bytes are covered. These whole instructions are copied into a small executable stub
+ * (allocated with module_alloc()) which is followed by an absolute jump back to the first instruction after the
+ * preamble. Calling the original is then just calling the stub - no locking and no writes to .text. Detours are refused
+ * (and we fall back to the method described above) when the preamble contains anything which cannot be relocated:
+ * RIP-relative addressing, relative jumps/calls (e.g. ftrace's "call __fentry__"), or an instruction ending the
+ * function (ret/jmp/int3 - i.e. the function is shorter than the trampoline). The remaining risk are backward jumps
+ * from the function body into the preamble; these practically don't happen in real prologues.
  *
- * Using call_overridden_symbol() thus has huge advantages over override+restore if you plan to call the original
- * function more than once. If you want to call it only once the call_overridden_symbol() is an equivalent of restore+
- * override. That's why, for readability reasons and DRY of checking code it's preferred to use call_overridden_symbol()
- * even if you call the original method even once.
  * There's a third method: utilizing forceful breakpoints like kprobe does. However, this is a rather complex system and
  * also contains many traps. Additionally, its overhead is no smaller than the current call_overridden_symbol()
  * implementation. The kernel uses breakpoints for more safety and to detect possible interactions between different
@@ -89,11 +105,21 @@
 
 #include "override_symbol.h"
 #include "../common.h"
-#include "call_protected.h" //_flush_tlb_all()
+#include "call_protected.h" //_flush_tlb_all(), _insn_*(), _module_alloc()
+#include "ksym_cache.h" //ksym_lookup_name()
+#include "init_profile.h" //rp_prof_count()
+#include "ovsym_stats.h" //ovsym_stats_register(), ovsym_stat_org_*()
 #include <asm/cacheflush.h> //PAGE_ALIGN
+#include <asm/insn.h> //struct insn, X86_MODRM_*
 #include <asm/asm-offsets.h> //__NR_syscall_max & NR_syscalls
 #include <asm/unistd_64.h> //syscalls numbers (e.g. __NR_read)
-#include <linux/kallsyms.h> //kallsyms_lookup_name()
+#include <linux/rcupdate.h> //synchronize_sched(), rcu_*()
+#include <linux/srcu.h> //srcu_*(), synchronize_srcu()
+#include <linux/mutex.h>
+#include <linux/slab.h> //kmalloc()
+#include <linux/stop_machine.h> //stop_machine()
+#include <linux/smp.h> //on_each_cpu()
+#include <asm/processor.h> //sync_core()
 #include <linux/string.h> //memcpy()
 
 #define JUMP_ADDR_POS 2 //JUMP starts at [2] in the jump template below
@@ -102,18 +128,32 @@ static const unsigned char jump_tpl[OVERRIDE_JUMP_SIZE] =
     "\xff\xe0" /* JMP *%rax */
 ;
 
+#define DETOUR_JUMP_ADDR_POS 6 //JUMP starts at [6] in the detour jump template below
+#define DETOUR_JUMP_SIZE (6 + 8) //JMP *0(%rip) + 64-bit-vaddr
+static const unsigned char detour_jump_tpl[DETOUR_JUMP_SIZE] =
+    "\xff\x25\x00\x00\x00\x00" /* JMP *0(%rip) - doesn't clobber any registers */
+    "\x00\x00\x00\x00\x00\x00\x00\x00" /* 64-bit-vaddr */
+;
+//Preamble is at most the trampoline size - 1 + the longest x86 instruction
+#define DETOUR_MAX_PREAMBLE (OVERRIDE_JUMP_SIZE - 1 + MAX_INSN_SIZE)
+#define DETOUR_STUB_SIZE (DETOUR_MAX_PREAMBLE + DETOUR_JUMP_SIZE)
+
+#ifdef OVSYM_STATS
+#define ENTRY_STUB_CNT_ADDR_POS 2 //counter ptr starts at [2] in the entry stub template below
+#define ENTRY_STUB_SEG_POS 10 //%gs prefix is at [10] in the entry stub template below
+#define ENTRY_STUB_JUMP_ADDR_POS 16 //JUMP starts at [16] in the entry stub template below
+#define ENTRY_STUB_SIZE (10 + 4 + 10 + 2) //MOVQ $cnt, %rax + INCQ %gs:(%rax) + MOVQ $vaddr, %rax + JMP *%rax
+static const unsigned char entry_stub_tpl[ENTRY_STUB_SIZE] =
+    "\x48\xb8" "\x00\x00\x00\x00\x00\x00\x00\x00" /* MOVQ 64-bit-percpu-ptr, %rax */
+    "\x65\x48\xff\x00" /* INCQ %gs:(%rax) - i.e. this_cpu_inc() */
+    "\x48\xb8" "\x00\x00\x00\x00\x00\x00\x00\x00" /* MOVQ 64-bit-vaddr, %rax */
+    "\xff\xe0" /* JMP *%rax */
+;
+#endif
+
 #define PAGE_ALIGN_BOTTOM(addr) (PAGE_ALIGN(addr) - PAGE_SIZE) //aligns the memory address to bottom of the page boundary
 #define NUM_PAGES_BETWEEN(low, high) (((PAGE_ALIGN_BOTTOM(high) - PAGE_ALIGN_BOTTOM(low)) / PAGE_SIZE) + 1)
 
-#define WITH_OVS_LOCK(__sym, code)                                     \
-    do {                                                               \
-        pr_loc_dbg("Obtaining lock for <%p>", __sym->org_sym_ptr);     \
-        spin_lock_irqsave(&__sym->lock, __sym->lock_irq);              \
-        ({code});                                                      \
-        spin_unlock_irqrestore(&__sym->lock, __sym->lock_irq);         \
-        pr_loc_dbg("Released lock for <%p>", __sym->org_sym_ptr);      \
-    } while(0);
-
 /**
  * Disables write-protection for the memory where symbol resides
  *
@@ -145,6 +185,7 @@ static void set_mem_rw(const unsigned long vaddr, unsigned long len)
     }
 
     _flush_tlb_all();
+    rp_prof_count(RP_PROF_TLB_FLUSH);
 }
 
 /**
@@ -166,13 +207,146 @@ static void set_mem_ro(const unsigned long vaddr, unsigned long len)
     }
 
     _flush_tlb_all();
+    rp_prof_count(RP_PROF_TLB_FLUSH);
+}
+
+/**
+ * A single pending write of OVERRIDE_JUMP_SIZE bytes into kernel text
+ */
+struct text_patch {
+    void *addr;
+    const void *code;
+    struct override_symbol_inst *sym; //optional; its "installed" flag will be set to "installed" below
+    bool installed;
+};
+
+struct text_patch_set {
+    struct text_patch *patches;
+    unsigned int num;
+};
+
+//Concurrent appliers would flip R/W attributes of the same pages under each other
+static DEFINE_MUTEX(text_patch_lock);
+
+/**
+ * Fills pages with unique pages touched by all patches
+ *
+ * @param pages must have space for at least num*2 entries (every patch can span at most two pages)
+ *
+ * @return number of pages
+ */
+static unsigned int collect_patch_pages(const struct text_patch *patches, unsigned int num, unsigned long *pages)
+{
+    unsigned int num_pages = 0;
+
+    for (unsigned int i = 0; i < num; ++i) {
+        unsigned long start = (unsigned long)patches[i].addr;
+        unsigned long last_page = (start + OVERRIDE_JUMP_SIZE - 1) & PAGE_MASK;
+
+        for (unsigned long addr = start & PAGE_MASK; addr <= last_page; addr += PAGE_SIZE) {
+            unsigned int j = 0;
+            while (j < num_pages && pages[j] != addr)
+                ++j;
+
+            if (j == num_pages)
+                pages[num_pages++] = addr;
+        }
+    }
+
+    return num_pages;
+}
+
+/**
+ * Changes R/W attribute of all pages passed WITHOUT flushing TLB (see set_mem_rw() for details)
+ */
+static void set_pages_rw_attr(const unsigned long *pages, unsigned int num_pages, bool writable)
+{
+    unsigned int level;
+    for (unsigned int i = 0; i < num_pages; ++i) {
+        pte_t *pte = lookup_address(pages[i], &level);
+        if (writable)
+            pte->pte |= _PAGE_RW;
+        else
+            pte->pte &= ~_PAGE_RW;
+    }
+}
+
+/**
+ * Executed by stop_machine() on a single CPU while all others spin with interrupts disabled
+ */
+static int write_text_patches(void *data)
+{
+    struct text_patch_set *set = data;
+
+    for (unsigned int i = 0; i < set->num; ++i) {
+        memcpy(set->patches[i].addr, set->patches[i].code, OVERRIDE_JUMP_SIZE);
+        if (set->patches[i].sym)
+            set->patches[i].sym->installed = set->patches[i].installed;
+    }
+
+    return 0;
+}
+
+static void do_sync_core(void *info)
+{
+    sync_core();
+}
+
+/**
+ * Applies all patches at once in an SMP-safe way
+ *
+ * The memory is unlocked once, then all patches are written inside a single stop_machine() (so that no CPU can be
+ * executing the code being modified), every CPU is serialized to drop any stale prefetched instructions, and the memory
+ * is locked again. This must be called from a process context.
+ *
+ * @param pages scratch space for collect_patch_pages()
+ *
+ * @return 0 on success, -E on error
+ */
+static int apply_text_patches(struct text_patch *patches, unsigned int num, unsigned long *pages)
+{
+    unsigned int num_pages = collect_patch_pages(patches, num, pages);
+    struct text_patch_set set = { .patches = patches, .num = num };
+    pr_loc_dbg("Applying %u text patch(es) spanning %u page(s)", num, num_pages);
+
+    mutex_lock(&text_patch_lock);
+    set_pages_rw_attr(pages, num_pages, true);
+    _flush_tlb_all();
+    rp_prof_count(RP_PROF_TLB_FLUSH);
+
+    //On failure write_text_patches() didn't run, so neither the code nor the "installed" flags were changed
+    int out = stop_machine(write_text_patches, &set, NULL);
+    if (likely(out == 0)) {
+        on_each_cpu(do_sync_core, NULL, 1);
+        rp_prof_count_n(RP_PROF_TEXT_PATCH, num);
+    }
+    else
+        pr_loc_err("stop_machine() failed - error=%d", out);
+
+    set_pages_rw_attr(pages, num_pages, false);
+    _flush_tlb_all();
+    rp_prof_count(RP_PROF_TLB_FLUSH);
+    mutex_unlock(&text_patch_lock);
+
+    return out;
+}
+
+/**
+ * Shortcut for apply_text_patches() with just one patch
+ */
+static int apply_text_patch(void *addr, const void *code, struct override_symbol_inst *sym, bool installed)
+{
+    struct text_patch patch = { .addr = addr, .code = code, .sym = sym, .installed = installed };
+    unsigned long pages[2];
+
+    return apply_text_patches(&patch, 1, pages);
 }
 
 int override_symbol(const char *name, const void *new_sym_ptr, void * *org_sym_ptr, unsigned char *org_sym_code)
 {
     pr_loc_dbg("Overriding %s() with %pf()<%p>", name, new_sym_ptr, new_sym_ptr);
 
-    *org_sym_ptr = (void *)kallsyms_lookup_name(name);
+    *org_sym_ptr = (void *)ksym_lookup_name(name);
     if (*org_sym_ptr == 0) {
         pr_loc_err("Failed to locate vaddr for %s()", name);
         return -EFAULT;
@@ -190,10 +364,10 @@ int override_symbol(const char *name, const void *new_sym_ptr, void * *org_sym_p
 
     memcpy(org_sym_code, *org_sym_ptr, OVERRIDE_JUMP_SIZE); //Backup old code
 
-    set_mem_rw((long)*org_sym_ptr, OVERRIDE_JUMP_SIZE);
     pr_loc_dbg("Writing jump code to <%p>", *org_sym_ptr);
-    memcpy(*org_sym_ptr, jump, OVERRIDE_JUMP_SIZE);
-    set_mem_ro((long)*org_sym_ptr, OVERRIDE_JUMP_SIZE);
+    int out = apply_text_patch(*org_sym_ptr, jump, NULL, false);
+    if (unlikely(out != 0))
+        return out;
 
     pr_loc_dbg("Override for %s set up with %p", name, new_sym_ptr);
     return 0;
@@ -204,16 +378,165 @@ struct override_symbol_inst {
     const void *new_sym_ptr;
     char org_sym_code[OVERRIDE_JUMP_SIZE];
     char trampoline[OVERRIDE_JUMP_SIZE];
-    spinlock_t lock;
-    unsigned long lock_irq;
     bool installed:1; //whether the symbol is currently overrode (=has trampoline installed)
     bool has_trampoline:1; //does this structure contain a valid trampoline code already?
-    bool mem_protected:1; //is the trampoline installation site memory-protected?
+    unsigned char *detour; //executable stub calling the original code (see "DETOURS" above) or NULL if not possible
+    struct ovsym_stats *stats; //NULL if stats are disabled (see ovsym_stats.c)
+    unsigned char *entry_stub; //executable stub counting calls before jumping to new_sym_ptr or NULL if there's none
     char name[];
 };
 
+/**
+ * Checks (once) whether the kernel has everything needed to build detours
+ */
+static bool detours_supported(void)
+{
+    static int supported = -1;
+
+    if (unlikely(supported == -1)) {
+        supported = ksym_lookup_name("insn_init") && ksym_lookup_name("insn_get_length") &&
+                    ksym_lookup_name("module_alloc");
+        pr_loc_dbg("Detours are %s on this kernel", supported ? "supported" : "NOT supported");
+    }
+
+    return supported;
+}
+
+/**
+ * Checks if the instruction can be safely executed from a different address
+ *
+ * @return 0 if it can, -E if it can't
+ */
+static int check_relocatable_insn(struct insn *insn)
+{
+    const unsigned char op = insn->opcode.bytes[0];
+
+    //jcc rel8, loop/jcxz, call rel32, jmp rel32, jmp rel8 & jcc rel32
+    if ((op >= 0x70 && op <= 0x7f) || (op >= 0xe0 && op <= 0xe3) || op == 0xe8 || op == 0xe9 || op == 0xeb ||
+        (op == 0x0f && insn->opcode.bytes[1] >= 0x80 && insn->opcode.bytes[1] <= 0x8f))
+        return -EADDRNOTAVAIL;
+
+    //ret, lret, iret, int3, and indirect jmp => the function ends within the preamble
+    if (op == 0xc2 || op == 0xc3 || op == 0xca || op == 0xcb || op == 0xcf || op == 0xcc ||
+        (op == 0xff && (X86_MODRM_REG(insn->modrm.value) == 4 || X86_MODRM_REG(insn->modrm.value) == 5)))
+        return -E2BIG;
+
+    //RIP-relative addressing (mod=00, r/m=101 in 64-bit mode)
+    if (insn->modrm.nbytes && X86_MODRM_MOD(insn->modrm.value) == 0 && X86_MODRM_RM(insn->modrm.value) == 5)
+        return -EADDRNOTAVAIL;
+
+    return 0;
+}
+
+/**
+ * Builds an executable stub which runs the original preamble and jumps to the rest of the original function
+ *
+ * This must be called before the trampoline is installed (it decodes the original code in place).
+ *
+ * @return 0 on success or -E on error (in which case sym->detour stays NULL)
+ */
+static int prepare_detour(struct override_symbol_inst *sym)
+{
+    if (!detours_supported())
+        return -ENOSYS;
+
+    struct insn insn;
+    unsigned int preamble_len = 0;
+    int out;
+    while (preamble_len < OVERRIDE_JUMP_SIZE) {
+        const unsigned char *kaddr = (const unsigned char *)sym->org_sym_ptr + preamble_len;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,19,0)
+        _insn_init(&insn, kaddr, 1);
+#else
+        _insn_init(&insn, kaddr, MAX_INSN_SIZE, 1);
+#endif
+        _insn_get_length(&insn);
+        if (unlikely(!insn.length)) {
+            pr_loc_dbg("Failed to decode instruction at %s+%u - cannot detour", sym->name, preamble_len);
+            return -EILSEQ;
+        }
+
+        if ((out = check_relocatable_insn(&insn)) != 0) {
+            pr_loc_dbg("Instruction %02x at %s+%u is not relocatable - cannot detour (error=%d)",
+                       insn.opcode.bytes[0], sym->name, preamble_len, out);
+            return out;
+        }
+
+        preamble_len += insn.length;
+    }
+
+    unsigned char *stub = _module_alloc(DETOUR_STUB_SIZE);
+    if (unlikely(!stub)) {
+        pr_loc_crt("module_alloc failed");
+        return -ENOMEM;
+    }
+
+    memcpy(stub, sym->org_sym_ptr, preamble_len);
+    memcpy(stub + preamble_len, detour_jump_tpl, DETOUR_JUMP_SIZE);
+    *(long *)&stub[preamble_len + DETOUR_JUMP_ADDR_POS] = (long)sym->org_sym_ptr + preamble_len;
+    sym->detour = stub;
+
+    pr_loc_dbg("Built detour for %s<%p> @ <%p> with %u bytes preamble", sym->name, sym->org_sym_ptr, stub,
+               preamble_len);
+    return 0;
+}
+
+#ifdef OVSYM_STATS
+/**
+ * Builds an executable stub which counts the call in sym->stats and jumps to the new symbol
+ *
+ * The trampoline is pointed to this stub instead of the new symbol. It clobbers %rax just like the trampoline does.
+ *
+ * @return 0 on success or -E on error (in which case calls are simply not counted)
+ */
+static int prepare_entry_stub(struct override_symbol_inst *sym)
+{
+    if (!sym->stats || !ksym_lookup_name("module_alloc"))
+        return -ENOSYS;
+
+    unsigned char *stub = _module_alloc(ENTRY_STUB_SIZE);
+    if (unlikely(!stub)) {
+        pr_loc_crt("module_alloc failed");
+        return -ENOMEM;
+    }
+
+    memcpy(stub, entry_stub_tpl, ENTRY_STUB_SIZE);
+    *(long *)&stub[ENTRY_STUB_CNT_ADDR_POS] = (long)&ovsym_stats_cpu(sym->stats)->calls;
+#ifndef CONFIG_SMP
+    stub[ENTRY_STUB_SEG_POS] = 0x90; //per-CPU ptr is a plain address on UP - the prefix becomes a NOP
+#endif
+    *(long *)&stub[ENTRY_STUB_JUMP_ADDR_POS] = (long)sym->new_sym_ptr;
+    sym->entry_stub = stub;
+
+    pr_loc_dbg("Built entry stub for %s<%p> @ <%p>", sym->name, sym->org_sym_ptr, stub);
+    return 0;
+}
+
+u64 __ovsym_org_begin(struct override_symbol_inst *sym)
+{
+    return ovsym_stat_org_begin(sym->stats);
+}
+
+void __ovsym_org_end(struct override_symbol_inst *sym, u64 start)
+{
+    ovsym_stat_org_end(sym->stats, start);
+}
+#else
+#define prepare_entry_stub(sym) //noop
+#endif //OVSYM_STATS
+
 static inline void put_ov_symbol_instance(struct override_symbol_inst *sym)
 {
+    if (sym->detour || sym->entry_stub) {
+        //Someone may have *just* called the original (or the shim) and still be running the stub
+        synchronize_sched();
+        if (sym->detour)
+            _module_memfree(sym->detour);
+        if (sym->entry_stub)
+            _module_memfree(sym->entry_stub);
+    }
+
+    ovsym_stats_unregister(sym->stats);
     kfree(sym);
 }
 
@@ -227,35 +550,25 @@ static struct override_symbol_inst* get_ov_symbol_instance(const char *symbol_na
     }
 
     sym->new_sym_ptr = new_sym_ptr;
-    spin_lock_init(&sym->lock);
     sym->installed = false;
     sym->has_trampoline = false;
-    sym->mem_protected = true;
+    sym->detour = NULL;
+    sym->stats = NULL;
+    sym->entry_stub = NULL;
     strcpy(sym->name, symbol_name);
 
-    sym->org_sym_ptr = (void *)kallsyms_lookup_name(sym->name);
+    sym->org_sym_ptr = (void *)ksym_lookup_name(sym->name);
     if (unlikely(sym->org_sym_ptr == 0)) { //header file: "Lookup the address for a symbol. Returns 0 if not found."
         pr_loc_err("Failed to locate vaddr for %s()", sym->name);
         put_ov_symbol_instance(sym);
         return ERR_PTR(-EFAULT);
     }
     pr_loc_dbg("Saved %s() ptr <%p>", sym->name, sym->org_sym_ptr);
+    sym->stats = ovsym_stats_register(sym->name);
 
     return sym;
 }
 
-static void __always_inline enable_mem_protection(struct override_symbol_inst *sym)
-{
-    set_mem_rw((unsigned long)sym->org_sym_ptr, OVERRIDE_JUMP_SIZE);
-    sym->mem_protected = true;
-}
-
-static void __always_inline disable_mem_protection(struct override_symbol_inst *sym)
-{
-    set_mem_rw((unsigned long)sym->org_sym_ptr, OVERRIDE_JUMP_SIZE);
-    sym->mem_protected = false;
-}
-
 /**
  * Generates trampoline code to jump from old symbol to the new symbol location and saves the original code
  */
@@ -263,14 +576,18 @@ static inline void prepare_trampoline(struct override_symbol_inst *sym)
 {
     pr_loc_dbg("Generating trampoline");
 
-    //First generate jump/trampoline to new_sym_ptr
+    //First generate jump/trampoline to new_sym_ptr (through the entry stub if calls are counted)
+    prepare_entry_stub(sym); //failure is not critical - calls will just not be counted
     memcpy(sym->trampoline, jump_tpl, OVERRIDE_JUMP_SIZE); //copy "empty" trampoline
-    *(long *)&sym->trampoline[JUMP_ADDR_POS] = (long)sym->new_sym_ptr; //paste new addr into trampoline
+    *(long *)&sym->trampoline[JUMP_ADDR_POS] =
+        (long)(sym->entry_stub ? sym->entry_stub : sym->new_sym_ptr); //paste new addr into trampoline
     pr_loc_dbg("Generated trampoline to %pF<%p> for %s<%p>: ", sym->new_sym_ptr, sym->new_sym_ptr, sym->name,
                sym->org_sym_ptr);
 
     memcpy(sym->org_sym_code, sym->org_sym_ptr, OVERRIDE_JUMP_SIZE); //Backup old code
     sym->has_trampoline = true;
+
+    prepare_detour(sym); //failure is not critical - it will just make calling the original slower
 }
 
 int __enable_symbol_override(struct override_symbol_inst *sym)
@@ -281,16 +598,8 @@ int __enable_symbol_override(struct override_symbol_inst *sym)
     if (!sym->has_trampoline)
         prepare_trampoline(sym);
 
-    if (sym->mem_protected)
-        disable_mem_protection(sym);
-
-    WITH_OVS_LOCK(sym,
-        pr_loc_dbg("Writing trampoline code to <%p>", sym->org_sym_ptr);
-        memcpy(sym->org_sym_ptr, sym->trampoline, OVERRIDE_JUMP_SIZE);
-        sym->installed = true;
-    );
-
-    return 0;
+    pr_loc_dbg("Writing trampoline code to <%p>", sym->org_sym_ptr);
+    return apply_text_patch(sym->org_sym_ptr, sym->trampoline, sym, true);
 }
 
 int __disable_symbol_override(struct override_symbol_inst *sym)
@@ -298,16 +607,8 @@ int __disable_symbol_override(struct override_symbol_inst *sym)
     if (unlikely(!sym->installed))
         return 0; //noop but not an error
 
-    if (sym->mem_protected)
-        disable_mem_protection(sym);
-
-    WITH_OVS_LOCK(sym,
-        pr_loc_dbg("Writing original code to <%p>", sym->org_sym_ptr);
-        memcpy(sym->org_sym_ptr, sym->org_sym_code, OVERRIDE_JUMP_SIZE);
-        sym->installed = false;
-    );
-
-    return 0;
+    pr_loc_dbg("Writing original code to <%p>", sym->org_sym_ptr);
+    return apply_text_patch(sym->org_sym_ptr, sym->org_sym_code, sym, false);
 }
 
 __always_inline void * __get_org_ptr(struct override_symbol_inst *sym)
@@ -315,6 +616,11 @@ __always_inline void * __get_org_ptr(struct override_symbol_inst *sym)
     return sym->org_sym_ptr;
 }
 
+__always_inline void * __get_detour_ptr(struct override_symbol_inst *sym)
+{
+    return sym->detour;
+}
+
 __always_inline bool symbol_is_overridden(struct override_symbol_inst *sym)
 {
     return likely(sym) && sym->installed;
@@ -329,10 +635,11 @@ struct override_symbol_inst* __must_check override_symbol_ng(const char *name, c
     if (unlikely(IS_ERR(sym)))
         return sym;
 
-    if ((out = __enable_symbol_override(sym)) != 0)
-        goto error_out;
+    prepare_trampoline(sym);
 
-    enable_mem_protection(sym); //by design standard override leaves the memory protected
+    //by design standard override leaves the memory protected (which apply_text_patch() does)
+    if ((out = apply_text_patch(sym->org_sym_ptr, sym->trampoline, sym, true)) != 0)
+        goto error_out;
 
     pr_loc_dbg("Successfully overrode %s with trampoline to %pF<%p>", sym->name, sym->new_sym_ptr, sym->new_sym_ptr);
     return sym;
@@ -342,31 +649,164 @@ struct override_symbol_inst* __must_check override_symbol_ng(const char *name, c
     return ERR_PTR(out);
 }
 
+int restore_symbols_ng(struct override_symbol_inst **syms, unsigned int num)
+{
+    pr_loc_dbg("Restoring %u symbol(s) to original code", num);
+
+    struct text_patch *patches = kmalloc((sizeof(struct text_patch) + sizeof(unsigned long) * 2) * num, GFP_KERNEL);
+    if (unlikely(!patches)) {
+        pr_loc_crt("kmalloc failed");
+        return -ENOMEM;
+    }
+
+    unsigned int num_patches = 0;
+    for (unsigned int i = 0; i < num; ++i) {
+        if (!syms[i] || !syms[i]->installed)
+            continue;
+
+        patches[num_patches].addr = syms[i]->org_sym_ptr;
+        patches[num_patches].code = syms[i]->org_sym_code;
+        patches[num_patches].sym = syms[i];
+        patches[num_patches].installed = false;
+        ++num_patches;
+    }
+
+    int out = 0;
+    if (num_patches)
+        out = apply_text_patches(patches, num_patches, (unsigned long *)&patches[num]);
+
+    kfree(patches);
+    if (unlikely(out != 0))
+        return out; //instances are NOT freed - the code is still overridden
+
+    for (unsigned int i = 0; i < num; ++i) {
+        if (syms[i])
+            put_ov_symbol_instance(syms[i]);
+    }
+
+    return 0;
+}
+
 int restore_symbol_ng(struct override_symbol_inst *sym)
 {
     pr_loc_dbg("Restoring %s<%p> to original code", sym->name, sym->org_sym_ptr);
 
     int out;
-    if ((out = __disable_symbol_override(sym)) != 0)
-        goto out_free;
-
-    enable_mem_protection(sym); //by design restore leaves the memory protected
+    //by design restore leaves the memory protected (which apply_text_patch() does)
+    if (sym->installed && (out = apply_text_patch(sym->org_sym_ptr, sym->org_sym_code, sym, false)) != 0) {
+        pr_loc_err("Failed to restore original code of %s - error=%d", sym->name, out);
+        return out; //instance is NOT freed - the trampoline still jumps to its stubs
+    }
 
     pr_loc_dbg("Successfully restored original code of %s", sym->name);
-
-    out_free:
     put_ov_symbol_instance(sym);
-    return out;
+
+    return 0;
+}
+
+struct override_symbol_batch {
+    unsigned int num;
+    unsigned int max;
+    struct text_patch *patches; //scratch space for patches
+    unsigned long *pages; //scratch space for page addresses; every trampoline can span at most two pages
+    struct override_symbol_inst *syms[];
+};
+
+struct override_symbol_batch* __must_check override_symbol_batch_begin(unsigned int max_symbols)
+{
+    if (unlikely(max_symbols == 0)) {
+        pr_loc_bug("Attempted to begin an empty override batch");
+        return ERR_PTR(-EINVAL);
+    }
+
+    struct override_symbol_batch *batch = kmalloc(sizeof(struct override_symbol_batch) +
+                                                  (sizeof(struct override_symbol_inst *) * max_symbols) +
+                                                  (sizeof(struct text_patch) * max_symbols) +
+                                                  (sizeof(unsigned long) * max_symbols * 2), GFP_KERNEL);
+    if (unlikely(!batch)) {
+        pr_loc_crt("kmalloc failed");
+        return ERR_PTR(-ENOMEM);
+    }
+
+    batch->num = 0;
+    batch->max = max_symbols;
+    batch->patches = (struct text_patch *)&batch->syms[max_symbols];
+    batch->pages = (unsigned long *)&batch->patches[max_symbols];
+
+    return batch;
+}
+
+struct override_symbol_inst* __must_check override_symbol_batch_add(struct override_symbol_batch *batch,
+                                                                    const char *name, const void *new_sym_ptr)
+{
+    pr_loc_dbg("Adding override of %s() with %pf()<%p> to batch", name, new_sym_ptr, new_sym_ptr);
+
+    if (unlikely(batch->num >= batch->max)) {
+        pr_loc_bug("Override batch is full (max=%u) - cannot add %s()", batch->max, name);
+        return ERR_PTR(-ENOSPC);
+    }
+
+    struct override_symbol_inst *sym = get_ov_symbol_instance(name, new_sym_ptr);
+    if (unlikely(IS_ERR(sym)))
+        return sym;
+
+    for (unsigned int i = 0; i < batch->num; ++i) {
+        if (unlikely(batch->syms[i]->org_sym_ptr == sym->org_sym_ptr)) {
+            pr_loc_bug("%s() is already present in the override batch", name);
+            put_ov_symbol_instance(sym);
+            return ERR_PTR(-EEXIST);
+        }
+    }
+
+    prepare_trampoline(sym);
+    batch->syms[batch->num++] = sym;
+
+    return sym;
+}
+
+int override_symbol_batch_commit(struct override_symbol_batch *batch)
+{
+    pr_loc_dbg("Committing override batch of %u symbol(s)", batch->num);
+
+    for (unsigned int i = 0; i < batch->num; ++i) {
+        batch->patches[i].addr = batch->syms[i]->org_sym_ptr;
+        batch->patches[i].code = batch->syms[i]->trampoline;
+        batch->patches[i].sym = batch->syms[i];
+        batch->patches[i].installed = true;
+    }
+
+    //by design standard override leaves the memory protected (which apply_text_patches() does)
+    int out = apply_text_patches(batch->patches, batch->num, batch->pages);
+    if (unlikely(out != 0)) {
+        pr_loc_err("Failed to commit override batch - error=%d", out);
+        override_symbol_batch_abort(batch);
+        return out;
+    }
+
+    pr_loc_dbg("Successfully committed override batch of %u symbol(s)", batch->num);
+    kfree(batch);
+
+    return 0;
+}
+
+void override_symbol_batch_abort(struct override_symbol_batch *batch)
+{
+    pr_loc_dbg("Aborting override batch of %u symbol(s)", batch->num);
+
+    for (unsigned int i = 0; i < batch->num; ++i)
+        put_ov_symbol_instance(batch->syms[i]);
+
+    kfree(batch);
 }
 
 int restore_symbol(void * org_sym_ptr, const unsigned char *org_sym_code)
 {
     pr_loc_dbg("Restoring symbol @ %pf()<%p>", org_sym_ptr, org_sym_ptr);
 
-    set_mem_rw((long)org_sym_ptr, OVERRIDE_JUMP_SIZE);
     pr_loc_dbg("Writing original code to <%p>", org_sym_ptr);
-    memcpy(org_sym_ptr, org_sym_code, OVERRIDE_JUMP_SIZE);
-    set_mem_ro((long)org_sym_ptr, OVERRIDE_JUMP_SIZE);
+    int out = apply_text_patch(org_sym_ptr, org_sym_code, NULL, false);
+    if (unlikely(out != 0))
+        return out;
     pr_loc_dbg("Symbol restored @ %pf()<%p>", org_sym_ptr, org_sym_ptr);
 
     return 0;
@@ -391,9 +831,63 @@ static void print_syscall_table(unsigned int from, unsigned to)
     }
 }
 
+/**
+ * Scans kernel read-only data for the syscall table
+ *
+ * We know numbers for syscalls (e.g. __NR_close, __NR_write, __NR_read, etc.) which are essentially fixed positions in
+ * the sys_call_table. We also know addresses of functions handling these calls (sys_close/sys_write/sys_read etc.).
+ * This lets us scan the memory for one syscall address reference and when found confirm if this is really a place of
+ * sys_call_table by verifying other 2-3 places to make sure other syscalls are where they should be.
+ * The table is "const" so it always lands in .rodata - the scan never leaves it (so that it cannot wander into
+ * unmapped memory on an unexpected layout).
+ */
+static unsigned long *scan_for_sys_call_table(void)
+{
+    unsigned long sys_close_ptr = ksym_lookup_name("sys_close");
+    unsigned long sys_open_ptr = ksym_lookup_name("sys_open");
+    unsigned long sys_read_ptr = ksym_lookup_name("sys_read");
+    unsigned long sys_write_ptr = ksym_lookup_name("sys_write");
+    if (sys_close_ptr == 0 || sys_open_ptr == 0 || sys_read_ptr == 0 || sys_write_ptr == 0) {
+        pr_loc_bug(
+                "One or more syscall handler addresses cannot be located: "
+                "sys_close<%p>, sys_open<%p>, sys_read<%p>, sys_write<%p>",
+                (void *)sys_close_ptr, (void *)sys_open_ptr, (void *)sys_read_ptr, (void *)sys_write_ptr);
+        return NULL;
+    }
+
+    unsigned long *start = (unsigned long *)ksym_lookup_name("__start_rodata");
+    unsigned long *end = (unsigned long *)ksym_lookup_name("__end_rodata");
+    if (!start || !end || end <= start + NR_syscalls) {
+        pr_loc_bug("Failed to determine .rodata bounds (%p - %p)", start, end);
+        return NULL;
+    }
+
+    //Only slots where sys_close can be are checked: the table must fully fit within .rodata
+    unsigned long *close_slot = start + __NR_close;
+    unsigned long *close_slot_end = end - NR_syscalls + __NR_close;
+
+    //If everything goes well it should take well below 1ms (.rodata is a few MBs and we're doing a single compare)
+    pr_loc_dbg("Scanning .rodata %p - %p for sys_call_table", start, end);
+    for (; close_slot < close_slot_end; ++close_slot) {
+        if (likely(*close_slot != sys_close_ptr)) //prefilter: a single word compare per step
+            continue;
+
+        unsigned long *table = close_slot - __NR_close;
+        if (table[__NR_open] == sys_open_ptr && table[__NR_read] == sys_read_ptr && table[__NR_write] == sys_write_ptr)
+            return table;
+    }
+
+    return NULL;
+}
+
 static int find_sys_call_table(void)
 {
-    syscall_table_ptr = (unsigned long *)kallsyms_lookup_name("sys_call_table");
+    static int last_error = 0; //the lookup is deterministic - there's no point in rescanning after a failure
+
+    if (unlikely(last_error))
+        return last_error;
+
+    syscall_table_ptr = (unsigned long *)ksym_lookup_name("sys_call_table");
     if (syscall_table_ptr != 0) {
         pr_loc_dbg("Found sys_call_table @ <%p> using kallsyms", syscall_table_ptr);
         return 0;
@@ -403,102 +897,221 @@ static int find_sys_call_table(void)
     //In essence some systems will have it and some will not - finding it using kallsyms is the easiest and fastest
     pr_loc_dbg("Failed to locate vaddr for sys_call_table using kallsyms - falling back to memory search");
 
-    /*
-     There's also the bruteforce way - scan through the memory until you find it :D
-     We know numbers for syscalls (e.g. __NR_close, __NR_write, __NR_read, etc.) which are essentially fixed positions
-     in the sys_call_table. We also know addresses of functions handling these calls (sys_close/sys_write/sys_read
-     etc.). This lets us scan the memory for one syscall address reference and when found confirm if this is really
-     a place of sys_call_table by verifying other 2-3 places to make sure other syscalls are where they should be
-     The huge downside of this method is it is slow as potentially the amount of memory to search may be large.
-    */
-    unsigned long sys_close_ptr = kallsyms_lookup_name("sys_close");
-    unsigned long sys_open_ptr = kallsyms_lookup_name("sys_open");
-    unsigned long sys_read_ptr = kallsyms_lookup_name("sys_read");
-    unsigned long sys_write_ptr = kallsyms_lookup_name("sys_write");
-    if (sys_close_ptr == 0 || sys_open_ptr == 0 || sys_read_ptr == 0 || sys_write_ptr == 0) {
-        pr_loc_bug(
-                "One or more syscall handler addresses cannot be located: "
-                "sys_close<%p>, sys_open<%p>, sys_read<%p>, sys_write<%p>",
-                (void *)sys_close_ptr, (void *)sys_open_ptr, (void *)sys_read_ptr, (void *)sys_write_ptr);
-         return -EFAULT;
-    }
-
-    /*
-     To speed up things a bit we search from a known syscall which was loaded early into the memory. To be safe we pick
-     the earliest address and go from there. It can be nicely visualized on a system which DO export sys_call_table
-     by running grep -E ' (__x64_)?sys_(close|open|read|write|call_table)$' /proc/kallsyms | sort
-     You will get something like that:
-      ffffffff860c18b0 T __x64_sys_close
-      ffffffff860c37a0 T __x64_sys_open
-      ffffffff860c7a80 T __x64_sys_read
-      ffffffff860c7ba0 T __x64_sys_write
-      ffffffff86e013a0 R sys_call_table    <= it's way below any of the syscalls but not too far (~13,892,336 bytes)
-    */
-    unsigned long i = sys_close_ptr;
-    if (sys_open_ptr < i) i = sys_open_ptr;
-    if (sys_read_ptr < i) i = sys_read_ptr;
-    if (sys_write_ptr < i) i = sys_write_ptr;
-
-    //If everything goes well it should take ~1-2ms tops (which is slow in the kernel sense but it's not bad)
-    pr_loc_dbg("Scanning memory for sys_call_table starting at %p", (void *)i);
-    for (; i < ULONG_MAX; i += sizeof(void *)) {
-        syscall_table_ptr = (unsigned long *)i;
-
-        if (unlikely(
-                syscall_table_ptr[__NR_close] == sys_close_ptr &&
-                syscall_table_ptr[__NR_open] == sys_open_ptr &&
-                syscall_table_ptr[__NR_read] == sys_read_ptr &&
-                syscall_table_ptr[__NR_write] == sys_write_ptr
-        )) {
-            pr_loc_dbg("Found sys_call_table @ %p", (void *)syscall_table_ptr);
-            return 0;
-        }
+    syscall_table_ptr = scan_for_sys_call_table();
+    if (syscall_table_ptr) {
+        pr_loc_dbg("Found sys_call_table @ %p", (void *)syscall_table_ptr);
+        return 0;
     }
 
     pr_loc_bug("Failed to find sys call table");
-    syscall_table_ptr = NULL;
-    return -EFAULT;
+    last_error = -EFAULT;
+    return last_error;
 }
 
-static unsigned long *overridden_syscall[NR_syscalls] = { NULL };
-int override_syscall(unsigned int syscall_num, const void *new_sysc_ptr, void * *org_sysc_ptr)
+/*
+ * Every dispatched syscall gets a slot with its own trampoline; the trampoline is what sits in the sys_call_table. The
+ * number of slots is small & fixed as only a handful of syscalls are ever hooked - this way trampolines are plain
+ * functions generated at compile time (and each one knows its slot without any lookup).
+ */
+#define MAX_DISPATCHED_SYSCALLS 8
+#define SYSCALL_SLOT_FREE UINT_MAX
+
+typedef asmlinkage long (*syscall_fn)(unsigned long, unsigned long, unsigned long, unsigned long, unsigned long,
+                                      unsigned long);
+
+/**
+ * Pre-hooks of a syscall; it's replaced as a whole (SRCU) on every change so that readers never see a partial list
+ */
+struct syscall_hooks {
+    unsigned int num;
+    struct {
+        syscall_hook_fn *fn;
+        int priority;
+    } hooks[];
+};
+
+struct syscall_slot {
+    unsigned int nr; //SYSCALL_SLOT_FREE if not used
+    syscall_fn org; //original sys_call_table entry
+    syscall_fn override; //set by override_syscall() or NULL
+    syscall_fn terminal; //what's called after hooks: override or original
+    struct syscall_hooks __rcu *hooks; //NULL when there are no hooks (=fast path)
+};
+
+static struct syscall_slot syscall_slots[MAX_DISPATCHED_SYSCALLS];
+static DEFINE_MUTEX(syscall_slots_lock); //serializes all changes to slots & the table; readers use SRCU
+static bool syscall_slots_initialized = false;
+
+//Hooks run in an SRCU read-side section (and not RCU) so that they can sleep, e.g. to copy_from_user() or getname()
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,11,0)
+DEFINE_STATIC_SRCU(syscall_hooks_srcu);
+#define init_syscall_hooks_srcu() (0)
+#else
+//There's no static SRCU on older kernels; it's initialized with the slots and the per-CPU counters are never freed
+static struct srcu_struct syscall_hooks_srcu;
+#define init_syscall_hooks_srcu() init_srcu_struct(&syscall_hooks_srcu)
+#endif
+
+static __always_inline long dispatch_syscall(struct syscall_slot *slot, unsigned long a0, unsigned long a1,
+                                             unsigned long a2, unsigned long a3, unsigned long a4, unsigned long a5)
 {
-    pr_loc_dbg("Overriding syscall #%d with %pf()<%p>", syscall_num, new_sysc_ptr, new_sysc_ptr);
+    //Fast path: no hooks => this is just an extra indirect call
+    if (likely(!rcu_access_pointer(slot->hooks)))
+        return ACCESS_ONCE(slot->terminal)(a0, a1, a2, a3, a4, a5);
+
+    struct syscall_hook_args args = { .nr = slot->nr, .args = { a0, a1, a2, a3, a4, a5 } };
+    long ret;
+
+    int idx = srcu_read_lock(&syscall_hooks_srcu);
+    struct syscall_hooks *hooks = srcu_dereference(slot->hooks, &syscall_hooks_srcu);
+    for (unsigned int i = 0; hooks && i < hooks->num; ++i) {
+        if (hooks->hooks[i].fn(&args, &ret) == SYSCALL_HOOK_RETURN) {
+            srcu_read_unlock(&syscall_hooks_srcu, idx);
+            return ret;
+        }
+    }
+    srcu_read_unlock(&syscall_hooks_srcu, idx);
 
-    int out = 0;
+    return ACCESS_ONCE(slot->terminal)(args.args[0], args.args[1], args.args[2], args.args[3], args.args[4],
+                                       args.args[5]);
+}
+
+#define DEFINE_SYSCALL_TRAMPOLINE(idx) \
+    static asmlinkage long syscall_trampoline_##idx(unsigned long a0, unsigned long a1, unsigned long a2, \
+                                                    unsigned long a3, unsigned long a4, unsigned long a5) \
+    { \
+        return dispatch_syscall(&syscall_slots[idx], a0, a1, a2, a3, a4, a5); \
+    }
+DEFINE_SYSCALL_TRAMPOLINE(0) DEFINE_SYSCALL_TRAMPOLINE(1) DEFINE_SYSCALL_TRAMPOLINE(2) DEFINE_SYSCALL_TRAMPOLINE(3)
+DEFINE_SYSCALL_TRAMPOLINE(4) DEFINE_SYSCALL_TRAMPOLINE(5) DEFINE_SYSCALL_TRAMPOLINE(6) DEFINE_SYSCALL_TRAMPOLINE(7)
+
+static const syscall_fn syscall_trampolines[MAX_DISPATCHED_SYSCALLS] = {
+    (syscall_fn)syscall_trampoline_0, (syscall_fn)syscall_trampoline_1, (syscall_fn)syscall_trampoline_2,
+    (syscall_fn)syscall_trampoline_3, (syscall_fn)syscall_trampoline_4, (syscall_fn)syscall_trampoline_5,
+    (syscall_fn)syscall_trampoline_6, (syscall_fn)syscall_trampoline_7,
+};
+
+static void write_syscall_table(unsigned int syscall_num, syscall_fn ptr)
+{
+    print_syscall_table(syscall_num-5, syscall_num+5);
+
+    set_mem_rw((long)&syscall_table_ptr[syscall_num], sizeof(unsigned long));
+    pr_loc_dbg("syscall #%d %ps<%p> will now be %ps<%p> @ %d", syscall_num, (void *)syscall_table_ptr[syscall_num],
+               (void *)syscall_table_ptr[syscall_num], ptr, ptr, smp_processor_id());
+    syscall_table_ptr[syscall_num] = (unsigned long)ptr;
+    set_mem_ro((long)&syscall_table_ptr[syscall_num], sizeof(unsigned long));
+
+    print_syscall_table(syscall_num-5, syscall_num+5);
+}
+
+/**
+ * Finds a slot used by a syscall; must be called with syscall_slots_lock held
+ */
+static struct syscall_slot *find_syscall_slot(unsigned int syscall_num)
+{
+    for (int i = 0; i < MAX_DISPATCHED_SYSCALLS; ++i) {
+        if (syscall_slots[i].nr == syscall_num)
+            return &syscall_slots[i];
+    }
+
+    return NULL;
+}
+
+/**
+ * Finds a slot used by a syscall or puts the syscall's trampoline in the table; must be called with the lock held
+ *
+ * @return slot or ERR_PTR(-E)
+ */
+static struct syscall_slot *get_syscall_slot(unsigned int syscall_num)
+{
     if (unlikely(!syscall_table_ptr)) {
-        out = find_sys_call_table();
+        int out = find_sys_call_table();
         if (unlikely(out != 0))
-            return out;
+            return ERR_PTR(out);
     }
 
     if (unlikely(syscall_num > __NR_syscall_max)) {
         pr_loc_bug("Invalid syscall number: %d > %d", syscall_num, __NR_syscall_max);
-        return -EINVAL;
+        return ERR_PTR(-EINVAL);
     }
 
-    print_syscall_table(syscall_num-5, syscall_num+5);
+    if (unlikely(!syscall_slots_initialized)) {
+        int out = init_syscall_hooks_srcu();
+        if (unlikely(out != 0)) {
+            pr_loc_crt("Failed to initialize SRCU for syscall hooks - error=%d", out);
+            return ERR_PTR(out);
+        }
 
-    if (unlikely(overridden_syscall[syscall_num])) {
-        pr_loc_bug("Syscall %d is already overridden - will be replaced (bug?)", syscall_num);
-    } else {
-        //Only save original-original entry (not the override one)
-        overridden_syscall[syscall_num] = (unsigned long *)syscall_table_ptr[syscall_num];
+        for (int i = 0; i < MAX_DISPATCHED_SYSCALLS; ++i)
+            syscall_slots[i].nr = SYSCALL_SLOT_FREE;
+        syscall_slots_initialized = true;
     }
 
-    if (org_sysc_ptr != 0)
-        *org_sysc_ptr = overridden_syscall[syscall_num];
+    struct syscall_slot *slot = find_syscall_slot(syscall_num);
+    if (slot)
+        return slot;
 
-    set_mem_rw((long)&syscall_table_ptr[syscall_num], sizeof(unsigned long));
-    pr_loc_dbg("syscall #%d originally %ps<%p> will now be %ps<%p> @ %d", syscall_num,
-               (void *) overridden_syscall[syscall_num], (void *) overridden_syscall[syscall_num], new_sysc_ptr,
-               new_sysc_ptr, smp_processor_id());
-    syscall_table_ptr[syscall_num] = (unsigned long) new_sysc_ptr;
-    set_mem_ro((long)&syscall_table_ptr[syscall_num], sizeof(unsigned long));
+    if (!(slot = find_syscall_slot(SYSCALL_SLOT_FREE))) {
+        pr_loc_bug("Cannot dispatch syscall #%d - all %d slots are used", syscall_num, MAX_DISPATCHED_SYSCALLS);
+        return ERR_PTR(-ENOSPC);
+    }
 
-    print_syscall_table(syscall_num-5, syscall_num+5);
+    //The slot must be complete before the trampoline becomes reachable through the table
+    slot->org = (syscall_fn)syscall_table_ptr[syscall_num];
+    slot->override = NULL;
+    slot->terminal = slot->org;
+    RCU_INIT_POINTER(slot->hooks, NULL);
+    slot->nr = syscall_num;
+    smp_wmb();
 
-    return out;
+    write_syscall_table(syscall_num, syscall_trampolines[slot - syscall_slots]);
+    pr_loc_dbg("Syscall #%d is now dispatched via slot #%ld", syscall_num, (long)(slot - syscall_slots));
+
+    return slot;
+}
+
+/**
+ * Puts the original syscall back if nothing uses the slot anymore; must be called with syscall_slots_lock held
+ */
+static void put_syscall_slot(struct syscall_slot *slot)
+{
+    if (slot->override || rcu_access_pointer(slot->hooks))
+        return;
+
+    write_syscall_table(slot->nr, slot->org);
+    pr_loc_dbg("Syscall #%d is no longer dispatched", slot->nr);
+
+    //Trampoline may still be starting on other CPUs (which read the table before we restored it) - the slot cannot be
+    // reused for another syscall before they're done with it. Its terminal stays pointing to the original until reuse.
+    // Hooks of the last list may still be sleeping before they get to call the terminal.
+    synchronize_sched();
+    synchronize_srcu(&syscall_hooks_srcu);
+    slot->nr = SYSCALL_SLOT_FREE;
+}
+
+int override_syscall(unsigned int syscall_num, const void *new_sysc_ptr, void * *org_sysc_ptr)
+{
+    pr_loc_dbg("Overriding syscall #%d with %pf()<%p>", syscall_num, new_sysc_ptr, new_sysc_ptr);
+
+    mutex_lock(&syscall_slots_lock);
+    struct syscall_slot *slot = get_syscall_slot(syscall_num);
+    if (IS_ERR(slot)) {
+        mutex_unlock(&syscall_slots_lock);
+        return PTR_ERR(slot);
+    }
+
+    if (unlikely(slot->override))
+        pr_loc_bug("Syscall %d is already overridden - will be replaced (bug?)", syscall_num);
+
+    //The original is always the original-original entry (not the previous override)
+    if (org_sysc_ptr != 0)
+        *org_sysc_ptr = slot->org;
+
+    slot->override = (syscall_fn)new_sysc_ptr;
+    ACCESS_ONCE(slot->terminal) = slot->override;
+    mutex_unlock(&syscall_slots_lock);
+
+    return 0;
 }
 
 int restore_syscall(unsigned int syscall_num)
@@ -515,21 +1128,134 @@ int restore_syscall(unsigned int syscall_num)
         return -EINVAL;
     }
 
-    if (unlikely(overridden_syscall[syscall_num] == 0)) {
+    mutex_lock(&syscall_slots_lock);
+    struct syscall_slot *slot = syscall_slots_initialized ? find_syscall_slot(syscall_num) : NULL;
+    if (unlikely(!slot || !slot->override)) {
+        mutex_unlock(&syscall_slots_lock);
         pr_loc_bug("Syscall #%d cannot be restored - it was never overridden", syscall_num);
         return -EINVAL;
     }
 
-    print_syscall_table(syscall_num-5, syscall_num+5);
+    pr_loc_dbg("Restoring syscall #%d from %ps<%p> to original %ps<%p>", syscall_num, slot->override, slot->override,
+               slot->org, slot->org);
+    slot->override = NULL;
+    ACCESS_ONCE(slot->terminal) = slot->org;
+    put_syscall_slot(slot);
+    mutex_unlock(&syscall_slots_lock);
 
-    set_mem_rw((long)&syscall_table_ptr[syscall_num], sizeof(unsigned long));
-    pr_loc_dbg("Restoring syscall #%d from %ps<%p> to original %ps<%p>", syscall_num,
-               (void *) syscall_table_ptr[syscall_num], (void *) syscall_table_ptr[syscall_num],
-               (void *) overridden_syscall[syscall_num], (void *) overridden_syscall[syscall_num]);
-    syscall_table_ptr[syscall_num] = (unsigned long)overridden_syscall[syscall_num];
-    set_mem_rw((long)&syscall_table_ptr[syscall_num], sizeof(unsigned long));
+    return 0;
+}
 
-    print_syscall_table(syscall_num-5, syscall_num+5);
+/**
+ * Makes a copy of hooks with one entry added (fn != NULL) or removed (fn == NULL => entry at rm_idx is skipped)
+ */
+static struct syscall_hooks *copy_syscall_hooks(const struct syscall_hooks *old, syscall_hook_fn *fn, int priority,
+                                                unsigned int rm_idx)
+{
+    unsigned int old_num = old ? old->num : 0;
+    unsigned int new_num = fn ? old_num + 1 : old_num - 1;
+    if (!new_num)
+        return NULL;
+
+    struct syscall_hooks *hooks = kmalloc(sizeof(struct syscall_hooks) + new_num * sizeof(hooks->hooks[0]),
+                                          GFP_KERNEL);
+    if (unlikely(!hooks)) {
+        pr_loc_crt("kmalloc failed");
+        return ERR_PTR(-ENOMEM);
+    }
+
+    hooks->num = 0;
+    for (unsigned int i = 0; i < old_num; ++i) {
+        //New hook goes before the first one with a higher priority number (=equal priorities keep the insert order)
+        if (fn && old->hooks[i].priority > priority) {
+            hooks->hooks[hooks->num].fn = fn;
+            hooks->hooks[hooks->num++].priority = priority;
+            fn = NULL;
+        }
+
+        if (!fn && i == rm_idx && new_num < old_num)
+            continue;
+
+        hooks->hooks[hooks->num++] = old->hooks[i];
+    }
+
+    if (fn) {
+        hooks->hooks[hooks->num].fn = fn;
+        hooks->hooks[hooks->num++].priority = priority;
+    }
+
+    return hooks;
+}
+
+int add_syscall_hook(unsigned int syscall_num, syscall_hook_fn *fn, int priority)
+{
+    pr_loc_dbg("Adding hook %pf()<%p> with priority %d to syscall #%d", fn, fn, priority, syscall_num);
+
+    mutex_lock(&syscall_slots_lock);
+    struct syscall_slot *slot = get_syscall_slot(syscall_num);
+    if (IS_ERR(slot)) {
+        mutex_unlock(&syscall_slots_lock);
+        return PTR_ERR(slot);
+    }
+
+    struct syscall_hooks *old = rcu_dereference_protected(slot->hooks, lockdep_is_held(&syscall_slots_lock));
+    for (unsigned int i = 0; old && i < old->num; ++i) {
+        if (unlikely(old->hooks[i].fn == fn)) {
+            mutex_unlock(&syscall_slots_lock);
+            pr_loc_bug("Hook %pf()<%p> is already registered for syscall #%d", fn, fn, syscall_num);
+            return -EEXIST;
+        }
+    }
+
+    struct syscall_hooks *hooks = copy_syscall_hooks(old, fn, priority, 0);
+    if (IS_ERR(hooks)) {
+        put_syscall_slot(slot); //it may have been just created for us
+        mutex_unlock(&syscall_slots_lock);
+        return PTR_ERR(hooks);
+    }
+
+    rcu_assign_pointer(slot->hooks, hooks);
+    mutex_unlock(&syscall_slots_lock);
+
+    if (old) {
+        synchronize_srcu(&syscall_hooks_srcu); //no CPU can be iterating over the old list after this
+        kfree(old);
+    }
+
+    return 0;
+}
+
+int remove_syscall_hook(unsigned int syscall_num, syscall_hook_fn *fn)
+{
+    pr_loc_dbg("Removing hook %pf()<%p> from syscall #%d", fn, fn, syscall_num);
+
+    mutex_lock(&syscall_slots_lock);
+    struct syscall_slot *slot = syscall_slots_initialized ? find_syscall_slot(syscall_num) : NULL;
+    struct syscall_hooks *old = slot ? rcu_dereference_protected(slot->hooks, lockdep_is_held(&syscall_slots_lock))
+                                     : NULL;
+
+    unsigned int idx = 0;
+    while (old && idx < old->num && old->hooks[idx].fn != fn)
+        ++idx;
+
+    if (unlikely(!old || idx == old->num)) {
+        mutex_unlock(&syscall_slots_lock);
+        pr_loc_bug("Hook %pf()<%p> is not registered for syscall #%d", fn, fn, syscall_num);
+        return -ENOENT;
+    }
+
+    struct syscall_hooks *hooks = copy_syscall_hooks(old, NULL, 0, idx);
+    if (IS_ERR(hooks)) {
+        mutex_unlock(&syscall_slots_lock);
+        return PTR_ERR(hooks);
+    }
+
+    rcu_assign_pointer(slot->hooks, hooks);
+    put_syscall_slot(slot); //the old list is not reachable anymore, so the slot may be released
+    mutex_unlock(&syscall_slots_lock);
+
+    synchronize_srcu(&syscall_hooks_srcu); //no CPU can be iterating over the old list after this
+    kfree(old);
 
     return 0;
 }
@@ -3,7 +3,7 @@
 
 #include <linux/types.h>
 
-#define OVERRIDE_JUMP_SIZE 1 + 1 + 8 + 1 + 1 //MOVQ + %rax + $vaddr + JMP + *%rax
+#define OVERRIDE_JUMP_SIZE (1 + 1 + 8 + 1 + 1) //MOVQ + %rax + $vaddr + JMP + *%rax
 #define DEFINE_OVSYMBOL_PTRS(fname) \
     static unsigned char *fname##_code = NULL; \
     static void *fname##_addr = NULL;
@@ -22,36 +22,50 @@
     fname##_addr = NULL; \
 
 typedef struct override_symbol_inst override_symbol_inst;
+typedef struct override_symbol_batch override_symbol_batch;
 
 /************************************************* Current interface **************************************************/
 /**
  * Calls the original symbol, returning nothing, that was previously overridden
  *
+ * Without a detour (see override_symbol.c) the code is swapped around the call with stop_machine(), so the caller
+ * must be able to sleep.
+ *
  * @param sym pointer to a override_symbol_inst
  * @param ... any arguments to the original function
  *
  * @return 0 if the execution succeeded, -E if it didn't
  */
 #define call_overridden_symbol_void(sym, ...) ({              \
-    int __ret;                                                \
-    bool __was_installed = symbol_is_overridden(sym);         \
+    int __ret = 0;                                            \
+    u64 __ovs_start = __ovsym_org_begin(sym);                 \
     _Pragma("GCC diagnostic push")                            \
     _Pragma("GCC diagnostic ignored \"-Wstrict-prototypes\"") \
-    void (*__ptr)() = __get_org_ptr(sym);                     \
+    void (*__ptr)() = __get_detour_ptr(sym);                  \
     _Pragma("GCC diagnostic pop")                             \
-    __ret = __disable_symbol_override(sym);                   \
-    if (likely(__ret == 0)) {                                 \
+    if (likely(__ptr)) {                                      \
         __ptr(__VA_ARGS__);                                   \
-        if (likely(__was_installed)) {                        \
-        __ret = __enable_symbol_override(sym);                \
+    } else {                                                  \
+        bool __was_installed = symbol_is_overridden(sym);     \
+        __ptr = __get_org_ptr(sym);                           \
+        __ret = __disable_symbol_override(sym);               \
+        if (likely(__ret == 0)) {                             \
+            __ptr(__VA_ARGS__);                               \
+            if (likely(__was_installed)) {                    \
+                __ret = __enable_symbol_override(sym);        \
+            }                                                 \
         }                                                     \
     }                                                         \
+    __ovsym_org_end(sym, __ovs_start);                        \
     __ret;                                                    \
 });
 
 /**
  * Calls the original symbol, returning a value, that was previously overridden
  *
+ * Without a detour (see override_symbol.c) the code is swapped around the call with stop_machine(), so the caller
+ * must be able to sleep.
+ *
  * @param out_var name of the variable where original function return value should be placed
  * @param sym pointer to a override_symbol_inst
  * @param ... any arguments to the original function
@@ -59,19 +73,26 @@ typedef struct override_symbol_inst override_symbol_inst;
  * @return 0 if the execution succeeded, -E if it didn't
  */
 #define call_overridden_symbol(out_var, sym, ...) ({          \
-    int __ret;                                                \
-    bool __was_installed = symbol_is_overridden(sym);         \
+    int __ret = 0;                                            \
+    u64 __ovs_start = __ovsym_org_begin(sym);                 \
     _Pragma("GCC diagnostic push")                            \
     _Pragma("GCC diagnostic ignored \"-Wstrict-prototypes\"") \
-    typeof (out_var) (*__ptr)() = __get_org_ptr(sym);         \
+    typeof (out_var) (*__ptr)() = __get_detour_ptr(sym);      \
     _Pragma("GCC diagnostic pop")                             \
-    __ret = __disable_symbol_override(sym);                   \
-    if (likely(__ret == 0)) {                                 \
+    if (likely(__ptr)) {                                      \
         out_var = __ptr(__VA_ARGS__);                         \
-        if (likely(__was_installed)) {                        \
-            __ret = __enable_symbol_override(sym);            \
+    } else {                                                  \
+        bool __was_installed = symbol_is_overridden(sym);     \
+        __ptr = __get_org_ptr(sym);                           \
+        __ret = __disable_symbol_override(sym);               \
+        if (likely(__ret == 0)) {                             \
+            out_var = __ptr(__VA_ARGS__);                     \
+            if (likely(__was_installed)) {                    \
+                __ret = __enable_symbol_override(sym);        \
+            }                                                 \
         }                                                     \
     }                                                         \
+    __ovsym_org_end(sym, __ovs_start);                        \
     __ret;                                                    \
 });
 
@@ -95,7 +116,8 @@ typedef struct override_symbol_inst override_symbol_inst;
  *     ...
  *     restore_symbol_ng(backup_addr, backup_code); //restore backed-up copy of printk()
  *
- * @todo: This should be rewritten using INSN without inline ASM wizardy, but this is much more complex
+ * If the kernel has the instruction decoder the original function will be called through a detour (see
+ * override_symbol.c for details) without modifying the code back and forth.
  */
 struct override_symbol_inst* __must_check override_symbol_ng(const char *name, const void *new_sym_ptr);
 
@@ -104,15 +126,77 @@ struct override_symbol_inst* __must_check override_symbol_ng(const char *name, c
  *
  * For details see override_symbol_ng() docblock
  *
- * @return 0 on success, -E on error
+ * @return 0 on success (the instance is freed), -E on error (the symbol stays overridden & the instance is kept)
  */
 int restore_symbol_ng(struct override_symbol_inst *sym);
 
+/**
+ * Restores multiple symbols overridden by override_symbol_ng() or a batch in one go
+ *
+ * This is much cheaper than calling restore_symbol_ng() for each of them as the kernel is stopped only once. NULL
+ * entries are skipped.
+ *
+ * @return 0 on success (all instances are freed), -E on error (nothing is restored & nothing is freed)
+ */
+int restore_symbols_ng(struct override_symbol_inst **syms, unsigned int num);
+
 /**
  * Check if the given symbol override is currently active
  */
 bool symbol_is_overridden(struct override_symbol_inst *sym);
 
+/**
+ * Starts a batch of symbol overrides
+ *
+ * Every override_symbol_ng() unlocks & relocks the memory on its own, and each of these ends with a full TLB flush
+ * (which is an IPI to every CPU). When multiple symbols are overridden at once it's much cheaper to group them: all
+ * affected pages are unlocked together, all trampolines are written, and pages are relocked again - with just two TLB
+ * flushes in total regardless of the number of symbols.
+ *
+ * @param max_symbols Maximum number of symbols which will be added to the batch
+ *
+ * @return batch pointer on success, ERR_PTR(-E) on error
+ *
+ * @example
+ *     struct override_symbol_batch *batch = override_symbol_batch_begin(2);
+ *     if (IS_ERR(batch)) { ... handle error ... }
+ *     ov_foo = override_symbol_batch_add(batch, "foo", foo_shim);
+ *     if (IS_ERR(ov_foo)) { override_symbol_batch_abort(batch); ... handle error ... }
+ *     ov_bar = override_symbol_batch_add(batch, "bar", bar_shim);
+ *     if (IS_ERR(ov_bar)) { override_symbol_batch_abort(batch); ... handle error ... }
+ *     override_symbol_batch_commit(batch); //both ov_foo and ov_bar are now active
+ *     ...
+ *     restore_symbol_ng(ov_foo); //each instance is restored separately
+ */
+struct override_symbol_batch* __must_check override_symbol_batch_begin(unsigned int max_symbols);
+
+/**
+ * Adds a symbol to the batch started with override_symbol_batch_begin()
+ *
+ * The symbol is looked up and its trampoline is prepared, but nothing is written until the batch is committed. The
+ * returned instance must not be used before override_symbol_batch_commit() is called.
+ *
+ * @return Instance of override_symbol_inst struct pointer on success, ERR_PTR(-E) on error; failing to add a symbol
+ *         doesn't invalidate the batch
+ */
+struct override_symbol_inst* __must_check override_symbol_batch_add(struct override_symbol_batch *batch,
+                                                                    const char *name, const void *new_sym_ptr);
+
+/**
+ * Installs all overrides added to the batch & frees the batch
+ *
+ * After this function returns all instances from override_symbol_batch_add() behave exactly like ones returned by
+ * override_symbol_ng().
+ *
+ * @return 0 on success, -E on error
+ */
+int override_symbol_batch_commit(struct override_symbol_batch *batch);
+
+/**
+ * Frees the batch and all instances added to it without installing anything
+ */
+void override_symbol_batch_abort(struct override_symbol_batch *batch);
+
 /**
  * Non-destructively overrides a syscall
  *
@@ -139,6 +223,57 @@ int override_syscall(unsigned int syscall_num, const void *new_sysc_ptr, void *
  */
 int restore_syscall(unsigned int syscall_num);
 
+/**
+ * Result of a syscall pre-hook
+ */
+typedef enum {
+    SYSCALL_HOOK_CONTINUE = 0, //call the next hook (and the syscall itself after the last one)
+    SYSCALL_HOOK_RETURN = 1, //don't call anything else and return the value set by the hook
+} syscall_hook_result;
+
+/**
+ * Arguments of a hooked syscall; hooks may modify them and the next hooks & the syscall will see the new values
+ */
+struct syscall_hook_args {
+    unsigned int nr;
+    unsigned long args[6];
+};
+
+/**
+ * A pre-hook executed before the syscall
+ *
+ * Hooks are executed in an SRCU read-side critical section in the context of the calling process: they can sleep (e.g.
+ * to access user memory), but everything sleeping there delays removal of hooks.
+ *
+ * @param ret Where the value to return from the syscall should be placed when SYSCALL_HOOK_RETURN is returned
+ */
+typedef syscall_hook_result (syscall_hook_fn)(struct syscall_hook_args *args, long *ret);
+
+/**
+ * Adds a pre-hook to a syscall
+ *
+ * Hooks are executed in the ascending priority order (hooks with the same priority in the order they were added),
+ * before the syscall override (see override_syscall()) or the original syscall. Hooks & overrides can be freely
+ * mixed and added/removed in any order. Syscalls which are implemented with pt_regs stubs on x86_64 (e.g. execve,
+ * clone, fork) cannot be called from a C function - they can only be hooked when overridden as well.
+ *
+ * @param syscall_num Number of the syscall (see override_syscall())
+ * @param fn Hook; the same function cannot be added to the same syscall twice
+ * @param priority Lower = earlier
+ *
+ * @return 0 on success, -E on error
+ */
+int add_syscall_hook(unsigned int syscall_num, syscall_hook_fn *fn, int priority);
+
+/**
+ * Removes a pre-hook added with add_syscall_hook()
+ *
+ * When this function returns the hook is guaranteed not to be running on any CPU.
+ *
+ * @return 0 on success, -E on error
+ */
+int remove_syscall_hook(unsigned int syscall_num, syscall_hook_fn *fn);
+
 /************************************************** Legacy interface **************************************************/
 /**
  * Overrides a kernel symbol with something else of your choice
@@ -177,8 +312,17 @@ int restore_symbol(void * org_sym_ptr, const unsigned char *org_sym_code);
 
 /****************** Private helpers (should not be used directly by any code outside of this unit!) *******************/
 #include <linux/types.h>
+#include "ovsym_stats.h" //OVSYM_STATS
 int __enable_symbol_override(override_symbol_inst *sym);
 int __disable_symbol_override(override_symbol_inst *sym);
 void * __get_org_ptr(struct override_symbol_inst *sym);
+void * __get_detour_ptr(struct override_symbol_inst *sym);
+#ifdef OVSYM_STATS
+u64 __ovsym_org_begin(struct override_symbol_inst *sym);
+void __ovsym_org_end(struct override_symbol_inst *sym, u64 start);
+#else
+#define __ovsym_org_begin(sym) (0)
+#define __ovsym_org_end(sym, start) do { (void)(start); } while(0)
+#endif
 
 #endif //REDPILLLKM_OVERRIDE_KFUNC_H
@@ -0,0 +1,260 @@
+/**
+ * Per-symbol call counters & latency histograms for symbols overridden with override_symbol_ng()
+ *
+ * Every override_symbol_inst only knows what it replaced and with what - nothing says how often a trampoline fires or
+ * how long calling the original takes. When a shim becomes a hot-path bottleneck in production (e.g. a code swapping
+ * symbol called thousands of times per second) these answer the question which one is it.
+ *
+ * WHAT IS MEASURED?
+ *  - calls: every hit of the trampoline. The trampoline jumps to a tiny entry stub (see override_symbol.c) which does
+ *    a single "incq %gs:" on the per-CPU counter and jumps to the shim - i.e. it costs one instruction per call.
+ *  - org_calls & latency: calls of the original through call_overridden_symbol[_void](). Only every 2^N-th call on a
+ *    given CPU (see ovsym_sample_shift) is timed with get_cycles() and put into a log-linear histogram, so that the
+ *    common path is an increment and a test.
+ * The trampoline *jumps* into the shim, so its return cannot be observed without rewriting the stack (which isn't
+ * safe for functions with arguments on the stack). The time of the shim itself is thus not measured - only the time
+ * it spends calling the original (which includes the detour or the code swapping with locks, see override_symbol.c).
+ *
+ * Stats are disabled by default (ovsym_stats=1 enables them) and, when enabled, they're available as a table in
+ * <debugfs>/redpill/ovsym_stats. Writing anything to the file resets the counters.
+ */
+#include "ovsym_stats.h"
+
+#ifdef OVSYM_STATS
+#include "../common.h"
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h> //kmalloc()
+#include <linux/percpu.h>
+#include <linux/mutex.h>
+#include <linux/list.h>
+#include <linux/log2.h> //fls64()
+#include <linux/timex.h> //get_cycles()
+#include <asm/tsc.h> //tsc_khz
+
+#define OVSYM_STATS_FILE "ovsym_stats"
+#define OVSYM_STATS_LAT_SUBS (1 << OVSYM_STATS_LAT_SUB_BITS)
+
+static bool ovsym_stats = false;
+module_param(ovsym_stats, bool, 0444);
+MODULE_PARM_DESC(ovsym_stats, "Count calls of overridden symbols & sample latency of their originals (see debugfs)");
+
+static uint ovsym_sample_shift = 6;
+module_param(ovsym_sample_shift, uint, 0644);
+MODULE_PARM_DESC(ovsym_sample_shift, "Time every 2^N-th call of an original per CPU (0 = time every call)");
+
+struct ovsym_stats {
+    struct list_head list;
+    const char *name;
+    struct ovsym_cpu_stats __percpu *cpu;
+};
+
+static LIST_HEAD(stats_list);
+static DEFINE_MUTEX(stats_list_lock); //protects stats_list & stats_file
+static struct dentry *stats_file = NULL;
+
+static unsigned int latency_to_bucket(u64 cycles)
+{
+    if (cycles < OVSYM_STATS_LAT_SUBS)
+        return cycles;
+
+    unsigned int msb = fls64(cycles) - 1;
+    unsigned int bucket = ((msb - OVSYM_STATS_LAT_SUB_BITS + 1) << OVSYM_STATS_LAT_SUB_BITS) |
+                          ((cycles >> (msb - OVSYM_STATS_LAT_SUB_BITS)) & (OVSYM_STATS_LAT_SUBS - 1));
+
+    return min_t(unsigned int, bucket, OVSYM_STATS_LAT_BUCKETS - 1);
+}
+
+//The highest number of cycles falling into a given bucket
+static u64 bucket_to_latency(unsigned int bucket)
+{
+    if (bucket < OVSYM_STATS_LAT_SUBS)
+        return bucket;
+
+    unsigned int shift = (bucket >> OVSYM_STATS_LAT_SUB_BITS) - 1;
+    u64 sub = bucket & (OVSYM_STATS_LAT_SUBS - 1);
+
+    return ((OVSYM_STATS_LAT_SUBS + sub + 1) << shift) - 1;
+}
+
+static u64 cycles_to_ns(u64 cycles)
+{
+    return likely(tsc_khz) ? div_u64(cycles * 1000000, tsc_khz) : cycles;
+}
+
+u64 ovsym_stat_org_begin(struct ovsym_stats *stats)
+{
+    if (!stats)
+        return 0;
+
+    u64 num = this_cpu_inc_return(stats->cpu->org_calls);
+    if (num & ((1ULL << ACCESS_ONCE(ovsym_sample_shift)) - 1))
+        return 0;
+
+    return get_cycles() ?: 1;
+}
+
+void ovsym_stat_org_end(struct ovsym_stats *stats, u64 start)
+{
+    if (!start)
+        return;
+
+    //The original may sleep & wake up on another CPU - TSCs are synchronized on everything we run on
+    s64 delta = (s64)(get_cycles() - start);
+    this_cpu_inc(stats->cpu->org_latency[latency_to_bucket(delta > 0 ? delta : 0)]);
+}
+
+struct ovsym_cpu_stats __percpu *ovsym_stats_cpu(struct ovsym_stats *stats)
+{
+    return stats->cpu;
+}
+
+//Sums a given field across all CPUs
+#define sum_stat(out, stats, field) \
+    do { (out) = 0; for_each_possible_cpu(cpu) { (out) += per_cpu_ptr(stats, cpu)->field; } } while(0)
+
+/**
+ * Finds the latency below which a given percent of samples falls
+ */
+static u64 latency_percentile(const u64 *hist, u64 samples, unsigned int percent)
+{
+    u64 rank = div_u64(samples * percent + 99, 100); //rounded up, so that p99 of 10 samples isn't the 9th one
+    u64 seen = 0;
+
+    for (int i = 0; i < OVSYM_STATS_LAT_BUCKETS; ++i) {
+        seen += hist[i];
+        if (seen >= rank)
+            return cycles_to_ns(bucket_to_latency(i));
+    }
+
+    return 0;
+}
+
+static int stats_show(struct seq_file *m, void *v)
+{
+    struct ovsym_stats *stats;
+    u64 hist[OVSYM_STATS_LAT_BUCKETS];
+    int cpu;
+
+    seq_printf(m, "%-32s %12s %12s %10s %10s %10s\n", "symbol", "calls", "org_calls", "sampled", "p50_ns", "p99_ns");
+
+    mutex_lock(&stats_list_lock);
+    list_for_each_entry(stats, &stats_list, list) {
+        u64 calls, org_calls, samples = 0;
+        sum_stat(calls, stats->cpu, calls);
+        sum_stat(org_calls, stats->cpu, org_calls);
+        for (int i = 0; i < OVSYM_STATS_LAT_BUCKETS; ++i) {
+            sum_stat(hist[i], stats->cpu, org_latency[i]);
+            samples += hist[i];
+        }
+
+        seq_printf(m, "%-32s %12llu %12llu %10llu", stats->name, calls, org_calls, samples);
+        if (samples)
+            seq_printf(m, " %10llu %10llu\n", latency_percentile(hist, samples, 50),
+                       latency_percentile(hist, samples, 99));
+        else
+            seq_printf(m, " %10s %10s\n", "-", "-");
+    }
+    mutex_unlock(&stats_list_lock);
+
+    seq_printf(m, "# latency is sampled every 2^%u calls of the original per CPU; tsc_khz=%u\n",
+               ACCESS_ONCE(ovsym_sample_shift), tsc_khz);
+    return 0;
+}
+
+static int stats_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, stats_show, NULL);
+}
+
+static ssize_t stats_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+    struct ovsym_stats *stats;
+    int cpu;
+
+    mutex_lock(&stats_list_lock);
+    list_for_each_entry(stats, &stats_list, list) {
+        for_each_possible_cpu(cpu)
+            memset(per_cpu_ptr(stats->cpu, cpu), 0, sizeof(struct ovsym_cpu_stats));
+    }
+    mutex_unlock(&stats_list_lock);
+
+    return count;
+}
+
+static const struct file_operations stats_fops = {
+    .owner = THIS_MODULE,
+    .open = stats_open,
+    .read = seq_read,
+    .write = stats_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+/**
+ * Creates the debugfs file when the first symbol is registered; must be called with stats_list_lock held
+ */
+static void publish_stats_file(void)
+{
+    if (stats_file)
+        return;
+
+    struct dentry *root = get_debugfs_root();
+    if (IS_ERR(root))
+        return; //we still collect stats - the next symbol will try again
+
+    stats_file = debugfs_create_file(OVSYM_STATS_FILE, 0600, root, NULL, &stats_fops);
+    if (IS_ERR_OR_NULL(stats_file)) {
+        pr_loc_err("Failed to create debugfs file for overridden symbols stats");
+        stats_file = NULL;
+        put_debugfs_root();
+    }
+}
+
+struct ovsym_stats *ovsym_stats_register(const char *name)
+{
+    if (!ovsym_stats)
+        return NULL;
+
+    struct ovsym_stats *stats = kmalloc(sizeof(struct ovsym_stats), GFP_KERNEL);
+    if (unlikely(!stats)) {
+        pr_loc_crt("kmalloc failed");
+        return NULL;
+    }
+
+    stats->cpu = alloc_percpu(struct ovsym_cpu_stats);
+    if (unlikely(!stats->cpu)) {
+        pr_loc_err("alloc_percpu failed for %s() stats - they will not be available", name);
+        kfree(stats);
+        return NULL;
+    }
+    stats->name = name;
+
+    mutex_lock(&stats_list_lock);
+    list_add_tail(&stats->list, &stats_list);
+    publish_stats_file();
+    mutex_unlock(&stats_list_lock);
+
+    pr_loc_dbg("Registered stats for %s()", name);
+    return stats;
+}
+
+void ovsym_stats_unregister(struct ovsym_stats *stats)
+{
+    if (!stats)
+        return;
+
+    mutex_lock(&stats_list_lock);
+    list_del(&stats->list);
+    if (list_empty(&stats_list) && stats_file) {
+        debugfs_remove(stats_file);
+        stats_file = NULL;
+        put_debugfs_root();
+    }
+    mutex_unlock(&stats_list_lock);
+
+    free_percpu(stats->cpu);
+    kfree(stats);
+}
+#endif //OVSYM_STATS
@@ -0,0 +1,70 @@
+#ifndef REDPILL_OVSYM_STATS_H
+#define REDPILL_OVSYM_STATS_H
+
+#include "debugfs_root.h" //RP_DEBUGFS_ENABLED
+
+//Stats are only collected when they can be read (which depends on stealth mode); define it manually to force disable
+#if defined(RP_DEBUGFS_ENABLED) && !defined(OVSYM_NO_STATS)
+#define OVSYM_STATS
+#endif
+
+#define OVSYM_STATS_LAT_SUB_BITS 2 //every power of 2 is split into 2^N linear buckets (i.e. ~25% precision)
+#define OVSYM_STATS_LAT_BUCKETS 128 //log-linear buckets of cycles (last one is catch-all: >=7*2^30 cycles, seconds)
+
+#ifdef OVSYM_STATS
+#include <linux/types.h>
+#include <linux/percpu.h> //__percpu
+
+/**
+ * Per-CPU counters of a single overridden symbol
+ *
+ * Every increment is a single this_cpu_* op without any locking. All values are summed across CPUs when read.
+ */
+struct ovsym_cpu_stats {
+    u64 calls; //trampoline hits - incremented by the entry stub in front of the shim (see override_symbol.c)
+    u64 org_calls; //calls of the original through call_overridden_symbol[_void]()
+    u32 org_latency[OVSYM_STATS_LAT_BUCKETS]; //sampled cycles spent in call_overridden_symbol[_void]()
+};
+
+struct ovsym_stats;
+
+/**
+ * Allocates stats for an overridden symbol & lists it in <debugfs>/redpill/ovsym_stats
+ *
+ * @param name Name of the symbol; it must outlive the stats (it's not copied)
+ *
+ * @return stats ptr or NULL if stats are disabled (see ovsym_stats module param) or cannot be allocated; both are fine
+ *         for the caller - there will just be no stats for the symbol
+ */
+struct ovsym_stats *ovsym_stats_register(const char *name);
+
+/**
+ * Reverses ovsym_stats_register(); it's safe to call it with NULL
+ *
+ * The caller must ensure that nothing is using the stats anymore (incl. the entry stub).
+ */
+void ovsym_stats_unregister(struct ovsym_stats *stats);
+
+/**
+ * Gets per-CPU counters of the symbol, so that the entry stub can increment them directly
+ */
+struct ovsym_cpu_stats __percpu *ovsym_stats_cpu(struct ovsym_stats *stats);
+
+/**
+ * Counts a call of the original and decides whether it should be timed
+ *
+ * @return cycles counter to pass to ovsym_stat_org_end() or 0 if this call isn't sampled
+ */
+u64 ovsym_stat_org_begin(struct ovsym_stats *stats);
+
+/**
+ * Records latency of a sampled call of the original (no-op if start is 0)
+ */
+void ovsym_stat_org_end(struct ovsym_stats *stats, u64 start);
+
+#else //OVSYM_STATS
+#define ovsym_stats_register(name) (NULL)
+#define ovsym_stats_unregister(stats) //noop
+#endif //OVSYM_STATS
+
+#endif //REDPILL_OVSYM_STATS_H
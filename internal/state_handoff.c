@@ -0,0 +1,220 @@
+/**
+ * Passes state which cannot be rebuilt from scratch between two instances of the module (live update)
+ *
+ * WHY?
+ * Some things can only be learned at a specific moment of the boot. The mfgBIOS vtable for example is found while the
+ * BIOS is being relocated by the kernel (see bios_shim.c) - a module loaded after the BIOS has no way of finding it.
+ * Without passing that knowledge the only way to get a new version of the module running is a full reboot.
+ *
+ * HOW IT WORKS?
+ * Two instances cannot be loaded at the same time (it's the same module) and hooks of the old one point to its code,
+ * which is gone as soon as it unloads. So every subsystem still exits as usual, but it first saves what it knows with
+ * rp_handoff_put(). When live update is requested the blob with all sections is left in memory on unload, and the new
+ * instance gets its address with the "handoff" param. The blob is verified (magic, its own address, format version,
+ * length and crc32) and copied during init, so subsystems can pick their sections with rp_handoff_get() and take over
+ * instead of starting from scratch:
+ *   addr=$(cat /sys/module/redpill/parameters/handoff_addr)
+ *   echo 1 > /sys/module/redpill/parameters/live_update
+ *   rmmod redpill && insmod redpill.ko handoff=$addr <other params>
+ *
+ * Every section has its own version, so a new module with a changed format of one section can still adopt the others.
+ */
+#include "state_handoff.h"
+#include "../common.h"
+#include <linux/moduleparam.h>
+#include <linux/crc32.h> //crc32_le()
+#include <linux/uaccess.h> //probe_kernel_read()
+
+#define RP_HANDOFF_MAGIC 0x4f485052 //"RPHO"
+#define RP_HANDOFF_FORMAT 1 //format of the header; sections are versioned separately
+#define RP_HANDOFF_SIZE 1024 //whole blob incl. header; sections are small
+#define RP_HANDOFF_CRC_START offsetof(struct rp_handoff, self) //magic, format, length & crc32 aren't covered
+
+struct rp_handoff_section_desc {
+    u16 version;
+    u16 offset; //from the start of data[]
+    u16 len; //0 = section not saved
+};
+
+/**
+ * Layout of the blob left in memory between instances
+ */
+struct rp_handoff {
+    u32 magic; //RP_HANDOFF_MAGIC
+    u16 format; //RP_HANDOFF_FORMAT
+    u16 length; //used length of the blob incl. the header
+    u32 crc32; //crc32_le(~0, <blob from self>, length - RP_HANDOFF_CRC_START) ^ ~0
+    u32 reserved;
+    u64 self; //address of the blob itself - protects against a stale/random address
+    struct rp_handoff_section_desc sections[__RP_HANDOFF_SECTIONS_NUM];
+    u8 data[];
+};
+#define RP_HANDOFF_DATA_MAX (RP_HANDOFF_SIZE - sizeof(struct rp_handoff))
+
+static unsigned long handoff = 0;
+module_param(handoff, ulong, 0);
+MODULE_PARM_DESC(handoff, "Address of the state left by the previous instance (its handoff_addr)");
+
+static unsigned long handoff_addr = 0;
+module_param(handoff_addr, ulong, 0400);
+MODULE_PARM_DESC(handoff_addr, "Address where the state will be left on unload when live_update is set");
+
+static bool live_update = false;
+module_param(live_update, bool, 0644);
+MODULE_PARM_DESC(live_update, "Leave the state in memory on unload so that it can be adopted by the next instance");
+
+static union {
+    struct rp_handoff hdr;
+    u8 raw[RP_HANDOFF_SIZE];
+} incoming;
+static bool incoming_valid = false;
+static struct rp_handoff *outgoing = NULL;
+static u16 outgoing_used = 0; //bytes of outgoing->data[] used
+
+static u32 handoff_crc(const struct rp_handoff *blob)
+{
+    return crc32_le(~0, (const u8 *)blob + RP_HANDOFF_CRC_START, blob->length - RP_HANDOFF_CRC_START) ^ ~0;
+}
+
+/**
+ * Copies & verifies the blob passed in the handoff param
+ *
+ * The address comes from the userspace so it's never dereferenced directly before it's known to be the blob.
+ *
+ * @return 0 on success or -E on error
+ */
+static int adopt_incoming(void)
+{
+    const void *blob = (const void *)handoff;
+    if (!virt_addr_valid(blob) || probe_kernel_read(&incoming.hdr, blob, sizeof(incoming.hdr)) != 0) {
+        pr_loc_err("Handoff address 0x%lx is not readable", handoff);
+        return -EFAULT;
+    }
+
+    if (incoming.hdr.magic != RP_HANDOFF_MAGIC || incoming.hdr.self != handoff) {
+        pr_loc_err("There's no handoff @ 0x%lx (magic=0x%08x)", handoff, incoming.hdr.magic);
+        return -EINVAL;
+    }
+
+    if (incoming.hdr.format != RP_HANDOFF_FORMAT) {
+        pr_loc_err("Handoff format %u is not supported - expected %u", incoming.hdr.format, RP_HANDOFF_FORMAT);
+        return -EPROTO;
+    }
+
+    if (incoming.hdr.length < sizeof(struct rp_handoff) || incoming.hdr.length > RP_HANDOFF_SIZE ||
+        probe_kernel_read(&incoming.raw, blob, incoming.hdr.length) != 0) {
+        pr_loc_err("Handoff length %u is invalid", incoming.hdr.length);
+        return -EINVAL;
+    }
+
+    u32 crc = handoff_crc(&incoming.hdr);
+    if (crc != incoming.hdr.crc32) {
+        pr_loc_err("Handoff crc32 mismatch (got 0x%08x expected 0x%08x)", crc, incoming.hdr.crc32);
+        return -EBADMSG;
+    }
+
+    for (int i = 0; i < __RP_HANDOFF_SECTIONS_NUM; ++i) {
+        const struct rp_handoff_section_desc *desc = &incoming.hdr.sections[i];
+        if (desc->len && desc->offset + desc->len > incoming.hdr.length - sizeof(struct rp_handoff)) {
+            pr_loc_err("Handoff section %d is out of bounds", i);
+            return -EINVAL;
+        }
+    }
+
+    //It's ours for sure now - nobody else will free it
+    kfree(blob);
+    return 0;
+}
+
+int rp_handoff_init(void)
+{
+    if (handoff) {
+        int out = adopt_incoming();
+        incoming_valid = (out == 0);
+        if (incoming_valid)
+            pr_loc_inf("Adopted state of the previous instance (%u bytes)", incoming.hdr.length);
+        else
+            pr_loc_wrn("State of the previous instance cannot be adopted (error=%d) - starting from scratch", out);
+    }
+
+    outgoing = kzalloc(RP_HANDOFF_SIZE, GFP_KERNEL);
+    if (unlikely(!outgoing)) {
+        pr_loc_crt("kzalloc failed");
+        return -ENOMEM;
+    }
+
+    outgoing_used = 0;
+    handoff_addr = (unsigned long)outgoing;
+    return 0;
+}
+
+const void *rp_handoff_get(rp_handoff_section section, u16 version, u16 len)
+{
+    if (!incoming_valid || unlikely(section >= __RP_HANDOFF_SECTIONS_NUM))
+        return NULL;
+
+    const struct rp_handoff_section_desc *desc = &incoming.hdr.sections[section];
+    if (!desc->len)
+        return NULL;
+
+    if (desc->version != version || desc->len != len) {
+        pr_loc_wrn("Handoff section %d has version %u/len %u - expected %u/%u; ignoring it", section, desc->version,
+                   desc->len, version, len);
+        return NULL;
+    }
+
+    return incoming.hdr.data + desc->offset;
+}
+
+int rp_handoff_put(rp_handoff_section section, u16 version, const void *data, u16 len)
+{
+    if (unlikely(section >= __RP_HANDOFF_SECTIONS_NUM || !len)) {
+        pr_loc_bug("Invalid handoff section %d (len=%u)", section, len);
+        return -EINVAL;
+    }
+
+    if (unlikely(!outgoing))
+        return -ENODEV; //init didn't get that far
+
+    struct rp_handoff_section_desc *desc = &outgoing->sections[section];
+    if (unlikely(desc->len)) {
+        pr_loc_bug("Handoff section %d was already saved", section);
+        return -EEXIST;
+    }
+
+    if (unlikely(outgoing_used + len > RP_HANDOFF_DATA_MAX)) {
+        pr_loc_bug("Handoff section %d of %u bytes doesn't fit (used %u of %zu)", section, len, outgoing_used,
+                   RP_HANDOFF_DATA_MAX);
+        return -ENOSPC;
+    }
+
+    memcpy(outgoing->data + outgoing_used, data, len);
+    desc->version = version;
+    desc->offset = outgoing_used;
+    desc->len = len;
+    outgoing_used += len;
+
+    return 0;
+}
+
+void rp_handoff_exit(bool unload)
+{
+    incoming_valid = false;
+    if (!outgoing)
+        return;
+
+    if (!unload || !live_update) {
+        kfree(outgoing);
+        outgoing = NULL;
+        handoff_addr = 0;
+        return;
+    }
+
+    outgoing->magic = RP_HANDOFF_MAGIC;
+    outgoing->format = RP_HANDOFF_FORMAT;
+    outgoing->length = sizeof(struct rp_handoff) + outgoing_used;
+    outgoing->self = (unsigned long)outgoing;
+    outgoing->crc32 = handoff_crc(outgoing);
+    pr_loc_inf("State left for the next instance - load it with handoff=0x%lx", handoff_addr);
+    outgoing = NULL; //it's not ours anymore
+}
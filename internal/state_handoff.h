@@ -0,0 +1,63 @@
+#ifndef REDPILL_STATE_HANDOFF_H
+#define REDPILL_STATE_HANDOFF_H
+
+#include <linux/types.h>
+
+/**
+ * Parts of the state passed between module instances; every one belongs to a single subsystem defining its format
+ *
+ * New sections can be added at the end only (the index is a part of the format).
+ */
+typedef enum {
+    RP_HANDOFF_BIOS_SHIM, //mfgBIOS location (see bios_shim.c)
+    RP_HANDOFF_PMU_SHIM, //vPMU state (see pmu_shim.c)
+    __RP_HANDOFF_SECTIONS_NUM
+} rp_handoff_section;
+
+//Handoff needs kernel memory probing which doesn't exist in the userspace emulator; define it manually to disable
+#ifndef RP_NO_HANDOFF
+/**
+ * Adopts the state left by the previous instance (if any was passed) & prepares space for the state of this one
+ *
+ * This must be called before any subsystem is initialized. Failure to adopt the state is not an error: subsystems will
+ * simply start from scratch.
+ *
+ * @return 0 on success, -E on error
+ */
+int rp_handoff_init(void);
+
+/**
+ * Gets a section of the state left by the previous instance
+ *
+ * The section is only returned when it was saved with exactly the same version & length, so that a subsystem never
+ * has to deal with a format it doesn't know. It can be called only during init.
+ *
+ * @return pointer to the data or NULL if there's no (compatible) section
+ */
+const void *rp_handoff_get(rp_handoff_section section, u16 version, u16 len);
+
+/**
+ * Saves a section of the state for the next instance; it's meant to be called when subsystems are exiting
+ *
+ * The data is copied, so it can live on the stack. Whether it will actually be left for the next instance is decided
+ * by rp_handoff_exit().
+ *
+ * @return 0 on success, -E on error
+ */
+int rp_handoff_put(rp_handoff_section section, u16 version, const void *data, u16 len);
+
+/**
+ * Leaves the state saved with rp_handoff_put() in memory (if live update was requested) or frees it
+ *
+ * @param unload Whether the module is unloading; on init failure the state is never left behind
+ */
+void rp_handoff_exit(bool unload);
+
+#else //RP_NO_HANDOFF
+#define rp_handoff_init() (0)
+#define rp_handoff_get(section, version, len) (NULL)
+#define rp_handoff_put(section, version, data, len) ((void)(data), 0)
+#define rp_handoff_exit(unload) //noop
+#endif //RP_NO_HANDOFF
+
+#endif //REDPILL_STATE_HANDOFF_H
@@ -10,8 +10,6 @@
 
 int initialize_stealth(void *config2)
 {
-    struct runtime_config *config = config2;
-
     int error = 0;
 #if STEALTH_MODE <= STEALTH_MODE_OFF
     //STEALTH_MODE_OFF shortcut
@@ -20,7 +18,7 @@ int initialize_stealth(void *config2)
 
 #if STEALTH_MODE > STEALTH_MODE_OFF
     //These are STEALTH_MODE_BASIC ones
-    if ((error = register_stealth_sanitize_cmdline(config->cmdline_blacklist)) != 0)
+    if ((error = register_stealth_sanitize_cmdline()) != 0)
         return error;
 #endif
 
@@ -0,0 +1,121 @@
+/*
+ * Serves procfs entries from precomputed buffers
+ *
+ * OVERVIEW
+ * Some files under /proc need to be sanitized in stealth mode (e.g. /proc/cmdline, see sanitize_cmdline.c). Their
+ * sanitized contents never change after the module is loaded, yet a naive replacement would format them on every read
+ * (and some, like /proc/cmdline, are read by DSM scripts quite often).
+ *
+ * HOW IT WORKS?
+ * For every file a slot is taken. The slot holds an immutable copy of the contents (with its length known upfront) and
+ * has its own show() implementation, which overrides the original seq_file show() of the entry. The replacement does a
+ * single seq_write() (i.e. one memcpy into the seq_file buffer) - there's no format string to parse.
+ * Slots have to be static functions as the show() callback doesn't carry anything pointing to our data.
+ *
+ * The entries are NOT mmap/splice-able as we're hooking below the file_operations of procfs (which is what makes this
+ * work without "struct proc_dir_entry" and when loaded as an I/O scheduler - see sanitize_cmdline.c).
+ */
+#include "proc_virt.h"
+#include "../../common.h"
+#include "../override_symbol.h" //override_symbol_ng() & restore_symbol_ng()
+#include <linux/seq_file.h> //seq_file, seq_write()
+#include <linux/mutex.h>
+
+struct proc_virt_file {
+    const char *content;
+    size_t len;
+    struct override_symbol_inst *ov;
+};
+
+static struct proc_virt_file virt_files[PROC_VIRT_MAX_FILES] = { { NULL } };
+static DEFINE_MUTEX(virt_files_lock);
+
+#define DEFINE_PROC_VIRT_SHOW(_slot) \
+    static int proc_virt_show_##_slot(struct seq_file *m, void *v) \
+    { \
+        seq_write(m, virt_files[_slot].content, virt_files[_slot].len); \
+        return 0; \
+    }
+
+DEFINE_PROC_VIRT_SHOW(0);
+DEFINE_PROC_VIRT_SHOW(1);
+DEFINE_PROC_VIRT_SHOW(2);
+DEFINE_PROC_VIRT_SHOW(3);
+static int (*const virt_shows[PROC_VIRT_MAX_FILES])(struct seq_file *m, void *v) = {
+    proc_virt_show_0, proc_virt_show_1, proc_virt_show_2, proc_virt_show_3
+};
+
+int proc_virt_register(const char *show_symbol, const char *content, size_t len)
+{
+    int out;
+    int slot;
+
+    mutex_lock(&virt_files_lock);
+    for (slot = 0; slot < PROC_VIRT_MAX_FILES && virt_files[slot].ov; slot++);
+    if (unlikely(slot == PROC_VIRT_MAX_FILES)) {
+        pr_loc_bug("No free slot to virtualize %s (max %d)", show_symbol, PROC_VIRT_MAX_FILES);
+        out = -ENOSPC;
+        goto out_unlock;
+    }
+
+    char *buf = kmalloc(len, GFP_KERNEL);
+    if (unlikely(!buf)) {
+        pr_loc_crt("kmalloc failed");
+        out = -ENOMEM;
+        goto out_unlock;
+    }
+    memcpy(buf, content, len);
+    virt_files[slot].content = buf;
+    virt_files[slot].len = len;
+
+    //Contents must be set before the show() is reachable
+    virt_files[slot].ov = override_symbol_ng(show_symbol, virt_shows[slot]);
+    if (IS_ERR(virt_files[slot].ov)) {
+        out = PTR_ERR(virt_files[slot].ov);
+        pr_loc_err("Failed to override %s - error %d", show_symbol, out);
+        virt_files[slot].ov = NULL;
+        virt_files[slot].content = NULL;
+        kfree(buf);
+        goto out_unlock;
+    }
+
+    pr_loc_dbg("Virtualized %s with %zu bytes in slot %d", show_symbol, len, slot);
+    out = slot;
+
+    out_unlock:
+    mutex_unlock(&virt_files_lock);
+    return out;
+}
+
+int proc_virt_unregister(int handle)
+{
+    if (handle < 0)
+        return 0;
+
+    if (unlikely(handle >= PROC_VIRT_MAX_FILES)) {
+        pr_loc_bug("Invalid proc_virt handle %d", handle);
+        return -EINVAL;
+    }
+
+    int out = 0;
+    mutex_lock(&virt_files_lock);
+    if (unlikely(!virt_files[handle].ov)) {
+        pr_loc_bug("proc_virt slot %d is not used", handle);
+        goto out_unlock;
+    }
+
+    //We cannot free the content if the original wasn't restored as our show() may still be called
+    if ((out = restore_symbol_ng(virt_files[handle].ov)) != 0) {
+        pr_loc_err("Failed to restore original show() for slot %d - error %d", handle, out);
+        goto out_unlock;
+    }
+
+    kfree(virt_files[handle].content);
+    virt_files[handle].content = NULL;
+    virt_files[handle].len = 0;
+    virt_files[handle].ov = NULL;
+
+    out_unlock:
+    mutex_unlock(&virt_files_lock);
+    return out;
+}
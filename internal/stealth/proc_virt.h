@@ -0,0 +1,32 @@
+#ifndef REDPILL_PROC_VIRT_H
+#define REDPILL_PROC_VIRT_H
+
+#include <linux/types.h> //size_t
+
+#define PROC_VIRT_MAX_FILES 4 //how many procfs entries can be virtualized at the same time
+
+/**
+ * Replaces contents of a procfs entry with an immutable, precomputed buffer
+ *
+ * The entry is identified by its seq_file show() callback (e.g. "cmdline_proc_show" for /proc/cmdline) which is
+ * overridden. Every read of the file is then served with a single copy of the buffer - no formatting is done in
+ * runtime. The content is copied during registration; the caller can free its copy afterwards.
+ *
+ * @param show_symbol name of the show() function serving the file
+ * @param content exact bytes to be returned (incl. any trailing "\n")
+ * @param len length of the content
+ *
+ * @return handle (>=0, to be passed to proc_virt_unregister()) on success, -E on error
+ */
+int __must_check proc_virt_register(const char *show_symbol, const char *content, size_t len);
+
+/**
+ * Restores original procfs entry replaced by proc_virt_register()
+ *
+ * @param handle value returned by proc_virt_register() (negative values are ignored)
+ *
+ * @return 0 on success, -E on error
+ */
+int proc_virt_unregister(int handle);
+
+#endif //REDPILL_PROC_VIRT_H
@@ -0,0 +1,126 @@
+/**
+ * Places threads & workqueues of the module on chosen CPUs with a chosen scheduling class
+ *
+ * Our threads (vIRQ dispatchers, vPMU dispatcher, vPMU forwarder) are latency-sensitive but very light. Left alone
+ * they float on any CPU at the default priority and compete with storage & network softirqs on busy boxes, which
+ * shows up as serial latency jitter (and the other way around: a burst of console output lands in the middle of I/O).
+ *
+ * By default threads are kept off the first online CPU (where Syno kernels deliver the vast majority of SATA & NIC
+ * interrupts) when there's more than one CPU, and their scheduling class isn't touched. Both can be changed from the
+ * cmdline:
+ *   rp_cpus=<cpu list>             e.g. rp_cpus=2-3 (the same format as isolcpus= or irqaffinity=)
+ *   rp_sched=<normal|fifo|rr>[:N]  e.g. rp_sched=fifo:10 or rp_sched=normal:-5 (N = RT priority or nice)
+ * RT classes should be used with care: a vIRQ thread busy-looping on a broken port would starve the CPU.
+ *
+ * Async workers of the kernel (e.g. used by the SATA boot shim) and the system workqueue are shared with everything
+ * else and are intentionally not touched.
+ */
+#include "thread_placement.h"
+#include "call_protected.h" //_alloc_workqueue_attrs(), _apply_workqueue_attrs(), _free_workqueue_attrs()
+#include "../common.h"
+#include <linux/cpumask.h>
+#include <linux/sched.h> //sched_setscheduler(), set_user_nice(), set_cpus_allowed_ptr()
+#include <linux/workqueue.h>
+
+static struct cpumask placement_cpus;
+static bool placement_cpus_set = false; //placement_cpus is used only when set explicitly
+static thread_sched_policy placement_policy = THREAD_SCHED_DEFAULT;
+static int placement_prio = 0;
+
+static const char *policy_names[] = { "default", "normal", "fifo", "rr" };
+
+void set_thread_placement(const struct thread_placement *config)
+{
+    placement_cpus_set = false;
+    if (config->cpus[0]) {
+        if (cpulist_parse(config->cpus, &placement_cpus) != 0 || !cpumask_intersects(&placement_cpus, cpu_online_mask))
+            pr_loc_err("CPU list \"%s\" is invalid or has no online CPUs - using defaults", config->cpus);
+        else
+            placement_cpus_set = true;
+    }
+
+    placement_policy = config->policy;
+    placement_prio = config->prio;
+    if ((placement_policy == THREAD_SCHED_NORMAL && (placement_prio < -20 || placement_prio > 19)) ||
+        ((placement_policy == THREAD_SCHED_FIFO || placement_policy == THREAD_SCHED_RR) &&
+         (placement_prio < 1 || placement_prio >= MAX_USER_RT_PRIO))) {
+        pr_loc_err("Priority %d is invalid for %s scheduling - using defaults", placement_prio,
+                   policy_names[placement_policy]);
+        placement_policy = THREAD_SCHED_DEFAULT;
+        placement_prio = 0;
+    }
+
+    pr_loc_dbg("Threads will be placed on CPUs %s with %s scheduling (prio=%d)",
+               placement_cpus_set ? config->cpus : "<default>", policy_names[placement_policy], placement_prio);
+}
+
+/**
+ * Computes the CPUs threads should run on at the moment (CPUs can go offline as well)
+ *
+ * @return true if mask was populated, false if threads should be left on any CPU
+ */
+static bool get_placement_cpus(struct cpumask *mask)
+{
+    if (placement_cpus_set) {
+        cpumask_and(mask, &placement_cpus, cpu_online_mask);
+        return !cpumask_empty(mask);
+    }
+
+    if (num_online_cpus() < 2)
+        return false;
+
+    cpumask_copy(mask, cpu_online_mask);
+    cpumask_clear_cpu(cpumask_first(cpu_online_mask), mask);
+    return true;
+}
+
+void place_thread(struct task_struct *task)
+{
+    struct cpumask mask;
+    int out;
+
+    if (get_placement_cpus(&mask) && (out = set_cpus_allowed_ptr(task, &mask)) != 0)
+        pr_loc_wrn("Failed to set CPUs of thread %s - error=%d", task->comm, out);
+
+    switch (placement_policy) {
+        case THREAD_SCHED_DEFAULT:
+            break;
+        case THREAD_SCHED_NORMAL:
+            set_user_nice(task, placement_prio);
+            break;
+        case THREAD_SCHED_FIFO:
+        case THREAD_SCHED_RR: {
+            struct sched_param param = { .sched_priority = placement_prio };
+            out = sched_setscheduler(task, placement_policy == THREAD_SCHED_FIFO ? SCHED_FIFO : SCHED_RR, &param);
+            if (out != 0)
+                pr_loc_wrn("Failed to set scheduling of thread %s - error=%d", task->comm, out);
+            break;
+        }
+    }
+}
+
+struct workqueue_struct *alloc_placed_workqueue(const char *name)
+{
+    //A single unbound worker is what alloc_ordered_workqueue() does, but ordered ones refuse attrs on newer kernels
+    struct workqueue_struct *wq = alloc_workqueue("%s", WQ_UNBOUND, 1, name);
+    if (unlikely(!wq))
+        return NULL;
+
+    struct workqueue_attrs *attrs = _alloc_workqueue_attrs(GFP_KERNEL);
+    if (unlikely(!attrs)) {
+        pr_loc_wrn("Failed to allocate attributes of workqueue %s - it will not be placed", name);
+        return wq;
+    }
+
+    if (!get_placement_cpus(attrs->cpumask))
+        cpumask_copy(attrs->cpumask, cpu_possible_mask);
+    if (placement_policy == THREAD_SCHED_NORMAL)
+        attrs->nice = placement_prio;
+
+    int out = _apply_workqueue_attrs(wq, attrs);
+    if (out != 0)
+        pr_loc_wrn("Failed to place workqueue %s - error=%d", name, out);
+
+    _free_workqueue_attrs(attrs);
+    return wq;
+}
@@ -0,0 +1,49 @@
+#ifndef REDPILL_THREAD_PLACEMENT_H
+#define REDPILL_THREAD_PLACEMENT_H
+
+#include <linux/types.h> //bool
+
+#define THREAD_PLACEMENT_CPUS_MAX 32 //max length of the CPU list as given on the cmdline (e.g. "1-3,6")
+
+typedef enum {
+    THREAD_SCHED_DEFAULT = 0, //leave whatever the kernel gives to new threads
+    THREAD_SCHED_NORMAL, //SCHED_NORMAL with prio being the nice value (-20...19)
+    THREAD_SCHED_FIFO, //SCHED_FIFO with prio being the RT priority (1...99)
+    THREAD_SCHED_RR, //SCHED_RR with prio being the RT priority (1...99)
+} thread_sched_policy;
+
+/**
+ * Where & how threads of the module should run (see rp_cpus= and rp_sched= in cmdline_delegate.h)
+ */
+struct thread_placement {
+    char cpus[THREAD_PLACEMENT_CPUS_MAX + 1]; //CPU list; empty = default (all online CPUs but the first one)
+    thread_sched_policy policy;
+    int prio;
+};
+
+struct task_struct;
+struct workqueue_struct;
+
+/**
+ * Validates & saves placement used by all threads created afterwards
+ *
+ * Invalid values are reported and replaced by defaults - a badly placed thread is still better than no module.
+ */
+void set_thread_placement(const struct thread_placement *config);
+
+/**
+ * Applies the placement to a thread of the module; it's best to call it before the thread is woken up
+ */
+void place_thread(struct task_struct *task);
+
+/**
+ * Allocates a workqueue executing one work at a time (like alloc_ordered_workqueue()) with workers placed on the
+ * configured CPUs
+ *
+ * Workqueues cannot use RT scheduling - only the nice value is applied to them (for THREAD_SCHED_NORMAL).
+ *
+ * @return workqueue ptr or NULL on error
+ */
+struct workqueue_struct *alloc_placed_workqueue(const char *name);
+
+#endif //REDPILL_THREAD_PLACEMENT_H
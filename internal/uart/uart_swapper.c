@@ -73,6 +73,20 @@
  * before we touch iobase or irq (which naturally has to remove IRQ if present) and then command the chip to startup
  * which will register IRQ if needed (for the new irq value of course ;))
  *
+ * LIVE SWAP
+ * Shutting down & restarting ports is a heavy hammer: output written during the window is lost or stalls, the chips
+ * are re-initialized and apps holding the ports open see a hiccup. In most real cases it can be avoided, as the only
+ * thing which really requires the restart is re-linking the IRQ chains. When both ports are in the same run state,
+ * are of the same type and each of them is the only port on its IRQ chain (or both share one IRQ) we can:
+ *  - wait for both transmitters to drain their circ_buf & go idle (so that nothing queued goes to the other lane)
+ *  - pause both IRQs and take the 8250 IRQ chain locks & port locks
+ *  - read the line setup (LCR, divisor, IER, MCR) each port programmed into its current chip
+ *  - exchange iobase/irq & co. and exchange the IRQ chain heads in the 8250 driver's struct irq_info (it's the dev_id
+ *    of the IRQ handler so it can be located via the irq_desc), which is exactly what re-linking would have done
+ *  - program each port's line setup into its new chip and resume; anything written in the meantime simply waits in the
+ *    circ_buf and goes out through the new lane
+ * If any of these conditions isn't met we fall back to the shutdown/restart method described above.
+ *
  * References:
  *  - Linux kernel sources (mainly drivers/tty/serial/8250/8250_core.c and drivers/tty/serial/serial_core.c)
  *  - https://linux-kernel-labs.github.io/refs/heads/master/labs/interrupts.html
@@ -89,7 +103,10 @@
 #include <linux/list.h> //LIST_POISON1, LIST_POISON2
 #include <linux/timer.h> //timer_pending()
 #include <linux/interrupt.h> //disable_irq()/enable_irq()
-#include <linux/irqdesc.h> //irq_has_action
+#include <linux/irqdesc.h> //irq_has_action, irq_to_desc()
+#include <linux/delay.h> //msleep()
+#include <linux/serial_reg.h> //UART_LCR, UART_LSR & friends
+#include "../ksym_cache.h" //ksym_lookup_name()
 
 #define pause_irq_save(irq) ({bool __state = irq_has_action(irq); if (__state) { disable_irq(irq); } __state; })
 #define resume_irq_saved(irq, saved) if (saved) { enable_irq(irq); }
@@ -383,7 +400,7 @@ static inline void restart_port(struct uart_8250_port *up)
 /**
  * Swaps two UART data lines with proper locking
  *
- * This function assumes ports are already stopped.
+ * This function assumes ports are already stopped (see swap_live() for a version which doesn't).
  */
 static inline void swap_uart_lanes(struct uart_8250_port *a, struct uart_8250_port *b)
 {
@@ -401,35 +418,220 @@ static inline void swap_uart_lanes(struct uart_8250_port *a, struct uart_8250_po
     spin_unlock_irqrestore(&b->port.lock, flags_a);
 }
 
-int uart_swap_hw_output(unsigned int from, unsigned int to)
+/**
+ * Mirror of struct irq_info from drivers/tty/serial/8250/8250_core.c (it's the dev_id of the 8250 IRQ handler)
+ *
+ * The layout is the same in all kernels we support. It's only dereferenced for irqactions verified to belong to the
+ * 8250 driver (see find_irq_info()).
+ */
+struct serial8250_irq_info {
+    struct hlist_node node;
+    int irq;
+    spinlock_t lock; //protects the IRQ chain list; the 8250 IRQ handler takes it before port locks
+    struct list_head *head;
+};
+
+//Line setup programmed into a chip, which has to follow the port to its new chip (FCR is write-only, see below)
+struct uart_line_cfg {
+    u8 lcr;
+    u8 dll;
+    u8 dlm;
+    u8 ier;
+    u8 mcr;
+};
+
+#define LIVE_SWAP_DRAIN_TIMEOUT_MS 100 //max time to wait for a transmitter to go idle before its lane is swapped
+
+//A port is alone on its IRQ chain when its list element points at itself
+#define is_irq_chain_singleton(up) ((up)->list.next == &(up)->list && (up)->list.prev == &(up)->list)
+
+/**
+ * Finds the 8250 driver's struct irq_info which is the head of the IRQ chain the port is the only member of
+ *
+ * @return ptr or NULL if not found (e.g. the port isn't the chain head or the handler cannot be located)
+ */
+static struct serial8250_irq_info *find_irq_info(struct uart_8250_port *up)
 {
-    if (unlikely(from == to))
-        return -EINVAL;
+    unsigned long handler = ksym_lookup_name("serial8250_interrupt");
+    struct irq_desc *desc = irq_to_desc(up->port.irq);
+    struct serial8250_irq_info *info = NULL;
+    unsigned long flags;
+
+    if (unlikely(!handler || !desc))
+        return NULL;
+
+    raw_spin_lock_irqsave(&desc->lock, flags);
+    for (struct irqaction *action = desc->action; action; action = action->next) {
+        struct serial8250_irq_info *curr = action->dev_id;
+        if ((unsigned long)action->handler == handler && curr && curr->irq == up->port.irq &&
+            curr->head == &up->list) {
+            info = curr;
+            break;
+        }
+    }
+    raw_spin_unlock_irqrestore(&desc->lock, flags);
 
-    pr_loc_dbg("Swapping ttyS%d<=>ttyS%d started", from, to);
+    return info;
+}
 
-    struct uart_8250_port *port_a = get_8250_port(from);
-    struct uart_8250_port *port_b = get_8250_port(to);
+/**
+ * Checks if the two ports can be swapped without shutting them down (see "LIVE SWAP" in the file header)
+ *
+ * @param info_a Will be set to the IRQ chain of port "a" if it has to be re-linked (or NULL if it doesn't)
+ * @param info_b Same as info_a for port "b"
+ */
+static bool can_swap_live(struct uart_8250_port *a, struct uart_8250_port *b, struct serial8250_irq_info **info_a,
+                          struct serial8250_irq_info **info_b)
+{
+    //Both chips were set up by the same driver code for their type, so unreadable FCR is the same on both of them
+    if (a->port.type != b->port.type) {
+        pr_loc_dbg("Ports are of different types (%u vs %u) - live swap impossible", a->port.type, b->port.type);
+        return false;
+    }
 
-    if (unlikely(!port_a)) {
-        pr_loc_err("Failed to locate ttyS%d port", from);
-        return PTR_ERR(port_a);
+    bool a_active = is_port_active(a);
+    if (a_active != is_port_active(b) || (a_active && is_irq_port(&a->port) != is_irq_port(&b->port))) {
+        pr_loc_dbg("Ports are in different run states - live swap impossible");
+        return false;
     }
-    if (unlikely(!port_b)) {
-        pr_loc_err("Failed to locate ttyS%d port", to);
-        return PTR_ERR(port_b);
+
+    //Inactive ports & timer-polled ports aren't linked to any IRQ chains; the same is true for ports on a shared IRQ
+    if (!a_active || !is_irq_port(&a->port) || a->port.irq == b->port.irq)
+        return true;
+
+    if (!is_irq_chain_singleton(a) || !is_irq_chain_singleton(b)) {
+        pr_loc_dbg("IRQs are shared with other ports - live swap impossible");
+        return false;
     }
 
+    *info_a = find_irq_info(a);
+    *info_b = find_irq_info(b);
+    if (!*info_a || !*info_b) {
+        pr_loc_dbg("Failed to locate 8250 IRQ chains (%p/%p) - live swap impossible", *info_a, *info_b);
+        *info_a = *info_b = NULL;
+        return false;
+    }
 
-    pr_loc_dbg("Disabling preempt & locking console");
-    pr_loc_inf("======= OUTPUT ON THIS PORT WILL STOP AND CONTINUE ON ANOTHER ONE (swapping ttyS%d & ttyS%d) =======",
-               from, to); //That will be the last message user sees before swap on the "old" port
+    return true;
+}
 
-    pr_loc_dbg("### LAST MESSAGE BEFORE SWAP ON \"OLD\" PORT ttyS%d<=>ttyS%d", from, to);
+/**
+ * Waits (bounded) for the port to transmit everything it has queued
+ *
+ * It's not fatal if the port doesn't drain (e.g. it's stalled by flow control): data left in the circ_buf will just go
+ * out through the new lane.
+ */
+static void drain_tx(struct uart_8250_port *up)
+{
+    struct uart_port *port = &up->port;
+    unsigned long flags;
+    bool idle = false;
+
+    for (int i = 0; i < LIVE_SWAP_DRAIN_TIMEOUT_MS; ++i) {
+        spin_lock_irqsave(&port->lock, flags);
+        idle = (!port->state || uart_circ_empty(&port->state->xmit)) &&
+               (port->serial_in(port, UART_LSR) & UART_LSR_TEMT);
+        spin_unlock_irqrestore(&port->lock, flags);
+
+        if (idle)
+            return;
+        msleep(1);
+    }
+
+    pr_loc_dbg("ttyS%d TX didn't drain in %dms - the rest will go through the new lane", port->line,
+               LIVE_SWAP_DRAIN_TIMEOUT_MS);
+}
+
+//Must be called with the port lock held
+static void read_line_cfg(struct uart_port *port, struct uart_line_cfg *cfg)
+{
+    cfg->lcr = port->serial_in(port, UART_LCR);
+    cfg->ier = port->serial_in(port, UART_IER);
+    cfg->mcr = port->serial_in(port, UART_MCR);
+    port->serial_out(port, UART_LCR, cfg->lcr | UART_LCR_DLAB);
+    cfg->dll = port->serial_in(port, UART_DLL);
+    cfg->dlm = port->serial_in(port, UART_DLM);
+    port->serial_out(port, UART_LCR, cfg->lcr);
+}
+
+//Must be called with the port lock held; IER goes last so that any interrupt fires with the chip fully set up
+static void write_line_cfg(struct uart_port *port, const struct uart_line_cfg *cfg)
+{
+    port->serial_out(port, UART_LCR, cfg->lcr | UART_LCR_DLAB);
+    port->serial_out(port, UART_DLL, cfg->dll);
+    port->serial_out(port, UART_DLM, cfg->dlm);
+    port->serial_out(port, UART_LCR, cfg->lcr);
+    port->serial_out(port, UART_MCR, cfg->mcr);
+    port->serial_out(port, UART_IER, cfg->ier);
+}
+
+/**
+ * Swaps two UART data lines without stopping the ports (see "LIVE SWAP" in the file header)
+ *
+ * The caller must verify the ports with can_swap_live() first. This function may sleep.
+ */
+static void swap_live(struct uart_8250_port *a, struct uart_8250_port *b, struct serial8250_irq_info *info_a,
+                      struct serial8250_irq_info *info_b)
+{
+    struct uart_line_cfg cfg_a, cfg_b;
+    unsigned long flags_a, flags_b, flags_ia = 0, flags_ib = 0;
+    bool active = is_port_active(a);
+
+    if (active) {
+        drain_tx(a);
+        drain_tx(b);
+    }
+
+    //Nothing can run the handlers now, so that no interrupt is delivered to a port which is halfway through the swap
+    unsigned int irq_a = a->port.irq, irq_b = b->port.irq;
+    bool irq_a_state = irq_a && pause_irq_save(irq_a);
+    bool irq_b_state = irq_b && irq_b != irq_a && pause_irq_save(irq_b);
+
+    //The lock order is the same as in the 8250 IRQ handler: IRQ chain first, then the port
+    if (info_a)
+        spin_lock_irqsave(&info_a->lock, flags_ia);
+    if (info_b)
+        spin_lock_irqsave(&info_b->lock, flags_ib);
+    spin_lock_irqsave(&a->port.lock, flags_a);
+    spin_lock_irqsave(&b->port.lock, flags_b);
+
+    if (active) {
+        read_line_cfg(&a->port, &cfg_a);
+        read_line_cfg(&b->port, &cfg_b);
+    }
+
+    //Unlike swap_uart_lanes() timers are NOT exchanged: rewriting a pending timer in place corrupts the timer base,
+    // and every timer polls its own port anyway (=it will follow the new iobase)
+    swap(a->port.iobase, b->port.iobase);
+    swap(a->port.irq, b->port.irq);
+    swap(a->port.uartclk, b->port.uartclk);
+    swap(a->port.flags, b->port.flags);
+    if (info_a && info_b)
+        swap(info_a->head, info_b->head); //what serial_unlink_irq_chain() + serial_link_irq_chain() would've done
+
+    if (active) {
+        write_line_cfg(&a->port, &cfg_a);
+        write_line_cfg(&b->port, &cfg_b);
+    }
+
+    spin_unlock_irqrestore(&b->port.lock, flags_b);
+    spin_unlock_irqrestore(&a->port.lock, flags_a);
+    if (info_b)
+        spin_unlock_irqrestore(&info_b->lock, flags_ib);
+    if (info_a)
+        spin_unlock_irqrestore(&info_a->lock, flags_ia);
+
+    if (irq_b != irq_a)
+        resume_irq_saved(irq_b, irq_b_state);
+    resume_irq_saved(irq_a, irq_a_state);
+}
+
+/**
+ * Swaps two ports by shutting them down, exchanging the lanes and restarting them (works in all cases but isn't silent)
+ */
+static void swap_restarting(struct uart_8250_port *port_a, struct uart_8250_port *port_b)
+{
     preempt_disable(); //we cannot be rescheduled here due to timing constraint and possibly IRQ interactions
-    console_lock(); //We don't want stray messages landing somewhere randomly when we swap, + the ports will be down
-    //this will be the first message after port unlocks after swapping
-    pr_loc_dbg("### FIRST MESSAGE AFTER SWAP ON \"NEW\" PORT ttyS%d<=>ttyS%d", from, to);
 
     //This is an edge case when swapping two ports where one is active and another one is not. Since the active status
     // is a property of the software (i.e. port opened/used by something) and shutting down/starting alters the state
@@ -453,14 +655,52 @@ int uart_swap_hw_output(unsigned int from, unsigned int to)
     if (port_b_was_running)
         restart_port(port_b);
 
-    console_unlock();
     preempt_enable();
+}
+
+int uart_swap_hw_output(unsigned int from, unsigned int to)
+{
+    if (unlikely(from == to))
+        return -EINVAL;
+
+    pr_loc_dbg("Swapping ttyS%d<=>ttyS%d started", from, to);
+
+    struct uart_8250_port *port_a = get_8250_port(from);
+    struct uart_8250_port *port_b = get_8250_port(to);
+
+    if (unlikely(!port_a)) {
+        pr_loc_err("Failed to locate ttyS%d port", from);
+        return PTR_ERR(port_a);
+    }
+    if (unlikely(!port_b)) {
+        pr_loc_err("Failed to locate ttyS%d port", to);
+        return PTR_ERR(port_b);
+    }
+
+    struct serial8250_irq_info *info_a = NULL, *info_b = NULL;
+    bool live = can_swap_live(port_a, port_b, &info_a, &info_b);
+
+    pr_loc_dbg("Locking console");
+    pr_loc_inf("======= OUTPUT ON THIS PORT WILL STOP AND CONTINUE ON ANOTHER ONE (swapping ttyS%d & ttyS%d) =======",
+               from, to); //That will be the last message user sees before swap on the "old" port
+
+    pr_loc_dbg("### LAST MESSAGE BEFORE SWAP ON \"OLD\" PORT ttyS%d<=>ttyS%d", from, to);
+    console_lock(); //We don't want stray messages landing somewhere randomly when we swap, + the ports will be down
+    //this will be the first message after port unlocks after swapping
+    pr_loc_dbg("### FIRST MESSAGE AFTER SWAP ON \"NEW\" PORT ttyS%d<=>ttyS%d", from, to);
+
+    if (live)
+        swap_live(port_a, port_b, info_a, info_b);
+    else
+        swap_restarting(port_a, port_b);
+
+    console_unlock();
 
     pr_loc_inf("======= OUTPUT ON THIS PORT CONTINUES FROM A DIFFERENT ONE (swapped ttyS%d & ttyS%d) =======", from,
                to);
 
-    pr_loc_dbg("Swapping ttyS%d (curr_iob=0x%03lx) <=> ttyS%d (curr_iob=0x%03lx) finished successfully", from,
-               port_a->port.iobase, to, port_b->port.iobase);
+    pr_loc_dbg("Swapping ttyS%d (curr_iob=0x%03lx) <=> ttyS%d (curr_iob=0x%03lx) finished %s", from,
+               port_a->port.iobase, to, port_b->port.iobase, live ? "live" : "with ports restart");
 
     return 0;
-}
\ No newline at end of file
+}
@@ -9,6 +9,10 @@
  * state (i.e. one is active/open/running and the other one is not). In such cases the swap will be attempted BUT the
  * port which was active may not be usable until re-opened (usually it will be, but there's a chance).
  *
+ * Whenever possible (same port types & run states, no IRQ sharing with other ports) the swap is done live: only the
+ * transmitters are drained and paused for a moment, so apps holding the ports & the console see no interruption.
+ * Otherwise both ports are shut down and restarted around the swap. This function may sleep.
+ *
  * @param from Line number (line = ttyS#, so line=0 = ttyS0; this is universal across Linux UART subsystem))
  * @param to  Line number
  * @return 0 on success or -E on error
@@ -27,8 +27,10 @@
  * -----------
  *  - For obvious reasons (as we are not working with a real hw) the DMA portion of the chip is not emulated
  *  - On most system the maximum number of UARTs emulated is 4 (driver's limitation, see CONFIG_SERIAL_8250_NR_UARTS)
- *  - FIFOs, true to the original 16550A, are limited to 16 bytes each. In theory, if needed, they can be enlarge up to
- *    even 256 bytes each with chip model change (as 8250 driver actually tests how big a FIFO is on setup)
+ *  - FIFOs, true to the original 16550A, are limited to 16 bytes each by default. They can be enlarged to 64 or 128
+ *    bytes by choosing a different chip model (see vuart_chip_model) which is reported to the 8250 driver as a fixed
+ *    port type (so the driver doesn't try to autodetect it). A 256 bytes variant is not offered as the only 8250 type
+ *    with such FIFO (XR17V35X) is a PCI/MMIO one which cannot be registered as a legacy ISA port.
  *  - FIFO mode is always enabled. There are some not-fully-accurate pieces which don't handle non-FIFO operation. There
  *    is (at least to our knowledge) no reason to use it adn kernel always asks for FIFO to save CPU anyway.
  *
@@ -46,7 +48,8 @@
  *    pretty catastrophic as you will be flooded with messages about IIR being read as long as the port stays open in 
  *    the userland. This consciously does not use kernel's dynamic debug facilities are some (e.g. 918+) kernels are
  *    compiled without it.
- *  - To change name of the vIRQ thread define VUART_THREAD_FMT which gets a real port IRQ # and ttyS# as its params.
+ *  - To change name of the vIRQ thread define VUART_THREAD_FMT which gets a real port IRQ # as its param. A single
+ *    thread serves all vUARTs sharing the same IRQ (e.g. COM1 & COM3), just like a shared ISA IRQ handler would.
  *  - UART_BUG_SWAPPED (defined in uart_defs.h) is used to detect swapped ports and make sure numbers used here are real
  *    ttyS* values and not swapped bs (as 8250 matches ports by iobase and not line#)
  *
@@ -70,9 +73,13 @@
 #include "../../internal/intercept_driver_register.h" //is_driver_registered, watch_driver_register, unwatch_driver_register
 #include "vuart_virtual_irq.h" //vIRQ handling & shimming; CHECKS VUART_USE_TIMER_FALLBACK
 #include <linux/serial_8250.h> //serial8250_unregister_port, uart_8250_port
+#include <linux/circ_buf.h> //CIRC_CNT_TO_END
 #include <linux/serial_reg.h> //UART_* consts
 #include <linux/spinlock.h> //locking devices (vdev->lock)
 #include <linux/kfifo.h> //kfifo_*
+#include <linux/math64.h> //div_u64
+#include <linux/mutex.h> //activation_lock
+#include <linux/workqueue.h> //schedule_work()
 
 /************************************************* Static definitions *************************************************/
 /*
@@ -82,8 +89,37 @@
 #define UART_IIR_FIFOEN 0xc0
 #define UART_IIR_FIFEN_B6 0x40
 #define UART_IIR_FIFEN_B7 0x80
+#define UART_IIR_16750_64B 0x20 //16750 sets bit 5 when 64-byte FIFO is enabled (not defined in older kernels headers)
 #define UART_DRIVER_NAME "serial8250" //see drivers/tty/serial/8250/8250_core.c in "serial8250_isa_driver"
 
+//Interrupt coalescing applied to every vUART when it's added (see vuart_set_irq_coalescing())
+static uint vuart_coalesce_bytes = 0;
+module_param(vuart_coalesce_bytes, uint, 0444);
+MODULE_PARM_DESC(vuart_coalesce_bytes, "Fire vUART vIRQ only after N bytes passed through the chip (0 = disabled)");
+
+static uint vuart_coalesce_usecs = 500;
+module_param(vuart_coalesce_usecs, uint, 0444);
+MODULE_PARM_DESC(vuart_coalesce_usecs, "Max latency of a coalesced vUART vIRQ in microseconds");
+
+/**
+ * Properties of chip models we can emulate. They should match uart_config[] in drivers/tty/serial/8250/8250_port.c
+ */
+struct vuart_chip_def {
+    const char *name;
+    unsigned int port_type; //PORT_* passed to the 8250 driver
+    unsigned int fifo_len; //must be a power of 2 (kfifo requirement)
+    bool has_efr:1; //whether LCR=0xBF exposes EFR under the FCR/IIR address
+    bool has_icr:1; //whether LSR address is used for ICR writes (indexed by SCR)
+    bool has_64b_iir:1; //whether IIR reports 64-byte FIFO mode (16750 only)
+};
+
+static const struct vuart_chip_def chip_defs[] = {
+    [VUART_CHIP_16550A] = { .name = "16550A", .port_type = PORT_16550A, .fifo_len = 16 },
+    [VUART_CHIP_16750]  = { .name = "16750", .port_type = PORT_16750, .fifo_len = 64, .has_64b_iir = true },
+    [VUART_CHIP_16C950] = { .name = "16C950", .port_type = PORT_16C950, .fifo_len = 128, .has_efr = true,
+                            .has_icr = true },
+};
+
 /**
  * Static definition of all possible UARTs in the system supported by 8250 driver
  * These definitions are exactly the same as in arch/x86/include/asm/serial.h
@@ -119,7 +155,8 @@ struct flush_callback {
     void *buffer;
     int threshold;
 };
-//Storage for all TX callbacks, see vuart_set_tx_callback()
+//Storage for all TX callbacks, see vuart_set_tx_callback(); flush_cbs[line] points to flush_cb_slots[line] when set
+static struct flush_callback flush_cb_slots[SERIAL8250_LAST_ISA_LINE];
 static struct flush_callback *flush_cbs[SERIAL8250_LAST_ISA_LINE] = { NULL };
 static volatile bool kernel_driver_ready = false; //Whether the 8250 UART driver is ready
 
@@ -144,6 +181,12 @@ static volatile bool kernel_driver_ready = false; //Whether the 8250 UART driver
 
 #define for_each_vdev() for (int line=0; line < ARRAY_SIZE(ttySs); ++line)
 
+//Get chip definition for a given vDEV
+#define get_vdev_chip(vdev) (&chip_defs[(vdev)->chip])
+
+//Whether the EFR is currently accessible instead of FCR/IIR (see 16C950 datasheet, "650-compatible registers")
+#define is_efr_window(vdev) (unlikely(get_vdev_chip(vdev)->has_efr) && (vdev)->lcr == UART_LCR_CONF_MODE_B)
+
 //Before v3.13 the kfifo_put() accepted a pointer, since then it accepts a value
 //ffs... https://github.com/torvalds/linux/commit/498d319bb512992ef0784c278fa03679f2f5649d
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,13,0)
@@ -186,7 +229,7 @@ static void update_interrupts_state(struct serial8250_16550A_vdev *vdev)
         //We also don't support the receiver time-out (kernel should pick up the data in time as it's a virtual port)
         uart_prdbg("IIR: setting RD (data-ready) interrupt");
         new_iir_int_state |= UART_IIR_RDI;
-    } else if ((vdev->ier & UART_IER_THRI) && ((vdev->lsr & UART_LSR_TEMT) || kfifo_is_empty(vdev->tx_fifo))) {
+    } else if ((vdev->ier & UART_IER_THRI) && ((vdev->lsr & UART_LSR_TEMT) || kfifo_is_empty(&vdev->tx_fifo))) {
         //When THR is empty or FIFO is empty (for us it's the same thing) kernel wants to know about that
         uart_prdbg("IIR: setting THR (transmitter empty) interrupt");
         new_iir_int_state |= UART_IIR_THRI;
@@ -202,9 +245,14 @@ static void update_interrupts_state(struct serial8250_16550A_vdev *vdev)
 
     //IIR (despite its name) also contains FIFO status along interrupts
     vdev->iir = new_iir_int_state;
-    if (likely(vdev->fcr & UART_FCR_ENABLE_FIFO))
+    if (likely(vdev->fcr & UART_FCR_ENABLE_FIFO)) {
         vdev->iir |= UART_IIR_FIFOEN;
 
+        //16750 reports 64-byte mode in IIR bit 5 (which is reserved on 16550A)
+        if (get_vdev_chip(vdev)->has_64b_iir && (vdev->fcr & UART_FCR7_64BYTE))
+            vdev->iir |= UART_IIR_16750_64B;
+    }
+
     dump_iir(vdev);
     uart_prdbg("Finished IIR state");
 }
@@ -219,10 +267,8 @@ static void reset_device(struct serial8250_16550A_vdev *vdev)
     lock_vuart_oppr(vdev);
 
     //Upon reset both FIFOs must be erased
-    if (vdev->tx_fifo)
-        kfifo_reset(vdev->tx_fifo);
-    if (vdev->rx_fifo)
-        kfifo_reset(vdev->rx_fifo);
+    kfifo_reset(&vdev->tx_fifo);
+    kfifo_reset(&vdev->rx_fifo);
 
     //Registries for when DLAB=0
     vdev->rhr = 0x00; //no data in receiving channel
@@ -235,6 +281,7 @@ static void reset_device(struct serial8250_16550A_vdev *vdev)
     vdev->lsr = UART_LSR_TEMT | UART_LSR_THRE; //transmitter empty & idle, all errors cleared, break not requested
     vdev->msr = 0x00; //all flow control flags not triggered
     vdev->scr = 0x00; //empty scratchpad
+    vdev->efr = 0x00; //all enhanced features disabled (only present on some chips)
 
     //Additional registries when DLAB=1
     vdev->dll = 0x00; //undefined divisor LSB latch
@@ -245,62 +292,24 @@ static void reset_device(struct serial8250_16550A_vdev *vdev)
 }
 
 /**
- * Allocate/create FIFOs on the device if they don't exist (and if they do you shouldn't call this function)
- *
- * @todo it should free on errors
+ * Sets up FIFOs embedded in the device to the chip model's depth (it cannot fail as there's nothing to allocate)
  */
-static int alloc_fifos(struct serial8250_16550A_vdev *vdev)
+static void init_fifos(struct serial8250_16550A_vdev *vdev)
 {
-    if (unlikely(vdev->rx_fifo)) { //this shouldn't happen on non-initialized port
-        pr_loc_bug("RX FIFO @ %d already alloc'd", vdev->line);
-        return -EINVAL;
-    }
-
-    vdev->rx_fifo = kzalloc(sizeof(struct kfifo), GFP_KERNEL);
-    if (unlikely(!vdev->rx_fifo)) {
-        pr_loc_crt("kzalloc for RX FIFO struct @ %d failed", vdev->line);
-        return -EFAULT;
-    }
-
-    if (unlikely(vdev->tx_fifo)) { //this shouldn't happen on non-initialized port
-        pr_loc_bug("TX FIFO @ %d already alloc'd", vdev->line);
-        return -EINVAL;
-    }
-
-    vdev->tx_fifo = kzalloc(sizeof(struct kfifo), GFP_KERNEL);
-    if (unlikely(!vdev->tx_fifo)) {
-        pr_loc_crt("kzalloc for TX FIFO struct @ %d failed", vdev->line);
-        return -EFAULT;
-    }
-
-    if (unlikely(kfifo_alloc(vdev->rx_fifo, VUART_FIFO_LEN, GFP_KERNEL) != 0)) {
-        pr_loc_crt("kfifo_alloc for RX FIFO elements @ %d failed", vdev->line);
-        return -EFAULT;
-    }
-
-    if (unlikely(kfifo_alloc(vdev->tx_fifo, VUART_FIFO_LEN, GFP_KERNEL) != 0)) {
-        pr_loc_crt("kfifo_alloc for TX FIFO elements @ %d failed", vdev->line);
-        return -EFAULT;
-    }
-
-    return 0;
+    //All fifo_len values in chip_defs are powers of 2 & fit in the storage so these never round down
+    kfifo_init(&vdev->tx_fifo, vdev->tx_fifo_buf, vdev->fifo_len);
+    kfifo_init(&vdev->rx_fifo, vdev->rx_fifo_buf, vdev->fifo_len);
+    INIT_KFIFO(vdev->rx_ring);
 }
 
 /**
- * Reverses what alloc_fifos() did
+ * Drops whatever is left in FIFOs, so that a stale port never looks like it has pending data (e.g. to the vIRQ)
  */
-static int free_fifos(struct serial8250_16550A_vdev *vdev)
+static void clear_fifos(struct serial8250_16550A_vdev *vdev)
 {
-    //This should be called when the vIRQ thread is killed so nothing call the IRQ handler without FIFOs
-    if (unlikely(!vdev->rx_fifo || !vdev->tx_fifo)) { //this shouldn't happen on initialized port
-        pr_loc_bug("RX and/or TX FIFO @ %d are not alloc'd (nothing to free)", vdev->line);
-        return -EINVAL;
-    }
-
-    kfifo_free(vdev->rx_fifo);
-    kfifo_free(vdev->tx_fifo);
-
-    return 0;
+    kfifo_reset(&vdev->tx_fifo);
+    kfifo_reset(&vdev->rx_fifo);
+    kfifo_reset(&vdev->rx_ring);
 }
 
 /**
@@ -315,16 +324,75 @@ static void flush_tx_fifo(struct serial8250_16550A_vdev *vdev, vuart_flush_reaso
 
     if (likely(flush_cbs[vdev->line])) {
         unsigned int flushed_bytes = 0;
-        flushed_bytes = kfifo_out(vdev->tx_fifo, flush_cbs[vdev->line]->buffer, VUART_FIFO_LEN);
+        flushed_bytes = kfifo_out(&vdev->tx_fifo, flush_cbs[vdev->line]->buffer, vdev->fifo_len);
         flush_cbs[vdev->line]->fn(vdev->line, flush_cbs[vdev->line]->buffer, flushed_bytes, reason);
+        vuart_stat_inc(vdev, tx_flushes[reason]);
+        vuart_stat_add(vdev, tx_bytes, flushed_bytes);
     } else {
         uart_prdbg("No callback for TX FIFO @ %d - discarding", vdev->line);
-        kfifo_reset(vdev->tx_fifo);
+        kfifo_reset(&vdev->tx_fifo);
     }
 
+    vuart_stat_flush_latency(vdev);
     vdev->lsr |= UART_LSR_TEMT | UART_LSR_THRE; //nothing should be in the buffer
 }
 
+/**
+ * Computes how long it takes to transmit a single character with the current line settings
+ *
+ * A character is a start bit + 5-8 data bits + optional parity + 1-2 stop bits. The baud rate is derived from the
+ * divisor programmed by the driver (if any), just like a real chip clocked at BASE_BAUD would do.
+ */
+static u64 get_char_time_ns(struct serial8250_16550A_vdev *vdev)
+{
+    unsigned int divisor = (vdev->dlm << 8) | vdev->dll;
+    unsigned int baud = divisor ? BASE_BAUD / divisor : vdev->baud;
+    unsigned int bits = 1 + 5 + (vdev->lcr & UART_LCR_WLEN8) + ((vdev->lcr & UART_LCR_PARITY) ? 1 : 0) +
+                        ((vdev->lcr & UART_LCR_STOP) ? 2 : 1);
+
+    return div_u64((u64)bits * NSEC_PER_SEC, baud ? baud : STD_COMX_BAUD);
+}
+
+#define tx_idle_detection(vdev) ((vdev)->tx_idle_chars != 0)
+
+#define get_tx_idle_gap_ns(vdev) (get_char_time_ns(vdev) * (vdev)->tx_idle_chars)
+
+/**
+ * Starts the inter-character gap measurement; this should be called when a character landed in an empty TX FIFO
+ */
+static inline void start_tx_idle_timer(struct serial8250_16550A_vdev *vdev)
+{
+    hrtimer_start(&vdev->tx_idle_timer, ns_to_ktime(get_tx_idle_gap_ns(vdev)), HRTIMER_MODE_REL);
+}
+
+/**
+ * Called when the gap measured from the first char of a burst passed
+ *
+ * Chars written in the meantime don't touch the timer (see handle_transmit_char()) so if the last one came less than
+ * tx_idle_chars character-times ago we just move the expiry to when the line will be idle and go back to sleep.
+ */
+static enum hrtimer_restart tx_idle_timer_cb(struct hrtimer *timer)
+{
+    struct serial8250_16550A_vdev *vdev = container_of(timer, struct serial8250_16550A_vdev, tx_idle_timer);
+    enum hrtimer_restart out = HRTIMER_NORESTART;
+
+    lock_vuart(vdev);
+    if (!kfifo_is_empty(&vdev->tx_fifo) && tx_idle_detection(vdev)) {
+        s64 idle_at_ns = vdev->tx_last_ns + get_tx_idle_gap_ns(vdev);
+        if (ktime_to_ns(ktime_get()) < idle_at_ns) {
+            hrtimer_set_expires(timer, ns_to_ktime(idle_at_ns));
+            out = HRTIMER_RESTART;
+        } else {
+            uart_prdbg("TX idle timeout on ttyS%d - triggering IDLE flush", vdev->line);
+            flush_tx_fifo(vdev, VUART_FLUSH_IDLE);
+            update_interrupts_state(vdev);
+        }
+    }
+    unlock_vuart(vdev);
+
+    return out;
+}
+
 /**
  * Pulls a character/byte from RX FIFO and places it into RHR for the driver to read it
  *  - It updates all registers according to the specs
@@ -338,10 +406,10 @@ static void flush_tx_fifo(struct serial8250_16550A_vdev *vdev, vuart_flush_reaso
 static unsigned char transfer_char_fifo_rhr(struct serial8250_16550A_vdev *vdev)
 {
     //Before this function is called UART_LSR_DR should be verified - it wasn't or it was wrong if this exploded
-    if(unlikely(kfifo_get(vdev->rx_fifo, &vdev->rhr) == 0))
+    if(unlikely(kfifo_get(&vdev->rx_fifo, &vdev->rhr) == 0))
         pr_loc_bug("Attempted to %s with empty FIFO - that shouldn't happen if the DR flag was checked", __FUNCTION__);
 
-    if (kfifo_is_empty(vdev->rx_fifo))
+    if (kfifo_is_empty(&vdev->rx_fifo))
         vdev->lsr &= ~UART_LSR_DR;
 
     //See descriptions of these fields in Table 3-12 from TI doc - these flags are cleared on character read
@@ -353,6 +421,45 @@ static unsigned char transfer_char_fifo_rhr(struct serial8250_16550A_vdev *vdev)
     return vdev->rhr;
 }
 
+/**
+ * Moves as much as possible from the RX ring (filled by vuart_inject_rx()) into the chip's RX FIFO
+ *  - It assumes you have vdev lock; it's the only consumer of the ring (which makes the ring lock-free for producers)
+ *  - It does NOT recalculate IIRs (see update_interrupts_state())
+ */
+static void transfer_ring_rx_fifo(struct serial8250_16550A_vdev *vdev)
+{
+    //In TEST/LOOP mode the chip is disconnected from the outside world - nothing should arrive
+    if (unlikely(vdev->mcr & UART_MCR_LOOP))
+        return;
+
+    char tmp[VUART_FIFO_MAX_LEN];
+    unsigned int avail = kfifo_avail(&vdev->rx_fifo);
+    if (avail > sizeof(tmp))
+        avail = sizeof(tmp);
+
+    unsigned int moved = kfifo_out(&vdev->rx_ring, tmp, avail);
+    if (!moved)
+        return;
+
+    kfifo_in(&vdev->rx_fifo, tmp, moved);
+    vdev->lsr |= UART_LSR_DR;
+    vuart_virq_count_bytes(vdev, moved);
+    uart_prdbg("Moved %u bytes from RX ring to RX FIFO @ ttyS%d", moved, vdev->line);
+}
+
+struct serial8250_16550A_vdev *vuart_get_vdev(int line)
+{
+    return get_line_vdev(line);
+}
+
+void vuart_refill_rx(struct serial8250_16550A_vdev *vdev)
+{
+    lock_vuart(vdev);
+    transfer_ring_rx_fifo(vdev);
+    update_interrupts_state(vdev);
+    unlock_vuart(vdev);
+}
+
 /**
  * An alternative to transfer_char_fifo_rhr() when FIFOs aren't used for transfers (e.g. in MSR TEST/LOOP mode)
  *
@@ -363,16 +470,19 @@ static void handle_receive_char(struct serial8250_16550A_vdev *vdev, unsigned ch
     //@todo this only handles overruns in FIFO mode and does not do that in non-FIFO; it behaves correctly but it
     // doesn't report OEs in non-FIFO
     vdev->rhr = value; //RHR is always populated with the value no matter the FIFO or non-FIFO mode
+    vuart_virq_count_bytes(vdev, 1);
 
     //Put value in FIFO, it will indicate with return of 0 if it was full before attempted put (overrun/overflow)
-    if (kfifo_put_val(vdev->rx_fifo, value) == 0) {
+    if (kfifo_put_val(&vdev->rx_fifo, value) == 0) {
         vdev->lsr |= UART_LSR_OE; //set overrun flag as FIFO detected that
+        vuart_stat_inc(vdev, rx_overruns);
 
         //During TEST/LOOP mode many overflows are caused on purpose - we don't want to hear about them really
         if (unlikely(!(vdev->mcr & UART_MCR_LOOP)))
             pr_loc_wrn("RX FIFO overflow detected @ ttyS%d", vdev->line);
     } else {
         vdev->lsr &= ~UART_LSR_OE; //no overrun condition - clear OE flag just in case
+        vuart_stat_inc(vdev, rx_bytes);
     }
 
     vdev->lsr |= UART_LSR_DR; //receiver has something for the kernel to pickup
@@ -384,7 +494,7 @@ static void handle_receive_char(struct serial8250_16550A_vdev *vdev, unsigned ch
  * This function does NOT recalculate IIRs (see update_interrupts_state()) and assumes you have vdev lock.
  *
  * CAUTION: order of these "ifs" for flushes here is crucial: we make a guarantee to the reason parameter that if both
- *  VUART_FLUSH_THRESHOLD and VUART_FLUSH_FULL are true (i.e. callback was set with threshold == VUART_FIFO_LEN) we
+ *  VUART_FLUSH_THRESHOLD and VUART_FLUSH_FULL are true (i.e. callback was set with threshold == vdev->fifo_len) we
  *  will prioritize threshold trigger (as a user-specified event takes precedence over internal event of FIFO full)
  * If the threshold specified by the callback setter was met flush the FIFO
  */
@@ -393,42 +503,110 @@ static void handle_transmit_char(struct serial8250_16550A_vdev *vdev, unsigned c
     //@todo this only handle non-FIFO properly: doesn't detect OE, and doesn't reset THRE
     vdev->thr = value; //THR is always populated with the value no matter the FIFO or non-FIFO mode
     vdev->lsr &= ~UART_LSR_THRE;
+    vuart_virq_count_bytes(vdev, 1);
 
-    int fifo_len = kfifo_len(vdev->tx_fifo);
+    int fifo_len = kfifo_len(&vdev->tx_fifo);
     uart_prdbg("%s got new char ascii=%c hex=%02x on ttyS%d (FIFO#=%d)", __FUNCTION__, value, value, vdev->line,
                fifo_len);
 
-    //FIFO is full - try to flush it; if we got here it means the threshold is for sure >VUART_FIFO_LEN as this is
+    //FIFO is full - try to flush it; if we got here it means the threshold is for sure >vdev->fifo_len as this is
     // checked after we put data into the FIFO (to make sure we trigger THRESHOLD event and not FULL)
     //The reason why we check this at the beginning of new char and not after adding to FIFO is that if the transmitting
-    // party sends exactly VUART_FIFO_LEN bytes and then ends the transmission we don't want to flush with FULL but with
+    // party sends exactly vdev->fifo_len bytes and then ends the transmission we don't want to flush with FULL but with
     // IDLE to give a better sense of what's going on to the caller. FULL implies "we got too much data, there may be
     // more coming" while IDLE implies that the unit of transmission ended.
-    if (unlikely(fifo_len == VUART_FIFO_LEN))
+    if (unlikely(fifo_len == vdev->fifo_len))
         flush_tx_fifo(vdev, VUART_FLUSH_FULL);
 
     //Put value in FIFO, it will indicate with return of 0 if it was full before attempted put (overrun/overflow)
     //This, if we are correct, cannot happen if the flush_tx_fifo() is functioning correctly as we try to flush above
-    int fifo_add = kfifo_put_val(vdev->tx_fifo, value);
+    int fifo_add = kfifo_put_val(&vdev->tx_fifo, value);
     fifo_len += fifo_add; //we can call kfifo_ API for this but why if we have both pieces of info anyway? ;)
     if (unlikely(fifo_add == 0)) {
         vdev->lsr |= UART_LSR_OE; //set overrun flag as FIFO detected that
+        vuart_stat_inc(vdev, tx_overruns);
         pr_loc_wrn("TX FIFO overflow detected");
     } else {
+#ifdef VUART_STATS
+        if (fifo_len == 1) //FIFO was empty - start measuring how long it takes to deliver this byte
+            vdev->tx_first_ns = vuart_stat_now_ns();
+#endif
         vdev->lsr &= ~UART_LSR_OE; //no overrun condition - clear OE flag just in case
     }
 
+    //The timer is armed only once per burst (when the FIFO stops being empty); it pushes its own deadline out when it
+    // fires early, so we only need to note when the last char came
+    if (tx_idle_detection(vdev)) {
+        vdev->tx_last_ns = ktime_to_ns(ktime_get());
+        if (fifo_len == 1)
+            start_tx_idle_timer(vdev);
+    }
+
     vdev->lsr &= ~UART_LSR_TEMT; //transmitter buffers are no longer empty
 
     //@todo THRE should be reset immediately in non-FIFO mode (i.e. at the same time as TEMT)
     //This is to prevent kernel from freaking out about "blackhole" UART (see https://unix.stackexchange.com/a/387650)
-    if (fifo_len >= VUART_FIFO_LEN / 2)
+    if (fifo_len >= vdev->fifo_len / 2)
         vdev->lsr &= ~UART_LSR_THRE;
 
     if (likely(flush_cbs[vdev->line]) && fifo_len >= flush_cbs[vdev->line]->threshold)
         flush_tx_fifo(vdev, VUART_FLUSH_THRESHOLD);
 }
 
+/**
+ * Attempts to read a register without taking the vdev lock
+ *
+ * Most of the reads done by the driver are pure polls without any side effects (e.g. wait_for_xmitr() spinning on LSR
+ * or checking MSR for CTS while writing to the console). Taking the lock (and disabling IRQs) for every such read is
+ * wasteful. This function handles only reads which do NOT change the chip state and retries if a writer was active
+ * while reading. Everything else (RHR reads, LSR with OE to clear, loop mode, DLAB etc.) is left for the slow path.
+ *
+ * @return true if the read was handled and "out" is valid, false if the slow path must be taken
+ */
+static __always_inline bool try_lockless_read(struct serial8250_16550A_vdev *vdev, int offset, unsigned int *out)
+{
+    unsigned int seq;
+    bool handled;
+
+    if (unlikely(!vdev->up)) //the port is captured under lock on first access
+        return false;
+
+    do {
+        seq = read_seqcount_begin(&vdev->reg_seq);
+        handled = true;
+
+        if (unlikely(vuart_rx_ring_pending(vdev))) {
+            handled = false; //RX ring must be transferred under lock
+        } else if (offset == UART_LSR && !(vdev->lsr & UART_LSR_OE)) {
+            *out = vdev->lsr;
+        } else if (offset == UART_MSR && !(vdev->mcr & UART_MCR_LOOP)) {
+            *out = vdev->msr;
+        } else if (offset == UART_IIR && !is_efr_window(vdev)) {
+            *out = vdev->iir;
+        } else if (offset == UART_IER && !(vdev->lcr & UART_LCR_DLAB)) {
+            *out = vdev->ier;
+        } else if (offset == UART_LCR) {
+            *out = vdev->lcr;
+        } else if (offset == UART_MCR) {
+            *out = vdev->mcr;
+        } else if (offset == UART_SCR) {
+            *out = vdev->scr;
+        } else {
+            handled = false;
+        }
+    } while (unlikely(read_seqcount_retry(&vdev->reg_seq, seq)));
+
+    return handled;
+}
+
+//Accounts a register read; IIR reads which found no interrupt pending are the driver polling us in vain
+#define count_reg_read(vdev, offset, out) \
+    do { \
+        vuart_stat_inc(vdev, reg_reads[(offset) & (VUART_STATS_REGS - 1)]); \
+        if ((offset) == UART_IIR && ((out) & UART_IIR_NO_INT)) \
+            vuart_stat_inc(vdev, iir_polls); \
+    } while(0)
+
 /**
  * The main READ routing passed to the 8250 driver. It should be as fast as possible and MUST be multithread-safe
  *
@@ -443,10 +621,22 @@ static unsigned int serial_remote_read(struct uart_port *port, int offset)
     uart_prdbg("Serial READ for line=%d/%d", port->line, ttySs[port->line].line);
 
     struct serial8250_16550A_vdev *vdev = get_line_vdev(port->line);
+    unsigned int out;
+    if (likely(try_lockless_read(vdev, offset, &out))) {
+        uart_prdbg("Lockless read of reg=%d => %x", offset, out);
+        count_reg_read(vdev, offset, out);
+        vuart_trace_reg(vdev, VUART_TR_READ, offset, out);
+        return out;
+    }
+
     lock_vuart(vdev);
     capture_uart_port(vdev, port);
-    unsigned int out;
-	switch (offset) {
+
+    //Every read is a good opportunity to pickup data staged by vuart_inject_rx() (esp. on timer-polled ports)
+    if (unlikely(vuart_rx_ring_pending(vdev)))
+        transfer_ring_rx_fifo(vdev);
+
+    switch (offset) {
         case UART_RX:
             //if DLAB is enabled DLL registry is desired; otherwise we should send THR
             //See Table 2 in the chip manual. DLAB controls access to address 000, 001, and 101. When DLAB=1 these
@@ -481,10 +671,16 @@ static unsigned int serial_remote_read(struct uart_port *port, int offset)
             }
             break;
         case UART_IIR:
+            if (is_efr_window(vdev)) {
+                out = vdev->efr;
+                reg_read("EFR");
+                break;
+            }
+
             out = vdev->iir;
             reg_read_dump(vdev, iir, "IIR/ISR");
             break;
-	    //case UART_FCR not present - write only register
+        //case UART_FCR not present - write only register
         case UART_LCR:
             out = vdev->lcr;
             reg_read_dump(vdev, lcr, "LCR");
@@ -520,10 +716,12 @@ static unsigned int serial_remote_read(struct uart_port *port, int offset)
             pr_loc_bug("Unknown registry %x read attempt on ttyS%d", offset, vdev->line);
             out = 0;
             break;
-	}
+    }
 
-	update_interrupts_state(vdev);
-	unlock_vuart(vdev);
+    update_interrupts_state(vdev);
+    unlock_vuart(vdev);
+    count_reg_read(vdev, offset, out);
+    vuart_trace_reg(vdev, VUART_TR_READ, offset, out);
 
     return out;
 }
@@ -542,6 +740,8 @@ static void serial_remote_write(struct uart_port *port, int offset, int value)
     //uart_prdbg("Serial WRITE for line=%d/%d", port->line, ttySs[port->line].line);
 
     struct serial8250_16550A_vdev *vdev = get_line_vdev(port->line);
+    vuart_stat_inc(vdev, reg_writes[offset & (VUART_STATS_REGS - 1)]);
+    vuart_trace_reg(vdev, VUART_TR_WRITE, offset, value);
     lock_vuart(vdev);
     capture_uart_port(vdev, port);
 
@@ -576,15 +776,28 @@ static void serial_remote_write(struct uart_port *port, int offset, int value)
              * kernel wrote everything what was there to write and [presumably] nothing else is coming anytime soon
              * So in short: if THReINT was enabled and it JUST got disabled flush the FIFO if it isn't empty
              */
-            if ((vdev->ier & UART_IER_THRI) && !(value & UART_IER_THRI) && !kfifo_is_empty(vdev->tx_fifo)) {
+            //With idle detection enabled the timer decides when the unit of transmission ended
+            if (!tx_idle_detection(vdev) && (vdev->ier & UART_IER_THRI) && !(value & UART_IER_THRI) &&
+                !kfifo_is_empty(&vdev->tx_fifo)) {
                 uart_prdbg("Kernel driver disabled THRe interrupt and fifo isn't empty - triggering IDLE flush");
                 flush_tx_fifo(vdev, VUART_FLUSH_IDLE);
             }
             vdev->ier = value & 0x0f; //we're not letting kernel set DMA registers since we don't support DMA
             reg_write_dump(vdev, ier, "IER");
+
+            //Data injected while the driver wasn't listening was held in the RX ring - now it may be (see
+            // vuart_rx_ring_pending()) and RDI will be raised below, as the driver will not read anything without it
+            if (unlikely(vuart_rx_ring_pending(vdev)))
+                transfer_ring_rx_fifo(vdev);
             break;
         //case UART_IIR not present - read only register
         case UART_FCR:
+            if (is_efr_window(vdev)) { //EFR lives under FCR address when LCR=0xBF
+                vdev->efr = value;
+                reg_write("EFR");
+                break;
+            }
+
             //FIFO registers are guarded by the FIFOEN - if it's not set only FIFOEN can be modified, see p27 of Ti doc
             if (!(vdev->fcr & UART_FCR_ENABLE_FIFO) && !(value & UART_FCR_ENABLE_FIFO))
                 value &= UART_FCR_ENABLE_FIFO;
@@ -594,14 +807,14 @@ static void serial_remote_write(struct uart_port *port, int offset, int value)
 
             //If the new FCR value called for flush of TX and/or RX do that right away
             if (vdev->fcr & UART_FCR_CLEAR_XMIT) {
-                kfifo_reset(vdev->tx_fifo);
+                kfifo_reset(&vdev->tx_fifo);
                 vdev->lsr |= UART_LSR_TEMT | UART_LSR_THRE;
                 uart_prdbg("TX FIFO flushed on FCR request");
                 dump_lsr(vdev);
             }
 
             if (vdev->fcr & UART_FCR_CLEAR_RCVR) {
-                kfifo_reset(vdev->rx_fifo);
+                kfifo_reset(&vdev->rx_fifo);
                 vdev->lsr &= ~UART_LSR_DR;
                 uart_prdbg("RX FIFO flushed on FCR request");
                 dump_lsr(vdev);
@@ -614,8 +827,24 @@ static void serial_remote_write(struct uart_port *port, int offset, int value)
         case UART_MCR:
             vdev->mcr = value;
             reg_write_dump(vdev, mcr, "MCR");
+
+            //The driver raises OUT2 (ISA IRQ gate) on startup and drops it on shutdown - it's the only bit which
+            // reliably follows the port being open, as e.g. RDI in IER is also dropped when the RX is throttled
+            //Activation may sleep & calls into the vIRQ/callbacks which take the lock - it cannot be done here. The work
+            // is queued with the lock held so that stop_port_activity() clearing "lazy" under it is a barrier for it.
+            if (vdev->lazy && !!(value & UART_MCR_OUT2) != vdev->port_open) {
+                vdev->port_open = !vdev->port_open;
+                schedule_work(&vdev->open_work);
+            }
             break;
         case UART_LSR:
+            //16C950 uses LSR address for writes to indexed control registers (ICR) selected by SCR; we don't emulate
+            // any of the 950-specific features (clock prescaler, trigger levels etc.) so the value is just swallowed
+            if (get_vdev_chip(vdev)->has_icr) {
+                uart_prdbg("ICR[0x%02x] write with %x - ignored", vdev->scr, value);
+                break;
+            }
+
             vdev->lsr = value;
             pr_loc_bug("Bogus LSR write attempt on ttyS%d - why?", vdev->line);
             dump_lsr(vdev);
@@ -632,7 +861,7 @@ static void serial_remote_write(struct uart_port *port, int offset, int value)
         default:
             pr_loc_bug("Unknown registry %x write attempt on ttyS%d with %x", offset, vdev->line, value);
             break;
-	}
+    }
 
     update_interrupts_state(vdev);
     unlock_vuart(vdev);
@@ -649,8 +878,6 @@ static int restore_serial8250_isa_port(struct serial8250_16550A_vdev *vdev);
  */
 static int initialize_ttyS(struct serial8250_16550A_vdev *vdev)
 {
-    int out;
-
     pr_loc_dbg("Initializing ttyS%d vUART", vdev->line);
     if (unlikely(vdev->initialized)) {
         pr_loc_bug("ttyS%d is already initialized", vdev->line);
@@ -658,15 +885,11 @@ static int initialize_ttyS(struct serial8250_16550A_vdev *vdev)
     }
 
     reset_device(vdev); //Puts device in a known RESET state as defined by the real chip docs
-    if ((out = alloc_fifos(vdev) != 0))
-        return out;
-
-    vdev->lock = kmalloc(sizeof(spinlock_t), GFP_KERNEL);
-    if (!unlikely(vdev->lock)) {
-        pr_loc_dbg("kmalloc failed to allocate memory for vUART spinlock");
-        return -EFAULT;
-    }
-    spin_lock_init(vdev->lock);
+    init_fifos(vdev);
+    spin_lock_init(&vdev->lock);
+    seqcount_init(&vdev->reg_seq);
+    hrtimer_init(&vdev->tx_idle_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    vdev->tx_idle_timer.function = tx_idle_timer_cb;
 
     //virq_* stuff is allocated/freed by enable_/disable_interrupts()
 
@@ -681,18 +904,14 @@ static int initialize_ttyS(struct serial8250_16550A_vdev *vdev)
  */
 static int deinitialize_ttyS(struct serial8250_16550A_vdev *vdev)
 {
-    int out;
-
     pr_loc_dbg("Deinitializing ttyS%d vUART", vdev->line);
     if (unlikely(!vdev->initialized)) {
         pr_loc_bug("ttyS%d is not initialized", vdev->line);
         return -ENODEV;
     }
 
-    if ((out = free_fifos(vdev) != 0))
-        return out;
-
-    kfree(vdev->lock);
+    hrtimer_cancel(&vdev->tx_idle_timer); //it uses both the FIFOs and the lock
+    clear_fifos(vdev); //the storage stays, so make sure nothing (e.g. the vIRQ) can see stale data
     vdev->initialized = false;
     pr_loc_dbg("Deinitialized ttyS%d vUART", vdev->line);
 
@@ -848,9 +1067,15 @@ static int update_serial8250_isa_port(struct serial8250_16550A_vdev *vdev)
     port->regshift = 0;
     port->serial_in = serial_remote_read;
     port->serial_out = serial_remote_write;
-    port->type = PORT_16550A;
+    port->type = get_vdev_chip(vdev)->port_type;
+    port->fifosize = vdev->fifo_len;
     up->cur_iotype = 0xFF;
 
+    //16550A is what the driver autodetects by itself; other models are reported as fixed as our emulation doesn't
+    // respond to their (often intrusive) detection sequences
+    if (vdev->chip != VUART_CHIP_16550A)
+        port->flags |= UPF_FIXED_TYPE;
+
     //DO NOT EVEN THINK about assigning "port" top vdev->port!!! serial8250_register_8250_port() uses our passed port to
     // match internally reserved (during boot) port structure. Our structure misses a lot of stuff like handlers and so
     //YOU CANNOT ASSIGN IT HERE!
@@ -931,9 +1156,11 @@ int vuart_set_tx_callback(int line, vuart_callback_t *cb, char *buffer, int thre
             return 0;
         }
 
-        //We don't really need to lock for that
-        kfree(flush_cbs[line]);
+        //The callback may be running right now (it's called with the lock held) - make sure it finished before the slot
+        // can be reused
+        lock_vuart_oppr(vdev);
         flush_cbs[line] = NULL;
+        unlock_vuart_oppr(vdev);
 
         pr_loc_dbg("Removed TX callback for ttyS%d (line=%d)", line, vdev->line);
         return 0;
@@ -941,21 +1168,14 @@ int vuart_set_tx_callback(int line, vuart_callback_t *cb, char *buffer, int thre
 
     pr_loc_dbg("Setting TX callback for for ttyS%d (line=%d)", line, vdev->line);
     line = vdev->line; //this looks to make no sense BUT it does when serials are swapped
-    if (likely(!flush_cbs[line])) { //if there was already a cb there we don't need to reserve memory
-        flush_cbs[line] = kmalloc(sizeof(struct flush_callback), GFP_KERNEL);
-        if (unlikely(!flush_cbs[line])) {
-            pr_loc_crt("kmalloc failed");
-            flush_cbs[line] = NULL;
-            return -EFAULT;
-        }
-    }
 
     //This can technically be called during serial port operation so we need to get a lock before we change these or
     // we risk sending a buffer to a wrong function. That lock may not exist when device is not added yet.
     lock_vuart_oppr(vdev);
-    flush_cbs[line]->fn = cb;
-    flush_cbs[line]->buffer = buffer;
-    flush_cbs[line]->threshold = threshold;
+    flush_cb_slots[line].fn = cb;
+    flush_cb_slots[line].buffer = buffer;
+    flush_cb_slots[line].threshold = threshold;
+    flush_cbs[line] = &flush_cb_slots[line];
     unlock_vuart_oppr(vdev);
 
     pr_loc_dbg("Added TX callback for ttyS%d (line=%d)", line, vdev->line);
@@ -963,44 +1183,288 @@ int vuart_set_tx_callback(int line, vuart_callback_t *cb, char *buffer, int thre
     return 0;
 }
 
-int vuart_inject_rx(int line, const char *buffer, int length)
+#ifndef VUART_USE_TIMER_FALLBACK
+unsigned int vuart_bulk_tx(struct serial8250_16550A_vdev *vdev)
+{
+    if (!vdev->bulk_tx || unlikely(!vdev->up) || unlikely(!vdev->up->state))
+        return 0;
+
+    //The lock order here MUST be the same as when the driver calls us (port->lock first, then vdev lock) or we deadlock
+    struct uart_port *port = vdev->up;
+    struct circ_buf *xmit = &port->state->xmit;
+    unsigned long port_flags;
+    unsigned int total = 0;
+
+    spin_lock_irqsave(&port->lock, port_flags);
+    //x_char & stopped TX have special semantics which are better left to the driver
+    if (port->x_char || uart_tx_stopped(port) || uart_circ_empty(xmit))
+        goto out_unlock_port;
+
+    lock_vuart(vdev);
+    if (unlikely(!flush_cbs[vdev->line])) //no one to deliver it to - let the driver push it through the slow path
+        goto out_unlock;
+
+    //Something may have been written to THR directly (e.g. console) - it has to be delivered first to keep the order
+    if (!kfifo_is_empty(&vdev->tx_fifo))
+        flush_tx_fifo(vdev, VUART_FLUSH_FULL);
+
+    do {
+        unsigned int len = CIRC_CNT_TO_END(xmit->head, xmit->tail, UART_XMIT_SIZE);
+        if (len > vdev->fifo_len)
+            len = vdev->fifo_len;
+
+        //Same reason priority as in handle_transmit_char() - see vuart_flush_reason for details
+        vuart_flush_reason reason;
+        if (len >= flush_cbs[vdev->line]->threshold)
+            reason = VUART_FLUSH_THRESHOLD;
+        else if (len == uart_circ_chars_pending(xmit))
+            reason = VUART_FLUSH_IDLE;
+        else
+            reason = VUART_FLUSH_FULL;
+
+        flush_cbs[vdev->line]->fn(vdev->line, xmit->buf + xmit->tail, len, reason);
+        vuart_stat_inc(vdev, tx_flushes[reason]);
+        xmit->tail = (xmit->tail + len) & (UART_XMIT_SIZE - 1);
+        port->icount.tx += len;
+        total += len;
+    } while (!uart_circ_empty(xmit));
+    uart_prdbg("Bulk TX moved %u bytes from ttyS%d", total, vdev->line);
+    vuart_stat_add(vdev, tx_bytes, total);
+
+    //The driver will find the buffer empty and stop TX (=disable THRI) but it will not wake up writers in such case
+    uart_write_wakeup(port);
+    vdev->lsr |= UART_LSR_TEMT | UART_LSR_THRE;
+    update_interrupts_state(vdev);
+
+    out_unlock:
+    unlock_vuart(vdev);
+    out_unlock_port:
+    spin_unlock_irqrestore(&port->lock, port_flags);
+
+    return total;
+}
+#endif
+
+int vuart_set_bulk_tx(int line, bool enable)
+{
+    validate_isa_line(line);
+
+#ifdef VUART_USE_TIMER_FALLBACK
+    pr_loc_err("Bulk TX is not supported with VUART_USE_TIMER_FALLBACK");
+    return -EOPNOTSUPP;
+#else
+    struct serial8250_16550A_vdev *vdev = get_line_vdev(line);
+    lock_vuart_oppr(vdev);
+    vdev->bulk_tx = enable;
+    unlock_vuart_oppr(vdev);
+
+    pr_loc_dbg("Bulk TX %s for ttyS%d", enable ? "enabled" : "disabled", line);
+    return 0;
+#endif
+}
+
+int vuart_set_irq_coalescing(int line, unsigned int bytes, unsigned int usecs)
 {
     validate_isa_line(line);
-    
-    if (unlikely(length > VUART_FIFO_LEN)) {
-        pr_loc_bug("Attempted to inject buffer of %d bytes - it's larger than FIFO size (%d bytes)", length, VUART_FIFO_LEN);
-        return -E2BIG;
+
+#ifdef VUART_USE_TIMER_FALLBACK
+    pr_loc_err("Interrupt coalescing is not supported with VUART_USE_TIMER_FALLBACK");
+    return -EOPNOTSUPP;
+#else
+    if (unlikely(bytes && !usecs)) {
+        pr_loc_bug("Interrupt coalescing requires max latency when bytes threshold is set");
+        return -EINVAL;
     }
-    
+
+    struct serial8250_16550A_vdev *vdev = get_line_vdev(line);
+    lock_vuart_oppr(vdev);
+    vdev->virq_coalesce_bytes = bytes;
+    vdev->virq_coalesce_usecs = usecs;
+    unlock_vuart_oppr(vdev);
+
+    pr_loc_dbg("vIRQ coalescing for ttyS%d set to bytes=%u usecs=%u", line, bytes, usecs);
+    return 0;
+#endif
+}
+
+int vuart_set_tx_idle_timeout(int line, unsigned int chars)
+{
+    validate_isa_line(line);
+
+    struct serial8250_16550A_vdev *vdev = get_line_vdev(line);
+    lock_vuart_oppr(vdev);
+    vdev->tx_idle_chars = chars;
+    //A burst already in the FIFO has no timer running - give it one so it doesn't wait for the next char
+    if (chars && !kfifo_is_empty(&vdev->tx_fifo)) {
+        vdev->tx_last_ns = ktime_to_ns(ktime_get());
+        start_tx_idle_timer(vdev);
+    }
+    unlock_vuart_oppr(vdev);
+
+    pr_loc_dbg("TX idle timeout for ttyS%d set to %u character-times", line, chars);
+    return 0;
+}
+
+int vuart_get_reg_accesses(int line, u64 *reads, u64 *writes)
+{
+    validate_isa_line(line);
+
+#ifdef VUART_STATS
+    struct serial8250_16550A_vdev *vdev = get_line_vdev(line);
+    if (unlikely(!vdev->stats))
+        return -ENODATA;
+
+    vuart_stats_sum_reg_accesses(vdev, reads, writes);
+    return 0;
+#else
+    return -EOPNOTSUPP;
+#endif
+}
+
+int vuart_inject_rx(int line, const char *buffer, int length)
+{
+    validate_isa_line(line);
+
     struct serial8250_16550A_vdev *vdev = get_line_vdev(line);
     if (unlikely(!vdev->initialized)) {
-        pr_loc_bug("Cannot inject data into non-initialized or non-registered device");
+        pr_loc_bug("Cannot inject data into non-initialized device");
         return -ENXIO;
     }
 
-    if (unlikely(!vdev->registered)) {
-        pr_loc_wrn("Cannot inject data into unregistered device"); //...as it will be removed by the driver on reg
-        return 0;
-    }
+    if (unlikely(length < 0))
+        return -EINVAL;
 
-    //No space to put data - not an error per-sen as this can be re-run again
-    if ((vdev->lsr & UART_LSR_DR) && unlikely(kfifo_is_full(vdev->rx_fifo) || unlikely(vdev->mcr & UART_MCR_LOOP)))
-        return 0;
-    
-    
-    int put_bytes = kfifo_in(vdev->rx_fifo, buffer, VUART_FIFO_LEN);
-    if (likely(put_bytes > 0))
-        vdev->lsr |= UART_LSR_DR;
+    //This is the producer side of the SPSC ring - it's safe without any locks (see kfifo.h). If the ring is full we
+    // will accept less and the caller should retry later (not an error per-se)
+    int put_bytes = kfifo_in(&vdev->rx_ring, buffer, length);
+    uart_prdbg("Staged %d/%d bytes for ttyS%d RX", put_bytes, length, line);
+    vuart_trace_rx(vdev, buffer, put_bytes); //only what was accepted; retries show up as separate calls
 
-    uart_prdbg("Injected %d bytes into ttyS%d RX", put_bytes, line);
-    update_interrupts_state(vdev);
+    //The consumer needs to be poked as the driver will not read anything before it gets an interrupt. Without vIRQ
+    // the 8250 timer will poll the chip and the data will be picked up on the next read. If the port isn't registered
+    // with the driver yet (or isn't open) the data just waits in the ring.
+    if (likely(put_bytes > 0))
+        vuart_virq_wake_up_rx(vdev);
 
     return put_bytes;
 }
 
-int vuart_add_device(int line)
+int vuart_rx_space(int line)
 {
-    pr_loc_dbg("Adding vUART ttyS%d", line);
+    validate_isa_line(line);
+
+    struct serial8250_16550A_vdev *vdev = get_line_vdev(line);
+    if (unlikely(!vdev->initialized))
+        return -ENXIO;
+
+    return kfifo_avail(&vdev->rx_ring);
+}
+
+int vuart_chip_fifo_len(vuart_chip_model model)
+{
+    if (unlikely(model < 0 || model >= ARRAY_SIZE(chip_defs))) {
+        pr_loc_bug("Unknown vUART chip model %d", model);
+        return -EINVAL;
+    }
+
+    return chip_defs[model].fifo_len;
+}
+
+/**************************************************** Lazy ports ******************************************************/
+static DEFINE_MUTEX(activation_lock); //serializes (de)activation of lazy ports
+
+/**
+ * Brings up everything which a lazy port needs while it's open
+ *
+ * The callback goes first so that the user is ready (e.g. has the TX callback set) before the vIRQ starts handling
+ * whatever the driver queued since it opened the port.
+ */
+static void activate_port(struct serial8250_16550A_vdev *vdev)
+{
+    int out;
+    pr_loc_dbg("ttyS%d opened by the driver - activating", vdev->line);
+
+    if (vdev->open_cb && (out = vdev->open_cb(vdev->line, true)) != 0)
+        pr_loc_err("Open callback for ttyS%d failed - error=%d", vdev->line, out);
+
+    if ((out = vuart_enable_interrupts(vdev)) != 0)
+        pr_loc_crt("Failed to enable vIRQ for ttyS%d - the port will not work (error=%d)", vdev->line, out);
+
+    vdev->active = true;
+}
+
+/**
+ * Reverses activate_port()
+ */
+static void deactivate_port(struct serial8250_16550A_vdev *vdev)
+{
+    int out;
+    pr_loc_dbg("ttyS%d closed by the driver - deactivating", vdev->line);
+
+    if ((out = vuart_disable_interrupts(vdev)) != 0)
+        pr_loc_err("Failed to disable vIRQ for ttyS%d - error=%d", vdev->line, out);
+
+    if (vdev->open_cb && (out = vdev->open_cb(vdev->line, false)) != 0)
+        pr_loc_err("Close callback for ttyS%d failed - error=%d", vdev->line, out);
+
+    vdev->active = false;
+}
+
+/**
+ * Follows the open state of the port noticed in serial_remote_write()
+ *
+ * Only the current state matters, so a quick close-open sequence which happened before the work got to run is a noop.
+ */
+static void port_open_work(struct work_struct *work)
+{
+    struct serial8250_16550A_vdev *vdev = container_of(work, struct serial8250_16550A_vdev, open_work);
+
+    mutex_lock(&activation_lock);
+    lock_vuart(vdev);
+    bool open = vdev->lazy && vdev->port_open;
+    unlock_vuart(vdev);
+
+    if (open && !vdev->active)
+        activate_port(vdev);
+    else if (!open && vdev->active)
+        deactivate_port(vdev);
+    mutex_unlock(&activation_lock);
+}
+
+/**
+ * Prepares a freshly initialized vdev to be added as a lazy (or a regular) port
+ */
+static void setup_lazy_port(struct serial8250_16550A_vdev *vdev, bool lazy, vuart_open_callback_t *open_cb)
+{
+    INIT_WORK(&vdev->open_work, port_open_work);
+    vdev->open_cb = open_cb;
+    vdev->port_open = false;
+    vdev->active = false;
+    vdev->lazy = lazy;
+}
+
+/**
+ * Stops everything running on behalf of the port before it's removed (vIRQ, open callback)
+ */
+static int stop_port_activity(struct serial8250_16550A_vdev *vdev)
+{
+    if (!vdev->lazy)
+        return vuart_disable_interrupts(vdev);
+
+    //Work is only scheduled with the lock held & lazy set - once we clear it under the lock nothing can be queued after
+    // the cancel below, and a direct run of the work will see the port as closed
+    lock_vuart(vdev);
+    vdev->lazy = false;
+    unlock_vuart(vdev);
+    cancel_work_sync(&vdev->open_work);
+    port_open_work(&vdev->open_work);
+
+    return 0;
+}
+
+static int add_device(int line, vuart_chip_model model, bool lazy, vuart_open_callback_t *open_cb)
+{
+    pr_loc_dbg("Adding %svUART ttyS%d", lazy ? "lazy " : "", line);
 
     validate_isa_line(line);
     warn_bug_swapped(line);
@@ -1008,27 +1472,62 @@ int vuart_add_device(int line)
     int out;
     struct serial8250_16550A_vdev *vdev = get_line_vdev(line);
 
+    if ((out = vuart_chip_fifo_len(model)) < 0)
+        return out;
+
+    if (unlikely(vdev->initialized)) { //initialize_ttyS() checks that too but we cannot change model under a live port
+        pr_loc_bug("ttyS%d is already initialized", vdev->line);
+        return -EBUSY;
+    }
+
+    vdev->chip = model;
+    vdev->fifo_len = out;
+
     if ((out = initialize_ttyS(vdev)) != 0)
         return out;
 
+    //Coalescing is a tuning knob - the port works (just with more vIRQ runs) if it cannot be applied
+    if (vuart_coalesce_bytes && vuart_set_irq_coalescing(line, vuart_coalesce_bytes, vuart_coalesce_usecs) != 0)
+        pr_loc_wrn("Failed to set vIRQ coalescing for ttyS%d - it will be disabled", line);
+
+    //Must be done before the registration as the driver may open the port right away (e.g. when it's a console)
+    setup_lazy_port(vdev, lazy, open_cb);
+
     if ((out = update_serial8250_isa_port(vdev)) != 0)
-        goto error_deinit;
+        goto error_stop;
 
-    if ((out = vuart_enable_interrupts(vdev)) != 0)
+    if (!lazy && (out = vuart_enable_interrupts(vdev)) != 0)
         goto error_restore;
 
-    pr_loc_inf("Added vUART at ttyS%d", line);
+    vuart_stats_register(vdev); //stats are optional - it never fails
+    vuart_trace_register(vdev); //uses the stats debugfs dir
+
+    pr_loc_inf("Added %svUART at ttyS%d (%s, FIFO=%u)", lazy ? "lazy " : "", line, get_vdev_chip(vdev)->name,
+               vdev->fifo_len);
     return 0;
 
     error_restore:
     restore_serial8250_isa_port(vdev);
 
-    error_deinit:
+    error_stop:
+    if (lazy)
+        stop_port_activity(vdev); //the port could've been opened during registration
+
     deinitialize_ttyS(vdev);
 
     return out;
 }
 
+int vuart_add_device(int line, vuart_chip_model model)
+{
+    return add_device(line, model, false, NULL);
+}
+
+int vuart_add_device_lazy(int line, vuart_chip_model model, vuart_open_callback_t *open_cb)
+{
+    return add_device(line, model, true, open_cb);
+}
+
 int vuart_remove_device(int line)
 {
     pr_loc_dbg("Removing vUART ttyS%d", line);
@@ -1038,10 +1537,13 @@ int vuart_remove_device(int line)
 
     int out;
     struct serial8250_16550A_vdev *vdev = get_line_vdev(line);
-    if ((out = vuart_disable_interrupts(vdev)) != 0 || (out = deinitialize_ttyS(vdev)) != 0 ||
+    if ((out = stop_port_activity(vdev)) != 0 || (out = deinitialize_ttyS(vdev)) != 0 ||
         (out = restore_serial8250_isa_port(vdev)) != 0 || (out = vuart_set_tx_callback(line, NULL, NULL, 0)) != 0)
         return out;
 
+    vuart_stats_unregister(vdev); //only safe after the port was restored (=8250 will not call us anymore)
+    vuart_trace_unregister(vdev);
+
     pr_loc_inf("Removed vUART & restored original UART at ttyS%d", line);
 
     return 0;
@@ -4,17 +4,42 @@
 #include <linux/types.h> //bool
 
 /**
- * Length of the RX/TX FIFO in bytes
- * Do NOT change this value just because you want to inject more data at once - it's a hardware-defined property
+ * Length of the RX/TX FIFO in bytes of the default chip (16550A)
+ * Do NOT change this value just because you want to inject more data at once - it's a hardware-defined property. If you
+ * need deeper FIFOs pick a different chip model when adding the device (see vuart_chip_model).
  */
 #define VUART_FIFO_LEN 16
 
+/**
+ * Length of the biggest RX/TX FIFO of all supported chip models; buffer of that size will fit any model
+ */
+#define VUART_FIFO_MAX_LEN 128
+
+/**
+ * Length of the RX staging ring used by vuart_inject_rx(); this is NOT a hardware property but a software buffer in
+ * front of the chip's RX FIFO. Must be a power of 2.
+ */
+#define VUART_RX_RING_LEN 4096
+
 /**
  * Defines maximum threshold possible; in practice this means you will never get any THRESHOLD events but only ID:E and
  * FULL ones.
  */
 #define VUART_THRESHOLD_MAX INT_MAX
 
+/**
+ * Chip model emulated by a given vUART
+ *
+ * All models are register-compatible with the 16550A and differ (from our perspective) only by the FIFO depth reported
+ * to the 8250 driver. Deeper FIFO means the driver pushes more bytes per THRE interrupt and we call the TX callback less
+ * often (e.g. 16750 flushes 4x less often than 16550A under a constant stream).
+ */
+typedef enum {
+    VUART_CHIP_16550A, //16 bytes FIFOs; the classic IBM/PC UART and the default
+    VUART_CHIP_16750,  //64 bytes FIFOs
+    VUART_CHIP_16C950, //128 bytes FIFOs (Oxford Semiconductor); emulates EFR & swallows ICR writes
+} vuart_chip_model;
+
 /**
  * Specified the reason why the vUART flushed the buffer
  *
@@ -44,6 +69,27 @@ typedef enum {
  */
 typedef void (vuart_callback_t)(int line, const char *buffer, unsigned int len, vuart_flush_reason reason);
 
+/**
+ * Represents a signature of a callback notified when the 8250 driver opens/closes a lazy port
+ *
+ * It's called from a workqueue (process context, may sleep) shortly after the driver started up the port (first open)
+ * or shut it down (last close). The port will not generate interrupts before the open call returns, so anything needed
+ * to handle the data (e.g. the TX callback) can be set up there without losing what the app writes right after open.
+ *
+ * @param line UART# which changed state
+ * @param open true when the port was opened, false when it was closed
+ *
+ * @return 0 on success or -E on error; a failure is logged but the port stays usable from the driver's perspective
+ */
+typedef int (vuart_open_callback_t)(int line, bool open);
+
+/**
+ * Returns the length of RX/TX FIFOs for a given chip model
+ *
+ * @return length in bytes or -EINVAL if the model is unknown
+ */
+int vuart_chip_fifo_len(vuart_chip_model model);
+
 /**
  * Adds a virtual UART device
  *
@@ -53,10 +99,30 @@ typedef void (vuart_callback_t)(int line, const char *buffer, unsigned int len,
  *
  * @param line UART number to replace, e.g. 0 for ttyS0. On systems with inverted UARTs you should use the real one, so
  *             even if ttyS0 points to 2nd physical port this method will ALWAYS use the one corresponding to ttyS*
+ * @param model Chip model to emulate; it determines the FIFOs length (see vuart_chip_fifo_len()). If you don't know
+ *              what to use pick VUART_CHIP_16550A.
+ *
+ * @return 0 on success or -E on error
+ */
+int vuart_add_device(int line, vuart_chip_model model);
+
+/**
+ * Adds a virtual UART device which stays dormant until the 8250 driver opens it
+ *
+ * This works just like vuart_add_device() as far as the driver is concerned. However, the vIRQ is not brought up (so
+ * no thread is running) until the port is opened, and it's stopped again when the port is closed. The open_cb is called
+ * on every such transition so that the user of the port can reserve its resources only for the time when the port is
+ * actually used. Open & close are detected from the driver raising/dropping OUT2 in MCR during startup/shutdown.
+ *
+ * Removing the device with vuart_remove_device() while it's open calls the open_cb with open=false.
+ *
+ * @param line UART number, e.g. 0 for ttyS0 (see vuart_add_device() for details)
+ * @param model Chip model to emulate (see vuart_add_device() for details)
+ * @param open_cb Function called when the port is opened/closed; it can be NULL if only the vIRQ should be lazy
  *
  * @return 0 on success or -E on error
  */
-int vuart_add_device(int line);
+int vuart_add_device_lazy(int line, vuart_chip_model model, vuart_open_callback_t *open_cb);
 
 /**
  * Removes a virtual UART device
@@ -82,15 +148,34 @@ int vuart_remove_device(int line);
  * the port. So while TX implies "transmission" from the perspective of the chip and the app opening the port it's an
  * RX side. This naming is consistent with what the whole 8250 subsystem uses.
  *
+ * The data is not placed in the chip directly but in a single-producer/single-consumer ring (VUART_RX_RING_LEN) in
+ * front of the chip's RX FIFO. The ring is drained into the chip as the driver reads the data. Thanks to that this
+ * function never takes the chip lock and can be safely called from any context (incl. one with IRQs disabled).
+ * There's no limit on the length: if the ring cannot fit everything the function accepts only what fits and returns
+ * the number of bytes accepted (backpressure). It's up to the caller to retry with the rest later on.
+ * It can be used as soon as the port is added with vuart_add_device(), even before the 8250 driver loads and picks the
+ * port up: until the driver starts listening (enables RX interrupts on open) the data is simply held in the ring, so a
+ * producer starting early in boot doesn't need to wait for the driver nor lose what it sent.
+ *
+ * WARNING: the ring is lock-free only with a single producer. If you have multiple producers for the same line you
+ * need to serialize calls to this function yourself.
+ *
  * @param line UART number to replace, e.g. 0 for ttyS0. On systems with inverted UARTs you should use the real one, so
  *             even if ttyS0 points to 2nd physical port this method will ALWAYS use the one corresponding to ttyS*
  * @param buffer Pointer to a buffer where we will read from. There's no assumption as to what the buffer contains.
- * @param length Length to read from the buffer up to VUART_FIFO_LEN
+ * @param length Length to read from the buffer
  *
- * @return 0 on success or -E on error
+ * @return number of bytes accepted (0 means the ring is full, try again later) or -E on error
  */
 int vuart_inject_rx(int line, const char *buffer, int length);
 
+/**
+ * Returns how many bytes vuart_inject_rx() can currently accept without truncation
+ *
+ * @return 0 or more bytes, -E on error
+ */
+int vuart_rx_space(int line);
+
 /**
  * Set a function which will be called upon data transmission by the port opener
  *
@@ -103,7 +188,7 @@ int vuart_inject_rx(int line, const char *buffer, int length);
  *         pr_loc_inf("TX @ ttyS%d: |%.*s|", line, len, buffer);
  *     }
  *     //....
- *     char buf[VUART_FIFO_LEN]; //Your buffer should be able to accommodate at least VUART_FIFO_LEN
+ *     char buf[VUART_FIFO_LEN]; //Your buffer should be able to accommodate at least FIFO length of the chip model
  *     vuart_set_tx_callback(TRY_PORT, dummy_tx_callback, buf, VUART_FIFO_LEN);
  *
  * WARNING:
@@ -115,7 +200,7 @@ int vuart_inject_rx(int line, const char *buffer, int length);
  *             even if ttyS0 points to 2nd physical port this method will ALWAYS use the one corresponding to ttyS*
  * @param cb Function to be called; call it with a NULL ptr to remove callback, see docblock for vuart_callback_t
  * @param buffer A pointer to a buffer where data will be placed. The buffer should be able to accommodate
- *               VUART_FIFO_LEN number of bytes. The buffer you pass will be the same one as passed back during a call
+ *               vuart_chip_fifo_len() number of bytes (or simply VUART_FIFO_MAX_LEN). The buffer you pass will be the same one as passed back during a call
  * @param threshold a *HINT* how many bytes at minimum should be deposited in the FIFO before callback is called. Keep
  *                  in mind that this is just a hint and you callback may be called sooner (e.g. when a client program
  *                  wrote only a single byte using e.g. echo -n X > /dev/ttyS0).
@@ -123,4 +208,70 @@ int vuart_inject_rx(int line, const char *buffer, int length);
  */
 int vuart_set_tx_callback(int line, vuart_callback_t *cb, char *buffer, int threshold);
 
+/**
+ * Enables or disables bulk ("paravirtual") TX mode
+ *
+ * In the normal mode every byte sent by the kernel goes through THR emulation (lock, FIFO put, LSR updates, threshold
+ * check). When bulk mode is enabled the vIRQ pulls chunks of data directly from the 8250 driver's circular TX buffer
+ * and passes them to the callback set with vuart_set_tx_callback(), skipping the per-byte emulation entirely. Bytes
+ * written directly to THR (e.g. by the kernel console) still go through the normal path.
+ *
+ * In bulk mode the buffer passed to the callback is NOT the one set with vuart_set_tx_callback() but points directly
+ * to the driver's memory - you must copy the data out before returning. The length will never exceed the FIFO length
+ * of the chip model. The callback is called with the port lock held - do not call any vUART functions from it.
+ *
+ * This mode is only available with vIRQ (i.e. not with VUART_USE_TIMER_FALLBACK).
+ *
+ * @param line UART number, e.g. 0 for ttyS0 (see vuart_add_device() for details)
+ * @param enable
+ *
+ * @return 0 on success or -E on error
+ */
+int vuart_set_bulk_tx(int line, bool enable);
+
+/**
+ * Configures interrupt moderation (coalescing) for a vUART
+ *
+ * By default the vIRQ fires as soon as the chip has any interrupt condition, which can be several times per burst of
+ * data. With coalescing enabled the vIRQ will only fire after at least "bytes" bytes passed through the chip (in either
+ * direction) or after "usecs" microseconds elapsed since the first interrupt condition, whichever comes first. This is
+ * the same idea as interrupt moderation in NICs: a little higher latency for a lot less handler runs under sustained
+ * traffic.
+ *
+ * This is only available with vIRQ (i.e. not with VUART_USE_TIMER_FALLBACK).
+ *
+ * @param line UART number, e.g. 0 for ttyS0 (see vuart_add_device() for details)
+ * @param bytes Bytes threshold; set to 0 to disable coalescing
+ * @param usecs Max latency; must be non-zero when bytes is non-zero
+ *
+ * @return 0 on success or -E on error
+ */
+int vuart_set_irq_coalescing(int line, unsigned int bytes, unsigned int usecs);
+
+/**
+ * Configures timer-based TX idle detection (similar to the receiver time-out of a real 16550)
+ *
+ * By default VUART_FLUSH_IDLE is triggered when the driver disables THRe interrupt, which depends on how the driver
+ * (and the app) access the port: a slow writer causes many tiny flushes while a fast one causes big ones. With the
+ * idle timeout set the TX FIFO is flushed with VUART_FLUSH_IDLE only after nothing was written for "chars"
+ * character-times at the emulated baud rate & line settings (e.g. 4 chars at 115200 8N1 is ~350us). This gives
+ * callbacks deterministic frame boundaries, as long as the sender doesn't pause mid-frame for longer than that.
+ *
+ * LSR TEMT/THRE and THRESHOLD/FULL flushes work as usual in this mode. The callback will be called from a timer (i.e.
+ * hardirq) context.
+ *
+ * @param line UART number, e.g. 0 for ttyS0 (see vuart_add_device() for details)
+ * @param chars Gap length in character-times; set to 0 to disable
+ *
+ * @return 0 on success or -E on error
+ */
+int vuart_set_tx_idle_timeout(int line, unsigned int chars);
+
+/**
+ * Gets total number of register reads & writes done by the driver on a given vUART (since it was added)
+ *
+ * @return 0 on success, -EOPNOTSUPP when stats aren't compiled in (see vuart_stats.h), or other -E on error
+ */
+int vuart_get_reg_accesses(int line, u64 *reads, u64 *writes);
+
 #endif //REDPILL_VIRTUAL_UART_H
@@ -0,0 +1,418 @@
+/**
+ * Character device backend for vUART (/dev/vuartN)
+ *
+ * The in-kernel TX callback interface (see vuart_set_tx_callback()) is great for small shims living in the module but
+ * it's a pain for anything bigger: you get at most a FIFO worth of data per call and you need to write kernel code to
+ * consume it. This module exposes a vUART to userspace so that a daemon (e.g. PMU emulator or a log shipper) can drain
+ * and inject serial traffic in bulk.
+ *
+ * HOW IT WORKS?
+ * -------------
+ * Each registered vUART gets a pair of SPSC rings allocated in vmalloc'ed memory which is shared with userspace via
+ * mmap() (layout is described with struct vuart_cdev_hdr). The TX callback of the line copies data straight into the
+ * TX ring and wakes up pollers - the whole path runs under vUART lock which makes the kernel a single producer. Data
+ * placed by userspace in the RX ring is moved to the vUART (vuart_inject_rx()) on VUART_CDEV_IOC_KICK_RX. For simple
+ * consumers read() and write() work as well (they use the same TX ring for reading, and inject directly for writing).
+ *
+ * Notes:
+ *  - the vUART does not notify about RX space freeing up, so POLLOUT is always reported; write() and the kick ioctl
+ *    will report how much has been actually accepted
+ *  - read() and mmap()-based consumption of TX cannot be mixed (both advance the same tail)
+ */
+#include "vuart_chardev.h"
+#include "virtual_uart.h"
+#include "vuart_internal.h" //validate_isa_line
+#include "../../common.h"
+#include "../../config/uart_defs.h" //SERIAL8250_LAST_ISA_LINE
+#include <linux/miscdevice.h> //misc_register, misc_deregister
+#include <linux/fs.h> //file_operations
+#include <linux/mm.h> //remap_vmalloc_range
+#include <linux/vmalloc.h> //vmalloc_user, vfree
+#include <linux/poll.h> //poll_wait, POLL*
+#include <linux/uaccess.h> //copy_to_user, copy_from_user
+#include <linux/mutex.h>
+
+#define RING_MASK (VUART_CDEV_RING_LEN - 1)
+#define MAP_LEN (VUART_CDEV_HDR_LEN + 2 * VUART_CDEV_RING_LEN)
+#define WRITE_CHUNK 256 //on-stack bounce buffer for write()
+
+static int vuart_cdev_line = -1;
+module_param(vuart_cdev_line, int, 0444);
+MODULE_PARM_DESC(vuart_cdev_line, "Add a vUART on ttyS<N> and expose it to userspace as /dev/vuart<N> (-1 = disabled)");
+
+struct vuart_cdev {
+    int line;
+    char name[8];
+    struct miscdevice misc;
+    struct vuart_cdev_hdr *hdr; //start of the whole mmap'able area
+    char *tx_data;
+    char *rx_data;
+    char fifo_buf[VUART_FIFO_MAX_LEN]; //buffer passed to vuart_set_tx_callback()
+    wait_queue_head_t wait; //woken up when TX data arrives
+    atomic_t opened;
+    struct mutex rx_lock; //serializes RX consumption (write() & kick ioctl)
+};
+
+static struct vuart_cdev *cdevs[SERIAL8250_LAST_ISA_LINE+1] = { NULL };
+//Serializes open() with (un)publishing in cdevs[]; it's never held while calling misc_(de)register() as misc_open()
+// calls our open() with the misc lock already taken
+static DEFINE_MUTEX(cdevs_lock);
+
+#define tx_pending(cd) ((u32)(ACCESS_ONCE((cd)->hdr->tx_head) - ACCESS_ONCE((cd)->hdr->tx_tail)))
+
+/**
+ * Called by the vUART with its lock held - we're the only TX producer
+ */
+static void tx_callback(int line, const char *buffer, unsigned int len, vuart_flush_reason reason)
+{
+    struct vuart_cdev *cd = cdevs[line];
+    if (unlikely(!cd))
+        return;
+
+    struct vuart_cdev_hdr *hdr = cd->hdr;
+    u32 head = hdr->tx_head;
+    u32 space = VUART_CDEV_RING_LEN - (head - ACCESS_ONCE(hdr->tx_tail));
+    unsigned int copy = min(len, space);
+    if (unlikely(copy < len))
+        hdr->tx_dropped += len - copy;
+
+    unsigned int off = head & RING_MASK;
+    unsigned int first = min(copy, (unsigned int)(VUART_CDEV_RING_LEN - off));
+    memcpy(cd->tx_data + off, buffer, first);
+    memcpy(cd->tx_data, buffer + first, copy - first);
+
+    smp_wmb(); //data must be visible before the head moves
+    hdr->tx_head = head + copy;
+    wake_up_interruptible(&cd->wait);
+}
+
+static struct vuart_cdev *get_cdev_by_minor(int minor)
+{
+    for (int i = 0; i <= SERIAL8250_LAST_ISA_LINE; ++i) {
+        if (cdevs[i] && cdevs[i]->misc.minor == minor)
+            return cdevs[i];
+    }
+
+    return NULL;
+}
+
+static int cdev_open(struct inode *inode, struct file *file)
+{
+    mutex_lock(&cdevs_lock);
+    struct vuart_cdev *cd = get_cdev_by_minor(iminor(inode));
+    if (unlikely(!cd)) {
+        mutex_unlock(&cdevs_lock);
+        return -ENODEV;
+    }
+
+    if (atomic_cmpxchg(&cd->opened, 0, 1) != 0) {
+        mutex_unlock(&cdevs_lock);
+        return -EBUSY;
+    }
+    mutex_unlock(&cdevs_lock);
+
+    file->private_data = cd;
+    return nonseekable_open(inode, file);
+}
+
+static int cdev_release(struct inode *inode, struct file *file)
+{
+    struct vuart_cdev *cd = file->private_data;
+    atomic_set(&cd->opened, 0);
+
+    return 0;
+}
+
+static ssize_t cdev_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
+{
+    struct vuart_cdev *cd = file->private_data;
+    struct vuart_cdev_hdr *hdr = cd->hdr;
+    int out;
+
+    if (!tx_pending(cd)) {
+        if (file->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+
+        if ((out = wait_event_interruptible(cd->wait, tx_pending(cd))) != 0)
+            return out;
+    }
+
+    u32 tail = hdr->tx_tail;
+    u32 pending = tx_pending(cd);
+    smp_rmb(); //head was read - now we can read the data
+    if (unlikely(pending > VUART_CDEV_RING_LEN))
+        return -EIO; //userspace corrupted the tail via mmap
+
+    unsigned int copy = min_t(size_t, count, pending);
+    unsigned int off = tail & RING_MASK;
+    unsigned int first = min(copy, (unsigned int)(VUART_CDEV_RING_LEN - off));
+    if (copy_to_user(buf, cd->tx_data + off, first) || copy_to_user(buf + first, cd->tx_data, copy - first))
+        return -EFAULT;
+
+    smp_mb(); //data must be read before the producer can overwrite it
+    hdr->tx_tail = tail + copy;
+
+    return copy;
+}
+
+static ssize_t cdev_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+    struct vuart_cdev *cd = file->private_data;
+    char chunk[WRITE_CHUNK];
+    ssize_t total = 0;
+    int accepted;
+
+    mutex_lock(&cd->rx_lock);
+    while (total < count) {
+        unsigned int len = min_t(size_t, count - total, WRITE_CHUNK);
+        if (copy_from_user(chunk, buf + total, len)) {
+            total = total ? total : -EFAULT;
+            goto out_unlock;
+        }
+
+        accepted = vuart_inject_rx(cd->line, chunk, len);
+        if (unlikely(accepted < 0)) {
+            total = total ? total : accepted;
+            goto out_unlock;
+        }
+
+        total += accepted;
+        if (accepted < len) //vUART RX ring is full
+            break;
+    }
+
+    if (!total && count)
+        total = -EAGAIN;
+
+    out_unlock:
+    mutex_unlock(&cd->rx_lock);
+    return total;
+}
+
+/**
+ * Moves data from the mmap'ed RX ring into the vUART
+ *
+ * @return number of bytes still waiting in the ring, or -E on error
+ */
+static long kick_rx(struct vuart_cdev *cd)
+{
+    struct vuart_cdev_hdr *hdr = cd->hdr;
+    long out;
+
+    mutex_lock(&cd->rx_lock);
+    u32 head = ACCESS_ONCE(hdr->rx_head);
+    u32 tail = hdr->rx_tail;
+    smp_rmb(); //head was read - now we can read the data
+    if (unlikely(head - tail > VUART_CDEV_RING_LEN)) {
+        out = -EINVAL;
+        goto out_unlock;
+    }
+
+    while (tail != head) {
+        unsigned int off = tail & RING_MASK;
+        unsigned int len = min((unsigned int)(head - tail), (unsigned int)(VUART_CDEV_RING_LEN - off));
+        int accepted = vuart_inject_rx(cd->line, cd->rx_data + off, len);
+        if (unlikely(accepted < 0)) {
+            out = accepted;
+            goto out_update;
+        }
+
+        tail += accepted;
+        if (accepted < len) //vUART RX ring is full
+            break;
+    }
+    out = head - tail;
+
+    out_update:
+    smp_mb(); //data must be consumed before the producer can overwrite it
+    hdr->rx_tail = tail;
+    out_unlock:
+    mutex_unlock(&cd->rx_lock);
+    return out;
+}
+
+static long cdev_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct vuart_cdev *cd = file->private_data;
+
+    switch (cmd) {
+        case VUART_CDEV_IOC_KICK_RX:
+            return kick_rx(cd);
+        default:
+            return -ENOTTY;
+    }
+}
+
+static unsigned int cdev_poll(struct file *file, poll_table *wait)
+{
+    struct vuart_cdev *cd = file->private_data;
+    unsigned int mask = POLLOUT | POLLWRNORM; //see notes in the file header
+
+    poll_wait(file, &cd->wait, wait);
+    if (tx_pending(cd))
+        mask |= POLLIN | POLLRDNORM;
+
+    return mask;
+}
+
+static int cdev_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct vuart_cdev *cd = file->private_data;
+
+    if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start != MAP_LEN)
+        return -EINVAL;
+
+    return remap_vmalloc_range(vma, cd->hdr, 0);
+}
+
+static const struct file_operations cdev_fops = {
+    .owner = THIS_MODULE,
+    .open = cdev_open,
+    .release = cdev_release,
+    .read = cdev_read,
+    .write = cdev_write,
+    .unlocked_ioctl = cdev_ioctl,
+    .poll = cdev_poll,
+    .mmap = cdev_mmap,
+    .llseek = no_llseek,
+};
+
+int vuart_register_chardev(int line)
+{
+    int out;
+    validate_isa_line(line);
+
+    if (unlikely(cdevs[line])) {
+        pr_loc_bug("Character device for ttyS%d is already registered", line);
+        return -EEXIST;
+    }
+
+    struct vuart_cdev *cd = kzalloc(sizeof(struct vuart_cdev), GFP_KERNEL);
+    if (unlikely(!cd)) {
+        pr_loc_crt("kmalloc failed");
+        return -ENOMEM;
+    }
+
+    cd->hdr = vmalloc_user(MAP_LEN); //it's zeroed
+    if (unlikely(!cd->hdr)) {
+        pr_loc_crt("vmalloc_user failed");
+        out = -ENOMEM;
+        goto error_free;
+    }
+
+    cd->line = line;
+    cd->hdr->tx_size = VUART_CDEV_RING_LEN;
+    cd->hdr->rx_size = VUART_CDEV_RING_LEN;
+    cd->tx_data = (char *)cd->hdr + VUART_CDEV_HDR_LEN;
+    cd->rx_data = cd->tx_data + VUART_CDEV_RING_LEN;
+    init_waitqueue_head(&cd->wait);
+    mutex_init(&cd->rx_lock);
+    atomic_set(&cd->opened, 0);
+
+    snprintf(cd->name, sizeof(cd->name), VUART_CDEV_NAME_FMT, line);
+    cd->misc.minor = MISC_DYNAMIC_MINOR;
+    cd->misc.name = cd->name;
+    cd->misc.fops = &cdev_fops;
+    if ((out = misc_register(&cd->misc)) != 0) {
+        pr_loc_err("Failed to register /dev/%s - error=%d", cd->name, out);
+        goto error_free;
+    }
+
+    mutex_lock(&cdevs_lock);
+    cdevs[line] = cd;
+    mutex_unlock(&cdevs_lock);
+    if ((out = vuart_set_tx_callback(line, tx_callback, cd->fifo_buf, VUART_THRESHOLD_MAX)) != 0)
+        goto error_deregister;
+
+    //Our callback copies everything out immediately so it can work directly on the driver's buffer
+    out = vuart_set_bulk_tx(line, true);
+    if (out != 0 && out != -EOPNOTSUPP)
+        goto error_deregister;
+
+    pr_loc_inf("Registered /dev/%s for vUART ttyS%d", cd->name, line);
+    return 0;
+
+    error_deregister:
+    vuart_set_tx_callback(line, NULL, NULL, 0);
+    mutex_lock(&cdevs_lock);
+    cdevs[line] = NULL;
+    mutex_unlock(&cdevs_lock);
+    misc_deregister(&cd->misc);
+    error_free:
+    vfree(cd->hdr);
+    kfree(cd);
+    return out;
+}
+
+int vuart_unregister_chardev(int line)
+{
+    validate_isa_line(line);
+
+    struct vuart_cdev *cd = cdevs[line];
+    if (unlikely(!cd)) {
+        pr_loc_bug("Character device for ttyS%d is not registered", line);
+        return -ENOENT;
+    }
+
+    //Once it's gone from cdevs[] (with the lock held) no open() can find it anymore, so it stays closed from now on
+    mutex_lock(&cdevs_lock);
+    if (atomic_read(&cd->opened)) {
+        mutex_unlock(&cdevs_lock);
+        pr_loc_err("Cannot unregister /dev/%s - it is still open", cd->name);
+        return -EBUSY;
+    }
+    cdevs[line] = NULL;
+    mutex_unlock(&cdevs_lock);
+
+    //After the callback is removed the vUART will never call us again (removal synchronizes with the vUART lock)
+    vuart_set_bulk_tx(line, false);
+    vuart_set_tx_callback(line, NULL, NULL, 0);
+    misc_deregister(&cd->misc);
+
+    //Pages which are still mapped by someone are refcounted by the mapping and will not be released just yet
+    vfree(cd->hdr);
+    pr_loc_inf("Unregistered /dev/%s", cd->name);
+    kfree(cd);
+
+    return 0;
+}
+
+int register_vuart_cdev_port(void)
+{
+    int out;
+    if (vuart_cdev_line < 0) {
+        pr_loc_dbg("vUART character device not requested");
+        return 0;
+    }
+
+    if (vuart_cdev_line > SERIAL8250_LAST_ISA_LINE) {
+        pr_loc_err("Invalid vuart_cdev_line=%d - only ttyS0-ttyS%d can be virtualized", vuart_cdev_line,
+                   SERIAL8250_LAST_ISA_LINE);
+        return -EINVAL;
+    }
+
+    //If the line is already used by e.g. the PMU shim this will fail with -EBUSY - two owners cannot share a port
+    if ((out = vuart_add_device(vuart_cdev_line, VUART_CHIP_16550A)) != 0) {
+        pr_loc_err("Failed to add vUART for ttyS%d - error=%d", vuart_cdev_line, out);
+        return out;
+    }
+
+    if ((out = vuart_register_chardev(vuart_cdev_line)) != 0) {
+        vuart_remove_device(vuart_cdev_line);
+        return out;
+    }
+
+    return 0;
+}
+
+int unregister_vuart_cdev_port(void)
+{
+    int out;
+    if (vuart_cdev_line < 0)
+        return 0;
+
+    if ((out = vuart_unregister_chardev(vuart_cdev_line)) != 0)
+        return out; //the vUART must stay as long as the character device uses it
+
+    return vuart_remove_device(vuart_cdev_line);
+}
@@ -0,0 +1,85 @@
+#ifndef REDPILL_VUART_CHARDEV_H
+#define REDPILL_VUART_CHARDEV_H
+
+/*
+ * Everything in this section is shared with userspace - it must only use fixed-size types and no kernel headers.
+ */
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/ioctl.h>
+#else
+#include <stdint.h>
+#include <sys/ioctl.h>
+typedef uint32_t __u32;
+typedef uint64_t __u64;
+#endif
+
+#define VUART_CDEV_NAME_FMT "vuart%d" //name of the misc device in /dev
+#define VUART_CDEV_RING_LEN (64*1024) //length of each data ring; must be a power of 2 & a multiple of PAGE_SIZE
+
+/**
+ * Layout of the memory mapped from /dev/vuartN:
+ *   [0, 4096)                        struct vuart_cdev_hdr (padded to a page)
+ *   [4096, 4096+tx_size)             TX data ring (chip => userspace, aka what the app wrote to ttyS)
+ *   [4096+tx_size, 4096+tx_size+rx_size) RX data ring (userspace => chip, aka what the app will read from ttyS)
+ *
+ * Both rings are single-producer/single-consumer with free-running indexes (mask them with size-1 to get an offset).
+ * The producer writes data first and only then advances its head; the consumer reads the data and then advances its
+ * tail. Kernel is the producer of TX and the consumer of RX. Userspace must issue VUART_CDEV_IOC_KICK_RX after
+ * producing RX data.
+ */
+#define VUART_CDEV_HDR_LEN 4096
+struct vuart_cdev_hdr {
+    __u32 tx_size;
+    __u32 rx_size;
+    volatile __u32 tx_head; //written by kernel
+    volatile __u32 tx_tail; //written by userspace
+    volatile __u32 rx_head; //written by userspace
+    volatile __u32 rx_tail; //written by kernel
+    volatile __u64 tx_dropped; //bytes sent by the app which didn't fit in the TX ring
+};
+
+#define VUART_CDEV_IOC_MAGIC 'V'
+//Moves data produced in the mmap'ed RX ring into the vUART; returns the number of bytes still waiting in the ring
+#define VUART_CDEV_IOC_KICK_RX _IO(VUART_CDEV_IOC_MAGIC, 1)
+
+#ifdef __KERNEL__
+/**
+ * Exposes a vUART as a /dev/vuartN character device
+ *
+ * The device allows userspace to consume TX and produce RX of the vUART in bulk. It can be used with plain read() and
+ * write() or (better) with mmap() of the shared rings (see struct vuart_cdev_hdr) + poll(). Only one process can have
+ * the device open at a time.
+ *
+ * The character device takes over the TX callback of the line (see vuart_set_tx_callback()) and enables bulk TX mode.
+ * The vUART itself must be added separately (before or after calling this function).
+ *
+ * @param line UART number, e.g. 0 for ttyS0 (see vuart_add_device() for details)
+ *
+ * @return 0 on success or -E on error
+ */
+int vuart_register_chardev(int line);
+
+/**
+ * Removes device created by vuart_register_chardev() and removes TX callback of the line
+ *
+ * @return 0 on success or -E on error
+ */
+int vuart_unregister_chardev(int line);
+
+/**
+ * Adds a vUART on the line requested with vuart_cdev_line= module param and exposes it with vuart_register_chardev()
+ *
+ * @return 0 on success (or when no line was requested) or -E on error
+ */
+int register_vuart_cdev_port(void);
+
+/**
+ * Reverses register_vuart_cdev_port()
+ *
+ * @return 0 on success or -E on error (e.g. -EBUSY when the device is still open)
+ */
+int unregister_vuart_cdev_port(void);
+#endif //__KERNEL__
+
+#endif //REDPILL_VUART_CHARDEV_H
@@ -1,20 +1,34 @@
 #ifndef REDPILL_VUART_INTERNAL_H
 #define REDPILL_VUART_INTERNAL_H
 
+#include "virtual_uart.h" //vuart_chip_model
+#include "vuart_stats.h" //VUART_STATS, struct vuart_stats
+#include "vuart_trace.h" //VUART_TRACE, struct vuart_trace
 #include <linux/spinlock.h>
+#include <linux/cache.h> //____cacheline_aligned_in_smp
+#include <linux/seqlock.h> //seqcount_t
+#include <linux/kfifo.h> //kfifo_is_empty()
+#include <linux/hrtimer.h> //TX idle timer
+#include <linux/serial_reg.h> //UART_IER_RDI
+#include <linux/workqueue.h> //struct work_struct
 #ifndef VUART_USE_TIMER_FALLBACK
 #include <linux/wait.h>
 #endif
 
 
 //Lock/unlock vdev for registries operations
-#define lock_vuart(vdev) spin_lock_irqsave((vdev)->lock, (vdev)->lock_flags);
-#define unlock_vuart(vdev) spin_unlock_irqrestore((vdev)->lock, (vdev)->lock_flags);
+//Every locked section is also a seqcount write section - this lets pure register reads (e.g. LSR polling) to be done
+// without taking the lock and disabling IRQs, while still never observing a half-done update (see
+// try_lockless_read() in virtual_uart.c)
+#define lock_vuart(vdev) \
+    do { spin_lock_irqsave(&(vdev)->lock, (vdev)->lock_flags); write_seqcount_begin(&(vdev)->reg_seq); } while(0)
+#define unlock_vuart(vdev) \
+    do { write_seqcount_end(&(vdev)->reg_seq); spin_unlock_irqrestore(&(vdev)->lock, (vdev)->lock_flags); } while(0)
 
 //In some circumstances operations may be performed on the chip before or after the chip is initialized. If it is
 // initialized we need a lock first; otherwise we do not. This is a shortcut for this opportunistic/conditional locking.
-#define lock_vuart_oppr(vdev) if ((vdev)->initialized) { lock_vuart(vdev); }
-#define unlock_vuart_oppr(vdev) if ((vdev)->initialized) { unlock_vuart(vdev); }
+#define lock_vuart_oppr(vdev) do { if ((vdev)->initialized) { lock_vuart(vdev); } } while(0)
+#define unlock_vuart_oppr(vdev) do { if ((vdev)->initialized) { unlock_vuart(vdev); } } while(0)
 
 #define validate_isa_line(line) \
     if (unlikely((line) > SERIAL8250_LAST_ISA_LINE)) { \
@@ -27,22 +41,14 @@
  * An emulated 16550A chips internal state
  *
  * See http://caro.su/msx/ocm_de1/16550.pdf for details; registers are on page 9 (Table 2)
+ *
+ * The layout is deliberate: everything touched on (almost) every register access is packed into the first cache line,
+ * the chip FIFOs (headers & storage) are embedded right after it & cold config goes last. The RX staging ring gets its
+ * own cache lines as its producer usually runs on a different CPU than the driver. Every vdev is cache-line aligned so
+ * that ports used from different CPUs don't false-share. The comments with sizes assume x86_64 without lock debugging.
  */
 struct serial8250_16550A_vdev {
-    //Port properties
-    u8			line;
-    u16			iobase;
-    u8			irq;
-    unsigned int         baud;
-
-    //The 8250 driver port structure - it will be populated as soon as 8250 gives us the real pointer
-    struct uart_port *up;
-
-    //Chip emulated FIFOs
-    struct kfifo *tx_fifo; //character to be sent (aka what we've got from the OS)
-    struct kfifo *rx_fifo; //characters received (aka what we want the OS to get from us)
-
-    //Chip registries (they're considered volatile but there's a spinlock protecting them)
+    //Chip registries (they're considered volatile but there's a spinlock protecting them) [14 bytes]
     u8 rhr; //Receiver Holding Register (characters received)
     u8 thr; //Transmitter Holding Register (characters REQUESTED to be sent, TSR will contain these to be TRANSMITTED)
     u8 ier; //Interrupt Enable Register
@@ -56,18 +62,104 @@ struct serial8250_16550A_vdev {
     u8 dll; //Divisor Lat Least significant byte (not really used but holds values written to it)
     u8 dlm; //Divisor Lat Most significant byte (not really used but holds values written to it; also called DLH)
     u8 psd; //Prescaler Division (not really used but holds values written to it)
+    u8 efr; //Enhanced Feature Register (16C950 only; accessible when LCR=0xBF, not really used but holds values)
 
-    //Some operations (e.g. FIFO access) must be locked
+    //Some operations (e.g. FIFO access) must be locked [2 + 4 + 4 + 4 + 8 bytes]
     bool initialized:1;
     bool registered:1; //whether the vdev is actually registered with 8250 subsystem
-    spinlock_t *lock;
+    bool bulk_tx:1; //whether TX data should be pulled directly from the driver's circular buffer (see vuart_set_bulk_tx())
+    u8 line;
+    unsigned int fifo_len; //cached from chip model as it's used on every character
+    seqcount_t reg_seq; //changes on every lock_vuart()/unlock_vuart() pair
+    spinlock_t lock;
     unsigned long lock_flags;
 
+    //The 8250 driver port structure - it will be populated as soon as 8250 gives us the real pointer [8 bytes]
+    struct uart_port *up;
+
+#ifdef VUART_TRACE
+    bool trace_on; //checked on every access; trace is guaranteed to be allocated when it's set
+#endif
+#ifdef VUART_STATS
+    struct vuart_stats __percpu *stats; //see vuart_stats.h; may be NULL if allocation failed
+#endif
+
+    //Chip emulated FIFOs; the storage is sized for the biggest chip but the FIFOs are set to the model's depth
+    struct kfifo tx_fifo ____cacheline_aligned_in_smp; //character to be sent (aka what we've got from the OS)
+    struct kfifo rx_fifo; //characters received (aka what we want the OS to get from us)
+    unsigned char tx_fifo_buf[VUART_FIFO_MAX_LEN];
+    unsigned char rx_fifo_buf[VUART_FIFO_MAX_LEN];
+
+    //Port properties
+    u16			iobase;
+    u8			irq;
+    unsigned int         baud;
+    vuart_chip_model     chip;
+
+    //TX idle detection (see vuart_set_tx_idle_timeout()); disabled when tx_idle_chars is 0
+    unsigned int tx_idle_chars; //inter-character gap, in character-times, after which the TX FIFO is flushed as IDLE
+    struct hrtimer tx_idle_timer; //armed when the TX FIFO stops being empty
+    s64 tx_last_ns; //when the last char was written to THR; the timer pushes its expiry out based on it
+
+    //Lazy activation (see vuart_add_device_lazy()); these aren't bitfields as they're protected by different locks
+    bool lazy; //whether open/close of the port by the driver should be tracked (vdev lock)
+    bool port_open; //whether the driver has the port started up, as seen on the registers level (vdev lock)
+    bool active; //whether vIRQ & the open callback were brought up for the open port (activation_lock)
+    vuart_open_callback_t *open_cb;
+    struct work_struct open_work; //(de)activates the port in a process context after port_open changes
+
+#ifdef VUART_STATS
+    struct dentry *stats_dir;
+    s64 tx_first_ns; //when the first byte landed in an empty TX FIFO (0 = FIFO empty/not measured)
+#endif
+
+#ifdef VUART_TRACE
+    struct vuart_trace *trace; //see vuart_trace.h; allocated on first enable
+#endif
+
 #ifndef VUART_USE_TIMER_FALLBACK
     //We emulate (i.e. self-trigger) interrupts on threads
-    struct task_struct *virq_thread; //where fake interrupt code is executed
-    wait_queue_head_t *virq_queue; //wait queue used to put thread to sleep
+    struct task_struct *virq_thread; //where fake interrupt code is executed (shared by all ports on the same IRQ)
+    wait_queue_head_t *virq_queue; //wait queue used to put thread to sleep (owned by the IRQ line, never freed)
+
+    //Interrupt moderation (see vuart_set_irq_coalescing()); coalescing is disabled when virq_coalesce_bytes is 0
+    unsigned int virq_coalesce_bytes; //how many bytes should pass before the vIRQ fires
+    unsigned int virq_coalesce_usecs; //max time a pending interrupt can wait for the bytes threshold
+    unsigned int virq_pending_bytes; //bytes which passed through the chip since the last vIRQ run
+    bool virq_timer_fired:1; //max latency timer expired since the last vIRQ run
+    struct hrtimer virq_coalesce_timer;
+#endif
+
+    //Lock-free SPSC staging area in front of rx_fifo (see vuart_inject_rx())
+    DECLARE_KFIFO(rx_ring, unsigned char, VUART_RX_RING_LEN) ____cacheline_aligned_in_smp;
+} ____cacheline_aligned_in_smp;
+
+//Whether there's data staged in the RX ring which can be moved to the chip's RX FIFO now
+//Data is held in the ring while the driver isn't listening (RDI disabled), i.e. before the port is registered & opened
+// or after it was closed. Otherwise FIFO clearing done by the driver on registration & startup would silently drop it.
+#define vuart_rx_ring_pending(vdev) \
+    (((vdev)->ier & UART_IER_RDI) && !kfifo_is_empty(&(vdev)->rx_ring) && !kfifo_is_full(&(vdev)->rx_fifo))
+
+/**
+ * Returns the vdev backing a given line; the caller must validate the line first (see validate_isa_line())
+ */
+struct serial8250_16550A_vdev *vuart_get_vdev(int line);
+
+/**
+ * Moves data staged by vuart_inject_rx() into the chip's RX FIFO and recomputes interrupts (takes vdev lock)
+ */
+void vuart_refill_rx(struct serial8250_16550A_vdev *vdev);
+
+#ifndef VUART_USE_TIMER_FALLBACK
+/**
+ * Moves all data pending in the 8250 driver's circular TX buffer straight to the TX callback (bulk TX fast path)
+ *
+ * This should be called from the vIRQ context right before the driver's interrupt handler. It's a noop if bulk mode is
+ * disabled or when there's nothing to do (the driver will then process the interrupt as usual).
+ *
+ * @return number of bytes transferred
+ */
+unsigned int vuart_bulk_tx(struct serial8250_16550A_vdev *vdev);
 #endif
-};
 
 #endif //REDPILL_VUART_INTERNAL_H
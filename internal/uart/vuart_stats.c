@@ -0,0 +1,209 @@
+/**
+ * Always-on counters for vUART exposed in debugfs
+ *
+ * Each vUART gets a <debugfs>/redpill/vuart/ttyS#/stats file which sums per-CPU counters at read time and prints them
+ * in a "name value" format (easy to parse & diff). Writing anything to the file resets the counters.
+ *
+ * These are meant to answer questions like "how many register accesses does a byte cost?" or "did the coalescing
+ * actually help?" in a production-like environment where VUART_DEBUG_LOG cannot be used.
+ */
+#include "vuart_stats.h"
+
+#ifdef VUART_STATS
+#include "vuart_internal.h"
+#include "../../common.h"
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/log2.h> //fls64()
+
+#define VUART_DEBUGFS_DIR "vuart"
+#define VUART_DEBUGFS_PORT_FMT "ttyS%d"
+
+static struct dentry *vuart_dir = NULL;
+static unsigned int vuart_dir_users = 0; //protected by being called from add/remove device only (not concurrent)
+
+static const char *reg_names[VUART_STATS_REGS] = { "rx_tx", "ier", "iir_fcr", "lcr", "mcr", "lsr", "msr", "scr" };
+static const char *flush_names[VUART_STATS_FLUSH_REASONS] = { "threshold", "idle", "full" };
+
+void vuart_stat_flush_latency(struct serial8250_16550A_vdev *vdev)
+{
+    if (unlikely(!vdev->stats) || !vdev->tx_first_ns)
+        return;
+
+    s64 delta = vuart_stat_now_ns() - vdev->tx_first_ns;
+    unsigned int bucket = (delta > 0) ? fls64(delta) : 0;
+    if (bucket >= VUART_STATS_LAT_BUCKETS)
+        bucket = VUART_STATS_LAT_BUCKETS - 1;
+
+    this_cpu_inc(vdev->stats->flush_latency[bucket]);
+    vdev->tx_first_ns = 0;
+}
+
+//Sums a given field across all CPUs
+#define sum_stat(out, stats, field) \
+    do { (out) = 0; for_each_possible_cpu(cpu) { (out) += per_cpu_ptr(stats, cpu)->field; } } while(0)
+
+void vuart_stats_sum_reg_accesses(struct serial8250_16550A_vdev *vdev, u64 *reads, u64 *writes)
+{
+    int cpu;
+    u64 val;
+
+    *reads = 0;
+    *writes = 0;
+    if (unlikely(!vdev->stats))
+        return;
+
+    for (int i = 0; i < VUART_STATS_REGS; ++i) {
+        sum_stat(val, vdev->stats, reg_reads[i]);
+        *reads += val;
+        sum_stat(val, vdev->stats, reg_writes[i]);
+        *writes += val;
+    }
+}
+
+static int stats_show(struct seq_file *m, void *v)
+{
+    struct serial8250_16550A_vdev *vdev = m->private;
+    struct vuart_stats __percpu *stats = vdev->stats;
+    int cpu;
+    u64 val;
+
+    if (unlikely(!stats))
+        return -ENODEV;
+
+    for (int i = 0; i < VUART_STATS_REGS; ++i) {
+        sum_stat(val, stats, reg_reads[i]);
+        seq_printf(m, "reg_read_%s %llu\n", reg_names[i], val);
+    }
+    for (int i = 0; i < VUART_STATS_REGS; ++i) {
+        sum_stat(val, stats, reg_writes[i]);
+        seq_printf(m, "reg_write_%s %llu\n", reg_names[i], val);
+    }
+
+    sum_stat(val, stats, iir_polls);
+    seq_printf(m, "iir_polls %llu\n", val);
+    sum_stat(val, stats, virq_wakeups);
+    seq_printf(m, "virq_wakeups %llu\n", val);
+    sum_stat(val, stats, virq_handler_calls);
+    seq_printf(m, "virq_handler_calls %llu\n", val);
+
+    for (int i = 0; i < VUART_STATS_FLUSH_REASONS; ++i) {
+        sum_stat(val, stats, tx_flushes[i]);
+        seq_printf(m, "tx_flush_%s %llu\n", flush_names[i], val);
+    }
+
+    sum_stat(val, stats, tx_bytes);
+    seq_printf(m, "tx_bytes %llu\n", val);
+    sum_stat(val, stats, rx_bytes);
+    seq_printf(m, "rx_bytes %llu\n", val);
+    sum_stat(val, stats, tx_overruns);
+    seq_printf(m, "tx_overruns %llu\n", val);
+    sum_stat(val, stats, rx_overruns);
+    seq_printf(m, "rx_overruns %llu\n", val);
+
+    //Bucket N contains latencies in [2^(N-1), 2^N) ns
+    for (int i = 0; i < VUART_STATS_LAT_BUCKETS; ++i) {
+        sum_stat(val, stats, flush_latency[i]);
+        if (val)
+            seq_printf(m, "flush_latency_lt_2^%d_ns %llu\n", i, val);
+    }
+
+    return 0;
+}
+
+static int stats_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, stats_show, inode->i_private);
+}
+
+static ssize_t stats_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+    struct serial8250_16550A_vdev *vdev = ((struct seq_file *)file->private_data)->private;
+    int cpu;
+
+    if (likely(vdev->stats)) {
+        for_each_possible_cpu(cpu)
+            memset(per_cpu_ptr(vdev->stats, cpu), 0, sizeof(struct vuart_stats));
+    }
+
+    return count;
+}
+
+static const struct file_operations stats_fops = {
+    .owner = THIS_MODULE,
+    .open = stats_open,
+    .read = seq_read,
+    .write = stats_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+void vuart_stats_register(struct serial8250_16550A_vdev *vdev)
+{
+    if (unlikely(vdev->stats)) {
+        pr_loc_bug("Stats for ttyS%d are already registered", vdev->line);
+        return;
+    }
+
+    vdev->stats = alloc_percpu(struct vuart_stats);
+    if (unlikely(!vdev->stats)) {
+        pr_loc_err("alloc_percpu failed for ttyS%d stats - they will not be available", vdev->line);
+        return;
+    }
+    vdev->tx_first_ns = 0;
+
+    if (!vuart_dir) {
+        struct dentry *root = get_debugfs_root();
+        if (IS_ERR(root))
+            return; //we still collect stats - it's cheap and keeps the hot path branch-free
+
+        vuart_dir = debugfs_create_dir(VUART_DEBUGFS_DIR, root);
+        if (IS_ERR_OR_NULL(vuart_dir)) {
+            pr_loc_err("Failed to create debugfs dir for vUART stats");
+            vuart_dir = NULL;
+            put_debugfs_root();
+            return;
+        }
+    }
+
+    char name[8];
+    snprintf(name, sizeof(name), VUART_DEBUGFS_PORT_FMT, vdev->line);
+    vdev->stats_dir = debugfs_create_dir(name, vuart_dir);
+    if (IS_ERR_OR_NULL(vdev->stats_dir)) {
+        pr_loc_err("Failed to create debugfs dir for ttyS%d stats", vdev->line);
+        vdev->stats_dir = NULL;
+        goto out_put_dir;
+    }
+    ++vuart_dir_users;
+
+    debugfs_create_file("stats", 0600, vdev->stats_dir, vdev, &stats_fops);
+    pr_loc_dbg("Registered vUART stats for ttyS%d", vdev->line);
+    return;
+
+    out_put_dir:
+    if (!vuart_dir_users) { //we just created it for this port
+        debugfs_remove_recursive(vuart_dir);
+        vuart_dir = NULL;
+        put_debugfs_root();
+    }
+}
+
+void vuart_stats_unregister(struct serial8250_16550A_vdev *vdev)
+{
+    if (vdev->stats_dir) {
+        debugfs_remove_recursive(vdev->stats_dir);
+        vdev->stats_dir = NULL;
+
+        if (--vuart_dir_users == 0) {
+            debugfs_remove_recursive(vuart_dir);
+            vuart_dir = NULL;
+            put_debugfs_root();
+        }
+    }
+
+    if (vdev->stats) {
+        free_percpu(vdev->stats);
+        vdev->stats = NULL;
+    }
+}
+#endif //VUART_STATS
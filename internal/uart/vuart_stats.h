@@ -0,0 +1,78 @@
+#ifndef REDPILL_VUART_STATS_H
+#define REDPILL_VUART_STATS_H
+
+#include "../debugfs_root.h" //RP_DEBUGFS_ENABLED
+
+//Stats are only collected when they can be read (which depends on stealth mode); define it manually to force disable
+#if defined(RP_DEBUGFS_ENABLED) && !defined(VUART_NO_STATS)
+#define VUART_STATS
+#endif
+
+#define VUART_STATS_REGS 8 //number of register offsets in 8250 (UART_RX...UART_SCR)
+#define VUART_STATS_FLUSH_REASONS 3 //see vuart_flush_reason
+#define VUART_STATS_LAT_BUCKETS 32 //log2 buckets of nanoseconds (last one is catch-all: >=2^31ns, ~2s)
+
+struct serial8250_16550A_vdev;
+
+#ifdef VUART_STATS
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+
+/**
+ * Per-CPU counters for a single vUART
+ *
+ * They're always-on (when compiled in) so they MUST be cheap: every increment is a single this_cpu_* op without any
+ * locking. All values are summed across CPUs when read.
+ */
+struct vuart_stats {
+    u64 reg_reads[VUART_STATS_REGS];
+    u64 reg_writes[VUART_STATS_REGS];
+    u64 iir_polls; //subset of reads of UART_IIR which returned no pending interrupts
+    u64 virq_wakeups; //how many times the vIRQ thread was actually woken up (coalesced wake-ups count once)
+    u64 virq_handler_calls; //how many times the 8250 interrupt handler was actually called
+    u64 tx_flushes[VUART_STATS_FLUSH_REASONS];
+    u64 tx_bytes;
+    u64 rx_bytes;
+    u64 rx_overruns;
+    u64 tx_overruns;
+    u64 flush_latency[VUART_STATS_LAT_BUCKETS]; //from first byte landing in empty TX FIFO to callback delivery
+};
+
+#define vuart_stat_inc(vdev, field) \
+    do { if (likely((vdev)->stats)) { this_cpu_inc((vdev)->stats->field); } } while(0)
+#define vuart_stat_add(vdev, field, val) \
+    do { if (likely((vdev)->stats)) { this_cpu_add((vdev)->stats->field, (val)); } } while(0)
+#define vuart_stat_now_ns() ktime_to_ns(ktime_get())
+
+/**
+ * Records latency of a TX flush (time since tx_first_ns)
+ */
+void vuart_stat_flush_latency(struct serial8250_16550A_vdev *vdev);
+
+/**
+ * Sums register reads & writes across all CPUs
+ */
+void vuart_stats_sum_reg_accesses(struct serial8250_16550A_vdev *vdev, u64 *reads, u64 *writes);
+
+/**
+ * Allocates stats for a vdev and exposes them in debugfs
+ *
+ * Failure here is never fatal for the vUART - there will just be no stats.
+ */
+void vuart_stats_register(struct serial8250_16550A_vdev *vdev);
+
+/**
+ * Reverses vuart_stats_register()
+ */
+void vuart_stats_unregister(struct serial8250_16550A_vdev *vdev);
+
+#else //VUART_STATS
+#define vuart_stat_inc(vdev, field) //noop
+#define vuart_stat_add(vdev, field, val) //noop
+#define vuart_stat_now_ns() 0
+#define vuart_stat_flush_latency(vdev) //noop
+#define vuart_stats_register(vdev) //noop
+#define vuart_stats_unregister(vdev) //noop
+#endif //VUART_STATS
+
+#endif //REDPILL_VUART_STATS_H
@@ -0,0 +1,329 @@
+/**
+ * Record & replay of vUART sessions
+ *
+ * When capture is enabled every register access done by the 8250 driver and every byte passed to vuart_inject_rx() is
+ * appended to a per-port ring as a compact 8-byte record (see vuart_trace.h for the format). The ring is exposed as
+ * <debugfs>/redpill/vuart/ttyS#/trace:
+ *  - echo 1 > trace: (re)starts the capture with an empty ring
+ *  - echo 0 > trace: stops the capture (what was recorded stays in the ring)
+ *  - cat trace > file: drains the ring; the header (with a number of dropped records) is emitted at the file start
+ * When the ring is full new records are dropped (and counted) so that the beginning of a session (usually the most
+ * interesting part, e.g. a boot) is preserved.
+ *
+ * The trace can be fed back into a vUART with vuart_trace_replay(), either in-kernel (see bench/vuart_bench.c) or in
+ * userspace (see host/emu_replay.c), to reproduce real-world traffic patterns deterministically and without hardware.
+ */
+#include "vuart_trace.h"
+#include "vuart_internal.h"
+#include "../../common.h"
+#include "../../config/uart_defs.h" //SERIAL8250_LAST_ISA_LINE
+#include <linux/serial_core.h> //struct uart_port
+#include <linux/ktime.h>
+
+#define REPLAY_RX_CHUNK 256 //max bytes passed to vuart_inject_rx() at once (can be lower if the trace says so)
+
+static __always_inline int replay_flush_rx(int line, const char *buffer, unsigned int *len,
+                                           struct vuart_replay_result *res)
+{
+    if (!*len)
+        return 0;
+
+    int out = vuart_inject_rx(line, buffer, *len);
+    res->rx_bytes += *len;
+    *len = 0;
+
+    return out < 0 ? out : 0;
+}
+
+int vuart_trace_replay(int line, const void *trace, size_t len, struct vuart_replay_result *result)
+{
+    validate_isa_line(line);
+
+    const struct vuart_trace_hdr *hdr = trace;
+    if (unlikely(len < sizeof(*hdr) || hdr->magic != VUART_TRACE_MAGIC || hdr->version != VUART_TRACE_VERSION ||
+                 (len - sizeof(*hdr)) % sizeof(struct vuart_trace_rec) != 0)) {
+        pr_loc_err("Invalid vUART trace (len=%zu)", len);
+        return -EINVAL;
+    }
+
+    struct serial8250_16550A_vdev *vdev = vuart_get_vdev(line);
+    if (unlikely(!vdev->initialized || !vdev->up)) {
+        pr_loc_err("Cannot replay on ttyS%d - the port is not added or not used by the 8250 driver yet", line);
+        return -ENXIO;
+    }
+
+    struct uart_port *port = vdev->up;
+    const struct vuart_trace_rec *rec = (const void *)(hdr + 1);
+    size_t recs_num = (len - sizeof(*hdr)) / sizeof(*rec);
+    struct vuart_replay_result res = { 0 };
+    char rx_buf[REPLAY_RX_CHUNK];
+    unsigned int rx_len = 0;
+    int out = 0;
+
+    pr_loc_dbg("Replaying %zu records recorded on ttyS%u (%u dropped) on ttyS%d", recs_num, hdr->line, hdr->dropped,
+               line);
+
+    s64 start = ktime_to_ns(ktime_get());
+    for (size_t i = 0; i < recs_num; ++i, ++rec) {
+        //RX bytes are grouped back into the calls they were recorded with; anything else ends the group
+        if (rec->type != VUART_TR_RX_CONT || rx_len == REPLAY_RX_CHUNK) {
+            if ((out = replay_flush_rx(line, rx_buf, &rx_len, &res)) != 0)
+                break;
+        }
+
+        switch (rec->type) {
+            case VUART_TR_READ:
+                if ((u8)port->serial_in(port, rec->offset) != rec->value)
+                    ++res.read_mismatches;
+                ++res.reads;
+                break;
+            case VUART_TR_WRITE:
+                port->serial_out(port, rec->offset, rec->value);
+                ++res.writes;
+                break;
+            case VUART_TR_RX_START:
+            case VUART_TR_RX_CONT:
+                rx_buf[rx_len++] = rec->value;
+                break;
+            default:
+                pr_loc_err("Invalid record type %u at record #%zu", rec->type, i);
+                out = -EINVAL;
+                break;
+        }
+
+        if (unlikely(out != 0))
+            break;
+        ++res.records;
+    }
+
+    if (out == 0)
+        out = replay_flush_rx(line, rx_buf, &rx_len, &res);
+    res.total_ns = ktime_to_ns(ktime_get()) - start;
+
+    pr_loc_dbg("Replayed %llu records on ttyS%d in %llu ns (%llu read mismatches)", res.records, line, res.total_ns,
+               res.read_mismatches);
+    if (result)
+        *result = res;
+
+    return out;
+}
+
+#ifdef VUART_TRACE
+#include <linux/debugfs.h>
+#include <linux/fs.h>
+#include <linux/kfifo.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h> //copy_to_user
+#include <linux/vmalloc.h>
+
+#define VUART_TRACE_LEN 65536 //records per port (512KiB); must be a power of 2
+#define TRACE_READ_CHUNK (PAGE_SIZE / sizeof(struct vuart_trace_rec)) //records copied to userspace at once
+
+struct vuart_trace {
+    spinlock_t lock; //records come from any context (incl. lockless reads with IRQs enabled)
+    DECLARE_KFIFO_PTR(ring, struct vuart_trace_rec);
+    s64 last_ns;
+    u32 dropped;
+};
+
+static DEFINE_MUTEX(trace_ctl_lock); //serializes enable/disable & allocation of rings
+
+//Must be called with trace->lock held
+static __always_inline void trace_put(struct vuart_trace *trace, s64 now, u8 type, u8 offset, u8 value)
+{
+    s64 delta = trace->last_ns ? now - trace->last_ns : 0;
+    struct vuart_trace_rec rec = {
+        .delta_ns = (delta > U32_MAX) ? U32_MAX : ((delta < 0) ? 0 : delta),
+        .type = type,
+        .offset = offset,
+        .value = value,
+        .reserved = 0,
+    };
+
+    trace->last_ns = now;
+    if (unlikely(!kfifo_in(&trace->ring, &rec, 1)))
+        ++trace->dropped;
+}
+
+void vuart_trace_record(struct serial8250_16550A_vdev *vdev, vuart_trace_type type, int offset, unsigned int value)
+{
+    struct vuart_trace *trace = vdev->trace;
+    unsigned long flags;
+
+    spin_lock_irqsave(&trace->lock, flags);
+    trace_put(trace, ktime_to_ns(ktime_get()), type, offset, value);
+    spin_unlock_irqrestore(&trace->lock, flags);
+}
+
+void vuart_trace_record_rx(struct serial8250_16550A_vdev *vdev, const char *buffer, int length)
+{
+    struct vuart_trace *trace = vdev->trace;
+    unsigned long flags;
+
+    if (length <= 0)
+        return;
+
+    spin_lock_irqsave(&trace->lock, flags);
+    s64 now = ktime_to_ns(ktime_get());
+    for (int i = 0; i < length; ++i)
+        trace_put(trace, now, i ? VUART_TR_RX_CONT : VUART_TR_RX_START, 0, buffer[i]);
+    spin_unlock_irqrestore(&trace->lock, flags);
+}
+
+static struct vuart_trace *alloc_trace(void)
+{
+    struct vuart_trace *trace = kzalloc(sizeof(struct vuart_trace), GFP_KERNEL);
+    void *ring = vmalloc(VUART_TRACE_LEN * sizeof(struct vuart_trace_rec));
+    if (unlikely(!trace || !ring)) {
+        kfree(trace);
+        vfree(ring);
+        return NULL;
+    }
+
+    spin_lock_init(&trace->lock);
+    kfifo_init(&trace->ring, ring, VUART_TRACE_LEN * sizeof(struct vuart_trace_rec));
+
+    return trace;
+}
+
+static void free_trace(struct vuart_trace *trace)
+{
+    vfree(trace->ring.kfifo.data); //initialized with kfifo_init() so kfifo_free() cannot be used
+    kfree(trace);
+}
+
+static ssize_t trace_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
+{
+    struct serial8250_16550A_vdev *vdev = file->private_data;
+    struct vuart_trace *trace = vdev->trace;
+    unsigned long flags;
+    size_t copied = 0;
+
+    if (!trace)
+        return 0; //capture was never enabled
+
+    //The header goes first so that "cat trace > file" produces a complete, self-describing trace
+    if (*ppos == 0) {
+        struct vuart_trace_hdr hdr = {
+            .magic = VUART_TRACE_MAGIC,
+            .version = VUART_TRACE_VERSION,
+            .line = vdev->line,
+            .chip = vdev->chip,
+            .reserved = 0,
+        };
+        if (count < sizeof(hdr))
+            return -EINVAL;
+
+        spin_lock_irqsave(&trace->lock, flags);
+        hdr.dropped = trace->dropped;
+        spin_unlock_irqrestore(&trace->lock, flags);
+
+        if (copy_to_user(buf, &hdr, sizeof(hdr)))
+            return -EFAULT;
+        copied = sizeof(hdr);
+    }
+
+    //Records cannot be copied to userspace directly under the spinlock (it may fault) - they go through a bounce buffer
+    struct vuart_trace_rec *chunk = kmalloc(TRACE_READ_CHUNK * sizeof(struct vuart_trace_rec), GFP_KERNEL);
+    if (unlikely(!chunk)) {
+        pr_loc_crt("kmalloc failed");
+        return copied ? copied : -ENOMEM;
+    }
+
+    while (count - copied >= sizeof(struct vuart_trace_rec)) {
+        unsigned int want = min_t(size_t, TRACE_READ_CHUNK, (count - copied) / sizeof(struct vuart_trace_rec));
+
+        spin_lock_irqsave(&trace->lock, flags);
+        unsigned int got = kfifo_out(&trace->ring, chunk, want);
+        spin_unlock_irqrestore(&trace->lock, flags);
+
+        if (!got)
+            break;
+
+        if (copy_to_user(buf + copied, chunk, got * sizeof(struct vuart_trace_rec))) {
+            kfree(chunk);
+            return -EFAULT;
+        }
+        copied += got * sizeof(struct vuart_trace_rec);
+    }
+
+    kfree(chunk);
+    *ppos += copied;
+    return copied;
+}
+
+static ssize_t trace_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+    struct serial8250_16550A_vdev *vdev = file->private_data;
+    unsigned int enable;
+    unsigned long flags;
+    int out;
+
+    if ((out = kstrtouint_from_user(buf, count, 0, &enable)) != 0)
+        return out;
+
+    mutex_lock(&trace_ctl_lock);
+    if (!enable) {
+        ACCESS_ONCE(vdev->trace_on) = false;
+        pr_loc_dbg("Stopped vUART trace capture on ttyS%d", vdev->line);
+        goto out_unlock;
+    }
+
+    if (!vdev->trace) {
+        struct vuart_trace *trace = alloc_trace();
+        if (unlikely(!trace)) {
+            pr_loc_crt("Failed to allocate vUART trace ring for ttyS%d", vdev->line);
+            out = -ENOMEM;
+            goto out_unlock;
+        }
+
+        vdev->trace = trace;
+        smp_wmb(); //trace_on must never be observed before the ring
+    }
+
+    spin_lock_irqsave(&vdev->trace->lock, flags);
+    kfifo_reset(&vdev->trace->ring);
+    vdev->trace->last_ns = 0;
+    vdev->trace->dropped = 0;
+    spin_unlock_irqrestore(&vdev->trace->lock, flags);
+
+    ACCESS_ONCE(vdev->trace_on) = true;
+    pr_loc_dbg("Started vUART trace capture on ttyS%d", vdev->line);
+
+    out_unlock:
+    mutex_unlock(&trace_ctl_lock);
+    return out ? out : count;
+}
+
+static const struct file_operations trace_fops = {
+    .owner = THIS_MODULE,
+    .open = simple_open,
+    .read = trace_read,
+    .write = trace_write,
+    .llseek = no_llseek,
+};
+
+void vuart_trace_register(struct serial8250_16550A_vdev *vdev)
+{
+    vdev->trace = NULL;
+    vdev->trace_on = false;
+
+    if (!vdev->stats_dir)
+        return; //no debugfs => nobody can enable the capture
+
+    debugfs_create_file("trace", 0600, vdev->stats_dir, vdev, &trace_fops);
+    pr_loc_dbg("Registered vUART trace for ttyS%d", vdev->line);
+}
+
+void vuart_trace_unregister(struct serial8250_16550A_vdev *vdev)
+{
+    mutex_lock(&trace_ctl_lock);
+    vdev->trace_on = false;
+    if (vdev->trace) {
+        free_trace(vdev->trace);
+        vdev->trace = NULL;
+    }
+    mutex_unlock(&trace_ctl_lock);
+}
+#endif //VUART_TRACE
@@ -0,0 +1,115 @@
+#ifndef REDPILL_VUART_TRACE_H
+#define REDPILL_VUART_TRACE_H
+
+#include "vuart_stats.h" //VUART_STATS
+#include <linux/types.h>
+
+//Capture lives next to the stats in debugfs (it uses the same per-port dir); define it manually to force disable
+#if defined(VUART_STATS) && !defined(VUART_NO_TRACE)
+#define VUART_TRACE
+#endif
+
+/**
+ * Binary trace format: a header followed by a stream of fixed-size records (all little-endian, as the hosts are x86)
+ *
+ * Each record is one register access done by the 8250 driver or one byte passed to vuart_inject_rx(). Injected bytes
+ * are recorded as a VUART_TR_RX_START followed by VUART_TR_RX_CONT for every next byte of the same call, so that a
+ * replay can reproduce the same vuart_inject_rx() calls (and not just the same bytes).
+ */
+#define VUART_TRACE_MAGIC 0x54565052 //"RPVT"
+#define VUART_TRACE_VERSION 1
+
+typedef enum {
+    VUART_TR_READ = 0, //register read; value is what the driver got
+    VUART_TR_WRITE = 1, //register write; value is what the driver wrote
+    VUART_TR_RX_START = 2, //first byte of a vuart_inject_rx() call
+    VUART_TR_RX_CONT = 3, //every next byte of the same call
+} vuart_trace_type;
+
+struct vuart_trace_hdr {
+    u32 magic;
+    u16 version;
+    u8 line; //ttyS# the trace was recorded on (informational - replay can target any line)
+    u8 chip; //vuart_chip_model of the recorded port
+    u32 dropped; //records lost because the ring was full
+    u32 reserved;
+} __packed;
+
+struct vuart_trace_rec {
+    u32 delta_ns; //time since the previous record; saturates at U32_MAX (~4.3s)
+    u8 type; //vuart_trace_type
+    u8 offset; //register offset (UART_RX...UART_SCR); 0 for RX records
+    u8 value;
+    u8 reserved;
+} __packed;
+
+/**
+ * Summary of a vuart_trace_replay() run
+ */
+struct vuart_replay_result {
+    u64 records; //records replayed
+    u64 reads;
+    u64 writes;
+    u64 rx_bytes; //bytes passed to vuart_inject_rx() (some may have been rejected by a full ring)
+    u64 read_mismatches; //reads which returned a different value than recorded
+    u64 total_ns;
+};
+
+/**
+ * Feeds a trace back into a vUART as fast as possible (timing in the trace is ignored)
+ *
+ * Register accesses are done through the same uart_port ops the 8250 driver uses, so the replay exercises the exact
+ * emulation code paths of the recorded session. The port must be added (vuart_add_device()) and registered with the
+ * 8250 driver already. Read mismatches are not an error: timing-dependent bits (e.g. THRE with a TX callback, vIRQ
+ * racing with us) can legitimately differ - a high count usually means the port was configured differently.
+ *
+ * This doesn't depend on debugfs and is available in every build (incl. the userspace one in host/).
+ *
+ * @param line ttyS# to replay on; it doesn't need to match the line the trace was recorded on
+ * @param trace Header followed by records, as read from the debugfs "trace" file
+ * @param len Length of the trace in bytes
+ * @param result Optional (may be NULL)
+ *
+ * @return 0 on success or -E on error (-EINVAL for a malformed trace)
+ */
+int vuart_trace_replay(int line, const void *trace, size_t len, struct vuart_replay_result *result);
+
+struct serial8250_16550A_vdev;
+
+#ifdef VUART_TRACE
+/**
+ * Per-port capture ring; allocated on first enable and kept until the port is removed (see vuart_trace.c)
+ */
+struct vuart_trace;
+
+void vuart_trace_record(struct serial8250_16550A_vdev *vdev, vuart_trace_type type, int offset, unsigned int value);
+
+/**
+ * Records an injection of a buffer (one record per byte)
+ */
+void vuart_trace_record_rx(struct serial8250_16550A_vdev *vdev, const char *buffer, int length);
+
+//Capture is off by default: the hot path pays a single predictable branch until someone enables it in debugfs
+#define vuart_trace_reg(vdev, type, offset, value) \
+    do { if (unlikely((vdev)->trace_on)) { vuart_trace_record((vdev), (type), (offset), (value)); } } while(0)
+#define vuart_trace_rx(vdev, buffer, length) \
+    do { if (unlikely((vdev)->trace_on)) { vuart_trace_record_rx((vdev), (buffer), (length)); } } while(0)
+
+/**
+ * Creates the "trace" file in the port's debugfs dir; must be called after vuart_stats_register()
+ */
+void vuart_trace_register(struct serial8250_16550A_vdev *vdev);
+
+/**
+ * Stops the capture and frees the ring; only safe after the port was restored (=8250 will not call us anymore)
+ */
+void vuart_trace_unregister(struct serial8250_16550A_vdev *vdev);
+
+#else //VUART_TRACE
+#define vuart_trace_reg(vdev, type, offset, value) //noop
+#define vuart_trace_rx(vdev, buffer, length) //noop
+#define vuart_trace_register(vdev) //noop
+#define vuart_trace_unregister(vdev) //noop
+#endif //VUART_TRACE
+
+#endif //REDPILL_VUART_TRACE_H
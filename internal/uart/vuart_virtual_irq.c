@@ -4,16 +4,146 @@
 #include "vuart_internal.h"
 #include "../../common.h"
 #include "../../debug/debug_vuart.h"
+#include "../../config/uart_defs.h" //SERIAL8250_LAST_ISA_LINE
+#include "../thread_placement.h" //place_thread()
 #include <linux/serial_reg.h> //UART_* consts
 #include <linux/kthread.h> //running vIRQ thread
 #include <linux/wait.h> //wait queue handling (init_waitqueue_head etc.)
 #include <linux/serial_8250.h> //serial8250_handle_irq
+#include <linux/mutex.h> //lines_lock
 
-//Default name of the thread for vIRQ
+//Default name of the thread for vIRQ (it gets the IRQ# as the only param since a single thread serves the whole line)
 #ifndef VUART_THREAD_FMT
-#define VUART_THREAD_FMT "vuart/%d-ttyS%d"
+#define VUART_THREAD_FMT "vuart/%d"
 #endif
 
+//Max number of distinct IRQs used by vUARTs; every port can in theory have its own IRQ
+#define VIRQ_MAX_LINES (SERIAL8250_LAST_ISA_LINE+1)
+
+//Whether the vIRQ thread has anything to do; it is evaluated every time the thread is woken up
+#define virq_should_run(vdev) \
+    (!((vdev)->iir & UART_IIR_NO_INT) && \
+     (!vuart_virq_coalescing(vdev) || (vdev)->virq_timer_fired || \
+      (vdev)->virq_pending_bytes >= (vdev)->virq_coalesce_bytes))
+
+/**
+ * Called when the max latency of coalesced interrupt expired
+ */
+static enum hrtimer_restart virq_coalesce_timer_cb(struct hrtimer *timer)
+{
+    struct serial8250_16550A_vdev *vdev = container_of(timer, struct serial8250_16550A_vdev, virq_coalesce_timer);
+    vdev->virq_timer_fired = true;
+    if (likely(vuart_virq_active(vdev)))
+        vuart_virq_do_wake_up(vdev);
+
+    return HRTIMER_NORESTART;
+}
+
+/**
+ * A single virtual IRQ line shared by one or more vUARTs (e.g. COM1 & COM3 both use IRQ 4)
+ *
+ * Just like a real shared ISA IRQ handler (see serial8250_interrupt()) a single thread services all ports on the line
+ * in one pass. All vdevs on the line point their virq_queue to the line's queue so that waking up any port wakes up
+ * the line dispatcher.
+ */
+struct virq_line {
+    int irq; //-1 if the slot is unused
+    struct task_struct *thread;
+    wait_queue_head_t queue;
+    spinlock_t ports_lock; //protects ports[] and is held while servicing them (like irq_info lock in 8250)
+    struct serial8250_16550A_vdev *ports[VIRQ_MAX_LINES];
+    unsigned int ports_num;
+};
+
+static struct virq_line virq_lines[VIRQ_MAX_LINES];
+static bool virq_lines_initialized = false;
+static DEFINE_MUTEX(lines_lock); //serializes enabling/disabling (=thread start/stop) of lines
+
+static inline void arm_coalesce_timer(struct serial8250_16550A_vdev *vdev)
+{
+    if (!hrtimer_active(&vdev->virq_coalesce_timer))
+        hrtimer_start(&vdev->virq_coalesce_timer, ns_to_ktime((u64)vdev->virq_coalesce_usecs * NSEC_PER_USEC),
+                      HRTIMER_MODE_REL);
+}
+
+void vuart_virq_coalesced_wake_up(struct serial8250_16550A_vdev *vdev)
+{
+    //Below the bytes threshold we only make sure the interrupt will not wait longer than the max latency
+    if (vdev->virq_pending_bytes < vdev->virq_coalesce_bytes) {
+        arm_coalesce_timer(vdev);
+        return;
+    }
+
+    vuart_virq_do_wake_up(vdev);
+}
+
+/**
+ * Resets coalescing state after the interrupt handler run
+ */
+static void reset_coalescing(struct serial8250_16550A_vdev *vdev)
+{
+    if (likely(!vuart_virq_coalescing(vdev)))
+        return;
+
+    //This is deliberately done without vdev lock: vuart_disable_interrupts() stops this thread while holding it. The
+    // worst which can happen is losing a few bytes from the counter which only delays the next vIRQ (up to max latency)
+    vdev->virq_pending_bytes = 0;
+    vdev->virq_timer_fired = false;
+    hrtimer_try_to_cancel(&vdev->virq_coalesce_timer);
+
+    //If the chip still has an interrupt pending (e.g. THRe with more data to send) nothing will wake us up unless the
+    // driver touches the chip again - we need to make sure the interrupt will be delivered after max latency
+    if (!(vdev->iir & UART_IIR_NO_INT))
+        arm_coalesce_timer(vdev);
+}
+
+/**
+ * Checks whether any port on the line needs servicing; it is evaluated every time the line thread is woken up
+ */
+static bool virq_line_should_run(struct virq_line *vline)
+{
+    bool out = false;
+    unsigned long flags;
+
+    spin_lock_irqsave(&vline->ports_lock, flags);
+    for (int i = 0; i < vline->ports_num; ++i) {
+        if (virq_should_run(vline->ports[i]) || vuart_rx_ring_pending(vline->ports[i])) {
+            out = true;
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&vline->ports_lock, flags);
+
+    return out;
+}
+
+/**
+ * Services a single port on the line; this is essentially what a per-port ISR would do
+ */
+static void virq_handle_port(struct serial8250_16550A_vdev *vdev)
+{
+    //Data injected into the RX ring lands in the chip here; this may (and usually will) raise an RDI interrupt
+    if (vuart_rx_ring_pending(vdev))
+        vuart_refill_rx(vdev);
+
+    if (!virq_should_run(vdev))
+        return;
+
+    if (unlikely(!vdev->up)) {
+        pr_loc_bug("Cannot call serial8250 interrupt handler for ttyS%d - port not captured (yet?)", vdev->line);
+        return;
+    }
+
+    //In bulk mode we move the data ourselves and let the driver only do the bookkeeping (e.g. stopping TX)
+    if (vdev->bulk_tx && (vdev->iir & UART_IIR_ID) == UART_IIR_THRI)
+        vuart_bulk_tx(vdev);
+
+    uart_prdbg("Calling serial8250 interrupt handler for ttyS%d", vdev->line);
+    serial8250_handle_irq(vdev->up, vdev->iir);
+    vuart_stat_inc(vdev, virq_handler_calls);
+    reset_coalescing(vdev);
+}
+
 /**
  * Function running on a separate kernel thread responsible for simulating the IRQ call (normally done via hardware
  * interrupt triggering CPU to invoke Linux IRQ subsystem)
@@ -21,7 +151,11 @@
  * There's no sane way to trigger IRQs in the low range used by 8250 UARTs. A pure asm call of "int $4" will result in a
  * crash (yes, we did try first ;)). So instead of hacking around the kernel we simply used the 8250 public interface to
  * trigger interrupt routines and implemented a small IRQ handling subsystem on our own.
- * @param data
+ *
+ * One thread serves all ports sharing a given IRQ. Ports are serviced in a loop until none of them has anything pending
+ * (which mimics how 8250 handles shared IRQs - it also loops over all ports on the line).
+ *
+ * @param data struct virq_line
  * @return
  */
 static int virq_thread(void *data)
@@ -29,13 +163,14 @@ static int virq_thread(void *data)
     allow_signal(SIGKILL);
 
     int out = 0;
-    struct serial8250_16550A_vdev *vdev = data;
+    struct virq_line *vline = data;
+    unsigned long flags;
 
-    uart_prdbg("%s started for ttyS%d pid=%d", __FUNCTION__, vdev->line, current->pid);
+    uart_prdbg("%s started for IRQ%d pid=%d", __FUNCTION__, vline->irq, current->pid);
     while(likely(!kthread_should_stop())) {
-        wait_event_interruptible(*vdev->virq_queue, !(vdev->iir & UART_IIR_NO_INT) || unlikely(kthread_should_stop()));
+        wait_event_interruptible(vline->queue, virq_line_should_run(vline) || unlikely(kthread_should_stop()));
         if (unlikely(signal_pending(current))) {
-            uart_prdbg("%s started for ttyS%d pid=%d received signal", __FUNCTION__, vdev->line, current->pid);
+            uart_prdbg("%s started for IRQ%d pid=%d received signal", __FUNCTION__, vline->irq, current->pid);
             out = -EPIPE;
             break;
         }
@@ -43,110 +178,173 @@ static int virq_thread(void *data)
         if (unlikely(kthread_should_stop()))
             break;
 
-        if (unlikely(!vdev->up)) {
-            pr_loc_bug("Cannot call serial8250 interrupt handler - port not captured (yet?)");
-            continue;
+        //Ports cannot be detached while we're servicing them (see vuart_disable_interrupts())
+        spin_lock_irqsave(&vline->ports_lock, flags);
+        for (int i = 0; i < vline->ports_num; ++i)
+            virq_handle_port(vline->ports[i]);
+        spin_unlock_irqrestore(&vline->ports_lock, flags);
+    }
+    uart_prdbg("%s stopped for IRQ%d pid=%d exit=%d", __FUNCTION__, vline->irq, current->pid, out);
+
+    //If the thread was killed outside of vuart_disable_interrupts() we need to mark all ports as having no vIRQ
+    spin_lock_irqsave(&vline->ports_lock, flags);
+    for (int i = 0; i < vline->ports_num; ++i)
+        vline->ports[i]->virq_thread = NULL;
+    vline->thread = NULL;
+    spin_unlock_irqrestore(&vline->ports_lock, flags);
+
+    return out;
+}
+
+/**
+ * Finds a line for a given IRQ or allocates a new one. Must be called with lines_lock held.
+ */
+static struct virq_line *get_virq_line(int irq)
+{
+    struct virq_line *free_slot = NULL;
+
+    if (unlikely(!virq_lines_initialized)) {
+        for (int i = 0; i < VIRQ_MAX_LINES; ++i) {
+            virq_lines[i].irq = -1;
+            init_waitqueue_head(&virq_lines[i].queue);
+            spin_lock_init(&virq_lines[i].ports_lock);
         }
+        virq_lines_initialized = true;
+    }
+
+    for (int i = 0; i < VIRQ_MAX_LINES; ++i) {
+        if (virq_lines[i].irq == irq)
+            return &virq_lines[i];
 
-        uart_prdbg("Calling serial8250 interrupt handler");
-        serial8250_handle_irq(vdev->up, vdev->iir);
+        if (!free_slot && virq_lines[i].irq == -1)
+            free_slot = &virq_lines[i];
     }
-    uart_prdbg("%s stopped for ttyS%d pid=%d exit=%d", __FUNCTION__, vdev->line, current->pid, out);
 
-    //that can lead to a small memory leak for virq_queue if thread is killed outisde disable_interrupts() but this
-    // shouldn't normally happen unless something goes horribly wrong
-    vdev->virq_thread = NULL;
+    if (unlikely(!free_slot)) {
+        pr_loc_bug("No free vIRQ line for IRQ%d", irq);
+        return NULL;
+    }
 
-    return out;
+    free_slot->irq = irq;
+    free_slot->ports_num = 0;
+    return free_slot;
 }
 
 int vuart_enable_interrupts(struct serial8250_16550A_vdev *vdev)
 {
-    int out;
+    int out = 0;
+    unsigned long flags;
     pr_loc_dbg("Enabling vIRQ for ttyS%d", vdev->line);
-    lock_vuart(vdev);
 
+    mutex_lock(&lines_lock);
     if (unlikely(!vdev->initialized)) {
         pr_loc_bug("ttyS%d is not initialized as vUART", vdev->line);
         out = -ENODEV;
-        goto error_unlock_free;
+        goto out_unlock;
     }
 
     if (unlikely(vuart_virq_active(vdev))) {
         pr_loc_bug("Interrupts are already enabled & scheduled for ttyS%d", vdev->line);
         out = -EBUSY;
-        goto error_unlock_free;
+        goto out_unlock;
     }
 
-    if (!(vdev->virq_queue = kmalloc(sizeof(wait_queue_head_t), GFP_KERNEL)) ||
-        !(vdev->virq_thread = kmalloc(sizeof(struct task_struct), GFP_KERNEL))) {
-        out = -EFAULT;
-        pr_loc_bug("kmalloc failed to reserve memory for vIRQ structures");
-        goto error_unlock_free;
+    struct virq_line *vline = get_virq_line(vdev->irq);
+    if (unlikely(!vline)) {
+        out = -ENOSPC;
+        goto out_unlock;
     }
 
-    init_waitqueue_head(vdev->virq_queue);
-    unlock_vuart(vdev); //we can safely unlock after reserving memory but before starting thread (so we're not atomic)
-
+    //The first port on the line brings the dispatcher up
+    if (!vline->thread) {
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wformat-extra-args"
-    //VUART_THREAD_FMT can resolve to anonymized version without line or even IRQ#
-    vdev->virq_thread = kthread_run(virq_thread, vdev, VUART_THREAD_FMT, vdev->irq, vdev->line);
+        //VUART_THREAD_FMT can resolve to anonymized version without IRQ#
+        struct task_struct *thread = kthread_create(virq_thread, vline, VUART_THREAD_FMT, vline->irq);
 #pragma GCC diagnostic pop
-    if (IS_ERR(vdev->virq_thread)) {
-        out = PTR_ERR(vdev->virq_thread);
-        pr_loc_bug("Failed to start vIRQ thread");
-        goto error_free;
+        if (IS_ERR(thread)) {
+            out = PTR_ERR(thread);
+            pr_loc_bug("Failed to start vIRQ thread for IRQ%d", vline->irq);
+            if (!vline->ports_num)
+                vline->irq = -1;
+            goto out_unlock;
+        }
+        place_thread(thread);
+        wake_up_process(thread);
+        vline->thread = thread;
     }
-    pr_loc_dbg("vIRQ fully enabled for for ttyS%d", vdev->line);
-
-    return 0;
 
-    error_unlock_free:
+    lock_vuart(vdev);
+    hrtimer_init(&vdev->virq_coalesce_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    vdev->virq_coalesce_timer.function = virq_coalesce_timer_cb;
+    vdev->virq_pending_bytes = 0;
+    vdev->virq_timer_fired = false;
+    vdev->virq_queue = &vline->queue;
+    vdev->virq_thread = vline->thread;
     unlock_vuart(vdev);
-    error_free:
-    if (vdev->virq_queue) {
-        kfree(vdev->virq_queue);
-        vdev->virq_queue = NULL;
-    }
-    if (vdev->virq_thread) {
-        kfree(vdev->virq_thread);
-        vdev->virq_thread = NULL;
-    }
+
+    spin_lock_irqsave(&vline->ports_lock, flags);
+    vline->ports[vline->ports_num++] = vdev;
+    spin_unlock_irqrestore(&vline->ports_lock, flags);
+    wake_up_interruptible(&vline->queue); //the port may already have something pending
+    pr_loc_dbg("vIRQ fully enabled for for ttyS%d (IRQ%d, %u port(s) on line)", vdev->line, vline->irq,
+               vline->ports_num);
+
+    out_unlock:
+    mutex_unlock(&lines_lock);
     return out;
 }
 
 int vuart_disable_interrupts(struct serial8250_16550A_vdev *vdev)
 {
     int out;
+    unsigned long flags;
     pr_loc_dbg("Disabling vIRQ for ttyS%d", vdev->line);
-    lock_vuart(vdev);
 
+    mutex_lock(&lines_lock);
     if (unlikely(!vdev->initialized)) {
         pr_loc_bug("ttyS%d is not initialized as vUART", vdev->line);
-        out = -ENODEV;
         goto out_unlock;
     }
 
     if (unlikely(!vuart_virq_active(vdev))) {
         pr_loc_bug("Interrupts are not enabled/scheduled for ttyS%d", vdev->line);
-        out = -EBUSY;
         goto out_unlock;
     }
 
-    out = kthread_stop(vdev->virq_thread);
-    if (out < 0) {
-        pr_loc_bug("Failed to stop vIRQ thread");
+    struct virq_line *vline = get_virq_line(vdev->irq); //it will always exist if the port is active
+    if (unlikely(!vline))
         goto out_unlock;
-    }
 
-    kfree(vdev->virq_thread);
+    //Once the port is gone from the line (which cannot happen mid-pass) the thread will never touch it again
+    spin_lock_irqsave(&vline->ports_lock, flags);
+    for (int i = 0; i < vline->ports_num; ++i) {
+        if (vline->ports[i] != vdev)
+            continue;
+
+        vline->ports[i] = vline->ports[--vline->ports_num];
+        vline->ports[vline->ports_num] = NULL;
+        break;
+    }
     vdev->virq_thread = NULL;
+    spin_unlock_irqrestore(&vline->ports_lock, flags);
+    hrtimer_cancel(&vdev->virq_coalesce_timer);
+
+    //Last port gone - the dispatcher is no longer needed
+    if (!vline->ports_num) {
+        if (vline->thread) {
+            out = kthread_stop(vline->thread);
+            if (out < 0)
+                pr_loc_bug("Failed to stop vIRQ thread for IRQ%d", vline->irq);
+            vline->thread = NULL;
+        }
+        vline->irq = -1;
+    }
+
     pr_loc_dbg("vIRQ disabled for ttyS%d", vdev->line);
 
     out_unlock:
-    unlock_vuart(vdev);
-
+    mutex_unlock(&lines_lock);
     return 0;
 }
-#endif
\ No newline at end of file
+#endif
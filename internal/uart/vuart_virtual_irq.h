@@ -4,6 +4,8 @@
 #ifdef VUART_USE_TIMER_FALLBACK
 #define vuart_virq_supported() 0
 #define vuart_virq_wake_up(dummy) //noop
+#define vuart_virq_count_bytes(dummy, len) //noop
+#define vuart_virq_wake_up_rx(dummy) //noop
 #define vuart_enable_interrupts(dummy) (0)
 #define vuart_disable_interrupts(dummy) (0)
 
@@ -12,7 +14,24 @@
 
 #define vuart_virq_supported() 1
 #define vuart_virq_active(vdev) (!!(vdev)->virq_thread)
-#define vuart_virq_wake_up(vdev) if (vuart_virq_active(vdev)) { wake_up_interruptible(vdev->virq_queue); }
+#define vuart_virq_coalescing(vdev) ((vdev)->virq_coalesce_bytes != 0)
+//Actually wakes up the vIRQ thread; all wake-ups should go through it so that they're counted in stats. Only the ones
+// which found the thread asleep are counted - a running thread will recheck the chip before it sleeps again anyway.
+#define vuart_virq_do_wake_up(vdev) \
+    do { \
+        if (waitqueue_active((vdev)->virq_queue)) { vuart_stat_inc(vdev, virq_wakeups); } \
+        wake_up_interruptible((vdev)->virq_queue); \
+    } while(0)
+#define vuart_virq_wake_up(vdev) \
+    if (vuart_virq_active(vdev)) { \
+        if (likely(!vuart_virq_coalescing(vdev))) { vuart_virq_do_wake_up(vdev); } \
+        else { vuart_virq_coalesced_wake_up(vdev); } \
+    }
+//Wakes up the vIRQ to pickup data from the RX ring; it doesn't go through coalescing as no interrupt is pending yet
+#define vuart_virq_wake_up_rx(vdev) if (vuart_virq_active(vdev)) { vuart_virq_do_wake_up(vdev); }
+//Accounts bytes moved through the chip for the purpose of interrupt coalescing; call it with vdev lock held
+#define vuart_virq_count_bytes(vdev, len) (vdev)->virq_pending_bytes += (len);
+void vuart_virq_coalesced_wake_up(struct serial8250_16550A_vdev *vdev);
 int vuart_enable_interrupts(struct serial8250_16550A_vdev *vdev);
 int vuart_disable_interrupts(struct serial8250_16550A_vdev *vdev);
 #endif //VUART_USE_TIMER_FALLBACK
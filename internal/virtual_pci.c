@@ -18,8 +18,10 @@
  *  - you should (but you don't HAVE to) set "master bus" (.command |= PCI_COMMAND_MASTER) for every function 0 device
  *    instance
  *  - every device MUST have a valid VID/DEV. None of the fields can be 0x0000 or 0xFFFF (they have special meanings)
- *  - this module does NOT have any support for capabilities (CAPs) as they're variable length and we don't want to
- *    force every device struct to take 256K of memory (todo if needed?)
+ *  - capabilities (CAPs) and extended config space (0x40-0xFFF) are supported via a sparse list of chunks (see struct
+ *    pci_cfg_ext) - they're variable length and we don't want to force every device struct to take 4K of memory.
+ *    Everything outside of the 64-byte header and the chunks reads as zeros. When the list is given the cap ptr and
+ *    PCI_STATUS_CAP_LIST are filled automatically.
  *  - there are three types of headers: PCI device, PCI-PCI bridge, PCI-CardBus bridge. Only the first one was tested.
  *    The second one allows for more levels of the tree and should work if configured properly (see struct
  *    pci_pci_bridge_descriptor) but it wasn't needed yet. The third one is practically a bitrot now.
@@ -45,6 +47,9 @@
  *       - use U24_CLASS_TO_U8_PROGIF(PCI_CLASS_SERIAL_USB) for pci_dev_descriptor.prog_if [0x03]
  *  - "pci_dev_conf_default_normal_dev" provides a sane-default device where you need to only set: vid, dev, class,
  *    and subclass.
+ *  - PCI_DSC_NORMAL_DEV() builds the same sane-default device at compile time. Since config space writes are rejected
+ *    descriptors are never modified - they can (and should) be const and shared between devices of the same type.
+ *    If writes are ever emulated only the written registers should get per-device storage (copy-on-write).
  *
  *
  * DEBUGGING DEVICES
@@ -149,7 +154,15 @@
  * x86 BUS SCANNING BUG (>=v4.1)
  * -----------------------------
  * Since v4.1 adding a new bus under a different domain will cause devices on the bus to not be fully populated. See the
- * comment in "vpci_add_single_device()" here for details & a simple fix.
+ * comment in "scan_new_bus()" here for details & a simple fix.
+ *
+ * BATCHED REGISTRATION
+ * --------------------
+ * Every scan/rescan of a bus makes the PCI core read config space of every devfn on the bus (and creates sysfs entries).
+ * Adding devices one by one means re-enumerating the same bus for every device. Between vpci_begin_batch() and
+ * vpci_commit_batch() devices are only staged (they're immediately visible to config space reads, but nothing scans
+ * for them). The commit creates each new bus once and rescans each existing bus which received devices once. This also
+ * removes the "fn=0 must be added last" limitation for multifunction devices (see vpci_add_multifunction_device()).
  *
  * KNOWN BUGS
  * ----------
@@ -176,78 +189,42 @@
 #include <linux/pci_ids.h> //Constants for vendors, classes, and other
 #include <linux/list.h> //list_for_each
 #include <linux/device.h> //device_del
+#include <linux/bitmap.h> //DECLARE_BITMAP, for_each_set_bit
 
 #define PCIBUS_VIRTUAL_DOMAIN 0x0001 //normal PC buses are (always?) on domain 0, this is just a next one
 #define PCI_DEVICE_NOT_FOUND_VID_DID 0xFFFFFFFF //A special case to detect non-existing devices (per PCI spec)
 
-/* As per PCI spec
- *    If a single function device is detected (i.e., bit 7 in the Header
- *    Type register of function 0 is 0), no more functions for that
- *    Device Number will be checked. If a multi-function device is
- *    detected (i.e., bit 7 in the Header Type register of function 0
- *    is 1), then all remaining Function Numbers will be checked.
- * This helper converts single-function header type to multifunction header type
- */
-#define PCI_HEADER_TO_MULTI(x) ((1 << 7) | (x))
-#define IS_PCI_HEADER_MULTI(x) (!!((x) & 0x80))
-
 //Model of a default config for a device
-const struct pci_dev_descriptor pci_dev_conf_default_normal_dev = {
-    .vid = 0xDEAD, //set me!
-    .dev = 0xBEEF, //set me!
-
-    .command = 0x0000,
-    .status  = 0x0000,
-
-    .rev_id = PCI_DSC_REV_NONE,
-    .prog_if = PCI_DSC_PROGIF_NONE,
-    .subclass = U16_CLASS_TO_U8_CLASS(PCI_CLASS_NOT_DEFINED), //set me!
-    .class = U16_CLASS_TO_U8_CLASS(PCI_CLASS_NOT_DEFINED), //set me!
-
-    .cache_line_size = 0x00,
-    .latency_timer = 0x00,
-    .header_type = PCI_HEADER_TYPE_NORMAL,
-    .bist = PCI_DSC_BIST_NONE, //Built-In Self Test
-
-    .bar0 = PCI_DSC_NULL_BAR,
-    .bar1 = PCI_DSC_NULL_BAR,
-    .bar2 = PCI_DSC_NULL_BAR,
-    .bar3 = PCI_DSC_NULL_BAR,
-    .bar4 = PCI_DSC_NULL_BAR,
-    .bar5 = PCI_DSC_NULL_BAR,
-
-    .cardbus_cis = 0x00000000,
-
-    .subsys_vid = 0x0000, //you probably want to set this
-    .subsys_id = 0x0000, //you probably want to set this
-
-    .exp_rom_base_addr = 0x00000000,
-
-    .cap_ptr = PCI_DSC_NULL_CAP,
-    .reserved_34_8_15 = PCI_DSC_RSV8,
-    .reserved_34_16_31 = PCI_DSC_RSV16,
-
-    .reserved_38h = 0x00000000,
-
-    .interrupt_line = PCI_DSC_NO_INT_LINE,
-    .interrupt_pin = PCI_DSC_NO_INT_PIN,
-    .min_gnt = PCI_DSC_ZERO_BURST,
-    .max_lat = PCI_DSC_INF_LATENCY,
-};
+const struct pci_dev_descriptor pci_dev_conf_default_normal_dev =
+    PCI_DSC_NORMAL_DEV(0xDEAD, 0xBEEF, U16_CLASS_TO_U8_CLASS(PCI_CLASS_NOT_DEFINED),
+                       U16_CLASS_TO_U8_CLASS(PCI_CLASS_NOT_DEFINED), PCI_DSC_PROGIF_NONE, PCI_DSC_REV_NONE,
+                       PCI_HEADER_TYPE_NORMAL); //vid, dev, class & subclass: set me!
 
 struct virtual_device {
-    unsigned char *bus_no; //same as bus->number, used when bus is not initialized yet (e.g. during scanning)
+    unsigned char bus_no; //same as bus->number, used when bus is not initialized yet (e.g. during scanning)
     unsigned char dev_no;
     unsigned char fn_no;
     struct pci_bus* bus;
-    void *descriptor;
+    const void *descriptor;
+    const struct pci_cfg_ext *ext; //may be NULL
 };
 static unsigned int free_bus_idx = 0; //Used to find next free bus and for indexing other arrays
 static struct pci_bus *buses[MAX_VPCI_BUSES] = { NULL }; //All virtual buses
 
 static unsigned int free_dev_idx = 0; //Used to find next free bus and for indexing other arrays
+static struct virtual_device device_slots[MAX_VPCI_DEVS]; //Storage for devices[] (both indexed by didx)
 static struct virtual_device *devices[MAX_VPCI_DEVS] = { NULL }; //All virtual devices
 
+//Direct BDF => device lookup used by config space accesses. The PCI core probes every devfn of every bus during scans
+// (and most of them don't exist) so this has to be O(1) for both hits & misses. Maps are allocated per used bus number.
+struct vbus_devfn_map {
+    struct virtual_device *devfn[256];
+};
+static struct vbus_devfn_map *devfn_maps[256] = { NULL }; //indexed by bus number
+
+static bool batch_active = false; //see vpci_begin_batch()
+static DECLARE_BITMAP(staged_buses, 256); //bus numbers which received devices & need a (re)scan on commit
+
 //Macros to easily iterate over lists above
 #define for_each_bus_idx() for (int i = 0, last_bus_idx = free_bus_idx-1; i <= last_bus_idx; i++)
 #define for_each_dev_idx() for (int i = 0, last_dev_idx = free_dev_idx-1; i <= last_dev_idx; i++)
@@ -255,11 +232,11 @@ static struct virtual_device *devices[MAX_VPCI_DEVS] = { NULL }; //All virtual d
 /**
  * Prints pci_dev_descriptor or pci_pci_bridge_descriptor
  */
-void print_pci_descriptor(void *test_dev)
+void print_pci_descriptor(const void *test_dev)
 {
     pr_loc_dbg("Printing PCI descriptor @ %p", test_dev);
     printk("\n31***********0***ADDR*******************\n");
-    u8 *ptr = (u8 *)test_dev;
+    const u8 *ptr = (const u8 *)test_dev;
     for (int row = 3; row < 64; row += 4) {
         for (int byte = 0; byte > -4; byte--) {
             printk("%02x ", *(ptr + row + byte));
@@ -274,6 +251,47 @@ void print_pci_descriptor(void *test_dev)
 //    printk("******************************************\n");
 }
 
+/**
+ * Finds a byte of the config space beyond the standard header in the sparse chunks list
+ */
+static u8 read_ext_cfg_byte(const struct pci_cfg_ext *ext, unsigned int offset)
+{
+    if (!ext)
+        return 0x00;
+
+    //Chunks are sorted & non-overlapping (see validate_cfg_ext()) - bsearch the last one starting at or before offset
+    unsigned int lo = 0, hi = ext->chunks_num;
+    while (lo < hi) {
+        unsigned int mid = (lo + hi) / 2;
+        if (ext->chunks[mid].offset <= offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo == 0)
+        return 0x00;
+
+    const struct pci_cfg_chunk *chunk = &ext->chunks[lo - 1];
+    return (offset < chunk->offset + chunk->len) ? chunk->data[offset - chunk->offset] : 0x00;
+}
+
+static inline u8 read_cfg_byte(const struct virtual_device *vdev, unsigned int offset)
+{
+    if (offset >= PCI_DSC_HEADER_LEN)
+        return read_ext_cfg_byte(vdev->ext, offset);
+
+    u8 byte = ((const u8 *)vdev->descriptor)[offset];
+    if (vdev->ext && vdev->ext->chunks_num) {
+        if (offset == PCI_CAPABILITY_LIST)
+            byte = vdev->ext->cap_ptr;
+        else if (offset == PCI_STATUS)
+            byte |= PCI_STATUS_CAP_LIST;
+    }
+
+    return byte;
+}
+
 /**
  * @param bus The bus (may be under first scan so only its number may be present in virtual_device)
  * @param devfn Device AND its function; it's a 0-256 number allowing for 32 devices with 8 functions each
@@ -286,44 +304,36 @@ static int pci_read_cfg(struct pci_bus *bus, unsigned int devfn, int where, int
 {
     //devfn is a combination of device number on bus and function number (Bus/Device/Function addressing)
     //Each device which exists MUST implement function 0. So every 8th value of devfn we have a new device.
-    unsigned char vdev_no = PCI_SLOT(devfn);
-    unsigned char vdev_fn = PCI_FUNC(devfn);
-
-    void *pci_descriptor = NULL;
+    //We cannot use devices[i]->bus->number during scan as the bus may just being created and no ->bus is available -
+    // but the bus number we receive here is always the same as the one the device was added with
+    struct vbus_devfn_map *map = devfn_maps[bus->number];
+    struct virtual_device *vdev = likely(map) ? map->devfn[devfn & 0xFF] : NULL;
 
     //Very noisy!
-    //pr_loc_dbg("Read SYN wh=0x%d sz=%d B / %d for vDEV @ bus=%02x dev=%02x fn=%02x", where, size, size * 8,
-    //           bus->number, vdev_no, vdev_fn);
-    for_each_dev_idx() {
-        //Very noisy!
-        //pr_loc_dbg("Checking vDEV @ bus=%02x dev=%02x fn=%02x", *devices[i]->bus_no, devices[i]->dev_no,
-        //           devices[i]->fn_no);
-
-        //We cannot use devices[i]->bus->number during scan as the bus may just being created and no ->bus is available
-        if(*devices[i]->bus_no == bus->number && devices[i]->dev_no == vdev_no && devices[i]->fn_no == vdev_fn) {
-            //Very noisy!
-            //pr_loc_dbg("Found matching vDEV @ bus=%02x dev=%02x fn=%02x => vidx=%d mf=%d", bus->number, vdev_no,
-            //           vdev_fn, i,
-            //           IS_PCI_HEADER_MULTI(((struct pci_dev_descriptor *) devices[i]->descriptor)->header_type) ? 1:0);
-            pci_descriptor = devices[i]->descriptor;
-            break;
-        }
-    };
+    //pr_loc_dbg("Read SYN wh=0x%d sz=%d B / %d for vDEV @ bus=%02x dev=%02x fn=%02x => %p", where, size, size * 8,
+    //           bus->number, PCI_SLOT(devfn), PCI_FUNC(devfn), vdev);
 
-    if (!pci_descriptor) { //This is not a hack - this is per PCI spec to return special "not found pid/vid"
+    if (!vdev) { //This is not a hack - this is per PCI spec to return special "not found pid/vid"
         if (where == PCI_VENDOR_ID || where == PCI_DEVICE_ID)
             *val = PCI_DEVICE_NOT_FOUND_VID_DID;
 
         //Very noisy!
         //pr_loc_dbg("Read NAK wh=0x%d sz=%d B / %d for vDEV @ bus=%02x dev=%02x fn=%02x", where, size, size * 8, bus->number,
-        //           vdev_no, vdev_fn);
+        //           PCI_SLOT(devfn), PCI_FUNC(devfn));
         return PCIBIOS_DEVICE_NOT_FOUND;
     }
 
     //Very noisy!
     //pr_loc_dbg("Read ACK wh=0x%d sz=%d B / %d for vDEV @ bus=%02x dev=%02x fn=%02x", where, size, size * 8, bus->number,
-    //           vdev_no, vdev_fn);
-    memcpy(val, (u8 *)pci_descriptor + where, size);
+    //           PCI_SLOT(devfn), PCI_FUNC(devfn));
+    if (unlikely(where < 0 || size < 1 || size > 4 || where + size > PCI_CFG_EXT_LEN))
+        return PCIBIOS_BAD_REGISTER_NUMBER;
+
+    //Config space is little endian, just like x86 - no conversion needed
+    u8 *out = (u8 *)val;
+    *val = 0;
+    for (int i = 0; i < size; i++)
+        out[i] = read_cfg_byte(vdev, where + i);
 
     return PCIBIOS_SUCCESSFUL;
 }
@@ -355,7 +365,7 @@ static struct pci_sysdata x86_sysdata = {
 //_NO  => number according to the PCI spec
 //_IDX => index in arrays (internal to this emulation layer only)
 #define BUS_NO_VALID(x) ((x) >= 0 && (x) <= 0xFF) //Check if a given bus# is valid according to the PCI spec
-#define DEV_NO_VALID(x) ((x) >= 0 && (x) <= 32) //Check if a given dev# is valid according to the PCI spec
+#define DEV_NO_VALID(x) ((x) >= 0 && (x) <= 31) //Check if a given dev# is valid according to the PCI spec
 #define FN_NO_VALID(x) ((x) >= 0 && (x) <= 7) //Check if a given function# is valid according to the PCI spec
 #define VBUS_IDX_VALID(x) ((x) >= 0 && (x) < MAX_VPCI_BUSES-1) //Check if virtual bus INDEX is valid for this emulator
 #define VBUS_IDX_USED(x) ((x) >= 0 && (x) < free_bus_idx) //Check if a given bus index is used now in the emulator
@@ -386,16 +396,28 @@ static inline int validate_bdf(unsigned char bus_no, unsigned char dev_no, unsig
     }
 
     //If the device has the same B/D/F address it is a duplicate
-    for_each_dev_idx() {
-        if (
-                likely(*devices[i]->bus_no == bus_no) &&
-                unlikely(devices[i]->dev_no == dev_no && devices[i]->fn_no == fn_no)
-                ) {
-            pr_loc_err("Device bus=%02x dev=%02x fn=%02x already exists in vidx=%d", bus_no, dev_no, fn_no, i);
-            return -EEXIST;
+    if (unlikely(devfn_maps[bus_no] && devfn_maps[bus_no]->devfn[PCI_DEVFN(dev_no, fn_no)])) {
+        pr_loc_err("Device bus=%02x dev=%02x fn=%02x already exists", bus_no, dev_no, fn_no);
+        return -EEXIST;
+    }
+
+    return 0;
+}
+
+/**
+ * Makes the device visible to config space accesses (see pci_read_cfg())
+ */
+static inline int map_vdev(unsigned char bus_no, struct virtual_device *device)
+{
+    if (!devfn_maps[bus_no]) {
+        devfn_maps[bus_no] = kzalloc(sizeof(struct vbus_devfn_map), GFP_KERNEL);
+        if (unlikely(!devfn_maps[bus_no])) {
+            pr_loc_crt("kzalloc failed");
+            return -ENOMEM;
         }
-    };
+    }
 
+    devfn_maps[bus_no]->devfn[PCI_DEVFN(device->dev_no, device->fn_no)] = device;
     return 0;
 }
 
@@ -412,8 +434,50 @@ static inline struct pci_bus *get_vbus_by_number(unsigned char bus_no)
     return NULL;
 }
 
-const struct virtual_device *
-vpci_add_device(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no, void *descriptor)
+/**
+ * Counts buses which will be created during commit (=staged numbers without a bus)
+ */
+static unsigned int count_staged_new_buses(void)
+{
+    unsigned int num = 0;
+    int bus_no;
+    for_each_set_bit(bus_no, staged_buses, 256) {
+        if (!get_vbus_by_number(bus_no))
+            ++num;
+    }
+
+    return num;
+}
+
+/**
+ * Checks if the chunks list is sorted, non-overlapping, and fits within the extended config space
+ */
+static int validate_cfg_ext(const struct pci_cfg_ext *ext)
+{
+    unsigned int min_offset = PCI_DSC_HEADER_LEN;
+    for (unsigned int i = 0; i < ext->chunks_num; i++) {
+        const struct pci_cfg_chunk *chunk = &ext->chunks[i];
+        if (unlikely(chunk->offset < min_offset || chunk->len == 0 || chunk->offset + chunk->len > PCI_CFG_EXT_LEN ||
+                     !chunk->data)) {
+            pr_loc_err("Config chunk #%u @ 0x%03x (len=%u) is invalid - chunks must be sorted, non-overlapping, and "
+                       "within 0x%02x-0x%03x", i, chunk->offset, chunk->len, PCI_DSC_HEADER_LEN, PCI_CFG_EXT_LEN - 1);
+            return -EINVAL;
+        }
+
+        min_offset = chunk->offset + chunk->len;
+    }
+
+    if (unlikely(ext->chunks_num && ext->cap_ptr < PCI_DSC_HEADER_LEN)) {
+        pr_loc_err("Capabilities pointer 0x%02x points inside of the standard header", ext->cap_ptr);
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static const struct virtual_device *
+vpci_add_device(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no, const void *descriptor,
+                const struct pci_cfg_ext *ext)
 {
     pr_loc_dbg("Attempting to add vPCI device [printed below] @ bus=%02x dev=%02x fn=%02x", bus_no, dev_no, fn_no);
     print_pci_descriptor(descriptor);
@@ -422,49 +486,65 @@ vpci_add_device(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no,
     if (error != 0)
         return ERR_PTR(error);
 
-    struct pci_bus *bus = get_vbus_by_number(bus_no);
+    if (ext && (error = validate_cfg_ext(ext)) != 0)
+        return ERR_PTR(error);
+
+    //No existing bus - check if we can add a new one
+    //if the free bus index is not valid it means we're out of free IDs for buses (incl. ones waiting for the commit)
+    if (!get_vbus_by_number(bus_no) && !test_bit(bus_no, staged_buses) &&
+        unlikely(!VBUS_IDX_VALID(free_bus_idx + count_staged_new_buses()))) {
+        pr_loc_bug("No more bus indexes are available (max buses: %d)", MAX_VPCI_BUSES);
+        return ERR_PTR(-ENOMEM);
+    }
 
     //At this point we know the device can be added either to a new or existing bus so we have to populate their struct
-    struct virtual_device *device = kmalloc(sizeof(struct virtual_device), GFP_KERNEL);
+    //The slot is taken only once the device is mapped - on failure it will simply be overwritten by the next one
+    struct virtual_device *device = &device_slots[free_dev_idx];
+    device->bus_no = bus_no;
     device->dev_no = dev_no;
     device->fn_no = fn_no;
+    device->bus = NULL; //set when the bus is scanned
     device->descriptor = descriptor;
+    device->ext = ext;
 
-    if (bus) { //We have an existing bus to use
-        device->bus_no = &bus->number;
-        devices[free_dev_idx++] = device;
+    if ((error = map_vdev(bus_no, device)) != 0)
+        return ERR_PTR(error);
 
-        //We cannot use "pci_scan_single_device" here in case there are mf devices
-        pci_rescan_bus(bus); //this cannot fail - it simply return max device num
+    devices[free_dev_idx++] = device;
+    set_bit(bus_no, staged_buses);
+    pr_loc_dbg("Staged device @ bus=%02x dev=%02x fn=%02x", bus_no, dev_no, fn_no);
 
-        pr_loc_err("Added device with existing bus @ bus=%02x dev=%02x fn=%02x", *device->bus_no, device->dev_no,
-                   device->fn_no);
+    if (batch_active)
         return device;
-    }
 
-    //No existing bus - check if we can add a new one
-    //if the free bus index is not valid it means we're out of free IDs for buses
-    if (unlikely(!VBUS_IDX_VALID(free_bus_idx))) {
-        pr_loc_bug("No more bus indexes are available (max buses: %d)", MAX_VPCI_BUSES);
-        return ERR_PTR(-ENOMEM);
+    error = vpci_commit_batch();
+    return error == 0 ? device : ERR_PTR(error);
+}
+
+void vpci_begin_batch(void)
+{
+    if (unlikely(batch_active)) {
+        pr_loc_bug("vPCI batch is already active");
+        return;
     }
 
-    //Since we don't have a bus so we need to add the device with a mock dev_no and trigger scanning (which actually
-    // creates the bus). While it sounds counter-intuitive it is how the PCI subsystem works.
-    unsigned char tmp_bus_no = bus_no; //It will be valid for the time of initial scan
-    device->bus_no = &tmp_bus_no;
-    devices[free_dev_idx++] = device;
+    pr_loc_dbg("Starting vPCI batch");
+    batch_active = true;
+}
 
-    bus = pci_scan_bus(*device->bus_no, &pci_shim_ops, &x86_sysdata);
+/**
+ * Creates a new root bus for devices staged with a given bus number
+ */
+static int scan_new_bus(unsigned char bus_no)
+{
+    //Since we don't have a bus we need to add the devices first and trigger scanning (which actually creates the bus).
+    // While it sounds counter-intuitive it is how the PCI subsystem works.
+    struct pci_bus *bus = pci_scan_bus(bus_no, &pci_shim_ops, &x86_sysdata);
     if (!bus) {
-        pr_loc_err("pci_scan_bus failed - cannot add new bus");
-        devices[free_dev_idx--] = NULL; //Reverse adding & ensure idx is still free
-        kfree(device); //Free memory for the device itself
-        return ERR_PTR(-EIO);
+        pr_loc_err("pci_scan_bus failed - cannot add new bus %02x", bus_no);
+        return -EIO;
     }
 
-    device->bus_no = &bus->number; //Replace temp bus number pointer with the actual bus struct pointer
-    device->bus = bus;
     buses[free_bus_idx++] = bus;
 
     /*
@@ -485,12 +565,59 @@ vpci_add_device(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no,
     pci_bus_add_devices(bus);
 #endif
 
-    pr_loc_err("Added device with new bus @ bus=%02x dev=%02x fn=%02x", *device->bus_no, device->dev_no, device->fn_no);
-    return device;
+    pr_loc_dbg("Added new bus %02x", bus_no);
+    return 0;
+}
+
+int vpci_commit_batch(void)
+{
+    int out = 0;
+    int bus_no;
+
+    batch_active = false;
+    for_each_set_bit(bus_no, staged_buses, 256) {
+        struct pci_bus *bus = get_vbus_by_number(bus_no);
+        if (bus) {
+            //We cannot use "pci_scan_single_device" here in case there are mf devices
+            pr_loc_dbg("Rescanning existing bus %02x", bus_no);
+            pci_rescan_bus(bus); //this cannot fail - it simply return max device num
+        } else {
+            int error = scan_new_bus(bus_no);
+            if (error != 0) {
+                out = error; //we continue with other buses; devices on this one will be simply missing
+                continue;
+            }
+            bus = get_vbus_by_number(bus_no);
+        }
+
+        for_each_dev_idx() {
+            if (devices[i]->bus_no == bus_no)
+                devices[i]->bus = bus;
+        }
+    }
+    bitmap_zero(staged_buses, 256);
+
+    if (out == 0)
+        pr_loc_dbg("vPCI batch committed");
+
+    return out;
+}
+
+const struct virtual_device *
+vpci_add_device_ext(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no,
+                    const struct pci_dev_descriptor *descriptor, const struct pci_cfg_ext *ext)
+{
+    if (unlikely(fn_no != 0x00 && !IS_PCI_HEADER_MULTI(descriptor->header_type))) {
+        pr_loc_bug("Attempted to use %s() to add fn=%02x of a device without multifunction header type",
+                   __FUNCTION__, fn_no);
+        return ERR_PTR(-EINVAL);
+    }
+
+    return vpci_add_device(bus_no, dev_no, fn_no, descriptor, ext);
 }
 
 const struct virtual_device *
-vpci_add_single_device(unsigned char bus_no, unsigned char dev_no, struct pci_dev_descriptor *descriptor)
+vpci_add_single_device(unsigned char bus_no, unsigned char dev_no, const struct pci_dev_descriptor *descriptor)
 {
     if (unlikely(IS_PCI_HEADER_MULTI(descriptor->header_type))) {
         pr_loc_bug("Attempted to use %s() to add multifunction device."
@@ -498,20 +625,24 @@ vpci_add_single_device(unsigned char bus_no, unsigned char dev_no, struct pci_de
         return ERR_PTR(-EINVAL);
     }
 
-    return vpci_add_device(bus_no, dev_no, 0x00, descriptor);
+    return vpci_add_device(bus_no, dev_no, 0x00, descriptor, NULL);
 }
 
 const struct virtual_device *
 vpci_add_multifunction_device(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no,
-                              struct pci_dev_descriptor *descriptor)
+                              const struct pci_dev_descriptor *descriptor)
 {
-    descriptor->header_type = PCI_HEADER_TO_MULTI(descriptor->header_type);
+    if (unlikely(!IS_PCI_HEADER_MULTI(descriptor->header_type))) {
+        pr_loc_bug("Attempted to use %s() to add a device without multifunction header type. "
+                   "Did you forget PCI_HEADER_TO_MULTI()?", __FUNCTION__);
+        return ERR_PTR(-EINVAL);
+    }
 
-    return vpci_add_device(bus_no, dev_no, fn_no, descriptor);
+    return vpci_add_device(bus_no, dev_no, fn_no, descriptor, NULL);
 }
 
 const struct virtual_device *
-vpci_add_single_bridge(unsigned char bus_no, unsigned char dev_no, struct pci_pci_bridge_descriptor *descriptor)
+vpci_add_single_bridge(unsigned char bus_no, unsigned char dev_no, const struct pci_pci_bridge_descriptor *descriptor)
 {
     if (unlikely(IS_PCI_HEADER_MULTI(descriptor->header_type))) {
         pr_loc_bug("Attempted to use %s() to add multifunction device."
@@ -519,16 +650,20 @@ vpci_add_single_bridge(unsigned char bus_no, unsigned char dev_no, struct pci_pc
         return ERR_PTR(-EINVAL);
     }
 
-    return vpci_add_device(bus_no, dev_no, 0x00, descriptor);
+    return vpci_add_device(bus_no, dev_no, 0x00, descriptor, NULL);
 }
 
 const struct virtual_device *
 vpci_add_multifunction_bridge(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no,
-                              struct pci_pci_bridge_descriptor *descriptor)
+                              const struct pci_pci_bridge_descriptor *descriptor)
 {
-    descriptor->header_type = PCI_HEADER_TO_MULTI(descriptor->header_type);
+    if (unlikely(!IS_PCI_HEADER_MULTI(descriptor->header_type))) {
+        pr_loc_bug("Attempted to use %s() to add a bridge without multifunction header type. "
+                   "Did you forget PCI_HEADER_TO_MULTI()?", __FUNCTION__);
+        return ERR_PTR(-EINVAL);
+    }
 
-    return vpci_add_device(bus_no, dev_no, fn_no, descriptor);
+    return vpci_add_device(bus_no, dev_no, fn_no, descriptor, NULL);
 }
 
 int vpci_remove_all_devices_and_buses(void)
@@ -546,10 +681,14 @@ int vpci_remove_all_devices_and_buses(void)
         }
     }
 
+    for (int i = 0; i < ARRAY_SIZE(devfn_maps); i++) {
+        kfree(devfn_maps[i]);
+        devfn_maps[i] = NULL;
+    }
+
     for_each_dev_idx() {
         pr_loc_dbg("Removing PCI vDEV @ didx %d", i);
-        kfree(devices[i]);
-        devices[i] = NULL;
+        devices[i] = NULL; //it lives in device_slots[]
     };
     free_dev_idx = 0;
 
@@ -560,6 +699,8 @@ int vpci_remove_all_devices_and_buses(void)
         buses[i] = NULL;
     }
     free_bus_idx = 0;
+    bitmap_zero(staged_buses, 256);
+    batch_active = false;
 
     pr_loc_inf("All vPCI devices and buses removed");
 
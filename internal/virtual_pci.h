@@ -29,6 +29,17 @@
 #define PCI_DSC_ZERO_BURST 0xFF //i.e. doesn't need any length of burst
 #define PCI_DSC_BIST_NONE 0x00
 
+/* As per PCI spec
+ *    If a single function device is detected (i.e., bit 7 in the Header
+ *    Type register of function 0 is 0), no more functions for that
+ *    Device Number will be checked. If a multi-function device is
+ *    detected (i.e., bit 7 in the Header Type register of function 0
+ *    is 1), then all remaining Function Numbers will be checked.
+ * This helper converts single-function header type to multifunction header type
+ */
+#define PCI_HEADER_TO_MULTI(x) ((1 << 7) | (x))
+#define IS_PCI_HEADER_MULTI(x) (!!((x) & 0x80))
+
 //See https://en.wikipedia.org/wiki/PCI_configuration_space#/media/File:Pci-config-space.svg
 //This struct MUST be packed to allow for easy reading, see https://kernelnewbies.org/DataAlignment
 struct pci_dev_descriptor {
@@ -75,6 +86,45 @@ struct pci_dev_descriptor {
 } __packed;
 extern const struct pci_dev_descriptor pci_dev_conf_default_normal_dev; //See details in the .c file
 
+/**
+ * Initializer for a sane-default normal device (the same as pci_dev_conf_default_normal_dev) usable at compile time
+ *
+ * Use it to build const descriptors, e.g. static const struct pci_dev_descriptor x = PCI_DSC_NORMAL_DEV(...);
+ * For multifunction devices pass PCI_HEADER_TO_MULTI(PCI_HEADER_TYPE_NORMAL) as header type.
+ */
+#define PCI_DSC_NORMAL_DEV(_vid, _dev, _class, _subclass, _prog_if, _rev_id, _header_type) { \
+    .vid = (_vid),                                                    \
+    .dev = (_dev),                                                    \
+    .command = 0x0000,                                                \
+    .status  = 0x0000,                                                \
+    .rev_id = (_rev_id),                                              \
+    .prog_if = (_prog_if),                                            \
+    .subclass = (_subclass),                                          \
+    .class = (_class),                                                \
+    .cache_line_size = 0x00,                                          \
+    .latency_timer = 0x00,                                            \
+    .header_type = (_header_type),                                    \
+    .bist = PCI_DSC_BIST_NONE, /*Built-In Self Test*/                 \
+    .bar0 = PCI_DSC_NULL_BAR,                                         \
+    .bar1 = PCI_DSC_NULL_BAR,                                         \
+    .bar2 = PCI_DSC_NULL_BAR,                                         \
+    .bar3 = PCI_DSC_NULL_BAR,                                         \
+    .bar4 = PCI_DSC_NULL_BAR,                                         \
+    .bar5 = PCI_DSC_NULL_BAR,                                         \
+    .cardbus_cis = 0x00000000,                                        \
+    .subsys_vid = 0x0000,                                             \
+    .subsys_id = 0x0000,                                              \
+    .exp_rom_base_addr = 0x00000000,                                  \
+    .cap_ptr = PCI_DSC_NULL_CAP,                                      \
+    .reserved_34_8_15 = PCI_DSC_RSV8,                                 \
+    .reserved_34_16_31 = PCI_DSC_RSV16,                               \
+    .reserved_38h = 0x00000000,                                       \
+    .interrupt_line = PCI_DSC_NO_INT_LINE,                            \
+    .interrupt_pin = PCI_DSC_NO_INT_PIN,                              \
+    .min_gnt = PCI_DSC_ZERO_BURST,                                    \
+    .max_lat = PCI_DSC_INF_LATENCY,                                   \
+}
+
 //Support for bridges wasn't tested
 struct pci_pci_bridge_descriptor {
     u16 vid;               //Vendor ID
@@ -128,12 +178,35 @@ struct pci_pci_bridge_descriptor {
     u16 bridge_ctrl;
 } __packed;
 
-//This is currently not implemented
-struct pci_dev_capability {
-    u8 cap_id; //see PCI_CAP_ID_*, set to 0x00 to denote null-capability
-    u8 cap_next; //offset where next capability exists, set to 0x00 to denote null-capability
-    u8 cap_data[];
-} __packed;
+#define PCI_DSC_HEADER_LEN 0x40 //both pci_dev_descriptor and pci_pci_bridge_descriptor cover the first 64 bytes
+#define PCI_CFG_EXT_LEN 0x1000 //full PCIe extended config space
+
+/**
+ * A continuous piece of config space beyond the standard header (e.g. a single capability structure)
+ */
+struct pci_cfg_chunk {
+    u16 offset; //>= PCI_DSC_HEADER_LEN
+    u16 len;
+    const u8 *data; //len bytes; for capabilities it starts with cap id & next cap ptr (see PCI_CAP_ID_*)
+};
+
+/**
+ * Sparse config space beyond the standard header: capabilities (0x40-0xFF) and PCIe extended config (0x100-0xFFF)
+ *
+ * Only the chunks listed are stored - everything else reads as zeros. Chunks MUST be sorted by offset and cannot
+ * overlap. Like descriptors, the structure is never modified and can be const & shared between devices.
+ * When chunks_num > 0 the capabilities pointer (0x34) reads as cap_ptr and PCI_STATUS_CAP_LIST is set automatically.
+ *
+ * Example (a device with just a PCI power management cap):
+ *   static const u8 pm_cap[] = { PCI_CAP_ID_PM, 0x00, 0x03, 0x00, 0x08, 0x00, 0x00, 0x00 };
+ *   static const struct pci_cfg_chunk chunks[] = { { .offset = 0x40, .len = sizeof(pm_cap), .data = pm_cap } };
+ *   static const struct pci_cfg_ext ext = { .cap_ptr = 0x40, .chunks_num = ARRAY_SIZE(chunks), .chunks = chunks };
+ */
+struct pci_cfg_ext {
+    u8 cap_ptr; //offset of the first capability
+    unsigned int chunks_num;
+    const struct pci_cfg_chunk *chunks;
+};
 
 /**
  * Adds a single new device (along with the bus if needed)
@@ -148,13 +221,13 @@ struct pci_dev_capability {
  * @return virtual_device ptr or error pointer (ERR_PTR(-E))
  */
 const struct virtual_device *
-vpci_add_single_device(unsigned char bus_no, unsigned char dev_no, struct pci_dev_descriptor *descriptor);
+vpci_add_single_device(unsigned char bus_no, unsigned char dev_no, const struct pci_dev_descriptor *descriptor);
 
 /**
  * See vpci_add_single_device() for details
  */
 const struct virtual_device *
-vpci_add_single_bridge(unsigned char bus_no, unsigned char dev_no, struct pci_pci_bridge_descriptor *descriptor);
+vpci_add_single_bridge(unsigned char bus_no, unsigned char dev_no, const struct pci_pci_bridge_descriptor *descriptor);
 
 
 /*
@@ -162,7 +235,7 @@ vpci_add_single_bridge(unsigned char bus_no, unsigned char dev_no, struct pci_pc
  *
  * Warning about multifunctional devices
  *  - this function has a slight limitation due to how Linux scans devices. You HAVE TO add fn_no=0 entry as the LAST
- *    one when calling it multiple times. Kernel scans devices only once for changes and if it finds fn=0 and it's the
+ *    one when calling it multiple times (unless all functions are added within a single vpci_begin_batch() batch). Kernel scans devices only once for changes and if it finds fn=0 and it's the
  *    only one (i.e. you added fn=0 first) adding more functions will not populate them (as kernel will never re-scan
  *    the device).
  *  - As per PCI spec Linux doesn't allow devices to have fn>0 if they don't have corresponding fn=0 entry
@@ -170,19 +243,49 @@ vpci_add_single_bridge(unsigned char bus_no, unsigned char dev_no, struct pci_pc
  * @param bus_no (0x00 - 0xFF)
  * @param dev_no (0x00 - 0x20)
  * @param fn_no (0x00 - 0x07)
- * @param descriptor Pointer to pci_dev_descriptor or pci_pci_bridge_descriptor
+ * @param descriptor Pointer to pci_dev_descriptor or pci_pci_bridge_descriptor; its header type must be multifunction
+ *                   (see PCI_HEADER_TO_MULTI())
  * @return virtual_device ptr or error pointer (ERR_PTR(-E))
  */
 const struct virtual_device *
 vpci_add_multifunction_device(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no,
-                              struct pci_dev_descriptor *descriptor);
+                              const struct pci_dev_descriptor *descriptor);
 
 /**
  * See vpci_add_multifunction_device() for details
  */
 const struct virtual_device *
 vpci_add_multifunction_bridge(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no,
-                              struct pci_pci_bridge_descriptor *descriptor);
+                              const struct pci_pci_bridge_descriptor *descriptor);
+
+/**
+ * Adds a device with capabilities and/or extended config space (along with the bus if needed)
+ *
+ * This works like vpci_add_single_device() (for fn_no=0 and non-multifunction descriptor) or like
+ * vpci_add_multifunction_device() otherwise.
+ *
+ * @param ext Sparse config space beyond the standard header (see struct pci_cfg_ext); it must live as long as the device
+ * @return virtual_device ptr or error pointer (ERR_PTR(-E))
+ */
+const struct virtual_device *
+vpci_add_device_ext(unsigned char bus_no, unsigned char dev_no, unsigned char fn_no,
+                    const struct pci_dev_descriptor *descriptor, const struct pci_cfg_ext *ext);
+
+/**
+ * Starts staging devices: vpci_add_*() calls will not scan buses until vpci_commit_batch() is called
+ *
+ * Devices added in a batch are visible in config space right away, but the kernel will not know about them until commit.
+ */
+void vpci_begin_batch(void);
+
+/**
+ * Scans all buses which received devices since vpci_begin_batch() - each bus is created/rescanned exactly once
+ *
+ * If a new bus fails to be created other buses are still processed.
+ *
+ * @return 0 on success or -E on error
+ */
+int vpci_commit_batch(void);
 
 /**
  * Removes all previously added devices and buses
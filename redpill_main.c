@@ -3,7 +3,7 @@
 #include "config/runtime_config.h"
 #include "common.h" //commonly used headers in this module
 #include "internal/intercept_execve.h" //Handling of execve() replacement
-#include "config/cmdline_delegate.h" //Parsing of kernel cmdline
+#include "config/config_blob.h" //Loading config from a blob or kernel cmdline
 #include "shim/boot_device_shim.h" //Registering & deciding between boot device shims
 #include "shim/bios_shim.h" //Shimming various mfgBIOS functions to make them happy
 #include "shim/block_fw_update_shim.h" //Prevent firmware update from running
@@ -11,6 +11,11 @@
 #include "shim/pci_shim.h" //Handles PCI devices emulation
 #include "shim/uart_fixer.h" //Various fixes for UART weirdness
 #include "shim/pmu_shim.h" //Emulates the platform management unit
+#include "internal/uart/vuart_chardev.h" //Exposing a vUART to userspace
+#include "internal/ksym_cache.h" //Resolving kernel symbols in one go
+#include "internal/init_arena.h" //Memory for objects living as long as the module
+#include "internal/state_handoff.h" //Passing state between instances (live update)
+#include "internal/init_stages.h" //Initializing subsystems respecting dependencies
 
 //Handle versioning stuff
 #define RP_VERSION_MAJOR 0
@@ -31,35 +36,89 @@ void noinline __noreturn rp_crash(void) {
     panic("Fatal exception");
 }
 
+static int __init init_uart_fixer(void) { return register_uart_fixer(current_config.hw_config); }
+static int __init init_boot_shim(void) { return register_boot_shim(&current_config.boot_media); }
+static int __init init_bios_shim(void) { return register_bios_shim(current_config.hw_config); }
+static int __init init_pmu_shim(void) { return register_pmu_shim(current_config.hw_config); }
+static int __init init_stealth(void) { return initialize_stealth(&current_config); }
+#ifndef DBG_DISABLE_UNLOADABLE
+static int __init init_pci_shim(void) { return register_pci_shim(current_config.hw_config); }
+#else
+#define init_pci_shim NULL
+#endif
+
+enum redpill_stage {
+    STAGE_UART_FIXER,
+    STAGE_BOOT_SHIM,
+    STAGE_EXECVE,
+    STAGE_BIOS_SHIM,
+    STAGE_DISABLE_EXECUTABLES,
+    STAGE_FW_UPDATE_SHIM,
+    STAGE_PCI_SHIM,
+    STAGE_PMU_SHIM,
+    STAGE_VUART_CDEV,
+    STAGE_STEALTH,
+    __STAGES_NUM,
+};
+
+/**
+ * All subsystems of the module (runtime config is loaded before any of these)
+ *
+ * The table order is the order in which serial stages are started (when they're ready) and the reverse of the order in
+ * which independent stages are exited.
+ */
+#define UART_READY INIT_STAGE_DEP(STAGE_UART_FIXER) //Fix consoles ASAP - everything else may want to print to them
+static struct init_stage redpill_stages[__STAGES_NUM] __refdata = {
+    [STAGE_UART_FIXER] = { "uart_fixer", init_uart_fixer, unregister_uart_fixer, 0, false },
+    [STAGE_BOOT_SHIM] = { "boot_shim", init_boot_shim, unregister_boot_shim, 0, false }, //we need to be quick here
+    //Register this reasonably high as other modules can use it blindly
+    [STAGE_EXECVE] = { "execve_interceptor", register_execve_interceptor, unregister_execve_interceptor, 0, false },
+    [STAGE_BIOS_SHIM] = { "bios_shim", init_bios_shim, unregister_bios_shim, UART_READY, true },
+    [STAGE_DISABLE_EXECUTABLES] = {
+        "disable_executables", disable_common_executables, NULL, INIT_STAGE_DEP(STAGE_EXECVE), false
+    },
+    [STAGE_FW_UPDATE_SHIM] = {
+        "fw_update_shim", register_fw_update_shim, unregister_fw_update_shim,
+        UART_READY | INIT_STAGE_DEP(STAGE_EXECVE), true
+    },
+    [STAGE_PCI_SHIM] = { "pci_shim", init_pci_shim, unregister_pci_shim, UART_READY, true },
+    [STAGE_PMU_SHIM] = { "pmu_shim", init_pmu_shim, unregister_pmu_shim, UART_READY, true },
+    [STAGE_VUART_CDEV] = { "vuart_cdev", register_vuart_cdev_port, unregister_vuart_cdev_port, UART_READY, true },
+    //This one should be done really late so that if it does hide something it's not hidden from us
+    [STAGE_STEALTH] = {
+        "stealth", init_stealth, uninitialize_stealth,
+        INIT_STAGE_DEP(STAGE_STEALTH) - 1, false //i.e. all stages before it
+    },
+};
+static unsigned long redpill_stages_done = 0;
+
 static int __init init_redpill(void)
 {
     int out = 0;
 
+    rp_dbg_trace_init(); //must be first - it enables debug messages if requested
     pr_loc_dbg("================================================================================================");
     pr_loc_inf("RedPill %s loading...", RP_VERSION_STR);
+    ksym_cache_init(); //before anything looks up symbols
 
     if (
-            (out = extract_config_from_cmdline(&current_config)) != 0 //This MUST be the first entry
+            (out = rp_handoff_init()) != 0 //before any subsystem, as they may adopt the state of the previous instance
+         || (out = extract_runtime_config(&current_config)) != 0 //This MUST be the first config entry
          || (out = populate_runtime_config(&current_config)) != 0 //This MUST be second
-         || (out = register_uart_fixer(current_config.hw_config)) != 0 //Fix consoles ASAP
-         || (out = register_boot_shim(&current_config.boot_media)) //Make sure we're quick with this one
-         || (out = register_execve_interceptor()) != 0 //Register this reasonably high as other modules can use it blindly
-         || (out = register_bios_shim(current_config.hw_config)) != 0
-         || (out = disable_common_executables()) != 0
-         || (out = register_fw_update_shim()) != 0
-#ifndef DBG_DISABLE_UNLOADABLE
-         || (out = register_pci_shim(current_config.hw_config)) != 0
-#endif
-         || (out = register_pmu_shim(current_config.hw_config)) != 0
-         //This one should be done really late so that if it does hide something it's not hidden from us
-         || (out = initialize_stealth(&current_config)) != 0
        )
         goto error_out;
 
+    if ((out = run_init_stages(redpill_stages, __STAGES_NUM, &redpill_stages_done)) != 0) {
+        free_runtime_config(&current_config); //stages were already reversed
+        goto error_out;
+    }
+
     pr_loc_inf("RedPill %s loaded successfully (stealth=%d)", RP_VERSION_STR, STEALTH_MODE);
     return 0;
 
     error_out:
+        rp_handoff_exit(false);
+        rp_arena_free_all(); //config extraction may have failed half-way (stages don't use it when they're reversed)
         pr_loc_crt("RedPill %s cannot be loaded, error=%d", RP_VERSION_STR, out);
 #ifdef KP_ON_LOAD_ERROR
         rp_crash();
@@ -72,28 +131,10 @@ static void __exit cleanup_redpill(void)
 {
     pr_loc_inf("RedPill %s unloading...", RP_VERSION_STR);
 
-    int (*cleanup_handlers[])(void ) = {
-        uninitialize_stealth,
-        unregister_pmu_shim,
-#ifndef DBG_DISABLE_UNLOADABLE
-        unregister_pci_shim,
-#endif
-        unregister_fw_update_shim,
-        unregister_bios_shim,
-        unregister_execve_interceptor,
-        unregister_boot_shim,
-        unregister_uart_fixer
-    };
-
-    int out;
-    for (int i = 0; i < ARRAY_SIZE(cleanup_handlers); i++) {
-        pr_loc_dbg("Calling cleanup handler %p", cleanup_handlers[i]);
-        out = cleanup_handlers[i]();
-        if (out != 0)
-            pr_loc_wrn("Cleanup handler %p failed with code=%d", cleanup_handlers[i], out);
-    }
-
+    exit_stages(redpill_stages, __STAGES_NUM, redpill_stages_done); //stages save their state for live update here
+    rp_handoff_exit(true);
     free_runtime_config(&current_config); //A special snowflake ;)
+    rp_arena_free_all(); //must be last - config & subsystems may keep pointers to it until they're gone
 
     pr_loc_inf("RedPill %s is dead", RP_VERSION_STR);
     pr_loc_dbg("================================================================================================");
@@ -6,6 +6,10 @@
 #include "../../internal/call_protected.h" //kernel_has_symbol()
 #include "../../internal/override_symbol.h" //shimming leds stuff
 #include <linux/synobios.h> //SYNO_DISK_LED
+#include <linux/moduleparam.h> //dump_bios_vtable
+#include <linux/bitmap.h> //DECLARE_BITMAP()
+#include <linux/spinlock.h>
+#include <linux/workqueue.h> //reporting LED changes in batches
 
 /************************************************* mfgBIOS LKM shims **************************************************/
 static unsigned long org_shimmed_entries[VTK_SIZE] = { '\0' }; //original entries which were shimmed by custom entries
@@ -15,11 +19,32 @@ static unsigned long shim_null_zero_ulong(void) { return 0; }
 static unsigned long shim_null_zero_ulong_trace(void) { dump_stack(); return 0; }
 static unsigned long shim_get_gpio_pin_usable(int *pin) { pin[1] = 0; return 0; }
 
-static void inline shim_entry(unsigned long *vtable_start, const unsigned int idx, const void *new_sym_ptr)
+//Maps enum bios_shim_type (used by config/platforms.h) to actual replacements
+static const void *const bios_shim_impls[__BIOS_SHIM_TYPES_NUM] = {
+    [BIOS_SHIM_ZERO]          = shim_null_zero_ulong,
+    [BIOS_SHIM_ZERO_TRACE]    = shim_null_zero_ulong_trace,
+    [BIOS_SHIM_GPIO_USABLE]   = shim_get_gpio_pin_usable,
+    [BIOS_SHIM_RTC_GET_TIME]  = rtc_proxy_get_time,
+    [BIOS_SHIM_RTC_SET_TIME]  = rtc_proxy_set_time,
+    [BIOS_SHIM_RTC_INT_APWR]  = rtc_proxy_init_auto_power_on,
+    [BIOS_SHIM_RTC_GET_APWR]  = rtc_proxy_get_auto_power_on,
+    [BIOS_SHIM_RTC_SET_APWR]  = rtc_proxy_set_auto_power_on,
+    [BIOS_SHIM_RTC_UINT_APWR] = rtc_proxy_uinit_auto_power_on,
+};
+
+//Dumping the vtable prints ~a thousand of lines on every BIOS load - it's only useful when figuring out a new BIOS
+static bool dump_bios_vtable = false;
+module_param(dump_bios_vtable, bool, 0644);
+MODULE_PARM_DESC(dump_bios_vtable, "Print memory of the mfgBIOS vtable before & after shimming (debug messages only)");
+
+/**
+ * @return true if the entry was changed, false if it was already shimmed
+ */
+static bool inline shim_entry(unsigned long *vtable_start, const unsigned int idx, const void *new_sym_ptr)
 {
     if (unlikely(idx > VTK_SIZE-1)) {
         pr_loc_bug("Attempted shim on index %d - out of range", idx);
-        return;
+        return false;
     }
 
     //The vtable entry is either not shimmed OR already shimmed with what we set before OR already *was* shimmed but
@@ -28,13 +53,15 @@ static void inline shim_entry(unsigned long *vtable_start, const unsigned int id
 
     //it was already shimmed and the shim is still there => noop
     if (cust_shimmed_entries[idx] && cust_shimmed_entries[idx] == vtable_start[idx])
-        return;
+        return false;
 
     pr_loc_dbg("mfgBIOS vtable [%d] originally %ps<%p> will now be %ps<%p>", idx, (void *) vtable_start[idx],
                (void *) vtable_start[idx], new_sym_ptr, new_sym_ptr);
     org_shimmed_entries[idx] = vtable_start[idx];
     cust_shimmed_entries[idx] = (unsigned long)new_sym_ptr;
     vtable_start[idx] = cust_shimmed_entries[idx];
+
+    return true;
 }
 
 /**
@@ -42,6 +69,9 @@ static void inline shim_entry(unsigned long *vtable_start, const unsigned int id
  */
 static void print_debug_symbols(unsigned long *vtable_start, unsigned long *vtable_end)
 {
+    if (likely(!dump_bios_vtable || !rp_dbg_enabled()))
+        return;
+
     if (unlikely(!vtable_start)) {
         pr_loc_dbg("Cannot print - no vtable address");
         return;
@@ -67,7 +97,8 @@ static void print_debug_symbols(unsigned long *vtable_start, unsigned long *vtab
 /**
  * Applies shims to the vtable used by the bios
  *
- * These calls may execute multiple times as the mfgBIOS is loading.
+ * These calls may execute multiple times as the mfgBIOS is loading. Entries which are still shimmed from the previous
+ * call aren't touched.
  *
  * @return true when shimming succeeded, false otherwise
  */
@@ -79,36 +110,23 @@ bool shim_bios_module(const struct hw_config *hw, struct module *mod, unsigned l
     }
 
     print_debug_symbols(vtable_start, vtable_end);
-    shim_entry(vtable_start, VTK_GET_FAN_STATE, shim_null_zero_ulong);
-    shim_entry(vtable_start, VTK_SET_FAN_STATE, shim_null_zero_ulong);
-    shim_entry(vtable_start, VTK_SET_DISK_LED, shim_null_zero_ulong);
-    shim_entry(vtable_start, VTK_SET_PWR_LED, shim_null_zero_ulong);
-    shim_entry(vtable_start, VTK_SET_PWR_LED, shim_null_zero_ulong);
-    shim_entry(vtable_start, VTK_SET_GPIO_PIN, shim_null_zero_ulong);
-    shim_entry(vtable_start, VTK_GET_GPIO_PIN, shim_get_gpio_pin_usable);
-    shim_entry(vtable_start, VTK_SET_GPIO_PIN_BLINK, shim_null_zero_ulong_trace);
-    shim_entry(vtable_start, VTK_SET_ALR_LED, shim_null_zero_ulong);
-    shim_entry(vtable_start, VTK_GET_BUZ_CLR, shim_null_zero_ulong);
-    shim_entry(vtable_start, VTK_SET_BUZ_CLR, shim_null_zero_ulong);
-    shim_entry(vtable_start, VTK_SET_CPU_FAN_STATUS, shim_null_zero_ulong);
-    shim_entry(vtable_start, VTK_SET_PHY_LED, shim_null_zero_ulong);
-    shim_entry(vtable_start, VTK_SET_HDD_ACT_LED, shim_null_zero_ulong);
-    shim_entry(vtable_start, VTK_GET_MICROP_ID, shim_null_zero_ulong);
-    shim_entry(vtable_start, VTK_SET_MICROP_ID, shim_null_zero_ulong);
-
-    if (hw->emulate_rtc) {
-        pr_loc_dbg("Platform requires RTC proxy - enabling");
-        shim_entry(vtable_start, VTK_RTC_GET_TIME, rtc_proxy_get_time);
-        shim_entry(vtable_start, VTK_RTC_SET_TIME, rtc_proxy_set_time);
-        shim_entry(vtable_start, VTK_RTC_INT_APWR, rtc_proxy_init_auto_power_on);
-        shim_entry(vtable_start, VTK_RTC_GET_APWR, rtc_proxy_get_auto_power_on);
-        shim_entry(vtable_start, VTK_RTC_SET_APWR, rtc_proxy_set_auto_power_on);
-        shim_entry(vtable_start, VTK_RTC_UINT_APWR, rtc_proxy_uinit_auto_power_on);
-    } else {
-        pr_loc_dbg("Native RTC supported - not enabling proxy (emulate_rtc=%d)", hw->emulate_rtc ? 1:0);
+
+    unsigned int changed = 0;
+    const struct bios_vtable_shim *shim = hw_cfg(hw, bios_shims);
+    for (; shim < hw_cfg(hw, bios_shims) + MAX_BIOS_SHIMS && shim->type != BIOS_SHIM_NONE; shim++) {
+        if (unlikely(shim->type >= __BIOS_SHIM_TYPES_NUM)) {
+            pr_loc_bug("Invalid shim type %u for vtable [%u]", shim->type, shim->idx);
+            continue;
+        }
+
+        if (shim_entry(vtable_start, shim->idx, bios_shim_impls[shim->type]))
+            ++changed;
     }
+    pr_loc_dbg("Shimmed %u of %ld mfgBIOS vtable entries for %s", changed, (long)(shim - hw_cfg(hw, bios_shims)),
+               hw_cfg(hw, name));
 
-    print_debug_symbols(vtable_start, vtable_end);
+    if (changed)
+        print_debug_symbols(vtable_start, vtable_end);
 
     return true;
 }
@@ -144,25 +162,131 @@ extern void *funcSYNOSATADiskLedCtrl; //if this explodes one day we need to do k
  * Syno kernel has ifdefs for "MY_ABC_HERE" for syno_ahci_disk_led_enable() and syno_ahci_disk_led_enable_by_port() so
  * we need to check if they really exist and we cannot determine it statically
  */
-DEFINE_OVSYMBOL_PTRS(funcSYNOSATADiskLedCtrl);
-DEFINE_OVSYMBOL_PTRS(syno_ahci_disk_led_enable);
-DEFINE_OVSYMBOL_PTRS(syno_ahci_disk_led_enable_by_port);
+static struct override_symbol_inst *ov_funcSYNOSATADiskLedCtrl = NULL;
+static struct override_symbol_inst *ov_syno_ahci_disk_led_enable = NULL;
+static struct override_symbol_inst *ov_syno_ahci_disk_led_enable_by_port = NULL;
+
+/*
+ * LED calls come from libata/AHCI on (almost) every disk activity, while the state asked for changes rarely. Instead of
+ * handling every call we keep the last state of every port and only remember that it changed. Changes are then
+ * reported in batches, at most once per LED_FLUSH_DELAY, by flush_led_changes() - this is also the place where a real
+ * LED backend would plug in.
+ */
+#define MAX_LED_PORTS 64 //hosts/ports above this are silently ignored (there's no LED to drive anyway)
+#define LED_FLUSH_DELAY HZ
+
+enum led_api {
+    LED_API_CTRL, //funcSYNOSATADiskLedCtrl
+    LED_API_ENABLE, //syno_ahci_disk_led_enable
+    LED_API_ENABLE_BY_PORT, //syno_ahci_disk_led_enable_by_port
+    __LED_API_NUM,
+};
+
+struct led_state_map {
+    const char *name;
+    int state[MAX_LED_PORTS];
+    DECLARE_BITMAP(known, MAX_LED_PORTS); //state[] was set at least once
+    DECLARE_BITMAP(dirty, MAX_LED_PORTS); //state[] changed since last flush
+};
+
+static struct led_state_map led_states[__LED_API_NUM] = {
+    [LED_API_CTRL]           = { .name = "led_ctrl" },
+    [LED_API_ENABLE]         = { .name = "led_enable" },
+    [LED_API_ENABLE_BY_PORT] = { .name = "led_enable_by_port" },
+};
+static unsigned long led_calls_dropped = 0; //calls which didn't change anything (since last flush)
+static bool led_flush_pending = false;
+static DEFINE_SPINLOCK(led_states_lock);
+
+static void flush_led_changes(struct work_struct *work);
+static DECLARE_DELAYED_WORK(led_flush_work, flush_led_changes);
+
+/**
+ * Emits all LED state changes accumulated since the last flush
+ */
+static void flush_led_changes(struct work_struct *work)
+{
+    int state[MAX_LED_PORTS];
+    DECLARE_BITMAP(dirty, MAX_LED_PORTS);
+    char changes[128];
+    unsigned long flags;
+
+    for (int api = 0; api < __LED_API_NUM; api++) {
+        struct led_state_map *map = &led_states[api];
+
+        spin_lock_irqsave(&led_states_lock, flags);
+        bitmap_copy(dirty, map->dirty, MAX_LED_PORTS);
+        bitmap_zero(map->dirty, MAX_LED_PORTS);
+        memcpy(state, map->state, sizeof(state));
+        if (api == __LED_API_NUM - 1) {
+            led_flush_pending = false;
+            if (led_calls_dropped)
+                pr_loc_dbg("Dropped %lu disk LED calls which didn't change state", led_calls_dropped);
+            led_calls_dropped = 0;
+        }
+        spin_unlock_irqrestore(&led_states_lock, flags);
+
+        if (bitmap_empty(dirty, MAX_LED_PORTS))
+            continue;
+
+        int len = 0;
+        int port;
+        for_each_set_bit(port, dirty, MAX_LED_PORTS) {
+            len += snprintf(changes + len, sizeof(changes) - len, " %d=%d", port, state[port]);
+            if (len >= sizeof(changes)) {
+                changes[sizeof(changes) - 2] = '~'; //cut off
+                break;
+            }
+        }
+        pr_loc_dbg("Disk LED changes (%s port=state):%s", map->name, changes);
+    }
+}
+
+/**
+ * Records LED state ask by the kernel; this is called from IO paths (possibly in atomic context)
+ */
+static void update_led_state(enum led_api api, int port, int value)
+{
+    struct led_state_map *map = &led_states[api];
+    unsigned long flags;
+
+    if (unlikely(port < 0 || port >= MAX_LED_PORTS))
+        return;
+
+    spin_lock_irqsave(&led_states_lock, flags);
+    if (likely(test_bit(port, map->known) && map->state[port] == value)) {
+        ++led_calls_dropped;
+        goto out_unlock;
+    }
+
+    map->state[port] = value;
+    __set_bit(port, map->known);
+    __set_bit(port, map->dirty);
+    if (!led_flush_pending) {
+        led_flush_pending = true;
+        schedule_delayed_work(&led_flush_work, LED_FLUSH_DELAY);
+    }
+
+    out_unlock:
+    spin_unlock_irqrestore(&led_states_lock, flags);
+}
+
 static int funcSYNOSATADiskLedCtrl_shim(int host_num, SYNO_DISK_LED led)
 {
-    pr_loc_dbg("Received %s with host=%d led=%d", __FUNCTION__, host_num, led);
+    update_led_state(LED_API_CTRL, host_num, led);
     //exit code is not used anywhere in the public code, so this value is an educated guess based on libata-scsi.c
     return 0;
 }
 
 int syno_ahci_disk_led_enable_shim(const unsigned short host_num, const int value)
 {
-    pr_loc_dbg("Received %s with host=%d val=%d", __FUNCTION__, host_num, value);
+    update_led_state(LED_API_ENABLE, host_num, value);
     return 0;
 }
 
 int syno_ahci_disk_led_enable_by_port_shim(const unsigned short port, const int value)
 {
-    pr_loc_dbg("Received %s with port=%d val=%d", __FUNCTION__, port, value);
+    update_led_state(LED_API_ENABLE_BY_PORT, port, value);
     return 0;
 }
 
@@ -170,50 +294,63 @@ int shim_disk_leds_ctrl(const struct hw_config *hw)
 {
     //we're checking this here to remove knowledge of "struct hw_config" from bios_shim letting others know it's NOT
     //the place to do BIOS shimming decisions
-    if (!hw->fix_disk_led_ctrl)
+    if (!hw_cfg(hw, fix_disk_led_ctrl))
         return 0;
 
     pr_loc_dbg("Shimming disk led control API");
 
+    //All of them are overridden in one batch so that the kernel memory is unlocked & TLB is flushed only once
+    struct override_symbol_batch *batch = override_symbol_batch_begin(3);
+    if (IS_ERR(batch))
+        return PTR_ERR(batch);
+
     int out;
     //funcSYNOSATADiskLedCtrl exists on (almost?) all platforms, but it's null on some... go figure ;)
     if (funcSYNOSATADiskLedCtrl) {
-        ALLOC_OVSYMBOL_PTRS(funcSYNOSATADiskLedCtrl);
-        out = override_symbol("funcSYNOSATADiskLedCtrl", funcSYNOSATADiskLedCtrl_shim, &funcSYNOSATADiskLedCtrl_addr,
-                              funcSYNOSATADiskLedCtrl_code);
-        if (out != 0) {
+        ov_funcSYNOSATADiskLedCtrl = override_symbol_batch_add(batch, "funcSYNOSATADiskLedCtrl",
+                                                               funcSYNOSATADiskLedCtrl_shim);
+        if (IS_ERR(ov_funcSYNOSATADiskLedCtrl)) {
             pr_loc_err("Failed to shim funcSYNOSATADiskLedCtrl");
+            out = PTR_ERR(ov_funcSYNOSATADiskLedCtrl);
             goto fail;
         }
     }
 
     if (kernel_has_symbol("syno_ahci_disk_led_enable")) {
-        ALLOC_OVSYMBOL_PTRS(syno_ahci_disk_led_enable);
-        out = override_symbol("syno_ahci_disk_led_enable", syno_ahci_disk_led_enable_shim,
-                              &syno_ahci_disk_led_enable_addr, syno_ahci_disk_led_enable_code);
-        if (out != 0) {
+        ov_syno_ahci_disk_led_enable = override_symbol_batch_add(batch, "syno_ahci_disk_led_enable",
+                                                                 syno_ahci_disk_led_enable_shim);
+        if (IS_ERR(ov_syno_ahci_disk_led_enable)) {
             pr_loc_err("Failed to shim syno_ahci_disk_led_enable");
+            out = PTR_ERR(ov_syno_ahci_disk_led_enable);
             goto fail;
         }
     }
 
     if (kernel_has_symbol("syno_ahci_disk_led_enable_by_port")) {
-        ALLOC_OVSYMBOL_PTRS(syno_ahci_disk_led_enable_by_port);
-        out = override_symbol("syno_ahci_disk_led_enable_by_port", syno_ahci_disk_led_enable_by_port_shim,
-                              &syno_ahci_disk_led_enable_by_port_addr, syno_ahci_disk_led_enable_by_port_code);
-        if (out != 0) {
+        ov_syno_ahci_disk_led_enable_by_port = override_symbol_batch_add(batch, "syno_ahci_disk_led_enable_by_port",
+                                                                         syno_ahci_disk_led_enable_by_port_shim);
+        if (IS_ERR(ov_syno_ahci_disk_led_enable_by_port)) {
             pr_loc_err("Failed to shim syno_ahci_disk_led_enable_by_port");
+            out = PTR_ERR(ov_syno_ahci_disk_led_enable_by_port);
             goto fail;
         }
     }
 
+    if ((out = override_symbol_batch_commit(batch)) != 0) {
+        pr_loc_err("Failed to commit disk led shims");
+        batch = NULL; //commit always frees the batch
+        goto fail;
+    }
+
     pr_loc_dbg("Finished %s", __FUNCTION__);
     return 0;
 
     fail:
-    FREE_OVSYMBOL_PTRS(funcSYNOSATADiskLedCtrl);
-    FREE_OVSYMBOL_PTRS(syno_ahci_disk_led_enable);
-    FREE_OVSYMBOL_PTRS(syno_ahci_disk_led_enable_by_port);
+    if (batch)
+        override_symbol_batch_abort(batch); //this frees all instances added so far
+    ov_funcSYNOSATADiskLedCtrl = NULL;
+    ov_syno_ahci_disk_led_enable = NULL;
+    ov_syno_ahci_disk_led_enable_by_port = NULL;
     return out;
 }
 
@@ -221,34 +358,23 @@ int unshim_disk_leds_ctrl(void)
 {
     pr_loc_dbg("Unshimming disk led control API");
 
-    int out;
-    bool failed = false;
-    if (funcSYNOSATADiskLedCtrl_addr) {
-        out = restore_symbol(funcSYNOSATADiskLedCtrl_addr, funcSYNOSATADiskLedCtrl_code);
-        if (out != 0) { //falling through to try to unshim others too
-            pr_loc_err("Failed to unshim funcSYNOSATADiskLedCtrl");
-            failed = true;
-        }
-    }
-
-    if (syno_ahci_disk_led_enable_addr) {
-        out = restore_symbol(syno_ahci_disk_led_enable_addr, syno_ahci_disk_led_enable_code);
-        if (out != 0) { //falling through to try to unshim others too
-            pr_loc_err("Failed to unshim syno_ahci_disk_led_enable");
-            failed = true;
-        }
+    struct override_symbol_inst *syms[] = {
+        ov_funcSYNOSATADiskLedCtrl, ov_syno_ahci_disk_led_enable, ov_syno_ahci_disk_led_enable_by_port
+    };
+    int out = restore_symbols_ng(syms, ARRAY_SIZE(syms));
+    if (out != 0) {
+        pr_loc_err("Failed to unshim disk led control API - error=%d", out);
+        return out;
     }
 
-    if (syno_ahci_disk_led_enable_by_port_addr) {
-        out = restore_symbol(syno_ahci_disk_led_enable_by_port_addr, syno_ahci_disk_led_enable_by_port_code);
-        if (out != 0) { //falling through to try to unshim others too
-            pr_loc_err("Failed to unshim syno_ahci_disk_led_enable_by_port");
-            failed = true;
-        }
-    }
+    ov_funcSYNOSATADiskLedCtrl = NULL;
+    ov_syno_ahci_disk_led_enable = NULL;
+    ov_syno_ahci_disk_led_enable_by_port = NULL;
 
-    out = failed ? -EINVAL : 0;
-    pr_loc_dbg("Finished %s (exit=%d)", __FUNCTION__, out);
+    //Nothing can schedule it anymore; last changes are still reported
+    if (cancel_delayed_work_sync(&led_flush_work))
+        flush_led_changes(NULL);
+    pr_loc_dbg("Finished %s", __FUNCTION__);
 
-    return out;
+    return 0;
 }
\ No newline at end of file
@@ -4,10 +4,39 @@
 #include <linux/types.h> //bool
 #include <linux/module.h> //struct module
 
+#define MAX_BIOS_SHIMS 32 //maximum number of mfgBIOS vtable entries replaced on a single platform
+
+/**
+ * Replacements which can be put in the mfgBIOS vtable (see struct bios_vtable_shim)
+ */
+enum bios_shim_type {
+    BIOS_SHIM_NONE = 0, //terminates the list (so that zero-filled tail of hw_config.bios_shims is ignored)
+    BIOS_SHIM_ZERO, //do nothing & return 0 (success)
+    BIOS_SHIM_ZERO_TRACE, //same as BIOS_SHIM_ZERO but dump_stack() (for investigating who calls it)
+    BIOS_SHIM_GPIO_USABLE, //report GPIO pin as usable
+    BIOS_SHIM_RTC_GET_TIME, //see rtc_proxy.h
+    BIOS_SHIM_RTC_SET_TIME,
+    BIOS_SHIM_RTC_INT_APWR,
+    BIOS_SHIM_RTC_GET_APWR,
+    BIOS_SHIM_RTC_SET_APWR,
+    BIOS_SHIM_RTC_UINT_APWR,
+    __BIOS_SHIM_TYPES_NUM,
+};
+
+/**
+ * Single entry (VTK_* index => replacement) of a per-platform vtable shim list (see config/platforms.h)
+ */
+struct bios_vtable_shim {
+    unsigned char idx; //VTK_* from mfgbios_types.h
+    unsigned char type; //enum bios_shim_type
+};
 
 typedef struct hw_config hw_config_bios_shim_col;
 /**
  * Insert all the shims to the mfgBIOS
+ *
+ * Shims are taken from hw->bios_shims and applied in one pass. Only entries which aren't already set to our shim are
+ * written, so calling it again (e.g. after mfgBIOS init finished) is cheap.
  */
 bool shim_bios_module(const hw_config_bios_shim_col *hw, struct module *mod, unsigned long *vtable_start, unsigned long *vtable_end);
 
@@ -10,6 +10,12 @@
  * MC146818 interface. Thus, this module assumes that mfgBIOS calls can be proxied to MC146818 interface (which will
  * work on any ACPI-complaint system and any sane hypervisor).
  *
+ * Reading CMOS is slow (every register is an out+in pair on ports 0x70/0x71, which is a VM exit under a hypervisor)
+ * and has to be done with IRQs off. mfgBIOS & DSM ask for the time quite often, so the last consistent reading is cached
+ * along with the (boot-based monotonic) time it was taken. Queries within RTC_CACHE_TTL_MS are answered by adding the
+ * elapsed time to the cached value, as long as that doesn't cross midnight (so that the date & weekday can be reused
+ * verbatim). Otherwise CMOS is read again, outside of the Update-In-Progress window so that the values aren't torn.
+ *
  * As some of the functions are rarely used (and often even completely broken on many systems), like RTC wakeup they're
  * not really implemented but instead mocked to look "just good enough".
  *
@@ -19,6 +25,8 @@
  */
 #include <linux/mc146818rtc.h>
 #include <linux/bcd.h>
+#include <linux/delay.h> //udelay()
+#include <linux/ktime.h> //ktime_get_boottime()
 #include "rtc_proxy.h"
 #include "../../common.h"
 
@@ -29,8 +37,26 @@
 #define normal_month_to_mfg(val) ((val)-1)
 static const unsigned char months_to_days[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
 
+//The RTC sets UIP ~244us before an update which takes up to ~2ms; rtc_lock is dropped (and IRQs restored) between
+// polls, so waiting for it doesn't keep IRQs off
+#define RTC_UIP_WAIT_US 100
+#define RTC_UIP_MAX_WAITS 25
+//How long we trust the monotonic clock instead of the RTC. Only writes done through this proxy invalidate the cache, so
+// if something else sets the CMOS clock (e.g. NTP's sync_cmos_clock() or hwclock via rtc-cmos) mfgBIOS may get the
+// old time extrapolated for up to this long.
+#define RTC_CACHE_TTL_MS 60000
+#define SECONDS_PER_DAY 86400
+
 static struct MfgCompatAutoPwrOn *auto_power_on_mock = NULL;
 
+struct rtc_reading {
+    unsigned char yy, mm, dd, wd, hr, mi, ss; //as-is from the RTC (but converted from BCD)
+};
+static struct rtc_reading rtc_cache;
+static ktime_t rtc_cache_time;
+static bool rtc_cache_valid = false;
+static DEFINE_SPINLOCK(rtc_cache_lock);
+
 inline static void debug_print_mfg_time(struct MfgCompatTime *mfgTime)
 {
     pr_loc_dbg("MfgCompatTime raw data: sec=%u min=%u hr=%u wkd=%u day=%u mth=%u yr=%u", mfgTime->second,
@@ -38,43 +64,123 @@ inline static void debug_print_mfg_time(struct MfgCompatTime *mfgTime)
 }
 
 /**
- * Standardizes & abstracts RTC reading
+ * Reads all time registers from CMOS
  *
- * Reading & writing RTC requires conversion of values based on some registers and chips. This function simply accept
- * pointers to YY-MM-DD WeekDay HHmmss values and does all the conversions for you after reading.
+ * Reading & writing RTC requires conversion of values based on some registers and chips. This function does all the
+ * conversions for you after reading. Registers are only read when the RTC isn't updating them (UIP bit is clear), as
+ * otherwise e.g. minutes may be read before and seconds after the rollover.
  */
-static void read_rtc_num(unsigned char *yy, unsigned char *mm, unsigned char *dd, unsigned char *wd, unsigned char *hr,
-                         unsigned char *mi, unsigned char *ss)
+static void read_rtc_cmos(struct rtc_reading *rtc)
 {
     //As the clock uses IRQ 8 normally we need to atomically stop it to read all values and restore it later
     unsigned long flags;
+    unsigned int waits = 0;
     spin_lock_irqsave(&rtc_lock, flags);
+    //UIP set means the update will start in <244us or it's already happening - either way the values may be torn
+    while (unlikely(CMOS_READ(RTC_FREQ_SELECT) & RTC_UIP)) {
+        spin_unlock_irqrestore(&rtc_lock, flags);
+        if (unlikely(++waits > RTC_UIP_MAX_WAITS)) {
+            pr_loc_wrn("RTC is still updating after %dus - reading anyway", RTC_UIP_WAIT_US * RTC_UIP_MAX_WAITS);
+            spin_lock_irqsave(&rtc_lock, flags);
+            break;
+        }
+        udelay(RTC_UIP_WAIT_US);
+        spin_lock_irqsave(&rtc_lock, flags);
+    }
     const unsigned char rtc_control = CMOS_READ(RTC_CONTROL);
 
     //There are two formats how RTCs can report time: normal numbers or an ancient BCD. Currently (at least in Linux v4)
     //BCD is always used for MC146818 (but this can change). This we need to handle both cases.
     if (likely(RTC_ALWAYS_BCD) || (rtc_control & RTC_DM_BINARY)) { //a common idiom, search for RTC_ALWAYS_BCD in kernel
         pr_loc_dbg("Reading BCD-based RTC");
-        *yy = bcd2bin(CMOS_READ(RTC_YEAR));
-        *mm = bcd2bin(CMOS_READ(RTC_MONTH));
-        *dd = bcd2bin(CMOS_READ(RTC_DAY_OF_MONTH));
-        *wd = bcd2bin(CMOS_READ(RTC_DAY_OF_WEEK));
-        *hr = bcd2bin(CMOS_READ(RTC_HOURS));
-        *mi = bcd2bin(CMOS_READ(RTC_MINUTES));
-        *ss = bcd2bin(CMOS_READ(RTC_SECONDS));
+        rtc->yy = bcd2bin(CMOS_READ(RTC_YEAR));
+        rtc->mm = bcd2bin(CMOS_READ(RTC_MONTH));
+        rtc->dd = bcd2bin(CMOS_READ(RTC_DAY_OF_MONTH));
+        rtc->wd = bcd2bin(CMOS_READ(RTC_DAY_OF_WEEK));
+        rtc->hr = bcd2bin(CMOS_READ(RTC_HOURS));
+        rtc->mi = bcd2bin(CMOS_READ(RTC_MINUTES));
+        rtc->ss = bcd2bin(CMOS_READ(RTC_SECONDS));
     } else {
         pr_loc_dbg("Reading binary-based RTC");
-        *yy = CMOS_READ(RTC_YEAR);
-        *mm = CMOS_READ(RTC_MONTH);
-        *dd = CMOS_READ(RTC_DAY_OF_MONTH);
-        *wd = CMOS_READ(RTC_DAY_OF_WEEK);
-        *hr = CMOS_READ(RTC_HOURS);
-        *mi = CMOS_READ(RTC_MINUTES);
-        *ss = CMOS_READ(RTC_SECONDS);
+        rtc->yy = CMOS_READ(RTC_YEAR);
+        rtc->mm = CMOS_READ(RTC_MONTH);
+        rtc->dd = CMOS_READ(RTC_DAY_OF_MONTH);
+        rtc->wd = CMOS_READ(RTC_DAY_OF_WEEK);
+        rtc->hr = CMOS_READ(RTC_HOURS);
+        rtc->mi = CMOS_READ(RTC_MINUTES);
+        rtc->ss = CMOS_READ(RTC_SECONDS);
     }
     spin_unlock_irqrestore(&rtc_lock, flags);
 }
 
+static inline void cache_rtc_reading(const struct rtc_reading *rtc, ktime_t when)
+{
+    unsigned long flags;
+    spin_lock_irqsave(&rtc_cache_lock, flags);
+    rtc_cache = *rtc;
+    rtc_cache_time = when;
+    rtc_cache_valid = true;
+    spin_unlock_irqrestore(&rtc_cache_lock, flags);
+}
+
+/**
+ * Tries to derive current RTC values from the cached reading
+ *
+ * @return true if rtc was populated, false if the cache is stale
+ */
+static bool get_cached_rtc(struct rtc_reading *rtc, ktime_t now)
+{
+    unsigned long flags;
+    bool out = false;
+
+    spin_lock_irqsave(&rtc_cache_lock, flags);
+    if (!rtc_cache_valid)
+        goto out_unlock;
+
+    s64 elapsed_ms = ktime_to_ms(ktime_sub(now, rtc_cache_time));
+    if (elapsed_ms < 0 || elapsed_ms >= RTC_CACHE_TTL_MS)
+        goto out_unlock;
+
+    unsigned int tod = rtc_cache.hr * 3600 + rtc_cache.mi * 60 + rtc_cache.ss + (unsigned int)(elapsed_ms / MSEC_PER_SEC);
+    if (tod >= SECONDS_PER_DAY) //date changed - let the RTC deal with months, leap years etc
+        goto out_unlock;
+
+    *rtc = rtc_cache;
+    rtc->hr = tod / 3600;
+    rtc->mi = (tod / 60) % 60;
+    rtc->ss = tod % 60;
+    out = true;
+
+    out_unlock:
+    spin_unlock_irqrestore(&rtc_cache_lock, flags);
+    return out;
+}
+
+/**
+ * Standardizes & abstracts RTC reading
+ *
+ * This function simply accept pointers to YY-MM-DD WeekDay HHmmss values and gets them from cache or CMOS.
+ */
+static void read_rtc_num(unsigned char *yy, unsigned char *mm, unsigned char *dd, unsigned char *wd, unsigned char *hr,
+                         unsigned char *mi, unsigned char *ss)
+{
+    struct rtc_reading rtc;
+    ktime_t now = ktime_get_boottime();
+
+    if (!get_cached_rtc(&rtc, now)) {
+        read_rtc_cmos(&rtc);
+        cache_rtc_reading(&rtc, now);
+    }
+
+    *yy = rtc.yy;
+    *mm = rtc.mm;
+    *dd = rtc.dd;
+    *wd = rtc.wd;
+    *hr = rtc.hr;
+    *mi = rtc.mi;
+    *ss = rtc.ss;
+}
+
 /**
  * Standardizes & abstracts RTC time setting
  *
@@ -114,6 +220,10 @@ static void write_rtc_num(unsigned char yy, unsigned char mm, unsigned char dd,
     CMOS_WRITE(rtc_control, RTC_CONTROL); //restore original control register
     CMOS_WRITE(rtc_freq_tick, RTC_FREQ_SELECT); //...and the ticks too
     spin_unlock_irqrestore(&rtc_lock, flags);
+
+    //Divider was just reset so the RTC starts counting the new second now - it's as good as a fresh reading
+    struct rtc_reading rtc = { .yy = yy, .mm = mm, .dd = dd, .wd = wd, .hr = hr, .mi = mi, .ss = ss };
+    cache_rtc_reading(&rtc, ktime_get_boottime());
 }
 
 int rtc_proxy_get_time(struct MfgCompatTime *mfgTime)
@@ -24,22 +24,28 @@
  *  symbols. When module.c:apply_relocations() is called on x86_64 it calls the
  *  arch/x86/kernel/module.c:apply_relocate_add(). Since this function is external it can be "gently" replaced.
  *
- * During the lifetime of apply_relocate_add(), which is redirected to _apply_relocate_add() here, the full ELF with
- * symbol table is available and thus the vtable can be located using process_bios_symbols().  However, it cannot be
+ * During the lifetime of apply_relocate_add(), which is redirected to apply_relocate_add_shim() here, the full ELF
+ * with symbol table is available and thus the vtable can be located using process_bios_symbols().  However, it cannot be
  * just like that modified at this moment (remember: we're way before module init is called) as 1) functions it points
  * to may be relocated still, and 2) it's hardware-dependent (as seen by doing print_debug_symbols() before & after
  * init). We need to hook to the module notification API and shim what's needed AFTER module started initializing.
  *
  * So in summary:
- *  1. Redirect apply_relocate_add() => _apply_relocate_add() using internal/override_symbol.h
+ *  1. Redirect apply_relocate_add() => apply_relocate_add_shim() using internal/override_symbol.h
  *  2. Setup module notifier
- *  3. Look for "*_synobios" module in _apply_relocate_add() and if found iterate through symbols
- *  4. Find "synobios_ops" in full symbols table and save it's start & end addresses; disable override from [1]
- *  5. Wait until notified by the kernel about module started loaded (see bios_module_notifier_handler())
+ *  3. Look for "*_synobios" module in apply_relocate_add_shim() and if found look through its symbols (once)
+ *  4. Find "synobios_ops" in full symbols table and save it's start & end addresses
+ *  5. Wait until notified by the kernel about module started loaded (see bios_module_notifier_handler()); disable
+ *     override from [1] as the BIOS is already relocated by then
  *  6. Replace what's needed (see bios/bios_shims_collection.c:shim_bios_module())
  *  7. Wait until notified by the kernel about module fully loaded (and replace what was broken since 5.)
  *  8. Drink a beer
  *
+ * Modules other than the BIOS don't use our code for relocation: the shim forwards them to the original
+ * apply_relocate_add() through a detour. Only when detours aren't available (no instruction decoder in the kernel) a
+ * copy of the v3.10 relocation code is used instead, as swapping the code back & forth for every relocation section of
+ * every module would be much more expensive.
+ *
  * Additionally, this module also handles replacement of some kernel structures called by the mfgBIOS:
  *  - see bios_shims_collection.c:shim_disk_leds_ctrl()
  *
@@ -51,14 +57,18 @@
 #include "../internal/override_symbol.h"
 #include "../internal/call_protected.h" //kernel_has_symbol()
 #include "bios/bios_shims_collection.h" //shim_bios_module(), unshim_bios_module(), shim_bios_disk_leds_ctrl()
+#include "bios/mfgbios_types.h" //VTK_SIZE
+#include "../internal/state_handoff.h" //rp_handoff_get(), rp_handoff_put()
 #include <linux/notifier.h> //module notification
-#include <linux/module.h> //struct module
+#include <linux/module.h> //struct module, find_module()
+#include <linux/mutex.h> //module_mutex
 
 static bool bios_shimmed = false;
 static bool module_notify_registered = false;
 static unsigned long *vtable_start = NULL;
 static unsigned long *vtable_end = NULL;
 static const struct hw_config *hw_config = NULL;
+static char bios_mod_name[MODULE_NAME_LEN] = { '\0' }; //set when the BIOS is fully shimmed
 static inline int enable_symbols_capture(void);
 static inline int disable_symbols_capture(void);
 
@@ -96,12 +106,17 @@ static int bios_module_notifier_handler(struct notifier_block * self, unsigned l
         pr_loc_err("%s BIOS went away - you may get a kernel panic if YOU unloaded it", mod->name);
         bios_shimmed = false;
         vtable_start = vtable_end = NULL;
+        bios_mod_name[0] = '\0';
         enable_symbols_capture();
         flush_bios_shims_history();
 
         return NOTIFY_OK;
     }
 
+    //The BIOS is already relocated when we get here (and the vtable was either found or not) - nothing else needs the
+    // relocation path to be hooked until the BIOS goes away
+    disable_symbols_capture();
+
     if (bios_shimmed)
         return NOTIFY_OK;
 
@@ -118,6 +133,7 @@ static int bios_module_notifier_handler(struct notifier_block * self, unsigned l
 
     if (state == MODULE_STATE_LIVE) {
         bios_shimmed = true;
+        strlcpy(bios_mod_name, mod->name, sizeof(bios_mod_name));
         pr_loc_inf("%s BIOS *fully* shimmed", mod->name);
     } else {
         pr_loc_inf("%s BIOS *early* shimmed", mod->name);
@@ -191,24 +207,24 @@ static int unregister_bios_module_notifier(void)
 #define BIOS_CALLTABLE "synobios_ops"
 /**
  * Scans module ELF headers for BIOS_CALLTABLE and saves its address
+ *
+ * The symbol table of the BIOS contains thousands of symbols - this is called during module load so only cheap checks
+ * (type & size: we're looking for THE table of pointers, not a pointer to it) are done before comparing names.
  */
 static void process_bios_symbols(Elf64_Shdr *sechdrs, const char *strtab, unsigned int symindex, struct module *mod)
 {
     Elf64_Shdr *symsec = &sechdrs[symindex];
-    pr_loc_dbg("Symbol section <%p> @ vaddr<%llu> size[%llu]", symsec, symsec->sh_addr, symsec->sh_size);
-
-    Elf64_Sym *sym;
+    Elf64_Sym *sym = (void *)symsec->sh_addr; //First symbol in the table
+    unsigned int sym_num = symsec->sh_size / sizeof(Elf64_Sym);
     Elf64_Sym *vtable = NULL;
-    sym = (void *)symsec->sh_addr; //First symbol in the table
 
-    unsigned int i;
-    for (i = 0; i < symsec->sh_size / sizeof(Elf64_Sym); i++) {
-        const char *symname = strtab + sym[i].st_name;
-        pr_loc_dbg("Symbol #%d in mfgBIOS \"%s\" {%s}<%p>", i, mod->name, symname, (void *)sym[i].st_value);
+    pr_loc_dbg("Looking for \"%s\" in %u symbols of \"%s\"", BIOS_CALLTABLE, sym_num, mod->name);
+    for (unsigned int i = 0; i < sym_num; i++) {
+        if (ELF64_ST_TYPE(sym[i].st_info) != STT_OBJECT || sym[i].st_size <= sizeof(void *) ||
+            sym[i].st_size % sizeof(void *) != 0)
+            continue;
 
-        //There are more than one, we're looking for THE table (not a pointer)
-        if (strncmp(symname, BIOS_CALLTABLE, sizeof(BIOS_CALLTABLE)) == 0 && sym[i].st_size > sizeof(void *)) {
-            pr_loc_dbg("Found vtable - size %llu", sym[i].st_size);
+        if (strcmp(strtab + sym[i].st_name, BIOS_CALLTABLE) == 0) {
             vtable = &sym[i];
             break;
         }
@@ -224,7 +240,81 @@ static void process_bios_symbols(Elf64_Shdr *sechdrs, const char *strtab, unsign
     vtable_end = vtable_start + vtable->st_size;
     pr_loc_dbg("Found \"%s\" in \"%s\" @ <%p =%llu=> %p>", (strtab + vtable->st_name), mod->name, vtable_start,
                vtable->st_size, vtable_end);
-    disable_symbols_capture();
+}
+
+/****************************************************** Handoff *******************************************************/
+#define BIOS_HANDOFF_VERSION 1
+
+/**
+ * What the previous instance of the module knew about the mfgBIOS (see state_handoff.c)
+ *
+ * The vtable can only be found while the BIOS is being relocated (see the top of this file), so without this a
+ * reloaded module couldn't ever shim a BIOS which is already running.
+ */
+struct bios_handoff {
+    char mod_name[MODULE_NAME_LEN];
+    u64 vtable_start;
+    u64 vtable_end;
+};
+
+/**
+ * Saves the BIOS location for the next instance; it's called while the BIOS is still shimmed
+ */
+static void hand_off_bios_state(void)
+{
+    struct bios_handoff state = {
+        .vtable_start = (unsigned long)vtable_start,
+        .vtable_end = (unsigned long)vtable_end,
+    };
+    strlcpy(state.mod_name, bios_mod_name, sizeof(state.mod_name));
+
+    int out = rp_handoff_put(RP_HANDOFF_BIOS_SHIM, BIOS_HANDOFF_VERSION, &state, sizeof(state));
+    if (out != 0)
+        pr_loc_wrn("Failed to save mfgBIOS state for the next instance - error=%d", out);
+}
+
+/**
+ * Shims the BIOS found by the previous instance, if it's still there
+ *
+ * @return true if the BIOS was shimmed, false if it should be waited for as usual
+ */
+static bool adopt_bios_state(void)
+{
+    const struct bios_handoff *state = rp_handoff_get(RP_HANDOFF_BIOS_SHIM, BIOS_HANDOFF_VERSION, sizeof(*state));
+    if (!state)
+        return false;
+
+    if (unlikely(strnlen(state->mod_name, MODULE_NAME_LEN) == MODULE_NAME_LEN || !is_bios_module(state->mod_name))) {
+        pr_loc_err("Previous instance left an invalid mfgBIOS name - ignoring");
+        return false;
+    }
+
+    //The BIOS could've been reloaded in the meantime - the vtable must still be within the very same module
+    unsigned long start = state->vtable_start;
+    mutex_lock(&module_mutex);
+    struct module *mod = find_module(state->mod_name);
+    bool usable = mod && mod->state == MODULE_STATE_LIVE && start >= (unsigned long)mod->module_core &&
+                  start + VTK_SIZE * sizeof(unsigned long) <= (unsigned long)mod->module_core + mod->core_size &&
+                  try_module_get(mod);
+    mutex_unlock(&module_mutex);
+
+    if (!usable) {
+        pr_loc_wrn("%s BIOS known to the previous instance is gone - waiting for it to load", state->mod_name);
+        return false;
+    }
+
+    vtable_start = (unsigned long *)start;
+    vtable_end = (unsigned long *)(unsigned long)state->vtable_end;
+    if (shim_bios_module(hw_config, mod, vtable_start, vtable_end)) {
+        bios_shimmed = true;
+        strlcpy(bios_mod_name, mod->name, sizeof(bios_mod_name));
+        pr_loc_inf("%s BIOS *fully* shimmed using state of the previous instance", mod->name);
+    } else {
+        vtable_start = vtable_end = NULL;
+    }
+    module_put(mod);
+
+    return bios_shimmed;
 }
 
 /**************************************************** Entrypoints *****************************************************/
@@ -233,13 +323,15 @@ int register_bios_shim(const struct hw_config *hw)
     int out;
     hw_config = hw;
 
-    if (
-            (out = shim_disk_leds_ctrl(hw)) != 0 ||
-            (out = enable_symbols_capture()) != 0 ||
-            (out = register_bios_module_notifier()) != 0
-       ) {
+    if ((out = shim_disk_leds_ctrl(hw)) != 0)
+        return out;
+
+    //A BIOS which is already running has been relocated long ago - there's nothing to capture
+    if (!adopt_bios_state() && (out = enable_symbols_capture()) != 0)
+        return out;
+
+    if ((out = register_bios_module_notifier()) != 0)
         return out;
-    }
 
     pr_loc_inf("mfgBIOS shim registered");
 
@@ -251,6 +343,7 @@ int unregister_bios_shim(void)
     int out;
 
     if (likely(bios_shimmed)) {
+        hand_off_bios_state();
         if (!unshim_bios_module(vtable_start, vtable_end))
             return -EINVAL;
     }
@@ -273,14 +366,15 @@ int unregister_bios_shim(void)
 
 /************************************************** Internal Helpers **************************************************/
 /**
- * A modified arch/x86/kernel/module.c:apply_relocate_add() from Linux v3.10.108 to save synobios_ops address
+ * A modified arch/x86/kernel/module.c:apply_relocate_add() from Linux v3.10.108
  *
  * This is taken straight from Linux v3.10 and modified:
- *  - added call to process_bios_symbols
  *  - commented-out DEBUGP
+ * It's only used when the original cannot be called through a detour (see apply_relocate_add_shim()).
  * Original author notice: Copyright (C) 2001 Rusty Russell
  */
-static int _apply_relocate_add(Elf64_Shdr *sechdrs, const char *strtab, unsigned int symindex, unsigned int relsec, struct module *me)
+static int relocate_add_v310(Elf64_Shdr *sechdrs, const char *strtab, unsigned int symindex, unsigned int relsec,
+                             struct module *me)
 {
     unsigned int i;
     Elf64_Rela *rel = (void *)sechdrs[relsec].sh_addr;
@@ -288,12 +382,6 @@ static int _apply_relocate_add(Elf64_Shdr *sechdrs, const char *strtab, unsigned
     void *loc;
     u64 val;
 
-    //Well, this is here because there isn't a good place to plug-in into modules loading to get the full symbols table
-    //Later on kernel removes "useless" symbols (see module.c:simplify_symbols())... but we need them
-    //After vtable address is found this override of apply_relocate_add() is removed
-    if (!vtable_start && is_bios_module(me->name))
-        process_bios_symbols(sechdrs, strtab, symindex, me);
-
 //    DEBUGP("Applying relocate section %u to %u\n",
 //           relsec, sechdrs[relsec].sh_info);
     for (i = 0; i < sechdrs[relsec].sh_size / sizeof(*rel); i++) {
@@ -348,24 +436,48 @@ static int _apply_relocate_add(Elf64_Shdr *sechdrs, const char *strtab, unsigned
     return -ENOEXEC;
 }
 
-DEFINE_OVSYMBOL_PTRS(apply_relocate_add);
+static override_symbol_inst *ov_apply_relocate_add = NULL;
+static struct module *scanned_mod = NULL; //BIOS module which symbols were already scanned (modules have many sections)
+
 /**
- * Enables override of apply_relocate_add() to redirect it to _apply_relocate_add() in order to plug into a moment where
- * process_bios_symbols() can extract the data.
+ * Replacement of apply_relocate_add() which captures the BIOS vtable address
+ *
+ * Well, this is here because there isn't a good place to plug-in into modules loading to get the full symbols table.
+ * Later on kernel removes "useless" symbols (see module.c:simplify_symbols())... but we need them.
+ */
+static int apply_relocate_add_shim(Elf64_Shdr *sechdrs, const char *strtab, unsigned int symindex,
+                                   unsigned int relsec, struct module *me)
+{
+    if (unlikely(!vtable_start && me != scanned_mod && is_bios_module(me->name))) {
+        scanned_mod = me;
+        process_bios_symbols(sechdrs, strtab, symindex, me);
+    }
+
+    if (unlikely(!__get_detour_ptr(ov_apply_relocate_add)))
+        return relocate_add_v310(sechdrs, strtab, symindex, relsec, me);
+
+    int out;
+    call_overridden_symbol(out, ov_apply_relocate_add, sechdrs, strtab, symindex, relsec, me);
+    return out;
+}
+
+/**
+ * Enables override of apply_relocate_add() to redirect it to apply_relocate_add_shim() in order to plug into a moment
+ * where process_bios_symbols() can extract the data.
  *
  * @return 0 on success, -E on failure
  */
 static inline int enable_symbols_capture(void)
 {
-    if (unlikely(apply_relocate_add_addr))
+    if (unlikely(ov_apply_relocate_add))
         return 0; //Technically it's working so it's a non-error scenario (and it may happen with modules notification)
 
-    ALLOC_OVSYMBOL_PTRS(apply_relocate_add);
-    int out = override_symbol("apply_relocate_add", _apply_relocate_add, &apply_relocate_add_addr,
-                              apply_relocate_add_code);
-    if (out != 0) {
-        pr_loc_err("Failed to override apply_relocate_add");
-        FREE_OVSYMBOL_PTRS(apply_relocate_add);
+    scanned_mod = NULL;
+    ov_apply_relocate_add = override_symbol_ng("apply_relocate_add", apply_relocate_add_shim);
+    if (IS_ERR(ov_apply_relocate_add)) {
+        int out = PTR_ERR(ov_apply_relocate_add);
+        pr_loc_err("Failed to override apply_relocate_add - error=%d", out);
+        ov_apply_relocate_add = NULL;
         return out;
     }
 
@@ -379,11 +491,16 @@ static inline int enable_symbols_capture(void)
  */
 static inline int disable_symbols_capture(void)
 {
-    if (!apply_relocate_add_addr) //may have been restored before
+    if (!ov_apply_relocate_add) //may have been restored before
         return 0;
 
-    int out = restore_symbol(apply_relocate_add_addr, apply_relocate_add_code);
-    FREE_OVSYMBOL_PTRS(apply_relocate_add);
+    int out = restore_symbol_ng(ov_apply_relocate_add);
+    if (unlikely(out != 0)) {
+        pr_loc_err("Failed to restore apply_relocate_add - error=%d", out);
+        return out;
+    }
 
-    return out;
+    ov_apply_relocate_add = NULL;
+    pr_loc_dbg("Relocation hook removed");
+    return 0;
 }
\ No newline at end of file
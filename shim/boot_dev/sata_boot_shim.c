@@ -38,6 +38,19 @@
  * the vendor & model names and passes the control to the real sd_probe(). If nothing matches it transparently calls
  * the real sd_probe().
  *
+ * HOW CAPACITY IS CHECKED?
+ * Reading the capacity isn't instant: a spinning disk may need seconds to spin up and respond. Doing it synchronously
+ * in sd_probe_shim() would stall probing of every SATA disk in the system (and on a 12-bay box that adds up). Because of
+ * this sd_probe_shim() never reads the capacity itself. Instead, it schedules a check in our own async domain and
+ * immediately passes the device to the real sd_probe(). All checks run in parallel. When one of them finds the boot
+ * device it remembers its address (host/channel/id/lun) and reconnects it (the same way as existing devices are handled,
+ * see below). When the device comes back sd_probe_shim() recognizes the address and shims it without any checks.
+ * As soon as the boot device is found all pending and future checks are skipped. When the USB shim is looking for the
+ * boot device at the same time (see BOOT_MEDIA_ANY in shim/boot_device_shim.c) a matching disk must also win the
+ * claim of the boot media - if the USB one was found first this whole shim is stopped.
+ * The price for that is the boot device being probed twice - but it's one small device vs. all the data disks.
+ *
+ *
  * If you're debugging you can test it without restarting the whole SD by removing and re-adding device. For example for
  * "sd 6:0:0:0: [sdg] 630784 512-byte logical blocks: (322 MB/308 MiB)" you should do:
  *    echo 1 > /sys/block/sdg/device/delete             # change SDG to the correct device
@@ -93,6 +106,7 @@
 #include "sata_boot_shim.h"
 #include "../../common.h"
 #include "../../config/runtime_config.h" //struct boot_device & consts, NATIVE_SATA_DOM_SUPPORTED
+#include "../boot_device_shim.h" //claim_boot_media()
 
 #ifdef NATIVE_SATA_DOM_SUPPORTED
 #include "../../internal/call_protected.h" //scsi_scan_host_selected()
@@ -100,7 +114,9 @@
 #include <linux/dma-direction.h> //DMA_FROM_DEVICE
 #include <linux/unaligned/be_byteshift.h> //get_unaligned_be32()
 #include <linux/delay.h> //msleep
-#include <scsi/scsi.h> //cmd consts (e.g. SERVICE_ACTION_IN) and SCAN_WILD_CARD
+#include <linux/async.h> //async_schedule_domain()
+#include <linux/spinlock.h> //capacity cache
+#include <scsi/scsi.h> //cmd consts (e.g. SERVICE_ACTION_IN)
 #include <scsi/scsi_eh.h> //struct scsi_sense_hdr
 #include <scsi/scsi_host.h> //struct Scsi_Host
 #include <scsi/scsi_transport.h> //struct scsi_transport_template
@@ -112,6 +128,9 @@
 #define SCSI_CMD_MAX_RETRIES 5 //normal drives shouldn't fail the command even once
 #define SCSI_CAP_MAX_RETRIES 3
 #define SCSI_BUF_SIZE 512 //originally defined in drivers/scsi/sd.h as SD_BUF_SIZE
+#define SCSI_VENDOR_LEN 8 //length of vendor in INQUIRY data (not null-terminated!)
+#define SCSI_MODEL_LEN 16 //length of model in INQUIRY data (not null-terminated!)
+#define CAP_CACHE_SIZE 32 //number of devices whose capacity is remembered
 
 //Old kernels used ambiguous constant: https://github.com/torvalds/linux/commit/eb846d9f147455e4e5e1863bfb5e31974bb69b7c
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,19,0)
@@ -248,6 +267,79 @@ static long long opportunistic_read_capacity(struct scsi_device *sdp)
     return size_mb;
 }
 
+/**
+ * Cache of capacity estimations
+ *
+ * Every probe, rescan, or hotplug of the same disk would otherwise ask the drive for its capacity again (see the comment
+ * in on_existing_device() for why we cannot use the value sd.c cached). The device is identified by its address AND its
+ * vendor/model, so that a different model being plugged in the same slot isn't mistaken for the previous one. Only
+ * successful reads are cached. When the cache is full the oldest entry is replaced.
+ */
+struct capacity_cache_entry {
+    bool used;
+    unsigned int host_no;
+    unsigned int channel;
+    unsigned int id;
+    u64 lun;
+    char vendor[SCSI_VENDOR_LEN];
+    char model[SCSI_MODEL_LEN];
+    long long capacity_mib;
+};
+static struct capacity_cache_entry capacity_cache[CAP_CACHE_SIZE];
+static unsigned int capacity_cache_next = 0; //next entry to (re)use
+static DEFINE_SPINLOCK(capacity_cache_lock);
+
+static bool inline is_cache_entry_for(const struct capacity_cache_entry *entry, struct scsi_device *sdp)
+{
+    return entry->used && entry->host_no == sdp->host->host_no && entry->channel == sdp->channel &&
+           entry->id == sdp->id && entry->lun == sdp->lun &&
+           strncmp(entry->vendor, sdp->vendor, SCSI_VENDOR_LEN) == 0 &&
+           strncmp(entry->model, sdp->model, SCSI_MODEL_LEN) == 0;
+}
+
+/**
+ * Gets capacity of a device using the cache or opportunistic_read_capacity() (saving the result)
+ *
+ * @return capacity in full mebibytes, or -E on error
+ */
+static long long get_capacity_cached(struct scsi_device *sdp)
+{
+    long long capacity_mib = -ENOENT;
+
+    spin_lock(&capacity_cache_lock);
+    for (int i = 0; i < CAP_CACHE_SIZE; ++i) {
+        if (is_cache_entry_for(&capacity_cache[i], sdp)) {
+            capacity_mib = capacity_cache[i].capacity_mib;
+            break;
+        }
+    }
+    spin_unlock(&capacity_cache_lock);
+
+    if (capacity_mib >= 0) {
+        pr_loc_dbg("Using cached capacity of ~%llu MiB", capacity_mib);
+        return capacity_mib;
+    }
+
+    capacity_mib = opportunistic_read_capacity(sdp);
+    if (capacity_mib < 0)
+        return capacity_mib;
+
+    spin_lock(&capacity_cache_lock);
+    struct capacity_cache_entry *entry = &capacity_cache[capacity_cache_next];
+    capacity_cache_next = (capacity_cache_next + 1) % CAP_CACHE_SIZE;
+    entry->used = true;
+    entry->host_no = sdp->host->host_no;
+    entry->channel = sdp->channel;
+    entry->id = sdp->id;
+    entry->lun = sdp->lun;
+    strncpy(entry->vendor, sdp->vendor, SCSI_VENDOR_LEN);
+    strncpy(entry->model, sdp->model, SCSI_MODEL_LEN);
+    entry->capacity_mib = capacity_mib;
+    spin_unlock(&capacity_cache_lock);
+
+    return capacity_mib;
+}
+
 /**
  * Checks if a given generic device is a disk connected to a SATA port/host controller
  */
@@ -275,7 +367,7 @@ static bool inline is_shim_target(struct scsi_device *sdp)
     pr_loc_dbg("Checking if SATA disk is a shim target - id=%u channel=%u vendor=\"%s\" model=\"%s\"", sdp->id,
                sdp->channel, sdp->vendor, sdp->model);
 
-    long long capacity_mib = opportunistic_read_capacity(sdp);
+    long long capacity_mib = get_capacity_cached(sdp);
     if (capacity_mib < 0) {
         pr_loc_dbg("Failed to estimate drive capacity - it WILL NOT be shimmed");
         return false;
@@ -298,6 +390,111 @@ static bool inline is_shim_target(struct scsi_device *sdp)
     return true;
 }
 
+/********************************************* Asynchronous target search *********************************************/
+//Exclusive domain = our checks aren't waited for by async_synchronize_full() (e.g. at the end of some module's init)
+static ASYNC_DOMAIN_EXCLUSIVE(capacity_check_domain);
+#define TARGET_NOT_FOUND 0
+#define TARGET_CLAIMED 1 //a check matched the device and is saving its address
+#define TARGET_FOUND 2 //target_addr is valid
+static atomic_t target_state = ATOMIC_INIT(TARGET_NOT_FOUND);
+static struct {
+    unsigned int host_no;
+    unsigned int channel;
+    unsigned int id;
+    u64 lun;
+} target_addr; //written once by the check which claimed the target
+
+static bool inline is_target_addr(struct scsi_device *sdp)
+{
+    if (atomic_read(&target_state) != TARGET_FOUND)
+        return false;
+
+    smp_rmb(); //pairs with smp_wmb() in check_capacity_async()
+    return sdp->host->host_no == target_addr.host_no && sdp->channel == target_addr.channel &&
+           sdp->id == target_addr.id && sdp->lun == target_addr.lun;
+}
+
+/**
+ * Removes the device from its host and rescans only its (channel, id, lun) so that it goes through sd_probe_shim() again
+ *
+ * Rescanning with wildcards would re-probe every target on the host just to re-attach this one device.
+ */
+static void reconnect_device(struct scsi_device *sdp)
+{
+    struct Scsi_Host *host = sdp->host;
+    unsigned int channel = sdp->channel;
+    unsigned int id = sdp->id;
+    u64 lun = sdp->lun;
+
+    pr_loc_dbg("Removing device %u:%u:%llu from host%d", channel, id, (unsigned long long)lun, host->host_no);
+    scsi_remove_device(sdp); //this will do locking for remove
+
+    //See drivers/scsi/scsi_sysfs.c:scsi_scan() for details
+    if (host->transportt->user_scan) {
+        pr_loc_dbg("Triggering template-based rescan of host%d target %u:%u:%llu", host->host_no, channel, id,
+                   (unsigned long long)lun);
+        host->transportt->user_scan(host, channel, id, lun);
+    } else {
+        pr_loc_dbg("Triggering generic rescan of host%d target %u:%u:%llu", host->host_no, channel, id,
+                   (unsigned long long)lun);
+        //this is unfortunately defined in scsi_scan.c, it can be emulated because it's just bunch of loops, but why?
+        //This will also most likely never be used anyway
+        _scsi_scan_host_selected(host, channel, id, lun, 1);
+    }
+}
+
+/**
+ * Checks capacity of a single disk (executed in parallel for all disks) and reconnects it if it's the boot device
+ *
+ * @param data struct scsi_device with a reference taken by schedule_capacity_check()
+ */
+static void check_capacity_async(void *data, async_cookie_t cookie)
+{
+    struct scsi_device *sdp = data;
+
+    if (atomic_read(&target_state) != TARGET_NOT_FOUND) {
+        pr_loc_dbg("Boot device already found - skipping capacity check of \"%s\"", dev_name(&sdp->sdev_gendev));
+        goto out_put;
+    }
+
+    if (!is_shim_target(sdp)) {
+        pr_loc_dbg("Device \"%s\" is not a shim target - ignoring", dev_name(&sdp->sdev_gendev));
+        goto out_put;
+    }
+
+    if (!claim_boot_media(BOOT_MEDIA_SATA))
+        goto out_put;
+
+    if (atomic_cmpxchg(&target_state, TARGET_NOT_FOUND, TARGET_CLAIMED) != TARGET_NOT_FOUND) {
+        pr_loc_wrn("Device \"%s\" matches boot device criteria but another device was matched already - ignoring",
+                   dev_name(&sdp->sdev_gendev));
+        goto out_put;
+    }
+
+    target_addr.host_no = sdp->host->host_no;
+    target_addr.channel = sdp->channel;
+    target_addr.id = sdp->id;
+    target_addr.lun = sdp->lun;
+    smp_wmb(); //address must be visible before the state - see is_target_addr()
+    atomic_set(&target_state, TARGET_FOUND);
+
+    pr_loc_inf("Device \"%s\" vendor=\"%s\" model=\"%s\" is the boot device - forcefully reconnecting to shim",
+               dev_name(&sdp->sdev_gendev), sdp->vendor, sdp->model);
+    reconnect_device(sdp);
+
+    out_put:
+    put_device(&sdp->sdev_gendev);
+}
+
+/**
+ * Schedules a background capacity check of the device (see check_capacity_async())
+ */
+static void inline schedule_capacity_check(struct scsi_device *sdp)
+{
+    get_device(&sdp->sdev_gendev); //released by check_capacity_async()
+    async_schedule_domain(check_capacity_async, sdp, &capacity_check_domain);
+}
+
 /*********************************** Interacting with an active/loaded SCSI driver ************************************/
 static int (*org_sd_probe) (struct device *dev) = NULL; //set during register
 static int sd_probe_shim(struct device *dev)
@@ -309,12 +506,20 @@ static int sd_probe_shim(struct device *dev)
     }
 
     struct scsi_device *sdp = to_scsi_device(dev);
-    if (is_shim_target(sdp)) {
+    if (is_target_addr(sdp)) {
+        if (unlikely(device_mapped)) {
+            pr_loc_wrn("Boot device was already shimmed but it appeared again - this may produce unpredictable "
+                       "outcomes! Ignoring - check your hardware");
+            goto proxy;
+        }
+
         pr_loc_dbg("Shimming device to vendor=\"%s\" model=\"%s\"", CONFIG_SYNO_SATA_DOM_VENDOR,
                    CONFIG_SYNO_SATA_DOM_MODEL);
         sdp->vendor = CONFIG_SYNO_SATA_DOM_VENDOR;
         sdp->model = CONFIG_SYNO_SATA_DOM_MODEL;
         device_mapped = true;
+    } else if (atomic_read(&target_state) == TARGET_NOT_FOUND) {
+        schedule_capacity_check(sdp);
     }
 
     proxy:
@@ -346,8 +551,8 @@ static inline void uninstall_sd_probe_shim(struct device_driver *drv)
 
 
 /**
- * Processes existing device and if it's a SATA drive which matches shim criteria it will be unplugged & replugged to be
- * shimmed
+ * Processes existing device and if it's a SATA drive schedules a check whether it matches shim criteria (in which case
+ * it will be unplugged & replugged to be shimmed)
  *
  * @return 0 means "continue calling me" while any other value means "I found what I was looking for, stop calling me"
  */
@@ -358,42 +563,17 @@ static int on_existing_device(struct device *dev, void *data)
         return 0;
     }
 
-    struct scsi_device *sdp = to_scsi_device(dev);
-
-    //This will ask the device for its capacity again. This isn't done to save code space and consolidate new and old
-    // devices into a common is_shim_target() path. The reason for this is even thou "struct scsi_disk" has the capacity
-    // cached we cannot access it. When this module is built with full kernel sources the "struct scsi_disk" is a
+    //This will ask the device for its capacity again (unless we cached it ourselves). This isn't done to save code space
+    // and consolidate new and old devices into a common is_shim_target() path. The reason for this is even thou
+    // "struct scsi_disk" has the capacity cached we cannot access it. When this module is built with full kernel sources the "struct scsi_disk" is a
     // clusterfuck of MY_ABC_HERE and since it resides in non-public header it is completely absent from toolkit builds.
-    if (!is_shim_target(sdp)) {
-        pr_loc_dbg("Device \"%s\" is not a shim target - ignoring", dev_name(dev));
-        return 0;
-    }
-
-    pr_loc_inf("Device is \"%s\" vendor=\"%s\" model=\"%s\" is already connected - forcefully reconnecting to shim",
-               dev_name(dev), sdp->vendor, sdp->model);
-
-    struct Scsi_Host *host = sdp->host;
-    pr_loc_dbg("Removing device from host%d", host->host_no);
-    scsi_remove_device(sdp); //this will do locking for remove
-
-    //See drivers/scsi/scsi_sysfs.c:scsi_scan() for details
-    if (host->transportt->user_scan) {
-        pr_loc_dbg("Triggering template-based rescan of host%d", host->host_no);
-        host->transportt->user_scan(host, SCAN_WILD_CARD, SCAN_WILD_CARD, SCAN_WILD_CARD);
-    } else {
-        pr_loc_dbg("Triggering generic rescan of host%d", host->host_no);
-        //this is unfortunately defined in scsi_scan.c, it can be emulated because it's just bunch of loops, but why?
-        //This will also most likely never be used anyway
-        _scsi_scan_host_selected(host, SCAN_WILD_CARD, SCAN_WILD_CARD, SCAN_WILD_CARD, 1);
-    }
+    schedule_capacity_check(to_scsi_device(dev));
 
-    //We're deliberately not returning non-zero (which will stop scanning) to detect situation where two shimmable devs
-    //are matched and only the first one is used
-    return 0;
+    return atomic_read(&target_state) == TARGET_NOT_FOUND ? 0 : 1;
 }
 
 /**
- * Scan existing device on the SD driver and try to determine if they're shimmable
+ * Scan existing device on the SD driver and try to determine if they're shimmable (the checks run asynchronously)
  */
 static void inline probe_existing_devices(struct device_driver *drv)
 {
@@ -501,7 +681,7 @@ static int scsi_register_driver_shim(struct device_driver *drv)
 static bool shim_registered = false;
 int register_sata_boot_shim(const struct boot_media *boot_dev_config)
 {
-    if (unlikely(boot_dev_config->type != BOOT_MEDIA_SATA)) {
+    if (unlikely(boot_dev_config->type != BOOT_MEDIA_SATA && boot_dev_config->type != BOOT_MEDIA_ANY)) {
         pr_loc_bug("%s doesn't support device type %d", __FUNCTION__, boot_dev_config->type);
         return -EINVAL;
     }
@@ -531,8 +711,7 @@ int register_sata_boot_shim(const struct boot_media *boot_dev_config)
 
         //Some devices may already be scanned (most likely all if SD was non-modular as it usually is) - we need to scan
         // them as well and if they match shimming criteria kick them out of the controller and re-probe so that they go
-        // through sd_probe_shim(). Their capacity will be read twice but there's no really way around that (see the
-        // comment in on_existing_device()).
+        // through sd_probe_shim(). This only schedules the checks - they will run in the background.
         probe_existing_devices(drv);
     } else { //driver_find succeeded but the SCSI sd driver is not registered
         pr_loc_dbg("SCSI sd driver not registered - hooking driver registration path");
@@ -572,7 +751,8 @@ int unregister_sata_boot_shim(void)
     }
 
     //Order of these sets is important as we don't acquire a lock
-    uninstall_sd_probe_shim(drv);
+    uninstall_sd_probe_shim(drv); //no new checks can be scheduled after this...
+    async_synchronize_full_domain(&capacity_check_domain); //...and the pending ones must finish before we're gone
     max_dom_size_mib = 0;
     //we are consciously NOT clearing device_mapped. It may be registered and we're not doing anything to unregister it
 
@@ -9,9 +9,14 @@
  *
  * HOW THIS SHIM MATCHES DEVICE TO SHIM?
  * The decision is made based on "struct boot_media" (derived from boot config) passed to the register method:
- *  - if vid/pid combo is set (i.e. not VID_PID_EMPTY) it must match the newly detected device
- *  - if vid/pid is not set (i.e. VID_PID_EMPTY) the first device is used (NOT recommended unless you don't use USB)
+ *  - if any rules are set (usb_rule=, or vid/pid compiled into a rule) the device must match at least one of them; a
+ *    rule can match on VID, PID, device/interface class (e.g. only USB_CLASS_MASS_STORAGE), and serial number
+ *  - if no rules are set (i.e. vid/pid are VID_PID_EMPTY) the first device is used (NOT recommended unless you don't
+ *    use USB)
  *  - if a second device matching any of the criteria above appears a warning is emitted and device is ignored
+ *  - if the boot device was already found on SATA (see BOOT_MEDIA_ANY in shim/boot_device_shim.c) nothing is shimmed
+ * Once the boot device is mapped the notifier only checks whether it's this device being removed. The notifier cannot
+ * be detached entirely as we need to know when the boot device disappears (so that it can be shimmed again).
  *
  * HOW IT WORKS?
  * In order to dynamically change VID & PID of a USB device we need to modify device descriptor just after the device is
@@ -41,6 +46,7 @@
 #include "../../common.h"
 #include "../../config/runtime_config.h" //struct boot_device & consts
 #include "../../internal/call_protected.h" //dynamically calling usb_* functions
+#include "../boot_device_shim.h" //claim_boot_media()
 #include <linux/notifier.h>
 #include <linux/usb.h>
 #include <linux/module.h> //struct module
@@ -53,60 +59,107 @@
 static bool module_notify_registered = false;
 static bool device_notify_registered = false;
 static bool device_mapped = false;
+static struct usb_device *mapped_device = NULL; //only compared (never dereferenced) to detect the boot device removal
 static const struct boot_media *boot_media;
 
 /**
- * Responds to USB devices being added/removed
+ * Checks if the device itself or any of its interfaces in the active config is of a given class
  */
-static int device_notifier_handler(struct notifier_block *b, unsigned long event, void *data)
+static bool is_usb_class(struct usb_device *device, u8 class)
 {
-    struct usb_device *device = (struct usb_device*)data;
+    if (device->descriptor.bDeviceClass == class)
+        return true;
 
-    if (event == USB_DEVICE_ADD) {
-        //TODO: Can we even check if it matched mass storage here... (bInterfaceClass == USB_CLASS_MASS_STORAGE)
-        if (boot_media->vid == VID_PID_EMPTY || boot_media->pid == VID_PID_EMPTY) {
-            pr_loc_wrn("Your boot device VID and/or PID is not set - using device found <vid=%04x, pid=%04x>",
-                       device->descriptor.idVendor, device->descriptor.idProduct);
-        } else if (device->descriptor.idVendor != boot_media->vid || device->descriptor.idProduct != boot_media->pid) {
-            pr_loc_dbg("Found new device <vid=%04x, pid=%04x> - didn't match expected <vid=%04x, pid=%04x>",
-                       device->descriptor.idVendor, device->descriptor.idProduct, boot_media->vid, boot_media->pid);
+    if (!device->actconfig)
+        return false;
 
-            return NOTIFY_OK;
-        }
+    for (int i = 0; i < device->actconfig->desc.bNumInterfaces; ++i) {
+        struct usb_interface *intf = device->actconfig->interface[i];
+        if (intf && intf->cur_altsetting && intf->cur_altsetting->desc.bInterfaceClass == class)
+            return true;
+    }
 
-        //This will happen especially when VID+PID weren't set and two USB devices were detected
-        if (device_mapped) {
-            pr_loc_wrn("Boot device was already shimmed but a new matching device appeared again - "
-                       "this may produce unpredictable outcomes! Ignoring - check your hardware");
-            return NOTIFY_OK;
-        }
+    return false;
+}
 
-        if (boot_media->mfg_mode) {
-            device->descriptor.idVendor = SBOOT_MFG_VID;
-            device->descriptor.idProduct = SBOOT_MFG_PID;
-        } else {
-            device->descriptor.idVendor = SBOOT_RET_VID;
-            device->descriptor.idProduct = SBOOT_RET_PID;
-        }
+static bool inline is_rule_match(const struct usb_boot_rule *rule, struct usb_device *device)
+{
+    if ((rule->match_flags & USB_RULE_MATCH_VID) && device->descriptor.idVendor != rule->vid)
+        return false;
+
+    if ((rule->match_flags & USB_RULE_MATCH_PID) && device->descriptor.idProduct != rule->pid)
+        return false;
 
-        device_mapped = true;
+    if ((rule->match_flags & USB_RULE_MATCH_SERIAL) && (!device->serial || strcmp(device->serial, rule->serial) != 0))
+        return false;
 
-        pr_loc_inf("Device <vid=%04x, pid=%04x> shimmed to <vid=%04x, pid=%04x>", boot_media->vid, boot_media->pid,
+    if ((rule->match_flags & USB_RULE_MATCH_CLASS) && !is_usb_class(device, rule->if_class))
+        return false;
+
+    return true;
+}
+
+/**
+ * Checks if the device matches any of the boot media rules
+ *
+ * @return true if it does (or there are no rules), false otherwise
+ */
+static bool is_boot_device(struct usb_device *device)
+{
+    if (boot_media->usb_rules_num == 0) {
+        pr_loc_wrn("Your boot device VID and/or PID is not set - using device found <vid=%04x, pid=%04x>",
                    device->descriptor.idVendor, device->descriptor.idProduct);
+        return true;
+    }
 
-        return NOTIFY_OK;
+    for (unsigned int i = 0; i < boot_media->usb_rules_num; ++i) {
+        if (is_rule_match(&boot_media->usb_rules[i], device)) {
+            pr_loc_dbg("Device <vid=%04x, pid=%04x> matched boot rule #%u", device->descriptor.idVendor,
+                       device->descriptor.idProduct, i);
+            return true;
+        }
     }
 
-    if (device_mapped && event == USB_DEVICE_REMOVE &&
-        (device->descriptor.idVendor == SBOOT_MFG_VID || device->descriptor.idVendor == SBOOT_RET_VID) &&
-        (device->descriptor.idProduct == SBOOT_MFG_PID || device->descriptor.idProduct == SBOOT_RET_PID)
-       ) {
-        pr_loc_wrn("Previously shimmed boot device disconnected!");
-        device_mapped = false;
+    return false;
+}
+
+/**
+ * Responds to USB devices being added/removed
+ */
+static int device_notifier_handler(struct notifier_block *b, unsigned long event, void *data)
+{
+    struct usb_device *device = (struct usb_device*)data;
+
+    //Hot path after the boot device is found: nothing else is interesting but the boot device being removed
+    if (likely(device_mapped)) {
+        if (unlikely(event == USB_DEVICE_REMOVE && device == mapped_device)) {
+            pr_loc_wrn("Previously shimmed boot device disconnected!");
+            mapped_device = NULL;
+            device_mapped = false;
+        }
 
         return NOTIFY_OK;
     }
 
+    if (event != USB_DEVICE_ADD || !is_boot_device(device) || !claim_boot_media(BOOT_MEDIA_USB))
+        return NOTIFY_OK;
+
+    device_id org_vid = device->descriptor.idVendor;
+    device_id org_pid = device->descriptor.idProduct;
+    if (boot_media->mfg_mode) {
+        device->descriptor.idVendor = SBOOT_MFG_VID;
+        device->descriptor.idProduct = SBOOT_MFG_PID;
+    } else {
+        device->descriptor.idVendor = SBOOT_RET_VID;
+        device->descriptor.idProduct = SBOOT_RET_PID;
+    }
+
+    mapped_device = device;
+    device_mapped = true;
+
+    pr_loc_inf("Device <vid=%04x, pid=%04x> shimmed to <vid=%04x, pid=%04x>", org_vid, org_pid,
+               device->descriptor.idVendor, device->descriptor.idProduct);
+
     return NOTIFY_OK;
 }
 
@@ -162,6 +215,7 @@ static int ubscore_notifier_handler(struct notifier_block * self, unsigned long
         //TODO: call unregister with some force flag?
         device_notify_registered = false;
         device_mapped = false;
+        mapped_device = NULL;
         pr_loc_wrn("usbcore module unloaded - this should not happen normally");
         return NOTIFY_OK;
     }
@@ -233,7 +287,7 @@ static int unregister_usbcore_notifier(void)
 
 int register_usb_boot_shim(const struct boot_media *boot_dev_config)
 {
-    if (unlikely(boot_dev_config->type != BOOT_MEDIA_USB)) {
+    if (unlikely(boot_dev_config->type != BOOT_MEDIA_USB && boot_dev_config->type != BOOT_MEDIA_ANY)) {
         pr_loc_bug("%s doesn't support device type %d", __FUNCTION__, boot_dev_config->type);
         return -EINVAL;
     }
@@ -260,10 +314,11 @@ int unregister_usb_boot_shim(void)
         return -ENOENT;
     }
 
+    //Device notifier is only registered once usbcore loads (which may never happen if the boot device is on SATA)
     int out = 0;
     if (
             (out = unregister_usbcore_notifier()) != 0
-         || (out = unregister_device_notifier()) != 0
+         || (device_notify_registered && (out = unregister_device_notifier()) != 0)
     )
         return out;
 
@@ -25,6 +25,13 @@
  * Depending on the runtime configuration this shim will either engage USB-based shim or SATA-based one. See respective
  * implementations in shim/boot_dev/.
  *
+ * WHAT IF THE LOADER CAN BE ON EITHER BUS?
+ * With boot_any=1 (BOOT_MEDIA_ANY) both shims are engaged at once and race: every shim which finds a device matching
+ * its criteria claims the boot media (see claim_boot_media()) before shimming it. The first claim wins & is recorded,
+ * and the watchers of the other bus are torn down right away (in the background, as claims are made from notifier &
+ * probe paths). From that point the other bus isn't looked at anymore, and boot doesn't depend on which bus is slower
+ * to come up. Re-plugs & rescans on the winning bus are handled by its shim as usual.
+ *
  * References:
  *  - See drivers/scsi/sd.c in Linux sources (especially sd_probe() method)
  */
@@ -33,10 +40,85 @@
 #include "../config/runtime_config.h"
 #include "boot_dev/usb_boot_shim.h"
 #include "boot_dev/sata_boot_shim.h"
+#include <linux/workqueue.h> //stopping the shim which lost the race
+#include <linux/mutex.h>
 
 #define BOOT_MEDIA_SHIM_NULL (-1)
 
+static const char *boot_media_names[] = { "USB", "SATA", "USB or SATA" };
+
 static int registered_type = BOOT_MEDIA_SHIM_NULL;
+static bool usb_shim_registered = false;
+static bool sata_shim_registered = false;
+static DEFINE_MUTEX(shims_lock); //protects *_shim_registered
+static atomic_t resolved_type = ATOMIC_INIT(BOOT_MEDIA_SHIM_NULL); //where the boot device was found (once set, final)
+
+static int register_shims(const struct boot_media *boot_dev_config)
+{
+    int out = 0;
+
+    if (boot_dev_config->type == BOOT_MEDIA_SATA || boot_dev_config->type == BOOT_MEDIA_ANY) {
+        if ((out = register_sata_boot_shim(boot_dev_config)) != 0)
+            return out;
+        sata_shim_registered = true;
+    }
+
+    if (boot_dev_config->type == BOOT_MEDIA_USB || boot_dev_config->type == BOOT_MEDIA_ANY) {
+        if ((out = register_usb_boot_shim(boot_dev_config)) != 0) {
+            if (sata_shim_registered && unregister_sata_boot_shim() == 0)
+                sata_shim_registered = false;
+            return out;
+        }
+        usb_shim_registered = true;
+    }
+
+    return out;
+}
+
+/**
+ * Stops the shim which didn't find the boot device (when both were racing for it)
+ */
+static void stop_losing_shim(struct work_struct *work)
+{
+    int out = 0;
+    int loser = atomic_read(&resolved_type) == BOOT_MEDIA_USB ? BOOT_MEDIA_SATA : BOOT_MEDIA_USB;
+
+    mutex_lock(&shims_lock);
+    if (loser == BOOT_MEDIA_SATA && sata_shim_registered) {
+        if ((out = unregister_sata_boot_shim()) == 0)
+            sata_shim_registered = false;
+    } else if (loser == BOOT_MEDIA_USB && usb_shim_registered) {
+        if ((out = unregister_usb_boot_shim()) == 0)
+            usb_shim_registered = false;
+    }
+    mutex_unlock(&shims_lock);
+
+    if (out != 0)
+        pr_loc_wrn("Failed to stop looking for the boot device on %s - error=%d", boot_media_names[loser], out);
+    else
+        pr_loc_dbg("Stopped looking for the boot device on %s", boot_media_names[loser]);
+}
+static DECLARE_WORK(stop_losing_shim_work, stop_losing_shim);
+
+bool claim_boot_media(enum boot_media_type type)
+{
+    int resolved = atomic_cmpxchg(&resolved_type, BOOT_MEDIA_SHIM_NULL, type);
+    if (likely(resolved == type)) //e.g. the boot device was re-plugged
+        return true;
+
+    if (resolved != BOOT_MEDIA_SHIM_NULL) {
+        pr_loc_dbg("Boot device was already found on %s - ignoring %s device", boot_media_names[resolved],
+                   boot_media_names[type]);
+        return false;
+    }
+
+    pr_loc_inf("Boot device found on %s", boot_media_names[type]);
+    if (ACCESS_ONCE(registered_type) == BOOT_MEDIA_ANY)
+        schedule_work(&stop_losing_shim_work);
+
+    return true;
+}
+
 int register_boot_shim(const struct boot_media *boot_dev_config)
 {
     if (unlikely(registered_type != BOOT_MEDIA_SHIM_NULL)) {
@@ -44,49 +126,50 @@ int register_boot_shim(const struct boot_media *boot_dev_config)
         return -EEXIST;
     }
 
-    int out;
-    switch (boot_dev_config->type) {
-        case BOOT_MEDIA_USB:
-            out = register_usb_boot_shim(boot_dev_config);
-            break;
-        case BOOT_MEDIA_SATA:
-            out = register_sata_boot_shim(boot_dev_config);
-            break;
-        default:
-            pr_loc_bug("Failed to %s - unknown type=%d", __FUNCTION__, boot_dev_config->type);
-            return -EINVAL;
+    if (unlikely(boot_dev_config->type > BOOT_MEDIA_ANY)) {
+        pr_loc_bug("Failed to %s - unknown type=%d", __FUNCTION__, boot_dev_config->type);
+        return -EINVAL;
     }
 
-    if (out != 0)
-        return out; //individual shims should print what went wrong
-
+    //Shims may claim the boot media before they even return (e.g. SATA disks probed already) - the type must be known,
+    // while the loser will be stopped only after all shims are registered (see stop_losing_shim())
     registered_type = boot_dev_config->type;
-    pr_loc_inf("Boot shim registered (type=%d)", registered_type);
+    mutex_lock(&shims_lock);
+    int out = register_shims(boot_dev_config);
+    mutex_unlock(&shims_lock);
+
+    if (out != 0) { //individual shims should print what went wrong
+        cancel_work_sync(&stop_losing_shim_work);
+        registered_type = BOOT_MEDIA_SHIM_NULL;
+        return out;
+    }
+
+    pr_loc_inf("Boot shim registered (type=%d: %s)", registered_type, boot_media_names[registered_type]);
     return 0;
 }
 
 int unregister_boot_shim(void)
 {
-    int out;
-    switch (registered_type) {
-        case BOOT_MEDIA_USB:
-            out = unregister_usb_boot_shim();
-            break;
-        case BOOT_MEDIA_SATA:
-            out = unregister_sata_boot_shim();
-            break;
-        case BOOT_MEDIA_SHIM_NULL:
-            pr_loc_bug("Boot shim is no registered");
-            return -ENOENT;
-        default: //that cannot happen unless register_boot_shim() is broken
-            pr_loc_bug("Failed to %s - unknown type=%d", __FUNCTION__, registered_type);
-            return -EINVAL;
+    if (unlikely(registered_type == BOOT_MEDIA_SHIM_NULL)) {
+        pr_loc_bug("Boot shim is no registered");
+        return -ENOENT;
     }
 
+    cancel_work_sync(&stop_losing_shim_work); //whatever it didn't stop is still marked as registered
+
+    int out = 0;
+    mutex_lock(&shims_lock);
+    if (usb_shim_registered && (out = unregister_usb_boot_shim()) == 0)
+        usb_shim_registered = false;
+    if (out == 0 && sata_shim_registered && (out = unregister_sata_boot_shim()) == 0)
+        sata_shim_registered = false;
+    mutex_unlock(&shims_lock);
+
     if (out != 0)
         return out; //individual shims should print what went wrong
 
     pr_loc_inf("Boot shim unregistered (type=%d)", registered_type);
     registered_type = BOOT_MEDIA_SHIM_NULL;
+    //we are consciously NOT resetting resolved_type - the boot device stays shimmed (see unregister_sata_boot_shim())
     return 0;
-}
\ No newline at end of file
+}
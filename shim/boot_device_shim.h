@@ -1,8 +1,20 @@
 #ifndef REDPILLLKM_BOOT_DEVICE_SHIM_H
 #define REDPILLLKM_BOOT_DEVICE_SHIM_H
 
+#include "../config/runtime_config.h" //enum boot_media_type
+
 struct boot_media;
 int register_boot_shim(const struct boot_media *boot_dev_config);
 int unregister_boot_shim(void);
 
+/**
+ * Claims the bus the boot device was found on; shims (see shim/boot_dev/) must call it before shimming a device
+ *
+ * The first claim is final: when both buses are watched (BOOT_MEDIA_ANY) the other shim is stopped in the background.
+ * Claims of the bus which won (e.g. when the boot device is re-plugged) always succeed.
+ *
+ * @return true if the device should be shimmed, false if the boot device was already found on another bus
+ */
+bool claim_boot_media(enum boot_media_type type);
+
 #endif //REDPILLLKM_BOOT_DEVICE_SHIM_H
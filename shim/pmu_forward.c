@@ -0,0 +1,424 @@
+/**
+ * Forwarding of vPMU commands to an agent running on the hypervisor
+ *
+ * When DSM runs as a VM things the PMU controls (power, LEDs, fans, scheduled power-on) belong to the host. Instead of
+ * emulating a 9600 baud serial link end-to-end (e.g. by passing a real serial port through) the vPMU sends commands it
+ * already parsed straight to the host agent, and injects whatever the agent sends back into the vPMU vUART.
+ *
+ * It's enabled with pmu_fwd module param, which selects the transport:
+ *  - "vsock:<cid>:<port>": AF_VSOCK stream socket (e.g. "vsock:2:5001" for an agent on the host of a KVM guest)
+ *  - "/dev/...": virtio-serial port (e.g. "/dev/vport0p1"), for kernels/hypervisors without vsock
+ *
+ * Both directions use the same framing: a little-endian u16 length followed by that many bytes of payload. Commands
+ * sent to the agent carry the signature+data as received from the kernel (without the 0x2d head), e.g. "4" for power
+ * LED on or "SW1". Payloads sent by the agent are passed to the kernel as-is, so they must include the PMU framing
+ * (e.g. "-" + "@" for a power button press). All commands dispatched in one go (see dispatch_commands() in pmu_shim.c)
+ * are sent to the agent as a single batch with one write.
+ *
+ * The local vPMU stays fully functional: commands are still handled locally (incl. precomputed replies), so the VM
+ * boots just fine when the agent isn't there. The connection is made asynchronously and remade whenever it breaks.
+ */
+#include "pmu_forward.h"
+#include "../common.h"
+#include "../internal/thread_placement.h" //place_thread()
+#include <linux/module.h> //module_param
+#include <linux/kthread.h> //kthread_create, kthread_stop
+#include <linux/mutex.h>
+#include <linux/net.h> //sock_create_kern, kernel_connect, kernel_sendmsg, kernel_recvmsg
+#include <linux/socket.h> //AF_VSOCK, MSG_*
+#include <linux/vm_sockets.h> //struct sockaddr_vm
+#include <linux/fs.h> //filp_open, vfs_read, vfs_write
+#include <linux/uaccess.h> //get_fs, set_fs
+#include <linux/version.h>
+#include <net/net_namespace.h> //init_net
+#include <asm/unaligned.h> //get_unaligned_le16, put_unaligned_le16
+
+#define PMU_FWD_THREAD_NAME "vpmu_fwd"
+#define PMU_FWD_FRAME_HDR_LEN sizeof(__le16)
+#define PMU_FWD_FRAME_MAX 256 //max payload of a frame sent by the agent; anything longer means we lost sync
+#define PMU_FWD_BATCH_LEN 1024 //if more is queued in one batch it will be split into multiple writes
+#define PMU_FWD_RETRY_MIN_MS 100
+#define PMU_FWD_RETRY_MAX_MS 5000
+#define PMU_FWD_POLL_MS 10 //how often a virtio-serial port is checked for data (it's opened as non-blocking)
+
+static char *pmu_fwd = NULL;
+module_param(pmu_fwd, charp, 0444);
+MODULE_PARM_DESC(pmu_fwd, "Forward vPMU commands to a hypervisor agent: vsock:<cid>:<port> or a virtio-serial port "
+                          "path (e.g. /dev/vport0p1)");
+
+/**
+ * A way to talk to the agent; all functions except recv() are called with fwd_lock held
+ */
+struct fwd_transport {
+    const char *name;
+    int (*open)(void);
+    int (*send)(const void *buffer, size_t len); //sends everything or returns -E
+    int (*recv)(void *buffer, size_t len); //>0 bytes read, 0 if the other side is gone, -EAGAIN if nothing to read
+    void (*shutdown)(void); //makes recv() return ASAP; it's called from other threads than recv()
+    void (*close)(void);
+};
+
+static const struct fwd_transport *fwd_ops = NULL; //NULL = forwarding not requested/not started
+static struct task_struct *fwd_thread = NULL;
+static pmu_forward_rx_cb *fwd_rx_cb = NULL;
+static DEFINE_MUTEX(fwd_lock); //protects fwd_up & fwd_stopping and serializes transport calls (except recv)
+static bool fwd_up = false;
+static bool fwd_stopping = false;
+
+//Batch is only touched from the vPMU dispatch context which is never run concurrently with itself
+static char batch[PMU_FWD_BATCH_LEN];
+static unsigned int batch_len = 0;
+static unsigned int batch_frames = 0;
+static unsigned long frames_sent = 0;
+static unsigned long frames_dropped = 0;
+
+/******************************************************* vsock ********************************************************/
+static unsigned int vsock_cid;
+static unsigned int vsock_port;
+static struct socket *vsock_sock = NULL;
+
+static int vsock_open(void)
+{
+    int out;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,2,0)
+    out = sock_create_kern(&init_net, AF_VSOCK, SOCK_STREAM, 0, &vsock_sock);
+#else
+    out = sock_create_kern(AF_VSOCK, SOCK_STREAM, 0, &vsock_sock);
+#endif
+    if (unlikely(out != 0)) {
+        vsock_sock = NULL;
+        return out;
+    }
+
+    struct sockaddr_vm addr = {
+        .svm_family = AF_VSOCK,
+        .svm_cid = vsock_cid,
+        .svm_port = vsock_port,
+    };
+    if ((out = kernel_connect(vsock_sock, (struct sockaddr *)&addr, sizeof(addr), 0)) != 0) {
+        sock_release(vsock_sock);
+        vsock_sock = NULL;
+    }
+
+    return out;
+}
+
+static int vsock_send(const void *buffer, size_t len)
+{
+    struct kvec vec = { .iov_base = (void *)buffer, .iov_len = len };
+    struct msghdr msg = { .msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL };
+
+    int out = kernel_sendmsg(vsock_sock, &msg, &vec, 1, len);
+    return (out == len) ? 0 : (out < 0 ? out : -EIO); //a partial send breaks the framing
+}
+
+static int vsock_recv(void *buffer, size_t len)
+{
+    struct kvec vec = { .iov_base = buffer, .iov_len = len };
+    struct msghdr msg = { .msg_flags = 0 };
+
+    return kernel_recvmsg(vsock_sock, &msg, &vec, 1, len, 0);
+}
+
+static void vsock_shutdown(void)
+{
+    kernel_sock_shutdown(vsock_sock, SHUT_RDWR);
+}
+
+static void vsock_close(void)
+{
+    sock_release(vsock_sock);
+    vsock_sock = NULL;
+}
+
+static const struct fwd_transport vsock_transport = {
+    .name = "vsock",
+    .open = vsock_open,
+    .send = vsock_send,
+    .recv = vsock_recv,
+    .shutdown = vsock_shutdown,
+    .close = vsock_close,
+};
+
+/*************************************************** virtio-serial ****************************************************/
+static struct file *vport_filp = NULL;
+static bool vport_reset = false; //there's no way to shutdown a file - recv() reports EOF instead
+
+static int vport_open(void)
+{
+    //Non-blocking as there's no way to interrupt a blocking read of the port from another thread
+    struct file *filp = filp_open(pmu_fwd, O_RDWR | O_NOCTTY | O_NONBLOCK, 0);
+    if (IS_ERR(filp))
+        return PTR_ERR(filp);
+
+    vport_filp = filp;
+    vport_reset = false;
+    return 0;
+}
+
+static int vport_send(const void *buffer, size_t len)
+{
+    mm_segment_t old_fs = get_fs();
+    loff_t pos = 0;
+
+    set_fs(KERNEL_DS);
+    ssize_t out = vfs_write(vport_filp, (const char __user *)buffer, len, &pos);
+    set_fs(old_fs);
+
+    return (out == len) ? 0 : (out < 0 ? out : -EIO);
+}
+
+static int vport_recv(void *buffer, size_t len)
+{
+    if (unlikely(ACCESS_ONCE(vport_reset)))
+        return 0;
+
+    mm_segment_t old_fs = get_fs();
+    loff_t pos = 0;
+
+    set_fs(KERNEL_DS);
+    ssize_t out = vfs_read(vport_filp, (char __user *)buffer, len, &pos);
+    set_fs(old_fs);
+
+    return out;
+}
+
+static void vport_shutdown(void)
+{
+    ACCESS_ONCE(vport_reset) = true; //recv() never blocks so it will see it on the next poll
+}
+
+static void vport_close(void)
+{
+    filp_close(vport_filp, NULL);
+    vport_filp = NULL;
+}
+
+static const struct fwd_transport vport_transport = {
+    .name = "virtio-serial",
+    .open = vport_open,
+    .send = vport_send,
+    .recv = vport_recv,
+    .shutdown = vport_shutdown,
+    .close = vport_close,
+};
+
+/****************************************************** Batching ******************************************************/
+void pmu_forward_queue(const char *data, u8 len)
+{
+    if (!fwd_ops)
+        return;
+
+    if (unlikely(batch_len + PMU_FWD_FRAME_HDR_LEN + len > sizeof(batch)))
+        pmu_forward_flush();
+
+    put_unaligned_le16(len, &batch[batch_len]);
+    memcpy(&batch[batch_len + PMU_FWD_FRAME_HDR_LEN], data, len);
+    batch_len += PMU_FWD_FRAME_HDR_LEN + len;
+    ++batch_frames;
+}
+
+void pmu_forward_flush(void)
+{
+    if (!batch_len)
+        return;
+
+    int out;
+    mutex_lock(&fwd_lock);
+    if (likely(fwd_up)) {
+        //On failure the framing cannot be trusted anymore - the thread will notice the shutdown and reconnect
+        if ((out = fwd_ops->send(batch, batch_len)) != 0 && out != -EAGAIN)
+            fwd_ops->shutdown();
+    } else {
+        out = -ENOTCONN;
+    }
+    mutex_unlock(&fwd_lock);
+
+    if (likely(out == 0)) {
+        pr_loc_dbg("Forwarded %u vPMU commands (%u bytes) to the agent", batch_frames, batch_len);
+        frames_sent += batch_frames;
+    } else {
+        pr_loc_dbg("Failed to forward %u vPMU commands to the agent - error=%d", batch_frames, out);
+        frames_dropped += batch_frames;
+    }
+
+    batch_len = 0;
+    batch_frames = 0;
+}
+
+/****************************************************** Receiving *****************************************************/
+/**
+ * Passes a payload received from the agent to the kernel, waiting for the space in vUART if needed
+ */
+static void deliver_payload(const char *buffer, unsigned int len)
+{
+    unsigned int done = 0;
+    while (done < len && !ACCESS_ONCE(fwd_stopping)) {
+        int out = fwd_rx_cb(buffer + done, len - done);
+        if (unlikely(out < 0)) {
+            pr_loc_err("Failed to deliver %u bytes from the vPMU agent - error=%d", len - done, out);
+            return;
+        }
+
+        done += out;
+        if (out == 0)
+            schedule_timeout_interruptible(1); //RX ring is full - the driver will read it soon
+    }
+
+    pr_loc_dbg("Delivered %u bytes from the vPMU agent", done);
+}
+
+/**
+ * Receives frames from the agent until the connection breaks or forwarding is stopped
+ */
+static void receive_frames(void)
+{
+    static char rx_buf[(PMU_FWD_FRAME_HDR_LEN + PMU_FWD_FRAME_MAX) * 2]; //only the forwarder thread uses it
+    unsigned int have = 0;
+
+    while (!ACCESS_ONCE(fwd_stopping)) {
+        int out = fwd_ops->recv(rx_buf + have, sizeof(rx_buf) - have);
+        if (out == -EAGAIN) {
+            schedule_timeout_interruptible(msecs_to_jiffies(PMU_FWD_POLL_MS));
+            continue;
+        }
+
+        if (out <= 0) {
+            if (!ACCESS_ONCE(fwd_stopping))
+                pr_loc_wrn("vPMU agent connection lost (%s) - error=%d", fwd_ops->name, out);
+            return;
+        }
+        have += out;
+
+        unsigned int off = 0;
+        while (have - off >= PMU_FWD_FRAME_HDR_LEN) {
+            unsigned int len = get_unaligned_le16(&rx_buf[off]);
+            if (unlikely(len > PMU_FWD_FRAME_MAX)) {
+                pr_loc_err("Invalid %u bytes frame from the vPMU agent - resetting connection", len);
+                return;
+            }
+
+            if (have - off < PMU_FWD_FRAME_HDR_LEN + len)
+                break; //the rest of the frame didn't arrive yet
+
+            if (len)
+                deliver_payload(&rx_buf[off + PMU_FWD_FRAME_HDR_LEN], len);
+            off += PMU_FWD_FRAME_HDR_LEN + len;
+        }
+
+        have -= off;
+        memmove(rx_buf, rx_buf + off, have);
+    }
+}
+
+static int forwarder_thread(void *data)
+{
+    unsigned int backoff_ms = PMU_FWD_RETRY_MIN_MS;
+
+    while (!kthread_should_stop()) {
+        int out = fwd_ops->open();
+        if (out == -EAFNOSUPPORT || out == -EINVAL) {
+            pr_loc_err("vPMU forwarding using %s is not supported by this kernel - error=%d", fwd_ops->name, out);
+            break;
+        } else if (out != 0) {
+            //Agent not listening yet (or port not there yet) is normal early in the boot
+            pr_loc_dbg("Failed to connect to vPMU agent using %s - error=%d; retrying in %ums", fwd_ops->name, out,
+                       backoff_ms);
+            schedule_timeout_interruptible(msecs_to_jiffies(backoff_ms));
+            backoff_ms = min(backoff_ms * 2, (unsigned int)PMU_FWD_RETRY_MAX_MS);
+            continue;
+        }
+
+        mutex_lock(&fwd_lock);
+        if (fwd_stopping) { //pmu_forward_stop() could not shut it down as it wasn't up yet
+            fwd_ops->close();
+            mutex_unlock(&fwd_lock);
+            break;
+        }
+        fwd_up = true;
+        mutex_unlock(&fwd_lock);
+
+        pr_loc_inf("vPMU forwarding connected using %s", fwd_ops->name);
+        backoff_ms = PMU_FWD_RETRY_MIN_MS;
+        receive_frames();
+
+        mutex_lock(&fwd_lock);
+        fwd_up = false;
+        fwd_ops->close();
+        mutex_unlock(&fwd_lock);
+    }
+
+    //kthread_stop() must always find the thread alive
+    set_current_state(TASK_INTERRUPTIBLE);
+    while (!kthread_should_stop()) {
+        schedule();
+        set_current_state(TASK_INTERRUPTIBLE);
+    }
+    __set_current_state(TASK_RUNNING);
+
+    return 0;
+}
+
+/**************************************************** Start & stop ****************************************************/
+static const struct fwd_transport *parse_fwd_param(void)
+{
+    if (sscanf(pmu_fwd, "vsock:%u:%u", &vsock_cid, &vsock_port) == 2)
+        return &vsock_transport;
+
+    if (pmu_fwd[0] == '/')
+        return &vport_transport;
+
+    return NULL;
+}
+
+int pmu_forward_start(pmu_forward_rx_cb *rx_cb)
+{
+    if (!pmu_fwd || !pmu_fwd[0]) {
+        pr_loc_dbg("vPMU forwarding not requested");
+        return 0;
+    }
+
+    const struct fwd_transport *ops = parse_fwd_param();
+    if (!ops) {
+        pr_loc_err("Invalid pmu_fwd=%s - expected vsock:<cid>:<port> or /dev/<virtio port>", pmu_fwd);
+        return -EINVAL;
+    }
+
+    fwd_rx_cb = rx_cb;
+    fwd_stopping = false;
+    fwd_up = false;
+    batch_len = batch_frames = 0;
+    frames_sent = frames_dropped = 0;
+    fwd_ops = ops;
+
+    struct task_struct *thread = kthread_create(forwarder_thread, NULL, PMU_FWD_THREAD_NAME);
+    if (IS_ERR(thread)) {
+        pr_loc_err("Failed to start vPMU forwarder thread - error=%ld", PTR_ERR(thread));
+        fwd_ops = NULL;
+        return PTR_ERR(thread);
+    }
+    place_thread(thread);
+    wake_up_process(thread);
+    fwd_thread = thread;
+
+    pr_loc_inf("vPMU forwarding to %s using %s started", pmu_fwd, ops->name);
+    return 0;
+}
+
+void pmu_forward_stop(void)
+{
+    if (!fwd_ops)
+        return;
+
+    mutex_lock(&fwd_lock);
+    fwd_stopping = true;
+    if (fwd_up)
+        fwd_ops->shutdown();
+    mutex_unlock(&fwd_lock);
+
+    kthread_stop(fwd_thread);
+    fwd_thread = NULL;
+    fwd_ops = NULL;
+
+    pr_loc_inf("vPMU forwarding stopped - sent %lu commands, dropped %lu", frames_sent, frames_dropped);
+}
@@ -0,0 +1,48 @@
+#ifndef REDPILL_PMU_FORWARD_H
+#define REDPILL_PMU_FORWARD_H
+
+#include <linux/types.h>
+
+/**
+ * Function used to deliver data sent by the hypervisor agent to the kernel (i.e. to inject it into the vPMU vUART)
+ *
+ * It's called from the forwarder thread (process context, may sleep).
+ */
+typedef int (pmu_forward_rx_cb)(const char *buffer, unsigned int len);
+
+//Forwarding needs kernel sockets & files which don't exist in the userspace emulator; define it manually to disable
+#ifndef PMU_NO_FORWARD
+/**
+ * Starts forwarding to the hypervisor agent if the user asked for it (see pmu_fwd module param in pmu_forward.c)
+ *
+ * This function doesn't block: the connection to the agent is made (and remade) by a separate thread.
+ *
+ * @return 0 if forwarding started or isn't requested, -E on error
+ */
+int pmu_forward_start(pmu_forward_rx_cb *rx_cb);
+
+/**
+ * Queues a command to be sent with the next batch; must be called from the vPMU dispatch context only
+ *
+ * @param data Command signature + data as received from the kernel (without the head)
+ */
+void pmu_forward_queue(const char *data, u8 len);
+
+/**
+ * Sends all commands queued with pmu_forward_queue() as a single write; must be called from the vPMU dispatch context
+ */
+void pmu_forward_flush(void);
+
+/**
+ * Stops forwarding and disconnects from the agent; it's safe to call it even if forwarding isn't active
+ */
+void pmu_forward_stop(void);
+
+#else //PMU_NO_FORWARD
+#define pmu_forward_start(rx_cb) (0)
+#define pmu_forward_queue(data, len) //noop
+#define pmu_forward_flush() //noop
+#define pmu_forward_stop() //noop
+#endif //PMU_NO_FORWARD
+
+#endif //REDPILL_PMU_FORWARD_H
@@ -1,18 +1,42 @@
+/**
+ * Virtual PMU (Power Management Unit) living on ttyS1
+ *
+ * DSM talks to the PMU with short "-"-headed packets. The vPMU decodes them, keeps track of the states they change (LEDs,
+ * fan health, WOL, scheduled power-on; see vpmu_state) and optionally forwards them to the hypervisor (see pmu_forward).
+ *
+ * LIMITATIONS
+ * The only command answered is OUT_GET_UNIQ, from the per-platform table (see struct pmu_hw_responses). The state is
+ * recorded but cannot be queried by DSM: the format of PMU=>kernel replies for anything else (e.g. SWITCH_UP_VER) isn't
+ * known, and sending guessed data is worse than letting the caller time out. Adding a reply is a matter of a new
+ * pmu_response_id, a cmd_reply entry in PMU_COMMANDS and the bytes in supported_platforms.
+ */
 #include "pmu_shim.h"
 #include "../common.h"
+#include "../config/runtime_config.h" //struct hw_config
 #include "../internal/uart/virtual_uart.h"
+#include "pmu_forward.h" //pmu_forward_*
+#include "../internal/state_handoff.h" //rp_handoff_get(), rp_handoff_put()
+#include "../internal/thread_placement.h" //alloc_placed_workqueue()
 #include <linux/kfifo.h> //kfifo_*
+#include <linux/mutex.h> //serializing vuart_inject_rx() producers
+#include <linux/workqueue.h> //dispatching commands outside of vUART context
 
 #define PMU_TTYS_LINE 1 //so far this is hardcoded by syno, so we doubt it will ever change
-#define WORK_BUFFER_LEN VUART_FIFO_LEN
+#define PMU_VUART_CHIP VUART_CHIP_16550A //PMU packets are tiny so deeper FIFOs don't help much; this is what real HW has
+#define PMU_VUART_FIFO_LEN VUART_FIFO_LEN //must match FIFO length of PMU_VUART_CHIP
+#define PMU_MAX_CMD_LEN 32 //max length of a single command incl. data (excl. head); longer ones are discarded
 #define to_hex_buf_len(len) ((len)*3+1) //2 chars for each hex + space + NULL terminator
-#define HEX_BUFFER_LEN to_hex_buf_len(VUART_FIFO_LEN)
+#define HEX_BUFFER_LEN to_hex_buf_len(PMU_MAX_CMD_LEN) //PMU_MAX_CMD_LEN must be >= PMU_VUART_FIFO_LEN
 
-//PMU packets are at minimum 2 bytes long (PMU_CMD_HEAD + 1-3 bytes command + optional data). If this is set to a high
-// value (e.g. VUART_FIFO_LEN) in practice commands will only be delivered when the client indicates end-of-transmission)
-// which may not be bad...
-#define PMU_MIN_PACKET 2
 #define PMU_CMD_HEAD 0x2d //every PMU packet is delimited by containing 0x2d (ASCII "-"/dash) as its first character
+#define PMU_DISPATCH_QUEUE_LEN 64 //max commands waiting for execution; must be a power of 2
+#define PMU_WQ_NAME "vpmu"
+#define PMU_TX_IDLE_CHARS 4 //gap ending a PMU "packet"; mfgBIOS writes whole commands at once, so it's never split
+
+static bool pmu_bulk_tx = false;
+module_param(pmu_bulk_tx, bool, 0444);
+MODULE_PARM_DESC(pmu_bulk_tx, "Take vPMU commands directly from the serial driver's TX buffer instead of emulating THR "
+                              "writes byte by byte (see vuart_set_bulk_tx())");
 
 typedef struct command_definition command_definition;
 
@@ -22,6 +46,7 @@ typedef struct command_definition command_definition;
 struct command_definition {
     void (*fn) (const command_definition *t, const char *data, u8 data_len);
     const u8 length; //commands are realistically 1-3 chars only
+    const u8 arg; //handler-specific argument (e.g. state group or response id)
     const char *name;
 } __packed;
 
@@ -29,11 +54,32 @@ struct command_definition {
  * Result for matching of command signature against known list
  */
 typedef enum {
-    PMU_CMD_AMBIGUOUS = -1,
     PMU_CMD_NOT_FOUND =  0,
     PMU_CMD_FOUND     =  1,
 } pmu_match_status;
 
+/**
+ * Groups of mutually exclusive vPMU states; each one holds the last command which changed it
+ */
+typedef enum {
+    VPMU_ST_PWR_LED,
+    VPMU_ST_STATUS_LED,
+    VPMU_ST_USB_LED,
+    VPMU_ST_10G_LED,
+    VPMU_ST_FAN_HEALTH,
+    VPMU_ST_SCHED_UP,
+    VPMU_ST_WOL,
+    VPMU_ST__COUNT
+} vpmu_state_group;
+
+static const command_definition *vpmu_state[VPMU_ST__COUNT] = { NULL }; //NULL = unknown (never set since boot)
+
+//Responses of the current platform, precomputed when the shim is registered (see prepare_responses())
+static struct {
+    const char *data;
+    unsigned int len;
+} responses[PMU_RESP__COUNT];
+
 /**
  * Default/noop shim for a PMU command. It simply prints the command received.
  */
@@ -42,17 +88,61 @@ static void cmd_shim_noop(const command_definition *t, const char *data, u8 data
     pr_loc_dbg("vPMU received %s using %d bytes - NOOP", t->name, data_len);
 }
 
+/**
+ * Records a state change requested by the command (e.g. a LED being turned on)
+ */
+static void cmd_set_state(const command_definition *t, const char *data, u8 data_len)
+{
+    const command_definition *prev = vpmu_state[t->arg];
+    vpmu_state[t->arg] = t;
+
+    if (prev == t) {
+        pr_loc_dbg("vPMU state %d already set by %s", t->arg, t->name);
+        return;
+    }
+
+    pr_loc_dbg("vPMU state %d changed %s => %s", t->arg, prev ? prev->name : "<unknown>", t->name);
+}
+
+//vuart_inject_rx() allows only a single producer; we have two: command handlers & the hypervisor agent (if forwarding)
+static DEFINE_MUTEX(inject_lock);
+
+/**
+ * Sends data to the kernel (through the vUART RX)
+ *
+ * @return number of bytes accepted or -E on error (see vuart_inject_rx())
+ */
+static int pmu_inject_rx(const char *buffer, unsigned int len)
+{
+    mutex_lock(&inject_lock);
+    int out = vuart_inject_rx(PMU_TTYS_LINE, buffer, len);
+    mutex_unlock(&inject_lock);
+
+    return out;
+}
+
+/**
+ * Sends a precomputed response back to the kernel (through the vUART RX)
+ */
+static void cmd_reply(const command_definition *t, const char *data, u8 data_len)
+{
+    if (unlikely(!responses[t->arg].data)) {
+        pr_loc_dbg("vPMU received %s but this platform has no response defined - ignoring", t->name);
+        return;
+    }
+
+    int out = pmu_inject_rx(responses[t->arg].data, responses[t->arg].len);
+    if (unlikely(out != responses[t->arg].len)) {
+        pr_loc_err("Failed to send %u bytes response to %s - result=%d", responses[t->arg].len, t->name, out);
+        return;
+    }
+
+    pr_loc_dbg("vPMU responded to %s with %u bytes", t->name, responses[t->arg].len);
+}
+
 //@todo when we get the physical PMU emulator we can move this to a separate library so that shim contacts an internal
 // routing routine for commands which aren't shimmed here. Then we will add all PMU=>kernel commands as well. Currently
 // we only define kernel=>PMU ones as these are the ones we need to listen for.
-#define PMU_CMD__MIN_CODE 0x30
-#define PMU_CMD__MAX_CODE 0x75
-#define single_byte_idx(id) ((id)-PMU_CMD__MIN_CODE)
-#define get_single_byte_cmd(id) single_byte_cmds[single_byte_idx(id)] //call it ONLY after has_single_byte_cmd!!!
-#define has_single_byte_cmd(id) \
-    (likely((id) >= PMU_CMD__MIN_CODE) && likely((id) <= PMU_CMD__MAX_CODE) && get_single_byte_cmd(id).length != 0)
-#define DEFINE_SINGLE_BYTE_CMD(cnm, fp) [single_byte_idx(PMU_CMD_ ## cnm)] = { .name = #cnm, .length = 1, .fn = fp }
-
 #define PMU_CMD_OUT_HW_POWER_OFF 0x31 //"1"
 #define PMU_CMD_OUT_BUZ_SHORT 0x32 //"2"
 #define PMU_CMD_OUT_BUZ_LONG 0x33 //"3"
@@ -90,46 +180,108 @@ static void cmd_shim_noop(const command_definition *t, const char *data, u8 data
 #define PMU_CMD_OUT_SCHED_UP_ON 0x73 //"s"
 #define PMU_CMD_OUT_FAN_HEALTH_OFF 0x74 //"t"
 #define PMU_CMD_OUT_FAN_HEALTH_ON 0x75 //"u"
+//Multibyte commands
+#define PMU_CMD_OUT_SW1 0x53, 0x57, 0x31 //"SW1"; exact meaning unknown, observed being sent by mfgBIOS
 
-static const command_definition single_byte_cmds[single_byte_idx(PMU_CMD__MAX_CODE)+1] = {
-    DEFINE_SINGLE_BYTE_CMD(OUT_HW_POWER_OFF, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_BUZ_SHORT, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_BUZ_LONG, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_PWR_LED_ON, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_PWR_LED_BLINK, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_PWR_LED_OFF, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_STATUS_LED_OFF, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_STATUS_LED_ON_GREEN, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_STATUS_LED_PULSE_GREEN, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_STATUS_LED_ON_ORANGE, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_STATUS_LED_PULSE_ORANGE, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_STATUS_LED_PULSE, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_USB_LED_ON, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_USB_LED_PULSE, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_USB_LED_OFF, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_HW_RESET, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_10G_LED_ON, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_10G_LED_OFF, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_LED_TOG_PWR_STAT, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_SWITCH_UP_VER, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_MIR_LED_OFF, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_GET_UNIQ, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_PWM_CYCLE, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_PWM_HZ, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_WOL_ON, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_SCHED_UP_OFF, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_SCHED_UP_ON, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_FAN_HEALTH_OFF, cmd_shim_noop),
-    DEFINE_SINGLE_BYTE_CMD(OUT_FAN_HEALTH_ON, cmd_shim_noop),
-};
+/*
+ * Command signatures (1-3 bytes) are packed into a single u32 as [len|b0|b1|b2]. This way the whole commands space can
+ * be matched with a single switch() which the compiler turns into a jump table/binary search - there's no iteration
+ * over the list at runtime, and a duplicated signature is a compile-time error ("duplicate case value").
+ */
+#define PMU_MAX_SIG_LEN 3
+#define pmu_sig_pack(len, b0, b1, b2) \
+    (((u32)(len) << 24) | ((u32)(u8)(b0) << 16) | ((u32)(u8)(b1) << 8) | (u32)(u8)(b2))
+#define PMU_SIG1(b0) pmu_sig_pack(1, b0, 0, 0)
+//Multibyte signatures are passed as a single PMU_CMD_* define with comma-separated bytes, hence the indirection
+#define PMU_SIG2(sig) pmu_sig_pack2_(sig)
+#define pmu_sig_pack2_(b0, b1) pmu_sig_pack(2, b0, b1, 0)
+#define PMU_SIG3(sig) pmu_sig_pack3_(sig)
+#define pmu_sig_pack3_(b0, b1, b2) pmu_sig_pack(3, b0, b1, b2)
+#define pmu_sig_len(sig) ((sig) >> 24)
 
+/**
+ * The one and only list of known commands: X(name, signature, handler, handler argument)
+ *
+ * Everything else (commands table, indexes, and the matcher) is generated from this list.
+ */
+#define PMU_COMMANDS(X) \
+    X(OUT_HW_POWER_OFF,            PMU_SIG1(PMU_CMD_OUT_HW_POWER_OFF),                cmd_shim_noop, 0) \
+    X(OUT_BUZ_SHORT,               PMU_SIG1(PMU_CMD_OUT_BUZ_SHORT),                   cmd_shim_noop, 0) \
+    X(OUT_BUZ_LONG,                PMU_SIG1(PMU_CMD_OUT_BUZ_LONG),                    cmd_shim_noop, 0) \
+    X(OUT_PWR_LED_ON,              PMU_SIG1(PMU_CMD_OUT_PWR_LED_ON),                  cmd_set_state, VPMU_ST_PWR_LED) \
+    X(OUT_PWR_LED_BLINK,           PMU_SIG1(PMU_CMD_OUT_PWR_LED_BLINK),               cmd_set_state, VPMU_ST_PWR_LED) \
+    X(OUT_PWR_LED_OFF,             PMU_SIG1(PMU_CMD_OUT_PWR_LED_OFF),                 cmd_set_state, VPMU_ST_PWR_LED) \
+    X(OUT_STATUS_LED_OFF,          PMU_SIG1(PMU_CMD_OUT_STATUS_LED_OFF),              cmd_set_state, VPMU_ST_STATUS_LED) \
+    X(OUT_STATUS_LED_ON_GREEN,     PMU_SIG1(PMU_CMD_OUT_STATUS_LED_ON_GREEN),         cmd_set_state, VPMU_ST_STATUS_LED) \
+    X(OUT_STATUS_LED_PULSE_GREEN,  PMU_SIG1(PMU_CMD_OUT_STATUS_LED_PULSE_GREEN),      cmd_set_state, VPMU_ST_STATUS_LED) \
+    X(OUT_STATUS_LED_ON_ORANGE,    PMU_SIG1(PMU_CMD_OUT_STATUS_LED_ON_ORANGE),        cmd_set_state, VPMU_ST_STATUS_LED) \
+    X(OUT_STATUS_LED_PULSE_ORANGE, PMU_SIG1(PMU_CMD_OUT_STATUS_LED_PULSE_ORANGE),     cmd_set_state, VPMU_ST_STATUS_LED) \
+    X(OUT_STATUS_LED_PULSE,        PMU_SIG1(PMU_CMD_OUT_STATUS_LED_PULSE),            cmd_set_state, VPMU_ST_STATUS_LED) \
+    X(OUT_USB_LED_ON,              PMU_SIG1(PMU_CMD_OUT_USB_LED_ON),                  cmd_set_state, VPMU_ST_USB_LED) \
+    X(OUT_USB_LED_PULSE,           PMU_SIG1(PMU_CMD_OUT_USB_LED_PULSE),               cmd_set_state, VPMU_ST_USB_LED) \
+    X(OUT_USB_LED_OFF,             PMU_SIG1(PMU_CMD_OUT_USB_LED_OFF),                 cmd_set_state, VPMU_ST_USB_LED) \
+    X(OUT_HW_RESET,                PMU_SIG1(PMU_CMD_OUT_HW_RESET),                    cmd_shim_noop, 0) \
+    X(OUT_10G_LED_ON,              PMU_SIG1(PMU_CMD_OUT_10G_LED_ON),                  cmd_set_state, VPMU_ST_10G_LED) \
+    X(OUT_10G_LED_OFF,             PMU_SIG1(PMU_CMD_OUT_10G_LED_OFF),                 cmd_set_state, VPMU_ST_10G_LED) \
+    X(OUT_LED_TOG_PWR_STAT,        PMU_SIG1(PMU_CMD_OUT_LED_TOG_PWR_STAT),            cmd_shim_noop, 0) \
+    X(OUT_SWITCH_UP_VER,           PMU_SIG1(PMU_CMD_OUT_SWITCH_UP_VER),               cmd_shim_noop, 0) \
+    X(OUT_MIR_LED_OFF,             PMU_SIG1(PMU_CMD_OUT_MIR_LED_OFF),                 cmd_shim_noop, 0) \
+    X(OUT_GET_UNIQ,                PMU_SIG1(PMU_CMD_OUT_GET_UNIQ),                    cmd_reply,     PMU_RESP_UNIQ) \
+    X(OUT_PWM_CYCLE,               PMU_SIG1(PMU_CMD_OUT_PWM_CYCLE),                   cmd_shim_noop, 0) \
+    X(OUT_PWM_HZ,                  PMU_SIG1(PMU_CMD_OUT_PWM_HZ),                      cmd_shim_noop, 0) \
+    X(OUT_WOL_ON,                  PMU_SIG1(PMU_CMD_OUT_WOL_ON),                      cmd_set_state, VPMU_ST_WOL) \
+    X(OUT_SCHED_UP_OFF,            PMU_SIG1(PMU_CMD_OUT_SCHED_UP_OFF),                cmd_set_state, VPMU_ST_SCHED_UP) \
+    X(OUT_SCHED_UP_ON,             PMU_SIG1(PMU_CMD_OUT_SCHED_UP_ON),                 cmd_set_state, VPMU_ST_SCHED_UP) \
+    X(OUT_FAN_HEALTH_OFF,          PMU_SIG1(PMU_CMD_OUT_FAN_HEALTH_OFF),              cmd_set_state, VPMU_ST_FAN_HEALTH) \
+    X(OUT_FAN_HEALTH_ON,           PMU_SIG1(PMU_CMD_OUT_FAN_HEALTH_ON),               cmd_set_state, VPMU_ST_FAN_HEALTH) \
+    X(OUT_SW1,                     PMU_SIG3(PMU_CMD_OUT_SW1),                         cmd_shim_noop, 0)
+
+#define GEN_CMD_IDX(cnm, sig, fp, fa) PMU_CMD_IDX_ ## cnm,
+#define GEN_CMD_DEF(cnm, sig, fp, fa) \
+    [PMU_CMD_IDX_ ## cnm] = { .name = #cnm, .length = pmu_sig_len(sig), .fn = fp, .arg = fa },
+#define GEN_CMD_CASE(cnm, sig, fp, fa) case sig: return &commands[PMU_CMD_IDX_ ## cnm];
+
+#define GEN_CMD_SIG(cnm, sig, fp, fa) [PMU_CMD_IDX_ ## cnm] = sig,
+
+enum { PMU_COMMANDS(GEN_CMD_IDX) PMU_CMD__COUNT };
+static const command_definition commands[PMU_CMD__COUNT] = { PMU_COMMANDS(GEN_CMD_DEF) };
+static const u32 command_sigs[PMU_CMD__COUNT] = { PMU_COMMANDS(GEN_CMD_SIG) }; //only needed for the handoff
+
+/**
+ * Looks up a command by its packed signature (see pmu_sig_pack())
+ *
+ * @return command or NULL if not found
+ */
+static __always_inline const command_definition *lookup_command(u32 sig)
+{
+    switch (sig) {
+        PMU_COMMANDS(GEN_CMD_CASE)
+        default:
+            return NULL;
+    }
+}
 
 static char *uart_buffer = NULL; //keeps data streamed directly by the vUART... todo: vUART should manage this buffer
-static char *work_buffer = NULL; //collecting & operatint on the data received from vUART
-static char *work_buffer_curr = NULL; //pointer to the current free space in work_buffer
 static char *hex_print_buffer = NULL; //helper buffer to print char arrays in hex
 
-#define work_buffer_fill() ((unsigned int)(work_buffer_curr - work_buffer))
+/**
+ * State of the streaming PMU parser; it persists between vUART flushes
+ *
+ * PMU packets have a head but no length & no terminator, so a command only ends when the next head arrives or when the
+ * transmitter goes idle (see pmu_rx_callback()). The parser therefore keeps a partially collected command between
+ * calls and looks at every byte exactly once.
+ */
+typedef enum {
+    PMU_PARSE_WAIT_HEAD, //anything which isn't a head is garbage
+    PMU_PARSE_CMD, //collecting bytes of a command after a head
+} pmu_parse_state;
+
+static struct {
+    pmu_parse_state state;
+    unsigned int cmd_len; //bytes seen after head (can go beyond PMU_MAX_CMD_LEN - these are not stored)
+    bool garbage_reported:1; //reports garbage once per run of it instead of per byte
+    char cmd[PMU_MAX_CMD_LEN];
+} parser;
 
 /**
  * Free all buffers used by this submodule
@@ -141,15 +293,10 @@ static void free_buffers(void)
     if (likely(uart_buffer))
         kfree(uart_buffer);
 
-    if (likely(work_buffer))
-        kfree(work_buffer);
-
     if (likely(hex_print_buffer))
         kfree(hex_print_buffer);
 
     uart_buffer = NULL;
-    work_buffer = NULL;
-    work_buffer_curr = NULL;
     hex_print_buffer = NULL;
 }
 
@@ -158,22 +305,13 @@ static void free_buffers(void)
  */
 static int alloc_buffers(void)
 {
-    uart_buffer = kmalloc(VUART_FIFO_LEN, GFP_KERNEL);
+    uart_buffer = kmalloc(PMU_VUART_FIFO_LEN, GFP_KERNEL);
     if (unlikely(!uart_buffer)) {
         pr_loc_err("kmalloc failure for uart_buffer");
         free_buffers();
         return -ENOMEM;
     }
 
-    work_buffer = kmalloc(WORK_BUFFER_LEN, GFP_KERNEL);
-    if (unlikely(!work_buffer)) {
-        pr_loc_err("kmalloc failure for work_buffer");
-        free_buffers();
-        return -ENOMEM;
-    }
-    work_buffer_curr = work_buffer;
-
-
     hex_print_buffer = kmalloc(HEX_BUFFER_LEN, GFP_KERNEL);
     if (unlikely(!hex_print_buffer)) {
         pr_loc_err("kmalloc failure for hex_print_buffer");
@@ -203,7 +341,7 @@ static const char *get_hex_print(const char *buffer, int len)
 
     int hex_len = 0;
     for (int i = 0; i < len; ++i) {
-        sprintf(&hex_print_buffer[i * 3], "%02x ", buffer[i]);
+        sprintf(&hex_print_buffer[i * 3], "%02x ", (u8)buffer[i]); //char may be signed => "ffffff80" would overflow
         hex_len += 3;
     }
 
@@ -214,31 +352,64 @@ static const char *get_hex_print(const char *buffer, int len)
 /**
  * Matches command against a list of known ones based on the signature specified
  *
+ * This is O(length) - the signature is packed and then looked up (see lookup_command()).
+ *
  * @param cmd pointer to a pointer where address of command structure can be saved if found
  */
 static pmu_match_status noinline
-match_command(const command_definition **cmd, const char *signature, const unsigned int sig_len)
+match_command(const command_definition **cmd, const char *signature, unsigned int sig_len)
 {
     if (unlikely(sig_len == 0)) {
         pr_loc_dbg("Invalid zero-length command (stray head without command signature) - discarding");
         return PMU_CMD_NOT_FOUND;
     }
 
-    if (likely(sig_len == 1) //regular 1 byte
-        || (sig_len == 3 && signature[1] == 0x0d && signature[2] == 0x0a) //1 byte with CRLF (sic!)
-       ) {
-        if (!has_single_byte_cmd(signature[0]))
-            return PMU_CMD_NOT_FOUND;
+    //Some commands are sent with CRLF (sic!) - it's not a part of the signature
+    if (sig_len > 2 && signature[sig_len-2] == 0x0d && signature[sig_len-1] == 0x0a)
+        sig_len -= 2;
 
-        *cmd = &get_single_byte_cmd(signature[0]);
-        return PMU_CMD_FOUND;
-    }
+    if (unlikely(sig_len > PMU_MAX_SIG_LEN))
+        return PMU_CMD_NOT_FOUND;
+
+    u32 sig = pmu_sig_pack(sig_len, signature[0], sig_len > 1 ? signature[1] : 0, sig_len > 2 ? signature[2] : 0);
+    if (!(*cmd = lookup_command(sig)))
+        return PMU_CMD_NOT_FOUND;
+
+    return PMU_CMD_FOUND;
+}
+
+/**
+ * Commands are matched in the vUART callback (=with vUART lock held & IRQs off) but their handlers may be arbitrarily
+ * expensive (LEDs, fans, replies etc.). They're therefore queued and executed on a workqueue. The queue is lock-free:
+ * the only producer is the vUART callback (serialized by the vUART lock) and the only consumer is the work item
+ * (which is never run concurrently with itself on an ordered workqueue).
+ */
+struct pmu_pending_cmd {
+    const command_definition *cmd;
+    u8 data_len;
+    char data[PMU_MAX_CMD_LEN];
+};
+
+static DECLARE_KFIFO(dispatch_queue, struct pmu_pending_cmd, PMU_DISPATCH_QUEUE_LEN);
+static struct workqueue_struct *dispatch_wq = NULL;
 
-    return PMU_CMD_NOT_FOUND; //@todo Currently we don't handle multibyte commands; it has to be a full iteration
+static void dispatch_commands(struct work_struct *work)
+{
+    struct pmu_pending_cmd pending;
+
+    //The whole batch is executed in one go; new commands queued in the meantime re-queue the work item. If forwarding
+    // to the hypervisor is active the batch is also sent to the agent as one write (see pmu_forward.c)
+    while (kfifo_out(&dispatch_queue, &pending, 1) == 1) {
+        pr_loc_dbg("Executing cmd %s handler %pF", pending.cmd->name, pending.cmd->fn);
+        pending.cmd->fn(pending.cmd, pending.data, pending.data_len);
+        pmu_forward_queue(pending.data, pending.data_len);
+    }
+    pmu_forward_flush();
 }
+static DECLARE_WORK(dispatch_work, dispatch_commands);
 
 /**
- * Finds command based on its signature and execute its callback if found
+ * Finds command based on its signature and queues its callback for execution if found
  */
 static void route_command(const char *buffer, const unsigned int len)
 {
@@ -250,70 +421,71 @@ static void route_command(const char *buffer, const unsigned int len)
         return;
     }
 
-    pr_loc_dbg("Executing cmd %s handler %pF", cmd->name, cmd->fn);
-    cmd->fn(cmd, buffer, len);
+    struct pmu_pending_cmd pending = { .cmd = cmd, .data_len = len };
+    memcpy(pending.data, buffer, len); //len is guaranteed to be <= PMU_MAX_CMD_LEN by the parser
+    if (unlikely(kfifo_in(&dispatch_queue, &pending, 1) != 1)) {
+        pr_loc_err("PMU dispatch queue is full - dropping cmd %s", cmd->name);
+        return;
+    }
+
+    queue_work(dispatch_wq, &dispatch_work);
 }
 
 /**
- * Scans work buffer (copied from vUART buffer) to find commands
- *
- * @param end_of_packet Indicates whether this command was called because the vUART transmitter assumed
- *                      end-of-transmission/IDLE, or flushed due to its buffer being full. If this parameter is true the
- *                      data in the work buffer is assumed to be a complete representation of the state. This becomes
- *                      important if we cannot with 100% confidence say, after reaching the end of the buffer, if it
- *                      will be a multibyte command (but we possibly didn't get all the bytes YET) or this is single or
- *                      multibyte command which we don't know.
- *
- * This function makes an assumption that when it's called that the buffer represents the whole state of the command
- * If this becomes to take too long we can move it to a separate thread, but this will require a lock.
+ * Ends the command currently collected by the parser and routes it
  */
-static noinline void process_work_buffer(bool end_of_packet)
+static void finish_command(void)
 {
-    if (unlikely(work_buffer == work_buffer_curr)) {
-        //this can happen if kernel sends no data but we get IDLE... shouldn't logically happen
-        pr_loc_wrn("%s called on empty buffer?!", __FUNCTION__);
-        return;
+    if (unlikely(parser.cmd_len > PMU_MAX_CMD_LEN)) {
+        pr_loc_wrn("Discarding %u byte PMU command - max supported length is %d (it started with hex=\"%s\")",
+                   parser.cmd_len, PMU_MAX_CMD_LEN, get_hex_print(parser.cmd, PMU_MAX_CMD_LEN));
+    } else {
+        route_command(parser.cmd, parser.cmd_len);
     }
 
-    int cmd_len = -1; //number of bytes in the command (excluding header)
-    for(char *curr = work_buffer; curr < work_buffer_curr; ++curr) {
-        if (*curr == PMU_CMD_HEAD) { //got the beginning of a new command
-            //we've found a new command in the buffer - lets check if the previously collected data matches anything
-            if (cmd_len != -1) { //we only want to call it if this isn't the first byte after last cmd (or 1st in buf)
-                route_command(curr-cmd_len, cmd_len);
-                cmd_len = 0; //we've got the head so 0 and not -1
-            } else {
-                ++cmd_len; //We've read the buffer containing head, we then expect to get something which is non-head
-            }
-        } else {
-            if (cmd_len == -1) { //we don't expect data before head
-                pr_loc_wrn("Found garbage data in PMU buffer before cmd head (\"%c\" / 0x%02x) - ignoring", *curr,
-                           *curr);
-                continue;
-            }
+    parser.cmd_len = 0;
+}
 
-            ++cmd_len; //collecting another byte for the currently processed command
+/**
+ * Feeds data from the vUART into the streaming parser
+ *
+ * @param end_of_packet Indicates whether the vUART transmitter assumed end-of-transmission/IDLE. In such case the
+ *                      command being collected is assumed to be complete (as commands have no terminator we cannot
+ *                      otherwise say that e.g. "-S" isn't the beginning of a longer "-SW1").
+ */
+static noinline void parse_pmu_stream(const char *buffer, unsigned int len, bool end_of_packet)
+{
+    for (const char *curr = buffer, *end = buffer + len; curr < end; ++curr) {
+        if (*curr == PMU_CMD_HEAD) { //got the beginning of a new command which also ends the previous one (if any)
+            if (parser.state == PMU_PARSE_CMD)
+                finish_command();
+
+            parser.state = PMU_PARSE_CMD;
+            parser.cmd_len = 0;
+            parser.garbage_reported = false;
+            continue;
         }
-    }
 
-    //We've finished processing the buffer. Now we need to decide what to do with that last piece of data
-    unsigned int processed = work_buffer_fill();
-    if (cmd_len != -1) { //if it's -1 it means we didn't find any heading so we're just discarding all data
-        if (end_of_packet) {
-            route_command(work_buffer_curr-cmd_len, cmd_len);
-        } else { //if the packed didn't end we need to keep that piece of buffer for the next run
-            processed -= cmd_len + 1; //we also keep head
+        if (unlikely(parser.state == PMU_PARSE_WAIT_HEAD)) { //we don't expect data before head
+            if (!parser.garbage_reported) {
+                pr_loc_wrn("Found garbage data in PMU stream before cmd head (\"%c\" / 0x%02x) - ignoring until head",
+                           *curr, *curr);
+                parser.garbage_reported = true;
+            }
+            continue;
         }
-    }
 
-    unsigned int left = work_buffer_fill() - processed;
-    if (likely(left != 0)) {
-        memmove(work_buffer, work_buffer+processed, left);
+        if (likely(parser.cmd_len < PMU_MAX_CMD_LEN))
+            parser.cmd[parser.cmd_len] = *curr;
+        ++parser.cmd_len;
     }
-    work_buffer_curr = work_buffer + left;
 
-//    pr_loc_dbg("Left buffer %p curr=%p with %d bytes in it (ascii=\"%.*s\" hex={%s})", work_buffer, work_buffer_curr, left, left, work_buffer,
-//               get_hex_print(work_buffer, left));
+    //Some versions of the mfgBIOS send the head AND THEN in a separate packet the actual command (sic!), so a lone head
+    // followed by IDLE is not a command yet
+    if (end_of_packet && parser.state == PMU_PARSE_CMD && parser.cmd_len > 0) {
+        finish_command();
+        parser.state = PMU_PARSE_WAIT_HEAD;
+    }
 }
 
 /**
@@ -323,47 +495,65 @@ static noinline void pmu_rx_callback(int line, const char *buffer, unsigned int
 {
     pr_loc_dbg("Got %d bytes from PMU: reason=%d hex={%s} ascii=\"%.*s\"", len, reason, get_hex_print(buffer, len), len, buffer);
 
-    int buffer_space = WORK_BUFFER_LEN - work_buffer_fill();
-    if (unlikely(work_buffer_curr + len > work_buffer + WORK_BUFFER_LEN)) { //todo just remove as much as needed from the buffer to fit more data
-        pr_loc_err("Work buffer is full! Only %d of %d bytes will be copied from receiver", len, buffer_space);
-        len = buffer_space;
+    //Commands are variable length and have no end delimiter nor length specified, with prefixes of short commands
+    // conflicting with longer commands (sic!). For example, "SW1" command when sent will look like "-SW1" (0x2d 0x53
+    // 0x57 0x31) and we cannot distinguish "-S" from incomplete "-SW1" until either the next head arrives (e.g.
+    // "-SW1-3") or the transmitter goes IDLE.
+    parse_pmu_stream(buffer, len, reason == VUART_FLUSH_IDLE);
+}
+
+/**
+ * Precomputes responses for the current platform so that replying is just a single inject
+ */
+static void prepare_responses(const struct hw_config *hw)
+{
+    for (int i = 0; i < PMU_RESP__COUNT; ++i) {
+        responses[i].data = hw_cfg(hw, pmu.resp[i]);
+        responses[i].len = responses[i].data ? strlen(responses[i].data) : 0;
     }
 
-    memcpy(work_buffer_curr, buffer, len);
-    work_buffer_curr += len;
-//    pr_loc_dbg("Copied data to work buffer, now with %d bytes in it (cur=%p)",
-//               (unsigned int)(work_buffer_curr - work_buffer), work_buffer_curr);
-
-    //We only want to analyze the buffer when we are sure we have the full command to process. This is because commands
-    // are variable length and have no end delimiter not length specified with prefixes of short commands conflicting
-    // with longer commands (sic!)
-    //For example, you have "SW1" command which when sent will look like "-SW1" (0x2d 0x53 0x57 0x31). We can capture
-    // this when VUART_FLUSH_IDLE happens. We can also easily capture this when multiple commands are sent at once
-    // (unlikely but possible) since it will be something like "-SW1-3". However, we CANNOT distinguish "-S" from
-    // incomplete "-SW1". So we need to rely on IDLE - if we got "-S" with IDLE it means it was "-S" and not the
-    // beginning of "-SW1".
-    //We also forcefully flush on full buffer even if no IDLE was specified, as it's technically possible for the
-    // software to send a long sequence of commands at once totaling more than our buffer (extremely unlikely).
-    //Additionally, we only process IDLE-signalled buffers when they have at least a single byte of data as some
-    // versions of the mfgBIOS attach head AND THEN in a separate packet send the actual commands (sic!)
-    if (reason == VUART_FLUSH_IDLE && work_buffer_fill() > 1)
-        process_work_buffer(true);
-    //our buffer is full [we must process] or vUART buffer was full [we should process]
-    else if (buffer_space <= len || reason == VUART_FLUSH_FULL)
-        process_work_buffer(false);
+    memset(vpmu_state, 0, sizeof(vpmu_state));
 }
 
-int register_pmu_shim(const struct hw_config *hw)
+/**
+ * Stops everything started by start_pmu() (if it was started at all)
+ */
+static void stop_pmu(void)
 {
-    pr_loc_dbg("Registering PMU emulator on line=%d...", PMU_TTYS_LINE);
+    if (pmu_bulk_tx)
+        vuart_set_bulk_tx(PMU_TTYS_LINE, false);
+    vuart_set_tx_idle_timeout(PMU_TTYS_LINE, 0);
+    vuart_set_tx_callback(PMU_TTYS_LINE, NULL, NULL, 0); //no new commands can arrive after that
+
+    //Run whatever is still queued and stop
+    if (dispatch_wq) {
+        destroy_workqueue(dispatch_wq); //it drains the queue first
+        dispatch_wq = NULL;
+    }
+    pmu_forward_stop(); //after the queue is gone, as it sends the last batch
+    free_buffers();
+}
 
+/**
+ * Reserves everything the vPMU needs to process commands; it's done only when something opens the PMU port
+ */
+static int start_pmu(void)
+{
     int out;
-    if ((out = vuart_add_device(PMU_TTYS_LINE) != 0)) {
-        pr_loc_err("Failed to initialize vUART for PMU at ttyS%d", PMU_TTYS_LINE);
+    if ((out = alloc_buffers()) != 0) //it will already print a specific error message and do free_buffers() if needed
         return out;
+    memset(&parser, 0, sizeof(parser));
+
+    INIT_KFIFO(dispatch_queue);
+    dispatch_wq = alloc_placed_workqueue(PMU_WQ_NAME);
+    if (unlikely(!dispatch_wq)) {
+        pr_loc_err("Failed to allocate PMU dispatch workqueue");
+        out = -ENOMEM;
+        goto error_out;
     }
 
-    if ((out = alloc_buffers()) != 0) //it will already print a specific error message and do free_buffers() if needed
+    //It only starts a thread - the agent may not be there yet, and the vPMU works without it anyway
+    if ((out = pmu_forward_start(pmu_inject_rx)) != 0)
         goto error_out;
 
     //We don't set the threshold as some commands are variable length but the "packets" are properly split
@@ -372,30 +562,124 @@ int register_pmu_shim(const struct hw_config *hw)
         goto error_out;
     }
 
-    pr_loc_dbg("PMU emulator registered");
+    //Packet boundaries based on THRe interrupt toggling depend on how fast the driver writes; the timer doesn't. The
+    // callback is then called from a hardirq, which is fine as the parser only routes commands to the dispatch queue.
+    if ((out = vuart_set_tx_idle_timeout(PMU_TTYS_LINE, PMU_TX_IDLE_CHARS)) != 0) {
+        pr_loc_err("Failed to set TX idle timeout for PMU");
+        goto error_out;
+    }
+
+    //pmu_rx_callback() only copies the data into the parser & queues work, so it can run with the port lock held
+    if (pmu_bulk_tx && (out = vuart_set_bulk_tx(PMU_TTYS_LINE, true)) != 0)
+        pr_loc_wrn("Failed to enable bulk TX for PMU - error=%d", out); //the normal path still works
+
+    pr_loc_dbg("PMU emulator started");
     return 0;
 
     error_out:
-    vuart_remove_device(PMU_TTYS_LINE); //this also removes callback (if set)
+    stop_pmu();
     return out;
 }
 
+/**
+ * Called by the vUART when the kernel opens/closes the PMU port
+ *
+ * Replies of commands drained on close are kept in the vUART RX ring and will be delivered on the next open.
+ */
+static int pmu_port_open_callback(int line, bool open)
+{
+    if (open)
+        return start_pmu();
+
+    stop_pmu();
+    pr_loc_dbg("PMU emulator stopped");
+    return 0;
+}
+
+#define PMU_HANDOFF_VERSION 1
+
+/**
+ * vPMU state passed to the next instance of the module (see state_handoff.c)
+ *
+ * Commands are saved as signatures, as these are defined by the protocol and not by the layout of commands[]
+ */
+struct pmu_handoff {
+    u32 state_sigs[VPMU_ST__COUNT]; //0 = unknown
+};
+
+static void hand_off_pmu_state(void)
+{
+    struct pmu_handoff state = { .state_sigs = { 0 } };
+    for (int i = 0; i < VPMU_ST__COUNT; ++i) {
+        if (vpmu_state[i])
+            state.state_sigs[i] = command_sigs[vpmu_state[i] - commands];
+    }
+
+    int out = rp_handoff_put(RP_HANDOFF_PMU_SHIM, PMU_HANDOFF_VERSION, &state, sizeof(state));
+    if (out != 0)
+        pr_loc_wrn("Failed to save vPMU state for the next instance - error=%d", out);
+}
+
+static void adopt_pmu_state(void)
+{
+    const struct pmu_handoff *state = rp_handoff_get(RP_HANDOFF_PMU_SHIM, PMU_HANDOFF_VERSION, sizeof(*state));
+    if (!state)
+        return;
+
+    for (int i = 0; i < VPMU_ST__COUNT; ++i) {
+        if (!state->state_sigs[i])
+            continue;
+
+        const command_definition *cmd = lookup_command(state->state_sigs[i]);
+        if (unlikely(!cmd || cmd->fn != cmd_set_state || cmd->arg != i)) {
+            pr_loc_wrn("vPMU state %d left by the previous instance (sig=0x%08x) is invalid - ignoring", i,
+                       state->state_sigs[i]);
+            continue;
+        }
+
+        vpmu_state[i] = cmd;
+    }
+
+    pr_loc_inf("vPMU state adopted from the previous instance");
+}
+
+static bool pmu_registered = false;
+int register_pmu_shim(const struct hw_config *hw)
+{
+    pr_loc_dbg("Registering PMU emulator on line=%d...", PMU_TTYS_LINE);
+
+    prepare_responses(hw); //the state lives as long as the shim, not only while the port is open
+    adopt_pmu_state();
+
+    //Nothing else is reserved until the port is opened (usually quite late in the boot)
+    int out;
+    if ((out = vuart_add_device_lazy(PMU_TTYS_LINE, PMU_VUART_CHIP, pmu_port_open_callback)) != 0) {
+        pr_loc_err("Failed to initialize vUART for PMU at ttyS%d", PMU_TTYS_LINE);
+        return out;
+    }
+
+    pmu_registered = true;
+    pr_loc_dbg("PMU emulator registered");
+    return 0;
+}
+
 int unregister_pmu_shim(void)
 {
     int out = 0;
 
-    if (unlikely(!uart_buffer)) {
+    if (unlikely(!pmu_registered)) {
         pr_loc_bug("Attempted to %s while it's not registered", __FUNCTION__);
         return 0; //Technically it succeeded
     }
 
     pr_loc_dbg("Unregistering PMU emulator...");
+    hand_off_pmu_state();
 
+    //If the port is open this also stops the PMU (see pmu_port_open_callback())
     if ((out = vuart_remove_device(PMU_TTYS_LINE)) != 0)
         pr_loc_err("Failed to remove vUART for line=%d", PMU_TTYS_LINE);
 
-    free_buffers();
-
+    pmu_registered = false;
     pr_loc_dbg("PMU emulator unregistered");
     return out;
 }
\ No newline at end of file
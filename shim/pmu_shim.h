@@ -1,6 +1,24 @@
 #ifndef REDPILL_PMU_SHIM_H
 #define REDPILL_PMU_SHIM_H
 
+/**
+ * Responses the vPMU can send back to the kernel
+ */
+typedef enum {
+    PMU_RESP_UNIQ, //reply to OUT_GET_UNIQ
+    PMU_RESP__COUNT
+} pmu_response_id;
+
+/**
+ * Per-platform table of responses (see supported_platforms)
+ *
+ * Every entry is the exact sequence of bytes to be sent (incl. any framing) or NULL if the platform should not
+ * respond to a given command. These are not formatted in any way in runtime.
+ */
+struct pmu_hw_responses {
+    const char *resp[PMU_RESP__COUNT];
+};
+
 typedef struct hw_config hw_config_;
 int register_pmu_shim(const struct hw_config *hw);
 int unregister_pmu_shim(void);
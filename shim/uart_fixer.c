@@ -69,15 +69,15 @@ int register_uart_fixer(const hw_config_uart_fixer *hw)
     pr_loc_dbg("Registering UART fixer...");
 
     if (
-            (hw->swap_serial && (out = uart_swap_hw_output(1, 0)) != 0) ||
-            (hw->reinit_ttyS0 && (out = fix_muted_ttyS0()) != 0)
+            (hw_cfg(hw, swap_serial) && (out = uart_swap_hw_output(1, 0)) != 0) ||
+            (hw_cfg(hw, reinit_ttyS0) && (out = fix_muted_ttyS0()) != 0)
        ) {
         pr_loc_err("Failed to register UART fixer");
 
         return out;
     }
 
-    serial_swapped = hw->swap_serial;
+    serial_swapped = hw_cfg(hw, swap_serial);
 
     pr_loc_inf("UART fixer registered");
     return out;